@@ -0,0 +1,91 @@
+#include "gtest/gtest.h"
+#include <string.h>
+
+#define MAX_RAW_SIZE (128 * 1024)
+
+extern unsigned char raw[];
+extern int raw_size;
+extern unsigned char packed[];
+
+extern int pack_block(void);
+extern int write_block(int *tokens);
+extern int rle_unpack(unsigned char *packed, int packed_len, unsigned char *out, int out_size);
+
+namespace rlepack {
+
+unsigned char unpacked_copy[MAX_RAW_SIZE];
+
+// packs raw[0 .. size-1] and checks that it unpacks again, returns the packed size
+int round_trip(int size)
+{
+  int tokens;
+
+  raw_size = size;
+  int cost = pack_block();
+  int len = write_block(&tokens);
+  EXPECT_EQ(len, cost);
+  EXPECT_EQ(rle_unpack(packed, len, unpacked_copy, MAX_RAW_SIZE), size);
+  EXPECT_EQ(memcmp(raw, unpacked_copy, size), 0);
+  return len;
+}
+
+TEST(RlepackTest, RunsOfOneByte)
+{
+  memset(raw, 0x55, 127);
+  raw[127] = 0x66;
+  // one two byte token for the run, and a raw byte
+  EXPECT_EQ(round_trip(128), 2 + 2);
+}
+
+TEST(RlepackTest, RunsOfBytePairs)
+{
+  for (int i = 0; i < 1020; i++)
+    raw[i] = i & 1 ? 0xff : 0x00;
+  // 255 pairs per four byte token
+  EXPECT_EQ(round_trip(1020), 2 * 4);
+}
+
+TEST(RlepackTest, IncompressibleData)
+{
+  unsigned int seed = 1;
+  for (int i = 0; i < 1000; i++) {
+    seed = seed * 1103515245 + 12345;
+    raw[i] = seed >> 16;
+  }
+  // a code byte per 127 raw bytes
+  EXPECT_LE(round_trip(1000), 1000 + 8);
+}
+
+TEST(RlepackTest, MixedTileData)
+{
+  unsigned int seed = 7;
+  for (int i = 0; i < MAX_RAW_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    switch ((i >> 9) & 3) {
+    case 0:
+      raw[i] = 0;
+      break;
+    case 1:
+      raw[i] = i & 1 ? 0xff : 0x00;
+      break;
+    case 2:
+      raw[i] = (seed >> 16) & 3;
+      break;
+    default:
+      raw[i] = i >> 4;
+    }
+  }
+  EXPECT_LT(round_trip(MAX_RAW_SIZE), MAX_RAW_SIZE / 2);
+}
+
+TEST(RlepackTest, UnpackStopsAtEndMarkerAndLimit)
+{
+  unsigned char stream[] = { 0x83, 0xaa, 0x02, 0x01, 0x02, 0x00, 0x83, 0xbb };
+  unsigned char out[8];
+
+  EXPECT_EQ(rle_unpack(stream, sizeof(stream), out, sizeof(out)), 5);
+  EXPECT_EQ(memcmp(out, "\xaa\xaa\xaa\x01\x02", 5), 0);
+  EXPECT_EQ(rle_unpack(stream, sizeof(stream), out, 4), -1);
+}
+
+} // namespace rlepack
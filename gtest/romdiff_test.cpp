@@ -0,0 +1,74 @@
+#include "gtest/gtest.h"
+#include <string.h>
+
+#define FILE_SIZE (128 * 1024)
+
+extern unsigned char ref[];
+extern int ref_count;
+extern unsigned char new_rom[];
+extern unsigned char diff[];
+extern int diff_len;
+extern unsigned char out[];
+
+extern void encode_rom(void);
+extern int decode_diff(unsigned char *ref, int ref_count, unsigned char *diff, int diff_len, unsigned char *out);
+
+namespace romdiff {
+
+void fill_random(unsigned char *buf, int len, unsigned int seed)
+{
+  for (int i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+}
+
+void expect_round_trip(void)
+{
+  encode_rom();
+  memset(out, 0, FILE_SIZE);
+  ASSERT_EQ(decode_diff(ref, ref_count, diff, diff_len, out), 0);
+  EXPECT_EQ(memcmp(out, new_rom, FILE_SIZE), 0);
+}
+
+TEST(RomdiffTest, IdenticalRomRoundTrips)
+{
+  ref_count = 1;
+  fill_random(ref, FILE_SIZE, 1);
+  memcpy(new_rom, ref, FILE_SIZE);
+  expect_round_trip();
+  // a run of 63 byte matches
+  EXPECT_LT(diff_len, FILE_SIZE / 16);
+}
+
+TEST(RomdiffTest, EditedRomRoundTrips)
+{
+  ref_count = 1;
+  fill_random(ref, FILE_SIZE, 2);
+  memcpy(new_rom, ref, FILE_SIZE);
+  // moved code, patched bytes and some completely new data
+  memmove(&new_rom[0x1000], &ref[0x1234], 0x2000);
+  for (int i = 0x8000; i < 0x9000; i += 37)
+    new_rom[i] ^= 0x5a;
+  fill_random(&new_rom[0x10000], 0x800, 3);
+  new_rom[FILE_SIZE - 1] ^= 0xff;
+  expect_round_trip();
+  EXPECT_LT(diff_len, FILE_SIZE / 4);
+}
+
+TEST(RomdiffTest, SeveralReferencesRoundTrip)
+{
+  ref_count = 2;
+  fill_random(ref, FILE_SIZE, 4);
+  fill_random(&ref[FILE_SIZE], FILE_SIZE, 5);
+  // the first half from one reference, the second half from the other
+  memcpy(new_rom, ref, FILE_SIZE / 2);
+  memcpy(&new_rom[FILE_SIZE / 2], &ref[FILE_SIZE + FILE_SIZE / 2], FILE_SIZE / 2);
+  new_rom[0x100] ^= 1;
+  new_rom[FILE_SIZE / 2 + 0x100] ^= 1;
+  expect_round_trip();
+  EXPECT_LT(diff_len, FILE_SIZE / 8);
+  ref_count = 1;
+}
+
+} // namespace romdiff
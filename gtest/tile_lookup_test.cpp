@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+#include <string.h>
+
+struct tile {
+  unsigned char bytes[8][8];
+};
+struct tile_set;
+
+extern struct tile_set *new_tileset(int max_tiles);
+extern int tile_lookup(struct tile_set *ts, struct tile *t, int ncm);
+extern void tile_flip(struct tile *out, struct tile *in, int flip, int ncm);
+
+namespace tile_lookup_test {
+
+// an L shape in the top left corner, which is different in all four orientations
+void make_tile(struct tile *t, unsigned char colour)
+{
+  memset(t, 0, sizeof(*t));
+  for (int i = 0; i < 4; i++) {
+    t->bytes[0][i] = colour;
+    t->bytes[i][0] = colour;
+  }
+  t->bytes[1][1] = colour + 1;
+}
+
+TEST(TileLookupTest, NewTilesGetConsecutiveNumbers)
+{
+  struct tile_set *ts = new_tileset(16);
+  struct tile a, b;
+
+  make_tile(&a, 1);
+  make_tile(&b, 5);
+  EXPECT_EQ(tile_lookup(ts, &a, 0), 0);
+  EXPECT_EQ(tile_lookup(ts, &b, 0), 1);
+  EXPECT_EQ(tile_lookup(ts, &a, 0), 0);
+  EXPECT_EQ(tile_lookup(ts, &b, 0), 1);
+}
+
+TEST(TileLookupTest, FlippedTilesReuseTheStoredOne)
+{
+  struct tile_set *ts = new_tileset(16);
+  struct tile stored, t, shown;
+
+  make_tile(&stored, 1);
+  ASSERT_EQ(tile_lookup(ts, &stored, 0), 0);
+  for (int flip = 0x4000; flip <= 0xc000; flip += 0x4000) {
+    tile_flip(&t, &stored, flip, 0);
+    int r = tile_lookup(ts, &t, 0);
+    EXPECT_EQ(r & 0x3fff, 0);
+    EXPECT_EQ(r & 0xc000, flip);
+    // showing the stored tile with the returned flip gives back t
+    tile_flip(&shown, &stored, r & 0xc000, 0);
+    EXPECT_EQ(memcmp(&shown, &t, sizeof(t)), 0);
+  }
+}
+
+TEST(TileLookupTest, FlipIsRelativeToTheFirstOrientationSeen)
+{
+  struct tile_set *ts = new_tileset(16);
+  struct tile base, first, t, shown;
+
+  // store the tile in a non-canonical orientation first
+  make_tile(&base, 1);
+  tile_flip(&first, &base, 0x8000, 0);
+  int n = tile_lookup(ts, &first, 0);
+  for (int flip = 0; flip <= 0xc000; flip += 0x4000) {
+    tile_flip(&t, &base, flip, 0);
+    int r = tile_lookup(ts, &t, 0);
+    EXPECT_EQ(r & 0x3fff, n);
+    tile_flip(&shown, &first, r & 0xc000, 0);
+    EXPECT_EQ(memcmp(&shown, &t, sizeof(t)), 0);
+  }
+}
+
+TEST(TileLookupTest, SymmetricTilesNeedNoFlip)
+{
+  struct tile_set *ts = new_tileset(16);
+  struct tile t;
+
+  memset(&t, 7, sizeof(t));
+  EXPECT_EQ(tile_lookup(ts, &t, 0), 0);
+  EXPECT_EQ(tile_lookup(ts, &t, 0), 0);
+}
+
+// NCM pixel x is the low nibble of byte x / 2 for even x, the high one for odd x
+int ncm_pixel(struct tile *t, int x, int y)
+{
+  unsigned char b = t->bytes[x / 2][y];
+  return x & 1 ? b >> 4 : b & 0xf;
+}
+
+TEST(TileLookupTest, NcmXFlipMirrorsPixels)
+{
+  struct tile_set *ts = new_tileset(16);
+  struct tile stored, t, shown;
+
+  // left/right asymmetric, and different in both nibbles of each byte
+  memset(&stored, 0, sizeof(stored));
+  for (int y = 0; y < 8; y++)
+    stored.bytes[0][y] = 0x21;
+  stored.bytes[1][0] = 0x03;
+  ASSERT_EQ(tile_lookup(ts, &stored, 1), 0);
+
+  tile_flip(&t, &stored, 0x4000, 1);
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 16; x++)
+      EXPECT_EQ(ncm_pixel(&t, x, y), ncm_pixel(&stored, 15 - x, y));
+
+  int r = tile_lookup(ts, &t, 1);
+  EXPECT_EQ(r & 0x3fff, 0);
+  EXPECT_EQ(r & 0xc000, 0x4000);
+  tile_flip(&shown, &stored, r & 0xc000, 1);
+  EXPECT_EQ(memcmp(&shown, &t, sizeof(t)), 0);
+
+  // the same bytes as an FCM tile are a different tile
+  EXPECT_EQ(tile_lookup(ts, &t, 0), 1);
+}
+
+} // namespace tile_lookup_test
@@ -0,0 +1,100 @@
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vdisk.h"
+
+// vdisk.c only needs the clock from m65common.c
+unsigned long long gettime_ms()
+{
+  return 0;
+}
+
+namespace vdisk_test {
+
+class VdiskTest : public ::testing::Test {
+  protected:
+  char filename[64];
+  VDISK *vd = NULL;
+
+  VDISK *open_blank(size_t size, const char *ext)
+  {
+    snprintf(filename, sizeof(filename), "/tmp/vdisk_test_%d%s", getpid(), ext);
+    FILE *f = fopen(filename, "wb");
+    for (size_t i = 0; i < size; i++)
+      fputc(0, f);
+    fclose(f);
+    vd = vdisk_open(filename);
+    return vd;
+  }
+
+  void TearDown() override
+  {
+    vdisk_close(vd);
+    unlink(filename);
+  }
+};
+
+TEST_F(VdiskTest, PicksGeometryFromSize)
+{
+  ASSERT_NE(open_blank(174848, ".d64"), nullptr);
+  EXPECT_STREQ(vd->geometry->name, "D64");
+  EXPECT_EQ(vd->track_offset[36], 174848u);
+}
+
+TEST_F(VdiskTest, D81MatchesTheOldLinearLayout)
+{
+  int len;
+
+  ASSERT_NE(open_blank(819200, ".d81"), nullptr);
+  EXPECT_STREQ(vd->geometry->name, "D81");
+  for (int track = 0; track < 80; track++)
+    for (int side = 0; side < 2; side++)
+      for (int sector = 1; sector <= 10; sector++) {
+        EXPECT_EQ(vdisk_offset(vd, track, sector, side, &len), (track * 20 + side * 10 + sector - 1) * 512L);
+        EXPECT_EQ(len, 512);
+      }
+  EXPECT_EQ(vdisk_offset(vd, 0, 11, 0, &len), -1);
+  EXPECT_EQ(vdisk_offset(vd, 80, 1, 0, &len), -1);
+}
+
+TEST_F(VdiskTest, D64TrackEndsInHalfSector)
+{
+  int len;
+
+  ASSERT_NE(open_blank(174848, ".d64"), nullptr);
+  // track 1 has 21 sectors: 0-11 on side 0, 12-20 on side 1
+  EXPECT_EQ(vdisk_offset(vd, 0, 6, 0, &len), 10 * 256L);
+  EXPECT_EQ(len, 512);
+  EXPECT_EQ(vdisk_offset(vd, 0, 7, 0, &len), -1);
+  EXPECT_EQ(vdisk_offset(vd, 0, 5, 1, &len), 20 * 256L);
+  EXPECT_EQ(len, 256);
+  EXPECT_EQ(vdisk_offset(vd, 0, 6, 1, &len), -1);
+  // track 35 has 17 sectors, the last one is the end of the image
+  EXPECT_EQ(vdisk_offset(vd, 34, 4, 1, &len), 174848L - 256);
+  EXPECT_EQ(len, 256);
+}
+
+TEST_F(VdiskTest, FlushWritesTheLastHalfSector)
+{
+  int len;
+  unsigned char buf[256];
+
+  ASSERT_NE(open_blank(174848, ".d64"), nullptr);
+  long offset = vdisk_offset(vd, 34, 4, 1, &len);
+  ASSERT_EQ(len, 256);
+  memset(vd->data + offset, 0xa5, len);
+  vdisk_mark_dirty(vd, offset, len);
+  EXPECT_EQ(vdisk_flush(vd), 1);
+  EXPECT_EQ(vd->dirty_count, 0);
+
+  FILE *f = fopen(filename, "rb");
+  fseek(f, offset, SEEK_SET);
+  ASSERT_EQ(fread(buf, 1, 256, f), 256u);
+  fclose(f);
+  for (int i = 0; i < 256; i++)
+    EXPECT_EQ(buf[i], 0xa5);
+}
+
+} // namespace vdisk_test
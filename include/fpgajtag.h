@@ -17,6 +17,7 @@ extern int fpgajtag_usbdk_enable;
  *
  * this will probe the usb interfaces and decide which one to use,
  * depending on the serialno, serialport and fpga_id given.
+ * serialno may be a comma separated list of JTAG serials.
  *
  */
 char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t fpga_id);
@@ -29,6 +30,15 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
  */
 int fpgajtag_main(char *bitstream);
 
+/*
+ * fpgajtag_program_all(bitstream)
+ *
+ * pushes the bitstream to every board init_fpgajtag found with a
+ * matching id code (and serial, if given), all at the same time.
+ * Returns the number of boards that failed.
+ */
+int fpgajtag_program_all(char *bitstream);
+
 // boundary scan stuff, don't know
 int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity);
 void set_vcd_file(char *name);
@@ -36,6 +36,35 @@ int do_serial_port_write(int fd, uint8_t *buffer, size_t size, const char *func,
 
 #define FAT32_MIN_END_OF_CLUSTER_MARKER 0xffffff8
 
+// vF011 requests are track, sector and side bytes (each with bit 7 set)
+// followed by '!' (read) or '\\' (write). Bit 6 of the side byte selects
+// drive 1.
+#define VF011_SIDE(b) ((b) & 0x0f)
+#define VF011_DEVICE(b) (((b) >> 6) & 0x01)
+
+/*
+ * monitor transport statistics, see monitor_flush()
+ */
+typedef struct {
+  long long srtt_us;   // smoothed echo round trip time
+  long long rttvar_us; // and its variation
+  long long rto_us;    // how long to wait for a single echo
+  unsigned int samples;
+  unsigned int timeouts;     // characters whose echo was not seen in time
+  long long last_write_us;   // duration of the last slow_write()
+  long long last_command_us; // last slow_write() until the next prompt
+  unsigned long long bytes;
+} MONITOR_TRANSPORT_STATS;
+extern MONITOR_TRANSPORT_STATS monitor_stats;
+
+int monitor_queue(const char *d, int l);
+int monitor_flush(const char *func, const char *file, const int line);
+int monitor_settle(long long max_us);
+int monitor_wait_readable(long long timeout_us);
+int monitor_rx_pending(void);
+int monitor_read_line(unsigned char *buf, int max, const char *prefix, long long timeout_us);
+void monitor_transport_report(void);
+
 #define WAIT_READ 0x1
 #define WAIT_WRITE 0x2
 unsigned char wait_for_serial(const unsigned char what, const unsigned long timeout_sec, const unsigned long timeout_usec);
@@ -71,6 +100,7 @@ int fetch_ram(unsigned long address, unsigned int count, unsigned char *buffer);
 int fetch_ram_invalidate(void);
 int fetch_ram_cacheable(unsigned long address, unsigned int count, unsigned char *buffer);
 int detect_mode(void);
+int detect_mode_probe(void);
 void print_error(const char *context);
 #ifdef WINDOWS
 HANDLE open_serial_port(const char *device, uint32_t baud_rate);
@@ -81,6 +111,13 @@ int open_the_serial_port(char *serial_port);
 void close_communication_port(void);
 int switch_to_c64mode(void);
 PORT_TYPE open_tcp_port(char *portname);
+#define M65MOND_DEFAULT_SOCKET "/tmp/m65mond.sock"
+#ifndef WINDOWS
+PORT_TYPE open_monitor_daemon(char *portname);
+#endif
+int monitor_daemon_fresh(void);
+extern int monitor_daemon;
+extern int monitor_daemon_mode;
 void close_tcp_port(PORT_TYPE localfd);
 void close_default_tcp_port(void);
 void do_write(PORT_TYPE localfd, char *str);
@@ -112,6 +149,7 @@ extern int saw_c64_mode;
 extern int saw_c65_mode;
 extern int saw_openrom;
 extern int xemu_flag;
+extern int no_rxbuff;
 
 // moved stuff
 
@@ -0,0 +1,122 @@
+#ifndef VDISK_H
+#define VDISK_H
+
+#include <stddef.h>
+#include <stdio.h>
+#ifndef WINDOWS
+#include <sys/types.h>
+#endif
+
+/*
+ * disk image geometry
+ *
+ * Images are laid out as consecutive tracks of 256 byte logical sectors,
+ * with sectors_per_track(track) giving the count for each (1 based)
+ * track. The F011 addresses 512 byte physical sectors per side; side 0
+ * holds the first half of the logical sectors of a track, side 1 the rest.
+ */
+typedef struct {
+  const char *name;
+  const char *extension;
+  size_t size;
+  int tracks;
+  int (*sectors_per_track)(int track);
+} VDISK_GEOMETRY;
+
+extern const VDISK_GEOMETRY vdisk_geometries[];
+
+/*
+ * disk image backing the virtual F011 (m65 --virtuald81)
+ *
+ * The whole image is mapped into memory once, so every sector (and thus
+ * the rest of the track) is available without further file I/O.
+ * Writes go into the mapped image and are only written back to the file
+ * in batches by vdisk_flush(). Opening the same file twice returns the
+ * same mapping.
+ */
+typedef struct vdisk {
+  char *filename;
+  unsigned char *data;
+  size_t size;
+  unsigned char *dirty; // one flag per 256 byte block
+  int dirty_count;
+  long long last_write_ms;
+  const VDISK_GEOMETRY *geometry;
+  size_t *track_offset; // byte offset of each track, indexed from 1
+  int refcount;
+  struct vdisk *next;
+#ifdef WINDOWS
+  FILE *f;
+#else
+  dev_t dev;
+  ino_t ino;
+  int fd;
+#endif
+} VDISK;
+
+/*
+ * per request latency histogram, buckets are powers of two in us
+ */
+#define VDISK_HIST_BUCKETS 20
+typedef struct {
+  const char *name;
+  unsigned int count;
+  long long total_us;
+  long long max_us;
+  unsigned int bucket[VDISK_HIST_BUCKETS];
+} VDISK_HISTOGRAM;
+
+/*
+ * vdisk_open(filename)
+ *
+ * maps the image file read/write and picks its geometry from the file
+ * size (or the extension, if the size is ambiguous). If the file is
+ * already open, the existing mapping is shared. Returns NULL on failure.
+ */
+VDISK *vdisk_open(const char *filename);
+
+/*
+ * vdisk_offset(vd, track, sector, side, len)
+ *
+ * translates a F011 physical sector (track from 0, sector from 1) into
+ * an offset into the image. *len is set to the number of valid bytes
+ * there (512, or 256 for the odd sector at the end of a D64 track).
+ * Returns -1 if the sector does not exist on this image.
+ */
+long vdisk_offset(VDISK *vd, int track, int sector, int side, int *len);
+
+/*
+ * vdisk_mark_dirty(vd, offset, len)
+ *
+ * records that len bytes at offset were modified in memory.
+ */
+void vdisk_mark_dirty(VDISK *vd, size_t offset, int len);
+
+/*
+ * vdisk_flush(vd)
+ *
+ * writes all dirty blocks back to the image file. Returns the number of
+ * 256 byte blocks written.
+ */
+int vdisk_flush(VDISK *vd);
+
+/*
+ * vdisk_flush_if_idle(vd, idle_ms)
+ *
+ * flushes only if there are dirty sectors and no write happened for
+ * idle_ms milliseconds.
+ */
+int vdisk_flush_if_idle(VDISK *vd, int idle_ms);
+
+/*
+ * vdisk_close(vd)
+ *
+ * drops a reference, flushing and unmapping the image when it was the
+ * last one.
+ */
+void vdisk_close(VDISK *vd);
+
+void vdisk_histogram_add(VDISK_HISTOGRAM *h, long long us);
+void vdisk_histogram_report(VDISK_HISTOGRAM *h);
+
+#endif /* VDISK_H */
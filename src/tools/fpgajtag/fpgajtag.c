@@ -40,6 +40,9 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <dirent.h>
+#ifndef WINDOWS
+#include <sys/wait.h>
+#endif
 
 #include "m65common.h"
 
@@ -73,6 +76,21 @@ static uint8_t *rstatus = DITEM(
     CONFIG_DUMMY, CONFIG_SYNC, CONFIG_TYPE2(0), CONFIG_TYPE1(CONFIG_OP_READ, CONFIG_REG_STAT, 1), SINT32(0));
 static int befbits, afterbits;
 
+/*
+ * every device init_fpgajtag() found with a matching idcode, for
+ * fpgajtag_program_all()
+ */
+#define MAX_TARGETS 32
+typedef struct {
+  int device_index, jtag_index;
+  uint32_t idcode;
+  char serial[64], path[1024];
+  int pid, status;
+  long long start_ms, ms;
+} FPGAJTAG_TARGET;
+static FPGAJTAG_TARGET targets[MAX_TARGETS];
+static int target_count;
+
 #ifndef USE_MDM
 void access_mdm(int version, int pre, int amatch)
 {
@@ -695,12 +713,28 @@ static void read_config_memory(int fd, uint32_t size)
   EXIT();
 }
 
+// serialno may be a comma separated list of serials
+static int serial_in_list(const char *list, const char *serial)
+{
+  int len = strlen(serial);
+  while (list && *list) {
+    if (!strncmp(list, serial, len) && (list[len] == ',' || !list[len]))
+      return 1;
+    list = strchr(list, ',');
+    if (list)
+      list++;
+  }
+  return 0;
+}
+
 /*
  * init_fpgajtag(serialno, serialport, fpga_id)
  *   returns usb device string
  *
  * this will probe the usb interfaces and decide which one to use,
  * depending on the serialno, serialport and fpga_id given.
+
+ * serialno may be a comma separated list of JTAG serials.
  *
  */
 char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t fpga_id)
@@ -713,6 +747,7 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
 
   // get usbdev candidates
   usbdev_get_candidates();
+  target_count = 0;
 
   /*
    * Initialize USB interface
@@ -723,8 +758,15 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
 
   for (i = 0; uinfo[i].dev; i++) {
     // fetch bus information
-    bus = libusb_get_bus_number(uinfo[i].dev);
-    pnum_len = libusb_get_port_numbers(uinfo[i].dev, pnum, 8);
+    if (fpgajtag_sim) {
+      // not on a bus, so it can't be matched to a serial port
+      bus = -1;
+      pnum_len = 0;
+    }
+    else {
+      bus = libusb_get_bus_number(uinfo[i].dev);
+      pnum_len = libusb_get_port_numbers(uinfo[i].dev, pnum, 8);
+    }
     // log what we found
     log_concat(NULL);
     log_concat("found %s (serial %s) [%d, [", uinfo[i].iManufacturer, uinfo[i].iSerialNumber, bus);
@@ -734,7 +776,8 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
     log_info(NULL);
 
     // if we got a serial_no, look if it matches, otherwise skip interface
-    if (serialno && strcmp(serialno, (char *)uinfo[i].iSerialNumber)) {
+    int serial_match = !serialno || serial_in_list(serialno, (char *)uinfo[i].iSerialNumber);
+    if (!serial_match) {
       log_info("  serial %s does not match, skipping", serialno);
     }
 
@@ -783,6 +826,15 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
         }
         else
           strcpy(last_path, "UNKNOWN");
+        if (serial_match && target_count < MAX_TARGETS) {
+          FPGAJTAG_TARGET *t = &targets[target_count++];
+          memset(t, 0, sizeof(*t));
+          t->device_index = i;
+          t->jtag_index = j;
+          t->idcode = idcode_array[j];
+          snprintf(t->serial, sizeof(t->serial), "%s", uinfo[i].iSerialNumber);
+          snprintf(t->path, sizeof(t->path), "%s", last_path);
+        }
         break;
       }
     if (j == idcode_count)
@@ -840,9 +892,10 @@ int fpgajtag_main(char *bitstream)
   const char *filename = bitstream;
 
   /*
-   * Read input file
+   * Read input file, unless fpgajtag_program_all() already did
    */
-  /* uint32_t file_idcode = */ read_inputfile(filename);
+  if (filename)
+    /* uint32_t file_idcode = */ read_inputfile(filename);
 
 #ifndef WINDOWS
   if (mflag)
@@ -1013,4 +1066,90 @@ exit_label:
   return 0;
 }
 
+// programs one target in a freshly opened libusb context
+static int program_target(FPGAJTAG_TARGET *t)
+{
+  uinfo = fpgausb_init();
+  uinfo_selected = -1;
+  // the enumeration order is normally stable, but go by serial if it is not
+  for (int i = 0; uinfo[i].dev; i++)
+    if (!strcmp((char *)uinfo[i].iSerialNumber, t->serial) && (uinfo_selected == -1 || i == t->device_index))
+      uinfo_selected = i;
+  if (uinfo_selected == -1) {
+    log_error("board %s (%s) disappeared", t->serial, t->path);
+    return -1;
+  }
+  jtag_index = t->jtag_index;
+  return fpgajtag_main(NULL);
+}
+
+int fpgajtag_program_all(char *bitstream)
+{
+  int i, failed = 0;
+  long long start = gettime_ms();
+
+  if (!target_count) {
+    log_crit("no matching boards to program");
+    return -1;
+  }
+  // read once, the workers share it
+  read_inputfile(bitstream);
+  log_note("programming %d board%s with %s (%d bytes)", target_count, target_count > 1 ? "s" : "", bitstream,
+      input_filesize);
+
+#ifdef WINDOWS
+  // no fork(), so one after the other
+  for (i = 0; i < target_count; i++) {
+    FPGAJTAG_TARGET *t = &targets[i];
+    t->start_ms = gettime_ms();
+    fpgausb_exit();
+    t->status = program_target(t);
+    t->ms = gettime_ms() - t->start_ms;
+  }
+#else
+  /*
+   * fpgajtag keeps its JTAG and USB state in globals, so every board gets
+   * its own worker process (and libusb context) rather than a thread.
+   */
+  fpgausb_exit();
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < target_count; i++) {
+    FPGAJTAG_TARGET *t = &targets[i];
+    t->start_ms = gettime_ms();
+    t->pid = fork();
+    if (!t->pid) {
+      log_info("board %s (%s): worker started", t->serial, t->path);
+      exit(program_target(t) ? 1 : 0);
+    }
+    if (t->pid < 0) {
+      log_error("board %s (%s): could not start worker: %s", t->serial, t->path, strerror(errno));
+      t->status = -1;
+    }
+  }
+  for (int running = target_count; running > 0;) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0)
+      break;
+    for (i = 0; i < target_count; i++)
+      if (targets[i].pid == pid) {
+        targets[i].ms = gettime_ms() - targets[i].start_ms;
+        targets[i].status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        running--;
+      }
+  }
+#endif
+
+  for (i = 0; i < target_count; i++) {
+    FPGAJTAG_TARGET *t = &targets[i];
+    if (t->status)
+      failed++;
+    log_note("board %s (%s; %08x): %s after %lldms", t->serial, t->path, t->idcode, t->status ? "FAILED" : "programmed",
+        t->ms);
+  }
+  log_note("%d of %d boards programmed in %lldms", target_count - failed, target_count, gettime_ms() - start);
+  return failed;
+}
+
 #include "boundary_scan.c"
@@ -0,0 +1,620 @@
+/*
+  Simulated FTDI MPSSE and Xilinx 7 series TAP for fpgajtag
+
+  Lets the JTAG layer (and the USB transfer engine in util.c) run without
+  a board: the MPSSE command stream is decoded into TCK/TMS/TDI clocks,
+  which drive a TAP state machine with IDCODE, USERCODE, BYPASS, CFG_IN,
+  CFG_OUT, JPROGRAM and JSTART. CFG_IN words go through a minimal
+  configuration packet processor (sync, type 1/2 packets, CMD, FDRI and
+  register reads), so that programming and readback see plausible
+  STAT/BOOTSTS values. Only a single device chain is modelled.
+
+  Copyright (C) 2014-2023 Paul Gardner-Stephen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <logging.h>
+
+#include "mpsse_sim.h"
+
+// TAP controller states, IEEE 1149.1
+enum {
+  TAP_RESET,
+  TAP_IDLE,
+  TAP_SELECT_DR,
+  TAP_CAPTURE_DR,
+  TAP_SHIFT_DR,
+  TAP_EXIT1_DR,
+  TAP_PAUSE_DR,
+  TAP_EXIT2_DR,
+  TAP_UPDATE_DR,
+  TAP_SELECT_IR,
+  TAP_CAPTURE_IR,
+  TAP_SHIFT_IR,
+  TAP_EXIT1_IR,
+  TAP_PAUSE_IR,
+  TAP_EXIT2_IR,
+  TAP_UPDATE_IR
+};
+
+// clang-format off
+static const uint8_t tap_next[16][2] = {
+  { TAP_IDLE,       TAP_RESET },     { TAP_IDLE,       TAP_SELECT_DR },
+  { TAP_CAPTURE_DR, TAP_SELECT_IR }, { TAP_SHIFT_DR,   TAP_EXIT1_DR },
+  { TAP_SHIFT_DR,   TAP_EXIT1_DR },  { TAP_PAUSE_DR,   TAP_UPDATE_DR },
+  { TAP_PAUSE_DR,   TAP_EXIT2_DR },  { TAP_SHIFT_DR,   TAP_UPDATE_DR },
+  { TAP_IDLE,       TAP_SELECT_DR }, { TAP_CAPTURE_IR, TAP_RESET },
+  { TAP_SHIFT_IR,   TAP_EXIT1_IR },  { TAP_SHIFT_IR,   TAP_EXIT1_IR },
+  { TAP_PAUSE_IR,   TAP_UPDATE_IR }, { TAP_PAUSE_IR,   TAP_EXIT2_IR },
+  { TAP_SHIFT_IR,   TAP_UPDATE_IR }, { TAP_IDLE,       TAP_SELECT_DR }
+};
+// clang-format on
+
+// 7 series instructions, 6 bit IR (ug470, Table 6-3)
+#define SIM_IR_LENGTH 6
+#define SIM_IR_CFG_OUT 0x04
+#define SIM_IR_CFG_IN 0x05
+#define SIM_IR_USERCODE 0x08
+#define SIM_IR_IDCODE 0x09
+#define SIM_IR_JPROGRAM 0x0b
+#define SIM_IR_JSTART 0x0c
+#define SIM_IR_JSHUTDOWN 0x0d
+
+#define SIM_SYNC_WORD 0xaa995566
+#define SIM_REG_FDRI 0x02
+#define SIM_REG_FDRO 0x03
+#define SIM_REG_CMD 0x04
+#define SIM_REG_STAT 0x07
+#define SIM_REG_IDCODE 0x0c
+#define SIM_REG_BOOTSTS 0x16
+#define SIM_CMD_START 0x05
+#define SIM_CMD_DESYNC 0x0d
+
+// JTAG startup needs a few TCKs in Run-Test/Idle after JSTART (ug470)
+#define SIM_STARTUP_CLOCKS 12
+
+static uint32_t sim_idcode = 0x13631093; // XC7A100T
+static long long sim_latency = 125, sim_kbps = 4000;
+static int sim_boards = 1;
+static long long sim_busy_until;
+
+static uint8_t sim_rx[65536];
+static int sim_rx_len;
+// bit reads shift into this and it is not cleared between commands
+static uint8_t sim_bits;
+// the start of a command split across writes
+static uint8_t *sim_pending;
+static int sim_pending_len, sim_pending_size;
+
+static struct {
+  int state;
+  uint8_t ir, ir_shift;
+  uint32_t dr;
+  int dr_bits;
+  int idle_clocks;
+  int tdo;
+} tap;
+
+static struct {
+  int synced, done, start_seen, id_error;
+  uint32_t shift;
+  int bits;
+  int reg, op, words_left;
+  uint32_t read_word;
+  int read_reg, read_left, read_bits;
+  uint32_t regs[32];
+} cfg;
+
+static struct {
+  long long tck, cfg_words, fdri_words;
+} sim_stats;
+
+static FILE *replay_file, *record_file;
+static long long replay_offset, replay_mismatch = -1;
+static uint8_t *replay_write;
+static int replay_write_len, replay_write_pos;
+
+static uint32_t cfg_stat(void)
+{
+  // INIT_B and INIT_COMPLETE, plus the DONE side once started up (ug470, Table 5-25)
+  uint32_t stat = (1 << 12) | (1 << 11);
+  if (cfg.done)
+    stat |= (1 << 14) | (1 << 13) | (1 << 6) | (1 << 5) | (1 << 4) | (4 << 18);
+  if (cfg.id_error)
+    stat |= 1 << 15;
+  return stat;
+}
+
+static uint32_t cfg_read_reg(int reg)
+{
+  switch (reg) {
+  case SIM_REG_STAT:
+    return cfg_stat();
+  case SIM_REG_IDCODE:
+    return sim_idcode & 0x0fffffff;
+  case SIM_REG_BOOTSTS:
+    return 1; // VALID_0
+  case SIM_REG_FDRO:
+    return 0;
+  }
+  return cfg.regs[reg & 31];
+}
+
+static void cfg_write_reg(int reg, uint32_t value)
+{
+  switch (reg) {
+  case SIM_REG_FDRI:
+    sim_stats.fdri_words++;
+    return;
+  case SIM_REG_CMD:
+    if ((value & 0x1f) == SIM_CMD_START)
+      cfg.start_seen = 1;
+    if ((value & 0x1f) == SIM_CMD_DESYNC) {
+      cfg.synced = 0;
+      cfg.shift = 0;
+      if (cfg.start_seen)
+        cfg.done = 1;
+    }
+    return;
+  case SIM_REG_IDCODE:
+    if ((value & 0x0fffffff) != (sim_idcode & 0x0fffffff)) {
+      log_warn("sim: bitstream idcode %08x does not match %08x", value, sim_idcode);
+      cfg.id_error = 1;
+    }
+    return;
+  }
+  cfg.regs[reg & 31] = value;
+}
+
+static void cfg_packet(uint32_t w)
+{
+  sim_stats.cfg_words++;
+  if (cfg.words_left > 0) {
+    cfg.words_left--;
+    if (cfg.op == 2)
+      cfg_write_reg(cfg.reg, w);
+    return;
+  }
+  switch (w >> 29) {
+  case 1:
+    cfg.op = (w >> 27) & 3;
+    cfg.reg = (w >> 13) & 0x3fff;
+    cfg.words_left = w & 0x7ff;
+    break;
+  case 2:
+    cfg.words_left = w & 0x7ffffff;
+    break;
+  default:
+    return;
+  }
+  if (cfg.op == 1) {
+    // reads are served through CFG_OUT
+    cfg.read_reg = cfg.reg;
+    cfg.read_left = cfg.words_left;
+    cfg.read_bits = 0;
+    cfg.words_left = 0;
+  }
+}
+
+// one bit shifted through CFG_IN, words go MSB first
+static void cfg_in(int tdi)
+{
+  cfg.shift = (cfg.shift << 1) | tdi;
+  if (!cfg.synced) {
+    if (cfg.shift == SIM_SYNC_WORD) {
+      cfg.synced = 1;
+      cfg.bits = 0;
+      cfg.words_left = 0;
+    }
+    return;
+  }
+  if (++cfg.bits == 32) {
+    cfg.bits = 0;
+    cfg_packet(cfg.shift);
+  }
+}
+
+static int cfg_out(void)
+{
+  if (!cfg.read_bits) {
+    if (!cfg.read_left)
+      return 0;
+    cfg.read_left--;
+    cfg.read_word = cfg_read_reg(cfg.read_reg);
+    cfg.read_bits = 32;
+  }
+  cfg.read_bits--;
+  return (cfg.read_word >> cfg.read_bits) & 1;
+}
+
+static void tap_capture_dr(void)
+{
+  switch (tap.ir) {
+  case SIM_IR_IDCODE:
+    tap.dr = sim_idcode;
+    tap.dr_bits = 32;
+    break;
+  case SIM_IR_USERCODE:
+    tap.dr = 0xffffffff;
+    tap.dr_bits = 32;
+    break;
+  default: // BYPASS and everything without a modelled register
+    tap.dr = 0;
+    tap.dr_bits = 1;
+    break;
+  }
+}
+
+static void tap_update_ir(void)
+{
+  tap.ir = tap.ir_shift;
+  tap.idle_clocks = 0;
+  if (tap.ir == SIM_IR_JPROGRAM)
+    memset(&cfg, 0, sizeof(cfg));
+  if (tap.ir == SIM_IR_JSHUTDOWN)
+    cfg.done = 0;
+}
+
+static int tap_clock(int tms, int tdi)
+{
+  // outside the shift states the FTDI keeps sampling the last bit driven
+  int tdo = tap.tdo;
+
+  sim_stats.tck++;
+  switch (tap.state) {
+  case TAP_SHIFT_DR:
+    if (tap.ir == SIM_IR_CFG_IN)
+      cfg_in(tdi);
+    else if (tap.ir == SIM_IR_CFG_OUT)
+      tdo = cfg_out();
+    else {
+      tdo = tap.dr & 1;
+      tap.dr = (tap.dr >> 1) | ((uint32_t)tdi << (tap.dr_bits - 1));
+    }
+    break;
+  case TAP_SHIFT_IR:
+    tdo = tap.ir_shift & 1;
+    tap.ir_shift = (tap.ir_shift >> 1) | (tdi << (SIM_IR_LENGTH - 1));
+    break;
+  case TAP_IDLE:
+    if (tap.ir == SIM_IR_JSTART && cfg.start_seen && ++tap.idle_clocks >= SIM_STARTUP_CLOCKS)
+      cfg.done = 1;
+    break;
+  }
+
+  tap.tdo = tdo;
+  tap.state = tap_next[tap.state][tms];
+  switch (tap.state) {
+  case TAP_RESET:
+    tap.ir = SIM_IR_IDCODE;
+    break;
+  case TAP_CAPTURE_DR:
+    tap_capture_dr();
+    break;
+  case TAP_CAPTURE_IR:
+    // 7 series IR capture: DONE, INIT_COMPLETE, ISC_ENABLED, ISC_DONE, 0, 1
+    tap.ir_shift = 1 | (cfg.done << 2) | (1 << 4) | (cfg.done << 5);
+    break;
+  case TAP_UPDATE_IR:
+    tap_update_ir();
+    break;
+  }
+  return tdo;
+}
+
+static void sim_reply(uint8_t b)
+{
+  if (sim_rx_len < sizeof(sim_rx))
+    sim_rx[sim_rx_len++] = b;
+}
+
+// length of the MPSSE command at p, or 0 if even that isn't known yet
+static int sim_command_length(const uint8_t *p, int len)
+{
+  switch (p[0]) {
+  case 0x19:
+  case 0x3d:
+    return len < 3 ? 0 : 3 + (p[2] << 8 | p[1]) + 1;
+  case 0x2e:
+    return 2;
+  case 0x1b:
+  case 0x2c:
+  case 0x3f:
+  case 0x4b:
+  case 0x6f:
+  case 0x80:
+  case 0x82:
+  case 0x86:
+  case 0x8f:
+    return 3;
+  }
+  return 1;
+}
+
+/*
+ * decodes MPSSE commands into clocks (opcodes as parsed by flush_write()),
+ * queueing what they read. Bit reads shift into the MSBs of a register
+ * that keeps the earlier bits, which is what read_data() relies on when
+ * it merges a bit read with the TMS read that follows. Unknown commands
+ * get the 0xfa "bad command" answer that sync_ftdi() relies on.
+ * Returns the number of bytes used, which stops short of a command that
+ * is not complete yet.
+ */
+static int sim_mpsse(const uint8_t *p, int len)
+{
+  int used = 0;
+
+  while (len > 0) {
+    uint8_t ch = *p;
+    int i, j, n, plen = sim_command_length(p, len);
+    uint8_t in = 0;
+
+    if (!plen || plen > len)
+      break;
+    switch (ch) {
+    case 0x19: // bytes out
+    case 0x2c: // bytes in
+    case 0x3d: // bytes out and in
+      n = (p[2] << 8 | p[1]) + 1;
+      for (i = 0; i < n; i++) {
+        uint8_t out = ch == 0x2c ? 0 : p[3 + i];
+        for (j = 0, in = 0; j < 8; j++)
+          in = (in >> 1) | (tap_clock(0, (out >> j) & 1) << 7);
+        if (ch != 0x19)
+          sim_reply(in);
+      }
+      break;
+    case 0x1b: // bits out
+    case 0x2e: // bits in
+    case 0x3f: // bits out and in
+      n = p[1] + 1;
+      for (j = 0; j < n; j++)
+        sim_bits = (sim_bits >> 1) | (tap_clock(0, ch == 0x2e ? 0 : (p[2] >> j) & 1) << 7);
+      if (ch != 0x1b)
+        sim_reply(sim_bits);
+      break;
+    case 0x4b: // TMS out, bit 7 is held on TDI
+    case 0x6f: // TMS out, TDO in
+      n = p[1] + 1;
+      for (j = 0; j < n; j++)
+        sim_bits = (sim_bits >> 1) | (tap_clock((p[2] >> j) & 1, p[2] >> 7) << 7);
+      if (ch == 0x6f)
+        sim_reply(sim_bits);
+      break;
+    case 0x8f: // clocks without data
+      n = (p[2] << 8 | p[1]) + 1;
+      for (i = 0; i < n * 8; i++)
+        tap_clock(0, 0);
+      break;
+    case 0x80:
+    case 0x82:
+    case 0x86:
+    case 0x85:
+    case 0x87:
+    case 0x8a:
+      break;
+    default:
+      sim_reply(0xfa);
+      sim_reply(ch);
+      break;
+    }
+    p += plen;
+    len -= plen;
+    used += plen;
+  }
+  return used;
+}
+
+static int record_read(FILE *f, char *type, uint8_t **buf, int *len)
+{
+  uint8_t hdr[5];
+  if (fread(hdr, 1, 5, f) != 5)
+    return -1;
+  *type = hdr[0];
+  *len = hdr[1] | hdr[2] << 8 | hdr[3] << 16 | hdr[4] << 24;
+  *buf = realloc(*buf, *len + 1);
+  if (fread(*buf, 1, *len, f) != *len)
+    return -1;
+  return 0;
+}
+
+// compares the command stream with the recorded one, recorded writes may be split differently
+static void replay_compare(const uint8_t *buf, int len)
+{
+  static uint8_t *rec = NULL;
+  int rec_len;
+  char type;
+
+  for (int i = 0; i < len; i++, replay_offset++) {
+    while (replay_write_pos >= replay_write_len) {
+      long pos = ftell(replay_file);
+      if (record_read(replay_file, &type, &rec, &rec_len)) {
+        replay_write_len = 0;
+        break;
+      }
+      if (type != 'W') {
+        // leave the reads for mpsse_sim_read()
+        fseek(replay_file, pos, SEEK_SET);
+        replay_write_len = 0;
+        break;
+      }
+      free(replay_write);
+      replay_write = rec;
+      rec = NULL;
+      replay_write_len = rec_len;
+      replay_write_pos = 0;
+    }
+    if (replay_write_pos >= replay_write_len || replay_write[replay_write_pos++] != buf[i]) {
+      if (replay_mismatch < 0) {
+        replay_mismatch = replay_offset;
+        log_warn("sim: command stream differs from the recording at byte %lld", replay_offset);
+      }
+      return;
+    }
+  }
+}
+
+static int replay_read(uint8_t *buf, int size)
+{
+  static uint8_t *rec = NULL;
+  int len;
+  char type = 0;
+
+  // skip whatever writes the comparison has not consumed
+  while (!record_read(replay_file, &type, &rec, &len) && type != 'R')
+    ;
+  if (type != 'R') {
+    log_warn("sim: recording ends before read %d", size);
+    return 0;
+  }
+  if (len > size)
+    len = size;
+  memcpy(buf, rec, len);
+  // the next write starts a fresh comparison after this read
+  replay_write_pos = replay_write_len = 0;
+  return len;
+}
+
+int mpsse_sim_setup(void)
+{
+  char *env;
+
+  if ((env = getenv("FPGAJTAG_RECORD")) && *env && !record_file) {
+    record_file = fopen(env, "wb");
+    if (!record_file)
+      log_warn("sim: could not create recording '%s'", env);
+    else
+      log_note("fpgajtag: recording the session to '%s'", env);
+  }
+
+  if ((env = getenv("FPGAJTAG_REPLAY")) && *env) {
+    replay_file = fopen(env, "rb");
+    if (!replay_file) {
+      log_crit("sim: could not open recording '%s'", env);
+      exit(-1);
+    }
+    log_note("fpgajtag: replaying the session in '%s'", env);
+  }
+
+  env = getenv("FPGAJTAG_SIM");
+  if (env && *env && strcmp(env, "0")) {
+    if (strchr(env, ',') || strlen(env) > 1)
+      sscanf(env, "%x,%lld,%lld,%d", &sim_idcode, &sim_latency, &sim_kbps, &sim_boards);
+    if (sim_kbps < 1)
+      sim_kbps = 1;
+    if (sim_boards < 1)
+      sim_boards = 1;
+    if (!replay_file)
+      log_note("fpgajtag: using the simulated MPSSE (idcode %08x, %lldus latency, %lldKB/s)", sim_idcode, sim_latency,
+          sim_kbps);
+  }
+  else if (!replay_file)
+    return 0;
+  return 1;
+}
+
+void mpsse_sim_reset(void)
+{
+  sim_rx_len = 0;
+  sim_pending_len = 0;
+  sim_busy_until = 0;
+  memset(&tap, 0, sizeof(tap));
+  memset(&cfg, 0, sizeof(cfg));
+  tap.state = TAP_RESET;
+  tap.ir = SIM_IR_IDCODE;
+}
+
+void mpsse_sim_write(const uint8_t *buf, int len)
+{
+  int used;
+
+  if (replay_file) {
+    replay_compare(buf, len);
+    return;
+  }
+  if (sim_pending_len + len > sim_pending_size) {
+    sim_pending_size = sim_pending_len + len;
+    sim_pending = realloc(sim_pending, sim_pending_size);
+  }
+  memcpy(sim_pending + sim_pending_len, buf, len);
+  sim_pending_len += len;
+  used = sim_mpsse(sim_pending, sim_pending_len);
+  memmove(sim_pending, sim_pending + used, sim_pending_len - used);
+  sim_pending_len -= used;
+}
+
+int mpsse_sim_read(uint8_t *buf, int size)
+{
+  int len;
+
+  if (replay_file)
+    return replay_read(buf, size);
+  len = size < sim_rx_len ? size : sim_rx_len;
+  memcpy(buf, sim_rx, len);
+  memmove(sim_rx, sim_rx + len, sim_rx_len - len);
+  sim_rx_len -= len;
+  return len;
+}
+
+long long mpsse_sim_complete_us(long long now_us, int len)
+{
+  long long start = sim_busy_until > now_us ? sim_busy_until : now_us;
+  sim_busy_until = start + len * 1000LL / sim_kbps;
+  return sim_busy_until + sim_latency;
+}
+
+long long mpsse_sim_latency_us(void)
+{
+  return sim_latency;
+}
+
+int mpsse_sim_boards(void)
+{
+  return sim_boards;
+}
+
+void mpsse_sim_report(void)
+{
+  if (replay_file) {
+    if (replay_mismatch < 0)
+      log_info("sim: command stream matches the recording (%lld bytes)", replay_offset);
+    return;
+  }
+  log_info("sim: %lld TCK, %lld configuration words (%lld FDRI), DONE %d, STAT %08x", sim_stats.tck, sim_stats.cfg_words,
+      sim_stats.fdri_words, cfg.done, cfg_stat());
+  memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+void mpsse_record(char type, const uint8_t *buf, int len)
+{
+  uint8_t hdr[5] = { type, len, len >> 8, len >> 16, len >> 24 };
+
+  if (!record_file || len < 0)
+    return;
+  fwrite(hdr, 1, sizeof(hdr), record_file);
+  fwrite(buf, 1, len, record_file);
+}
+
+void mpsse_record_close(void)
+{
+  if (record_file)
+    fclose(record_file);
+  record_file = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef MPSSE_SIM_H
+#define MPSSE_SIM_H
+
+#include <stdint.h>
+
+/*
+ * software stand-in for the FTDI MPSSE engine and the JTAG TAP of a
+ * single Xilinx 7 series FPGA (see mpsse_sim.c)
+ *
+ * FPGAJTAG_SIM=<idcode>,<latency us>,<KB/s>[,<boards>] (or 1 for the defaults)
+ *   runs the TAP model behind a USB latency/bandwidth model, optionally
+ *   pretending that several identical boards are attached.
+ * FPGAJTAG_REPLAY=<file>
+ *   answers reads from a recorded session instead, and reports where
+ *   the command stream starts to differ from the recording.
+ * FPGAJTAG_RECORD=<file>
+ *   records all writes and reads of the session, on real hardware or not.
+ */
+
+/*
+ * mpsse_sim_setup()
+ *
+ * reads the environment, returns 1 if the stand-in replaces the FTDI.
+ */
+int mpsse_sim_setup(void);
+
+// back to power on state, as after opening the device
+void mpsse_sim_reset(void);
+
+// runs a block of MPSSE commands, queueing whatever they read
+void mpsse_sim_write(const uint8_t *buf, int len);
+
+// takes up to size queued bytes, returns how many there were
+int mpsse_sim_read(uint8_t *buf, int size);
+
+/*
+ * mpsse_sim_complete_us(now_us, len)
+ *
+ * returns when a transfer of len bytes submitted at now_us completes on
+ * the modelled link.
+ */
+long long mpsse_sim_complete_us(long long now_us, int len);
+long long mpsse_sim_latency_us(void);
+
+// how many boards (all sharing one model) fpgausb_init() should list
+int mpsse_sim_boards(void);
+
+// logs TCK count, configuration words and device state
+void mpsse_sim_report(void);
+
+/*
+ * session recording, records are a type byte ('W' or 'R'), a 32 bit
+ * little endian length and the data.
+ */
+void mpsse_record(char type, const uint8_t *buf, int len);
+void mpsse_record_close(void);
+
+#endif /* MPSSE_SIM_H */
@@ -29,11 +29,13 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <zlib.h>
+#include <sys/time.h>
 #ifndef WINDOWS
 #include <sys/select.h>
 #endif
 #include "util.h"
 #include "elfdef.h"
+#include "mpsse_sim.h"
 
 int fpgajtag_usbdk_enable = 0;
 int fpgajtag_libusb_open_failed = 0;
@@ -147,34 +149,172 @@ void memdump(const uint8_t *p, int len, char *title)
 }
 
 #ifndef USE_LIBFTDI
+/*
+ * Bulk writes go out asynchronously, with up to USB_WRITE_SLOTS transfers
+ * in flight, so that the next chunk of a bitstream is being prepared while
+ * the previous ones are still on the wire. Reads first wait for all
+ * writes to complete; the FTDI answers in order anyway.
+ *
+ * FPGAJTAG_SIM or FPGAJTAG_REPLAY in the environment replace the FTDI by
+ * a software stand-in (see mpsse_sim.h), so that the engine and the JTAG
+ * layer can be measured and tested without a board.
+ */
+#define USB_WRITE_SLOTS 4
+
+typedef struct {
+#ifndef NO_LIBUSB
+  struct libusb_transfer *transfer;
+#endif
+  uint8_t buf[USB_CHUNKSIZE];
+  int busy;
+  long long done_us; // when the stand-in completes it
+} USB_WRITE_SLOT;
+
+static USB_WRITE_SLOT usb_write_slots[USB_WRITE_SLOTS];
+static int usb_in_flight, usb_write_failed;
+
+static struct {
+  long long start_us, bytes, writes, reads, stalls;
+  int max_in_flight;
+} usb_stats;
+
+int fpgajtag_sim = 0;
+
+static long long usb_now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void usb_sleep_us(long long us)
+{
+#ifdef WINDOWS
+  Sleep(us / 1000);
+#else
+  struct timeval timeout;
+  timeout.tv_sec = us / 1000000;
+  timeout.tv_usec = us % 1000000;
+  select(0, NULL, NULL, NULL, &timeout);
+#endif
+}
+
+#ifndef NO_LIBUSB
+static void LIBUSB_CALL usb_write_done(struct libusb_transfer *transfer)
+{
+  USB_WRITE_SLOT *slot = transfer->user_data;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+    log_crit("fpgajtag: usb bulk write failed: status %d req size %d act %d", transfer->status, transfer->length,
+        transfer->actual_length);
+    usb_write_failed = 1;
+  }
+  slot->busy = 0;
+  usb_in_flight--;
+}
+#endif
+
+// waits until at least one transfer completed (or all, if all is set)
+static void usb_write_wait(int all)
+{
+  int target = all ? 0 : USB_WRITE_SLOTS - 1;
+
+  while (usb_in_flight > target) {
+    if (fpgajtag_sim) {
+      long long now = usb_now_us(), next = 0;
+      for (int i = 0; i < USB_WRITE_SLOTS; i++) {
+        USB_WRITE_SLOT *slot = &usb_write_slots[i];
+        if (!slot->busy)
+          continue;
+        if (slot->done_us <= now) {
+          slot->busy = 0;
+          usb_in_flight--;
+        }
+        else if (!next || slot->done_us < next)
+          next = slot->done_us;
+      }
+      if (usb_in_flight > target && next)
+        usb_sleep_us(next - now);
+      continue;
+    }
+#ifndef NO_LIBUSB
+    struct timeval tv = { 1, 0 };
+    libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+#endif
+  }
+  if (usb_write_failed)
+    exit(-1);
+}
+
 static int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
 {
-  int actual_length = -1;
-  int ret = -1;
   if (logging)
     formatwrite(1, buf, size, "WRITE");
-#ifndef NO_LIBUSB
-  ret = libusb_bulk_transfer(usbhandle, ENDPOINT_IN, (unsigned char *)buf, size, &actual_length, USB_TIMEOUT);
 #ifdef USE_LOGGING
   dump_bytes(log_depth + 2, __FUNCTION__, buf, size);
 #endif
+  if (!usb_stats.start_us)
+    usb_stats.start_us = usb_now_us();
+  // commands may straddle the chunks, so the stand-in sees the whole buffer
+  mpsse_record('W', buf, size);
+  if (fpgajtag_sim)
+    mpsse_sim_write(buf, size);
+
+  for (int done = 0; done < size;) {
+    USB_WRITE_SLOT *slot = NULL;
+    int len = size - done > USB_CHUNKSIZE ? USB_CHUNKSIZE : size - done;
+
+    if (usb_in_flight == USB_WRITE_SLOTS) {
+      usb_stats.stalls++;
+      usb_write_wait(0);
+    }
+    for (int i = 0; i < USB_WRITE_SLOTS && !slot; i++)
+      if (!usb_write_slots[i].busy)
+        slot = &usb_write_slots[i];
+    memcpy(slot->buf, buf + done, len);
+    slot->busy = 1;
+    usb_in_flight++;
+    if (usb_in_flight > usb_stats.max_in_flight)
+      usb_stats.max_in_flight = usb_in_flight;
+    usb_stats.bytes += len;
+    usb_stats.writes++;
+    done += len;
+
+    if (fpgajtag_sim) {
+      slot->done_us = mpsse_sim_complete_us(usb_now_us(), len);
+      continue;
+    }
+#ifndef NO_LIBUSB
+    if (!slot->transfer)
+      slot->transfer = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(slot->transfer, usbhandle, ENDPOINT_IN, slot->buf, len, usb_write_done, slot, USB_TIMEOUT);
+    int ret = libusb_submit_transfer(slot->transfer);
+    if (ret < 0) {
+      log_crit("fpgajtag: usb bulk write failed: ret %d req size %d", ret, len);
+      exit(-1);
+    }
 #endif
-  if (ret < 0) {
-    log_crit("fpgajtag: usb bulk write failed: ret %d req size %d act %d", ret, size, actual_length);
-    exit(-1);
   }
-#ifndef WINDOWS
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 100;
-  select(0, NULL, NULL, NULL, &timeout);
-#endif
-  return actual_length;
+  return size;
 }
+
 static int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
 {
   int actual_length = 1;
   int count = 0, ret = -1;
+
+  // the answer can't come before the request went out
+  usb_write_wait(1);
+  usb_stats.reads++;
+
+  if (fpgajtag_sim) {
+    usb_sleep_us(mpsse_sim_latency_us());
+    actual_length = mpsse_sim_read(buf, size);
+    mpsse_record('R', buf, actual_length);
+    if (actual_length != size)
+      log_debug("[%s] actual_length %d does not match request size %d", __FUNCTION__, actual_length, size);
+    return actual_length;
+  }
+
   do {
     count++;
 #ifndef NO_LIBUSB
@@ -190,15 +330,12 @@ static int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int siz
       return -1;
     }
     actual_length -= 2;
-#ifndef WINDOWS
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100;
-    select(0, NULL, NULL, NULL, &timeout);
-#endif
+    if (actual_length == 0)
+      usb_sleep_us(100);
   } while (actual_length == 0);
   if (actual_length > 0) {
     memcpy(buf, usbreadbuffer + 2, actual_length);
+    mpsse_record('R', buf, actual_length);
     if (actual_length != size) {
       log_debug("[%s] actual_length %d does not match request size %d", __FUNCTION__, actual_length, size);
       // if (!trace)
@@ -209,6 +346,17 @@ static int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int siz
   }
   return actual_length;
 }
+
+static void usb_report_stats(void)
+{
+  if (!usb_stats.start_us)
+    return;
+  long long us = usb_now_us() - usb_stats.start_us;
+  log_info("fpgajtag: %lld bytes in %lld writes and %lld reads, %lldms (%lldKB/s), up to %d in flight, %lld stalls",
+      usb_stats.bytes, usb_stats.writes, usb_stats.reads, us / 1000, us ? usb_stats.bytes * 1000 / us : 0,
+      usb_stats.max_in_flight, usb_stats.stalls);
+  memset(&usb_stats, 0, sizeof(usb_stats));
+}
 #endif // end if not USE_LIBFTDI
 
 /*
@@ -384,6 +532,25 @@ uint8_t *read_data(void)
 USB_INFO *fpgausb_init(void)
 {
   int i = 0, j, res;
+
+  usbinfo_array_index = 0;
+  fpgajtag_sim = mpsse_sim_setup();
+  if (fpgajtag_sim) {
+    static char sim_device;
+    for (i = 0; i < mpsse_sim_boards() && i < MAX_USB_DEVICECOUNT - 1; i++) {
+      usbinfo_array[i].dev = &sim_device;
+      usbinfo_array[i].idVendor = 0x0403;
+      usbinfo_array[i].idProduct = 0x6010;
+      usbinfo_array[i].bcdDevice = 0x700;
+      usbinfo_array[i].bNumConfigurations = 1;
+      strcpy((char *)usbinfo_array[i].iManufacturer, "fpgajtag");
+      strcpy((char *)usbinfo_array[i].iProduct, "simulated MPSSE");
+      snprintf((char *)usbinfo_array[i].iSerialNumber, sizeof(usbinfo_array[i].iSerialNumber), "SIM%d", i);
+    }
+    usbinfo_array[i].dev = NULL;
+    usbinfo_array_index = i;
+    return usbinfo_array;
+  }
 #ifndef NO_LIBUSB
   libusb_device *dev;
   struct libusb_device_descriptor desc;
@@ -464,6 +631,12 @@ USB_INFO *fpgausb_init(void)
 void fpgausb_open(int device_index, int interface)
 {
   int step = 0;
+
+  if (fpgajtag_sim) {
+    ftdi_interface = interface;
+    mpsse_sim_reset();
+    return;
+  }
 #ifndef NO_LIBUSB
   int cfg, baudrate = 9600;
   static const char frac_code[8] = { 0, 3, 2, 4, 1, 5, 6, 7 };
@@ -554,6 +727,12 @@ error:
 void fpgausb_close(void)
 {
   flush_write(NULL);
+  usb_write_wait(1);
+  usb_report_stats();
+  if (fpgajtag_sim) {
+    mpsse_sim_report();
+    return;
+  }
 #ifdef USE_LIBFTDI
   int i;
   for (i = 0; i < 100; i++)
@@ -571,11 +750,27 @@ void fpgausb_release(void)
 {
   fclose(logfile);
   close(datafile_fd);
+  mpsse_record_close();
+  fpgausb_exit();
+}
+
+void fpgausb_exit(void)
+{
+  if (fpgajtag_sim)
+    return;
 #ifndef NO_LIBUSB
+  if (!usb_context)
+    return;
+  for (int i = 0; i < USB_WRITE_SLOTS; i++) {
+    if (usb_write_slots[i].transfer)
+      libusb_free_transfer(usb_write_slots[i].transfer);
+    usb_write_slots[i].transfer = NULL;
+  }
   libusb_free_device_list(device_list, 1);
 #ifndef USE_LIBFTDI
   libusb_exit(usb_context);
 #endif
+  usb_context = NULL;
 #endif
 }
 
@@ -98,6 +98,7 @@ extern int trace;
 extern uint8_t *input_fileptr;
 extern int input_filesize;
 extern struct ftdi_context *global_ftdi;
+extern int fpgajtag_sim; // set when FPGAJTAG_SIM selects the simulated MPSSE
 
 void memdump(const uint8_t *p, int len, char *title);
 
@@ -113,6 +114,7 @@ USB_INFO *fpgausb_init(void);
 void fpgausb_open(int device_index, int interface_id);
 void fpgausb_close(void);
 void fpgausb_release(void);
+void fpgausb_exit(void); // drops the libusb context, e.g. before forking workers that open their own
 void init_ftdi(int device_index, int interface_id);
 
 void write_data(uint8_t *buf, int size);
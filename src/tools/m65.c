@@ -58,6 +58,7 @@
 #include <logging.h>
 #include <screen_shot.h>
 #include <fpgajtag.h>
+#include <vdisk.h>
 
 #define UT_TIMEOUT 10
 #define UT_RES_TIMEOUT 127
@@ -146,7 +147,7 @@ int comma_eight_comma_one = 0;
 int ethernet_video = 0;
 int ethernet_cpulog = 0;
 int virtual_f011 = 0;
-char *d81file = NULL;
+char *d81file[2] = { NULL, NULL };
 char *filename = NULL;
 char *romfile = NULL;
 char *logfile = NULL;
@@ -155,7 +156,7 @@ char *flashmenufile = NULL;
 char *charromfile = NULL;
 char *colourramfile = NULL;
 FILE *f = NULL;
-FILE *fd81 = NULL;
+VDISK *vdrive[2] = { NULL, NULL };
 char *search_path = ".";
 char *bitstream = NULL;
 char *vivado_bat = NULL;
@@ -165,6 +166,7 @@ char *serial_port = NULL;
 char modeline_cmd[1024] = "";
 int break_point = -1;
 int jtag_only = 0;
+int jtag_all = 0;
 int bitstream_only = 0;
 uint32_t zap_addr;
 int zap = 0;
@@ -202,6 +204,7 @@ int mode_report = 0;
 
 long long last_virtual_time = 0;
 int last_virtual_writep = 0;
+int last_virtual_device = -1;
 int last_virtual_track = -1;
 int last_virtual_sector = -1;
 int last_virtual_side = -1;
@@ -336,6 +339,8 @@ void init_cmd_options(void)
                   "NOTE: m65 always tries to autodiscover the device if needed. This option is just for debugging.");
   CMD_OPTION("device",    1, 0,         'l', "port",  "Name of serial <port> to use, e.g., "DEVICENAME".");
   CMD_OPTION("jtagser",   1, 0,         'f', "serial","Select which FPGA to reconfigure by specifying JTAG <serial>.");
+  CMD_OPTION("jtagall",   0, 0,         0x82, "",     "Push the bitstream of -b/-q to all matching FPGAs (or all --jtagser serials, "
+                  "separated by commas) in parallel, report per board and quit.");
   CMD_OPTION("speed",     1, 0,         's', "230400|1000000|1500000|2000000|4000000",
                   "Speed of serial port in <bits per second> (defaults to 2000000). This needs to match the speed your bitstream uses!");
   CMD_OPTION("usedk",     0, 0,         'K', "",      "Use DK backend for libUSB, if available.");
@@ -360,7 +365,8 @@ void init_cmd_options(void)
   CMD_OPTION("pal",       0, 0,         'p', "",      "switch to PAL video mode.");
   CMD_OPTION("ntsc",      0, 0,         'n', "",      "switch to NTSC video mode.");
 
-  CMD_OPTION("virtuald81",1, 0,         'd', "d81",   "enable virtual D81 access on local <d81> image.");
+  CMD_OPTION("virtuald81",1, 0,         'd', "d81",   "enable virtual F011 access on local <d81> image (D64/D71/D81/D65). "
+                  "Give twice to also serve drive 1.");
 
   CMD_OPTION("unittest",  2, 0,         'u', "timeout", "run program in unit test mode (<timeout> in seconds, defaults to 10).");
   CMD_OPTION("utlog",     1, 0,         'w', "file",  "append unit test results to <file>.");
@@ -406,76 +412,79 @@ void init_cmd_options(void)
   // clang-format on
 }
 
+VDISK_HISTOGRAM vf011_read_latency = { "vF011 read latency" };
+VDISK_HISTOGRAM vf011_write_latency = { "vF011 write latency" };
+
+VDISK *virtual_f011_open(int device)
+{
+  if (device < 0 || device > 1 || !d81file[device]) {
+    log_warn("vF011 request for drive %d, which has no image", device);
+    return NULL;
+  }
+  if (vdrive[device] != NULL)
+    return vdrive[device];
+
+  vdrive[device] = vdisk_open(d81file[device]);
+  if (!vdrive[device]) {
+    log_crit("could not open disk image: '%s'", d81file[device]);
+    exit(-1);
+  }
+  log_info("vF011 drive %d: '%s' (%s)", device, d81file[device], vdrive[device]->geometry->name);
+  return vdrive[device];
+}
+
 int virtual_f011_read(int device, int track, int sector, int side)
 {
+  unsigned char padded[512];
 
   pending_vf011_read = 0;
 
-  long long start = gettime_ms();
+  long long start = gettime_us();
 
   if (!vf011_first_read_time)
-    vf011_first_read_time = start - 1;
+    vf011_first_read_time = gettime_ms() - 1;
 
-#if 0
-#ifdef WINDOWS
-  fprintf(stderr,"T+%I64d ms : Servicing hypervisor request for F011 FDC sector read.\n",
-	  gettime_ms()-start);
-#else
-  fprintf(stderr,"T+%lld ms : Servicing hypervisor request for F011 FDC sector read.\n",
-	  gettime_ms()-start);
-#endif
-#endif
-
-  if (fd81 == NULL) {
+  VDISK *vd = virtual_f011_open(device);
 
-    fd81 = fopen(d81file, "rb+");
-    if (!fd81) {
-      log_crit("could not open D81 file: '%s'", d81file);
-      exit(-1);
-    }
-  }
+  // The whole image is mapped, so the sector (and the rest of its track)
+  // is already in memory. Everything that touches the MEGA65 happens in
+  // a single stop/start of the CPU, instead of one for the data and one
+  // for the status.
+  real_stop_cpu();
 
   // Only actually load new sector contents if we don't think it is a duplicate request
-  if ( // ((gettime_ms()-last_virtual_time)>100)
-       // ||
-      (last_virtual_writep) || (last_virtual_track != track) || (last_virtual_sector != sector)
-      || (last_virtual_side != side)) {
+  if ((last_virtual_writep) || (last_virtual_device != device) || (last_virtual_track != track)
+      || (last_virtual_sector != sector) || (last_virtual_side != side)) {
     last_virtual_time = gettime_ms();
+    last_virtual_writep = 0;
+    last_virtual_device = device;
     last_virtual_track = track;
     last_virtual_sector = sector;
     last_virtual_side = side;
 
-    /* read the block */
-    unsigned char buf[512];
-    int b = -1;
-    int physical_sector = (side == 0 ? sector - 1 : sector + 9);
-
-    int result = fseek(fd81, (track * 20 + physical_sector) * 512, SEEK_SET);
-
-    if (result) {
-      log_crit("error finding D81 sector %d @ 0x%x", result, (track * 20 + physical_sector) * 512);
-      exit(-2);
+    int len = 0;
+    long offset = vd ? vdisk_offset(vd, track, sector, side, &len) : -1;
+    unsigned char *buf = offset < 0 ? NULL : vd->data + offset;
+    if (!buf)
+      log_warn("drive %d has no sector %d/%d/%d, returning empty sector", device, track, sector, side);
+    if (len < 512) {
+      // missing sector, or the last half sector of a D64/D71 track
+      memset(padded, 0, 512);
+      if (buf)
+        memcpy(padded, buf, len);
+      buf = padded;
     }
-    else {
-      b = fread(buf, 1, 512, fd81);
-      //	fprintf(stderr, " bytes read: %d @ 0x%x\n", b,(track*20+physical_sector)*512);
-
-      if (b == 512) {
 
-        //      dump_bytes(0,"The sector",buf,512);
-
-        /* send block to m65 memory */
-        push_ram(READ_SECTOR_BUFFER_ADDRESS, 0x200, buf);
-      }
-    }
+    /* send block to m65 memory */
+    push_ram(READ_SECTOR_BUFFER_ADDRESS, 0x200, buf);
   }
 
   /* signal done/result */
-  real_stop_cpu();
   mega65_poke(0xffd3086, side & 0x7f);
   start_cpu();
 
-  vf011_bytes_read += 256;
+  vdisk_histogram_add(&vf011_read_latency, gettime_us() - start);
+  vf011_bytes_read += 512;
   log_info("READ  device: %d  track: %d  sector: %d  side: %d @ %3.2fKB/sec", device, track, sector, side,
       vf011_bytes_read * 1.0 / (gettime_ms() - vf011_first_read_time));
 
@@ -484,62 +493,71 @@ int virtual_f011_read(int device, int track, int sector, int side)
 
 int virtual_f011_write(int device, int track, int sector, int side)
 {
+  unsigned char buf[512];
 
   pending_vf011_write = 0;
 
-  long long start = gettime_ms();
+  long long start = gettime_us();
 
   if (!vf011_first_read_time)
-    vf011_first_read_time = start - 1;
+    vf011_first_read_time = gettime_ms() - 1;
 
   log_debug("servicing hypervisor request for F011 FDC sector write.");
 
-  if (fd81 == NULL) {
-
-    fd81 = fopen(d81file, "wb+");
-    if (!fd81) {
-      log_crit("could not open D81 file: '%s'", d81file);
-      exit(-1);
-    }
-  }
+  VDISK *vd = virtual_f011_open(device);
 
   last_virtual_time = gettime_ms();
+  last_virtual_writep = 1;
+  last_virtual_device = device;
   last_virtual_track = track;
   last_virtual_sector = sector;
   last_virtual_side = side;
 
-  unsigned char buf[512];
-  fetch_ram(WRITE_SECTOR_BUFFER_ADDRESS, 512, buf);
-
-  int physical_sector = (side == 0 ? sector - 1 : sector + 9);
+  int len = 0;
+  long offset = vd ? vdisk_offset(vd, track, sector, side, &len) : -1;
 
-  int result = fseek(fd81, (track * 20 + physical_sector) * 512, SEEK_SET);
-
-  if (result) {
-    log_crit("failed to find D81 sector %d @ 0x%x", result, (track * 20 + physical_sector) * 512);
-    exit(-2);
-  }
+  // The sector goes into the mapped image straight away, but is only
+  // written back to the file once writes pause (see vdisk_flush_if_idle()).
+  real_stop_cpu();
+  fetch_ram(WRITE_SECTOR_BUFFER_ADDRESS, 512, buf);
+  if (offset < 0)
+    log_warn("drive %d has no sector %d/%d/%d, discarding write", device, track, sector, side);
   else {
-    int b = fwrite(buf, 1, 512, fd81);
-    //	log_debeg("bytes read: %d @ 0x%x", b,(track*20+physical_sector)*512);
-
-    if (b != 512) {
-      log_warn("short write of %d bytes", b);
-    }
+    memcpy(vd->data + offset, buf, len);
+    vdisk_mark_dirty(vd, offset, len);
   }
 
   /* signal done/result */
-  real_stop_cpu();
   mega65_poke(0xffd3086, side & 0x0f);
   start_cpu();
 
-  vf011_bytes_read += 256;
+  vdisk_histogram_add(&vf011_write_latency, gettime_us() - start);
+  vf011_bytes_read += 512;
   log_info("WRITE device: %d  track: %d  sector: %d  side: %d @ %3.2fKB/sec", device, track, sector, side,
       vf011_bytes_read * 1.0 / (gettime_ms() - vf011_first_read_time));
 
   return 0;
 }
 
+void virtual_f011_close(void)
+{
+  if (vdrive[0] == NULL && vdrive[1] == NULL)
+    return;
+  log_debug("closing disk image files");
+  for (int i = 0; i < 2; i++) {
+    vdisk_close(vdrive[i]);
+    vdrive[i] = NULL;
+  }
+  vdisk_histogram_report(&vf011_read_latency);
+  vdisk_histogram_report(&vf011_write_latency);
+}
+
+void virtual_f011_flush_if_idle(void)
+{
+  for (int i = 0; i < 2; i++)
+    vdisk_flush_if_idle(vdrive[i], 500);
+}
+
 uint32_t uint32_from_buf(unsigned char *b, int ofs)
 {
   uint32_t v = 0;
@@ -1502,20 +1520,20 @@ unsigned char check_for_vf011_requests()
     // Handle request
     recent_bytes[3] = 0;
     pending_vf011_read = 1;
-    pending_vf011_device = 0;
+    pending_vf011_device = VF011_DEVICE(recent_bytes[2]);
     pending_vf011_track = recent_bytes[0] & 0x7f;
     pending_vf011_sector = recent_bytes[1] & 0x7f;
-    pending_vf011_side = recent_bytes[2] & 0x0f;
+    pending_vf011_side = VF011_SIDE(recent_bytes[2]);
     return 1;
   }
   if (recent_bytes[3] == 0x5c) {
     // Handle request
     recent_bytes[3] = 0;
     pending_vf011_write = 1;
-    pending_vf011_device = 0;
+    pending_vf011_device = VF011_DEVICE(recent_bytes[2]);
     pending_vf011_track = recent_bytes[0] & 0x7f;
     pending_vf011_sector = recent_bytes[1] & 0x7f;
-    pending_vf011_side = recent_bytes[2] & 0x0f;
+    pending_vf011_side = VF011_SIDE(recent_bytes[2]);
     return 1;
   }
   return 0;
@@ -1875,8 +1893,11 @@ int main(int argc, char **argv)
       osk_enable = 1;
       break;
     case 'd':
-      virtual_f011 = 1;
-      d81file = strdup(optarg);
+      if (virtual_f011 == 2) {
+        log_crit("only drives 0 and 1 can be virtualised");
+        exit(-3);
+      }
+      d81file[virtual_f011++] = strdup(optarg);
       break;
     case 's':
       serial_speed = atoi(optarg);
@@ -1949,6 +1970,10 @@ int main(int argc, char **argv)
       }
       wait_for_bitstream = 1;
       break;
+    case 0x82: // jtagall
+      jtag_all = 1;
+      bitstream_only = 1;
+      break;
     case 0x81: // memsave
     {
       char *next;
@@ -1981,6 +2006,8 @@ int main(int argc, char **argv)
 
   if (argc - optind > 1)
     usage(-3, "Unexpected extra commandline arguments.");
+  if (jtag_all && !bitstream)
+    usage(-3, "--jtagall needs a bitstream.");
 
   log_debug("parameter parsing done");
 
@@ -2024,6 +2051,10 @@ int main(int argc, char **argv)
     }
 #endif
 
+    // every matching board gets the bitstream, and that is all we do
+    if (jtag_all)
+      do_exit(fpgajtag_program_all(bitstream) ? 1 : 0);
+
     // check if init_fpgajtag did totally fail
     if (detected_port == NULL) {
       if (!jtag_only)
@@ -2184,8 +2215,8 @@ int main(int argc, char **argv)
       do_exit(-1);
   }
 
-  if (virtual_f011)
-    log_note("vf011 - remote access to disk image '%s' requested", d81file);
+  for (int i = 0; i < virtual_f011; i++)
+    log_note("vf011 - remote access to disk image '%s' on drive %d requested", d81file[i], i);
 
   if (hyppo_report)
     show_hyppo_report();
@@ -2274,9 +2305,9 @@ int main(int argc, char **argv)
       log_note("virtualising F011 FDC access");
 
       // Enable FDC virtualisation
-      mega65_poke(0xffd3659, 0x01);
-      // Enable disk 0 (including for write)
-      mega65_poke(0xffd368b, 0x03);
+      mega65_poke(0xffd3659, virtual_f011 > 1 ? 0x03 : 0x01);
+      // Enable disk 0 (and 1) including for write
+      mega65_poke(0xffd368b, virtual_f011 > 1 ? 0x1b : 0x03);
     }
     if (!reset_first)
       start_cpu();
@@ -2952,21 +2983,28 @@ int main(int argc, char **argv)
     log_warn("resetting the system might render your D81 image unusable!");
     while (1) {
 #ifndef WINDOWS
-      fd_set read_set;
-      FD_SET(fd, &read_set);
-      FD_SET(STDIN_FILENO, &read_set);
-      if (select(fd + 1, &read_set, NULL, NULL, NULL) < 1) {
-        log_debug("vF011: select false");
-        continue;
-      }
-      else
-        log_debug("vF011: select true");
-      if (FD_ISSET(STDIN_FILENO, &read_set) && fgetc(stdin) == 'q') {
-        log_crit("exit requested, please power cycle your MEGA65");
-        break;
+      // bytes the monitor transport has already read ahead don't wake select()
+      if (!monitor_rx_pending()) {
+        fd_set read_set;
+        struct timeval idle_timeout = { 0, 500000 };
+        FD_ZERO(&read_set);
+        FD_SET(fd, &read_set);
+        FD_SET(STDIN_FILENO, &read_set);
+        if (select(fd + 1, &read_set, NULL, NULL, &idle_timeout) < 1) {
+          log_debug("vF011: select false");
+          // nothing happening, so write back any cached sector writes
+          virtual_f011_flush_if_idle();
+          continue;
+        }
+        else
+          log_debug("vF011: select true");
+        if (FD_ISSET(STDIN_FILENO, &read_set) && fgetc(stdin) == 'q') {
+          log_crit("exit requested, please power cycle your MEGA65");
+          break;
+        }
+        if (!FD_ISSET(fd, &read_set))
+          continue;
       }
-      if (!FD_ISSET(fd, &read_set))
-        continue;
 #endif
 
       b = serialport_read(fd, buff, 8192);
@@ -2991,11 +3029,11 @@ int main(int argc, char **argv)
         check_for_vf011_requests();
       }
       handle_vf011_requests();
+#ifdef WINDOWS
+      virtual_f011_flush_if_idle();
+#endif
     }
-    if (fd81 != NULL) {
-      log_debug("closing d81 image file");
-      fclose(fd81);
-    }
+    virtual_f011_close();
     // disable vF011
     mega65_poke(0xffd3659, 0x00);
     mega65_poke(0xffd368b, 0x07);
@@ -3013,6 +3051,8 @@ void do_exit(int retval)
       pthread_join(threads[i], NULL);
   }
 #endif
+  // make sure cached vF011 writes reach the image file
+  virtual_f011_close();
   close_communication_port();
   exit(retval);
 }
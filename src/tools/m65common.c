@@ -48,6 +48,7 @@
 #include <ws2tcpip.h>
 #else
 #include <netdb.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #endif
 
@@ -132,10 +133,219 @@ PORT_TYPE fd = { WINPORT_TYPE_INVALID, INVALID_HANDLE_VALUE, INVALID_SOCKET };
 PORT_TYPE fd = -1;
 #endif
 
+/*
+ * Monitor transport
+ *
+ * Everything written with slow_write() goes through a transmit queue.
+ * Bitstreams with an RX buffer get the whole queue in one write. Without
+ * one, the monitor can only take the next character once it has echoed
+ * the previous one, so instead of sleeping a fixed time per character we
+ * wait for the echo, or the current echo timeout, whichever comes first.
+ * The echo delays feed a round trip time estimator (as for TCP, RFC 6298)
+ * that also bounds the other waits on the monitor.
+ *
+ * Bytes read while waiting for echoes are kept in a look-ahead buffer and
+ * handed out again by serialport_read(), so callers don't lose anything.
+ */
+#define MONITOR_TXQ_SIZE 8192
+#define MONITOR_RXQ_SIZE 65536
+#define MONITOR_RTO_MIN_US 200
+#define MONITOR_RTO_MAX_US 20000
+
+MONITOR_TRANSPORT_STATS monitor_stats = { 0, 0, 2000 * SLOW_FACTOR };
+
+static unsigned char monitor_txq[MONITOR_TXQ_SIZE];
+static int monitor_txq_len = 0;
+static unsigned char monitor_rxq[MONITOR_RXQ_SIZE];
+static int monitor_rxq_head = 0, monitor_rxq_len = 0;
+static long long monitor_cmd_sent_us = 0;
+
+#ifdef WINDOWS
+SSIZE_T raw_serial_port_read(WINPORT port, uint8_t *buffer, size_t size, const char *func, const char *file, const int line);
+#else
+size_t raw_serial_port_read(int fd, uint8_t *buffer, size_t size, const char *func, const char *file, const int line);
+#endif
+
+static void monitor_rtt_sample(long long us)
+{
+  if (!monitor_stats.samples) {
+    monitor_stats.srtt_us = us;
+    monitor_stats.rttvar_us = us / 2;
+  }
+  else {
+    long long err = us - monitor_stats.srtt_us;
+    monitor_stats.rttvar_us += ((err < 0 ? -err : err) - monitor_stats.rttvar_us) / 4;
+    monitor_stats.srtt_us += err / 8;
+  }
+  monitor_stats.samples++;
+  monitor_stats.rto_us = monitor_stats.srtt_us + 4 * monitor_stats.rttvar_us;
+  if (monitor_stats.rto_us < MONITOR_RTO_MIN_US)
+    monitor_stats.rto_us = MONITOR_RTO_MIN_US;
+  if (monitor_stats.rto_us > MONITOR_RTO_MAX_US)
+    monitor_stats.rto_us = MONITOR_RTO_MAX_US;
+}
+
+// read whatever arrives into the look-ahead buffer, waiting at most timeout_us
+static int monitor_rx_fill(long long timeout_us)
+{
+  int b = 0;
+
+  if (timeout_us < 0)
+    timeout_us = 0;
+  if (monitor_rxq_head + monitor_rxq_len == MONITOR_RXQ_SIZE && monitor_rxq_head) {
+    memmove(monitor_rxq, &monitor_rxq[monitor_rxq_head], monitor_rxq_len);
+    monitor_rxq_head = 0;
+  }
+  int space = MONITOR_RXQ_SIZE - monitor_rxq_head - monitor_rxq_len;
+  unsigned char *tail = &monitor_rxq[monitor_rxq_head + monitor_rxq_len];
+  if (!space) {
+    // nobody is reading, so we can't look for echoes either
+    do_usleep(timeout_us);
+    return 0;
+  }
+#ifdef WINDOWS
+  // no select() on serial handles, so poll in small steps
+  long long end = gettime_us() + timeout_us;
+  while ((b = raw_serial_port_read(fd, tail, space, NULL, NULL, 0)) < 1 && gettime_us() < end)
+    do_usleep(100);
+#else
+  fd_set read_set;
+  struct timeval tv = { timeout_us / 1000000, timeout_us % 1000000 };
+  FD_ZERO(&read_set);
+  FD_SET(fd, &read_set);
+  if (select(fd + 1, &read_set, NULL, NULL, &tv) > 0)
+    b = raw_serial_port_read(fd, tail, space, NULL, NULL, 0);
+#endif
+  if (b < 1)
+    return 0;
+  monitor_rxq_len += b;
+  return b;
+}
+
+int monitor_wait_readable(long long timeout_us)
+{
+  /*
+    Wait up to timeout_us for something to read. Anything that arrives
+    stays in the look-ahead buffer for the next serialport_read().
+  */
+  if (monitor_rxq_len)
+    return 1;
+  return monitor_rx_fill(timeout_us) > 0;
+}
+
+int monitor_rx_pending(void)
+{
+  // bytes already read ahead, which a select() on fd will not see
+  return monitor_rxq_len;
+}
+
+int monitor_queue(const char *d, int l)
+{
+  if (monitor_txq_len + l > MONITOR_TXQ_SIZE)
+    monitor_flush(NULL, NULL, 0);
+  if (l > MONITOR_TXQ_SIZE)
+    return -1;
+  memcpy(&monitor_txq[monitor_txq_len], d, l);
+  monitor_txq_len += l;
+  return 0;
+}
+
+int monitor_flush(const char *func, const char *file, const int line)
+{
+  long long start = gettime_us();
+
+  if (!monitor_txq_len)
+    return 0;
+
+  if (!no_rxbuff) {
+    do_serial_port_write(fd, monitor_txq, monitor_txq_len, func, file, line);
+  }
+  else {
+    for (int i = 0; i < monitor_txq_len; i++) {
+      int scanned = monitor_rxq_len;
+      long long sent = gettime_us(), waited;
+      while (do_serial_port_write(fd, &monitor_txq[i], 1, func, file, line) < 1)
+        do_usleep(monitor_stats.rto_us / 4);
+      // wait for the echo of this character
+      while (1) {
+        if (memchr(&monitor_rxq[monitor_rxq_head + scanned], monitor_txq[i], monitor_rxq_len - scanned)) {
+          monitor_rtt_sample(gettime_us() - sent);
+          break;
+        }
+        scanned = monitor_rxq_len;
+        waited = gettime_us() - sent;
+        if (waited >= monitor_stats.rto_us) {
+          monitor_stats.timeouts++;
+          break;
+        }
+        monitor_rx_fill(monitor_stats.rto_us - waited);
+      }
+    }
+  }
+
+  monitor_stats.bytes += monitor_txq_len;
+  monitor_txq_len = 0;
+  monitor_cmd_sent_us = gettime_us();
+  monitor_stats.last_write_us = monitor_cmd_sent_us - start;
+  return 0;
+}
+
+int monitor_settle(long long max_us)
+{
+  /*
+    Without an RX buffer, anything sent while the monitor is still busy
+    printing gets lost. Wait until the line has been quiet for two echo
+    timeouts, but no longer than max_us (which is what we used to sleep).
+  */
+  if (!no_rxbuff)
+    return 0;
+  long long start = gettime_us(), last = start, quiet = 2 * monitor_stats.rto_us, now;
+  while ((now = gettime_us()) - start < max_us && now - last < quiet) {
+    if (monitor_rx_fill(quiet - (now - last)) > 0)
+      last = gettime_us();
+  }
+  return 0;
+}
+
+int monitor_read_line(unsigned char *buf, int max, const char *prefix, long long timeout_us)
+{
+  /*
+    Read until a complete line starting with prefix has arrived, or
+    timeout_us passed. Returns the number of bytes in buf (NUL terminated).
+  */
+  long long end = gettime_us() + timeout_us;
+  int len = 0;
+
+  buf[0] = 0;
+  while (len < max - 1) {
+    if (!monitor_wait_readable(end - gettime_us()))
+      break;
+    int b = serialport_read(fd, buf + len, max - 1 - len);
+    if (b > 0) {
+      len += b;
+      buf[len] = 0;
+    }
+    char *p = strstr((char *)buf, prefix);
+    if (p && strchr(p + strlen(prefix), '\n'))
+      break;
+    if (gettime_us() >= end)
+      break;
+  }
+  return len;
+}
+
+void monitor_transport_report(void)
+{
+  if (!monitor_stats.bytes)
+    return;
+  log_debug("monitor transport: %llu bytes sent, echo rtt %lld us (+/- %lld us, %u samples, %u timeouts)",
+      monitor_stats.bytes, monitor_stats.srtt_us, monitor_stats.rttvar_us, monitor_stats.samples, monitor_stats.timeouts);
+  log_debug("monitor transport: last write took %lld us, last command %lld us until prompt", monitor_stats.last_write_us,
+      monitor_stats.last_command_us);
+}
+
 int do_slow_write(PORT_TYPE fd, char *d, int l, const char *func, const char *file, const int line)
 {
-  // UART is at 2Mbps, but we need to allow enough time for a whole line of
-  // writing. 100 chars x 0.5usec = 500usec. So 1ms between chars should be ok.
   int i;
   if (debug_serial && 0) {
     printf("\nWriting ");
@@ -150,25 +360,9 @@ int do_slow_write(PORT_TYPE fd, char *d, int l, const char *func, const char *fi
     fgets(line, 1024, stdin);
   }
 
-  for (i = 0; i < l; i++) {
-    if (no_rxbuff) {
-      if (serial_speed == 4000000)
-        do_usleep(1000 * SLOW_FACTOR);
-      else
-        do_usleep(2000 * SLOW_FACTOR);
-    }
-    int w = do_serial_port_write(fd, (unsigned char *)&d[i], 1, func, file, line);
-    while (w < 1) {
-      if (no_rxbuff) {
-        if (serial_speed == 4000000)
-          do_usleep(500 * SLOW_FACTOR);
-        else
-          do_usleep(1000 * SLOW_FACTOR);
-      }
-      w = do_serial_port_write(fd, (unsigned char *)&d[i], 1, func, file, line);
-    }
-  }
-  return 0;
+  for (i = 0; i < l; i += MONITOR_TXQ_SIZE)
+    monitor_queue(&d[i], l - i > MONITOR_TXQ_SIZE ? MONITOR_TXQ_SIZE : l - i);
+  return monitor_flush(func, file, line);
 }
 
 void do_write(PORT_TYPE localfd, char *str)
@@ -242,19 +436,19 @@ void check_for_vf011_jobs(unsigned char *read_buff, int b)
     if (read_buff[i] == '!') {
       if ((read_buff[i - 1] & read_buff[i - 2] & read_buff[i - 3]) & 0x80) {
         pending_vf011_read = 1;
-        pending_vf011_device = 0;
+        pending_vf011_device = VF011_DEVICE(read_buff[i - 1]);
         pending_vf011_track = read_buff[i - 3] & 0x7f;
         pending_vf011_sector = read_buff[i - 2] & 0x7f;
-        pending_vf011_side = read_buff[i - 1] & 0x0f;
+        pending_vf011_side = VF011_SIDE(read_buff[i - 1]);
       }
     }
     if (read_buff[i] == 0x5c) {
       if ((read_buff[i - 1] & read_buff[i - 2] & read_buff[i - 3]) & 0x80) {
         pending_vf011_write = 1;
-        pending_vf011_device = 0;
+        pending_vf011_device = VF011_DEVICE(read_buff[i - 1]);
         pending_vf011_track = read_buff[i - 3] & 0x7f;
         pending_vf011_sector = read_buff[i - 2] & 0x7f;
-        pending_vf011_side = read_buff[i - 1] & 0x0f;
+        pending_vf011_side = VF011_SIDE(read_buff[i - 1]);
       }
     }
   }
@@ -285,6 +479,10 @@ void wait_for_prompt(void)
       serialport_write(fd, (uint8_t *)"\r", 1);
     }
     if (strstr((char *)read_buff, ".")) {
+      if (monitor_cmd_sent_us) {
+        monitor_stats.last_command_us = gettime_us() - monitor_cmd_sent_us;
+        monitor_cmd_sent_us = 0;
+      }
       break;
     }
   }
@@ -407,8 +605,7 @@ int fake_stop_cpu(void)
   }
   // Stop CPU
   //  log_debug("Stopping CPU");
-  if (no_rxbuff)
-    do_usleep(50000);
+  monitor_settle(50000);
   slow_write_safe(fd, "t1\r", 3);
   purge_and_check_for_vf011_jobs(1);
   return 0;
@@ -425,8 +622,7 @@ int real_stop_cpu(void)
   }
   // Stop CPU
   // log_debug("Stopping CPU");
-  if (no_rxbuff)
-    do_usleep(50000);
+  monitor_settle(50000);
   cpu_stopped = 1;
   slow_write(fd, "t1\r", 3);
   purge_and_check_for_vf011_jobs(1);
@@ -439,8 +635,7 @@ int start_cpu(void)
   if (cpu_stopped) {
     //    log_debug("Starting CPU\n");
   }
-  if (no_rxbuff)
-    do_usleep(50000);
+  monitor_settle(50000);
   slow_write(fd, "t0\r", 3);
   purge_and_check_for_vf011_jobs(0);
   return 0;
@@ -456,8 +651,7 @@ int load_file(char *filename, int load_addr, int patchHyppo)
     exit(-2);
   }
 
-  if (no_rxbuff)
-    do_usleep(50000);
+  monitor_settle(50000);
   unsigned char buf[65536];
   int max_bytes;
   int byte_limit = 4096;
@@ -555,8 +749,8 @@ int restart_hyppo(void)
 {
   // Start executing in new hyppo
   printf("Re-Starting CPU in new HYPPO\n");
-  if (!no_rxbuff)
-    do_usleep(50000);
+  // the new HYPPO needs this time whether or not we can see echoes
+  do_usleep(50000);
   purge_input();
   slow_write(fd, "g8100\r", 6);
   wait_for_prompt();
@@ -657,7 +851,8 @@ int rxbuff_detect(void)
   unsigned char read_buff[8193];
 
   // If running with xemu, assume no rxbuff available (for now)
-  if (xemu_flag)
+  // m65mond already told us when we connected
+  if (xemu_flag || monitor_daemon)
     return !no_rxbuff;
 
   monitor_sync();
@@ -691,18 +886,21 @@ int monitor_sync(void)
   unsigned char read_buff[8192];
   int b = 1;
 
+  // m65mond hands the link over in sync
+  if (monitor_daemon_fresh())
+    return 0;
+
   // Begin by sending a null command and purging input
   char cmd[8192];
   cmd[0] = 0x15; // ^U
   cmd[1] = '#';  // prevent instruction stepping
   cmd[2] = 0x0d; // Carriage return
   purge_input();
-  if (no_rxbuff)
-    do_usleep(20000); // Give plenty of time for things to settle
+  monitor_settle(20000);
   slow_write_safe(fd, cmd, 3);
   //  printf("Wrote empty command.\n");
   if (no_rxbuff) {
-    do_usleep(20000); // Give plenty of time for things to settle
+    monitor_settle(20000);
     purge_input();
   }
   else {
@@ -725,23 +923,10 @@ int monitor_sync(void)
     time_t start = time(0);
 
     while (1) {
-      if (no_rxbuff)
-        do_usleep(10000 * SLOW_FACTOR);
+      monitor_wait_readable(no_rxbuff ? 10000 * SLOW_FACTOR : 1100);
       b = serialport_read(fd, read_buff, 8192);
       if (b < 0)
         b = 0;
-      if (b < 1) {
-        do_usleep(100);
-        b = serialport_read(fd, read_buff, 8192);
-        if (b < 0)
-          b = 0;
-      }
-      if (b < 1) {
-        do_usleep(1000);
-        b = serialport_read(fd, read_buff, 8192);
-        if (b < 0)
-          b = 0;
-      }
       if (b > 8191)
         b = 8191;
       read_buff[b] = 0;
@@ -792,17 +977,8 @@ int get_pc(void)
     monitor_sync();
 
   slow_write_safe(fd, "r\r", 2);
-  if (no_rxbuff)
-    do_usleep(50000);
-  else
-    do_usleep(2000);
   unsigned char buff[8192];
-  int b = serialport_read(fd, buff, 8192);
-  if (b < 0)
-    b = 0;
-  if (b > 8191)
-    b = 8191;
-  buff[b] = 0;
+  monitor_read_line(buff, 8192, "\n,", 250000);
   //  if (b>0) dump_bytes(2,"PC read input",buff,b);
   char *s = strstr((char *)buff, "\n,");
   if (s)
@@ -820,17 +996,8 @@ int in_hypervisor(void)
     monitor_sync();
 
   slow_write_safe(fd, "r\r", 2);
-  if (no_rxbuff)
-    do_usleep(50000);
-  else
-    do_usleep(2000);
   unsigned char buff[8192];
-  int b = serialport_read(fd, buff, 8192);
-  if (b < 0)
-    b = 0;
-  if (b > 8191)
-    b = 8191;
-  buff[b] = 0;
+  monitor_read_line(buff, 8192, "\n,", 250000);
   //  if (b>0) dump_bytes(2,"H read input",buff,b);
   char *s = strstr((char *)buff, " H ");
   if (s)
@@ -916,12 +1083,13 @@ int push_ram(unsigned long address, unsigned int count, unsigned char *buffer)
     if (b > 4096)
       b = 4096;
 
-    if (count == 1) {
+    // the last byte of a slab can't be sent with 'l' (the end address
+    // would wrap to 0), so it goes as a single byte, too
+    if (count == 1 || b < 1) {
       //	fprintf(stderr,"Writing single byte\n");
-      sprintf(cmd, "s%lx %x\r", address, buffer[0]);
+      b = 1;
+      sprintf(cmd, "s%lx %x\r", address + offset, buffer[offset]);
       slow_write_safe(fd, cmd, strlen(cmd));
-      if (no_rxbuff)
-        do_usleep(1000 * SLOW_FACTOR);
     }
     else {
       if (new_monitor)
@@ -929,8 +1097,6 @@ int push_ram(unsigned long address, unsigned int count, unsigned char *buffer)
       else
         sprintf(cmd, "l%lx %lx\r", address + offset - 1, address + offset + b - 1);
       slow_write_safe(fd, cmd, strlen(cmd));
-      if (no_rxbuff)
-        do_usleep(1000 * SLOW_FACTOR);
       if (xemu_flag)
         do_usleep(50000 * SLOW_FACTOR);
       int n = b;
@@ -1102,6 +1268,42 @@ int fetch_ram_cacheable(unsigned long address, unsigned int count, unsigned char
 
 time_t last_settle_msg_time = 0;
 
+int detect_mode_probe(void)
+{
+  /*
+    One look at $D030 and the screen address, without waiting for the
+    KERNAL or HYPPO to settle first. Returns 0 if the mode was found.
+  */
+  unsigned char mem_buff[16];
+
+  fetch_ram(0xffd3030, 1, mem_buff);
+  if (mem_buff[0] == 0x64) {
+    saw_c65_mode = 1;
+    log_debug("in C65 mode");
+    return 0;
+  }
+
+  // Use screen address to guess mode
+  fetch_ram(0xffd3060, 3, mem_buff);
+  if (mem_buff[1] == 0x04) {
+    log_debug("screen is at $0400");
+    // check $01 port value
+    fetch_ram(0x7770001, 1, mem_buff);
+    log_debug("port $01 contains $%02x", mem_buff[0]);
+    if ((mem_buff[0] & 0xf) == 0x07) {
+      saw_c64_mode = 1;
+      log_debug("in C64 mode");
+      return 0;
+    }
+  }
+  if (mem_buff[1] == 0x08) {
+    saw_c65_mode = 1;
+    log_debug("in C65 mode");
+    return 0;
+  }
+  return 1;
+}
+
 int detect_mode(void)
 {
   /*
@@ -1111,6 +1313,14 @@ int detect_mode(void)
     input loop for either of the modes, if possible. OpenROMs being
     under development makes this tricky.
   */
+  if (monitor_daemon_fresh() && monitor_daemon_mode) {
+    saw_c64_mode = monitor_daemon_mode == 64 || monitor_daemon_mode == 1;
+    saw_c65_mode = monitor_daemon_mode == 65;
+    saw_openrom = monitor_daemon_mode == 1;
+    log_debug("mode cached by m65mond");
+    return 0;
+  }
+
   saw_c65_mode = 0;
   saw_c64_mode = 0;
   saw_openrom = 0;
@@ -1156,31 +1366,8 @@ int detect_mode(void)
       d054 = mega65_peek(0xffd3054);
     }
 
-    fetch_ram(0xffd3030, 1, mem_buff);
-    if (mem_buff[0] == 0x64) {
-      saw_c65_mode = 1;
-      log_debug("in C65 mode");
-      return 0;
-    }
-
-    // Use screen address to guess mode
-    fetch_ram(0xffd3060, 3, mem_buff);
-    if (mem_buff[1] == 0x04) {
-      log_debug("screen is at $0400");
-      // check $01 port value
-      fetch_ram(0x7770001, 1, mem_buff);
-      log_debug("port $01 contains $%02x", mem_buff[0]);
-      if ((mem_buff[0] & 0xf) == 0x07) {
-        saw_c64_mode = 1;
-        log_debug("in C64 mode");
-        return 0;
-      }
-    }
-    if (mem_buff[1] == 0x08) {
-      saw_c65_mode = 1;
-      log_debug("in C65 mode");
+    if (!detect_mode_probe())
       return 0;
-    }
   }
 
 #if 0
@@ -1461,7 +1648,7 @@ SSIZE_T win_tcp_read(SOCKET sock, uint8_t *buffer, size_t size, const char *func
   return count;
 }
 
-SSIZE_T do_serial_port_read(WINPORT port, uint8_t *buffer, size_t size, const char *func, const char *file, const int line)
+SSIZE_T raw_serial_port_read(WINPORT port, uint8_t *buffer, size_t size, const char *func, const char *file, const int line)
 {
   if (port.type == WINPORT_TYPE_FILE)
     return win_serial_port_read(port.fdfile, buffer, size, func, file, line);
@@ -1504,7 +1691,7 @@ int do_serial_port_write(int fd, uint8_t *buffer, size_t size, const char *funct
   return size;
 }
 
-size_t do_serial_port_read(int fd, uint8_t *buffer, size_t size, const char *function, const char *file, const int line)
+size_t raw_serial_port_read(int fd, uint8_t *buffer, size_t size, const char *function, const char *file, const int line)
 {
   int count;
 
@@ -1618,8 +1805,26 @@ void close_serial_port(void)
 
 #endif
 
+SSIZE_T do_serial_port_read(PORT_TYPE port, uint8_t *buffer, size_t size, const char *func, const char *file, const int line)
+{
+  // hand out anything the monitor transport read ahead first
+  if (monitor_rxq_len) {
+    if (size > monitor_rxq_len)
+      size = monitor_rxq_len;
+    memcpy(buffer, &monitor_rxq[monitor_rxq_head], size);
+    monitor_rxq_head += size;
+    monitor_rxq_len -= size;
+    if (!monitor_rxq_len)
+      monitor_rxq_head = 0;
+    return size;
+  }
+  return raw_serial_port_read(port, buffer, size, func, file, line);
+}
+
 unsigned char wait_for_serial(const unsigned char what, const unsigned long timeout_sec, const unsigned long timeout_usec)
 {
+  if ((what & WAIT_READ) && monitor_rxq_len)
+    return WAIT_READ;
 #ifdef WINDOWS
   return 0xff;
 #else
@@ -1815,6 +2020,97 @@ int stricmp(const char *a, const char *b)
 
 #endif
 
+/*
+ * m65mond client
+ *
+ * "unix[#<path>]" connects to a running m65mond instead of the serial
+ * port. The daemon owns the UART, keeps the monitor synchronised and
+ * serves one client at a time; it starts each session with a header
+ * line carrying what it has cached:
+ *
+ *   M65MOND|<rxbuff>|<model>|<model name>|<mode>|<bitstream version>|<rom version>\n
+ *
+ * where mode is 0 (unknown), 1 (OpenROM), 64 or 65. After that the
+ * socket is a plain byte pipe to the monitor.
+ */
+int monitor_daemon = 0;
+int monitor_daemon_mode = 0;
+
+int monitor_daemon_fresh(void)
+{
+  // the cached state is good until we send our first command
+  return monitor_daemon && !monitor_stats.bytes;
+}
+
+#ifndef WINDOWS
+PORT_TYPE open_monitor_daemon(char *portname)
+{
+  struct sockaddr_un addr;
+  char header[1024], *fields[7], *p;
+  int localfd, len = 0, n;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (portname[4] == '#')
+    strncpy(addr.sun_path, &portname[5], sizeof(addr.sun_path) - 1);
+  else if (getenv("M65MOND_SOCKET"))
+    strncpy(addr.sun_path, getenv("M65MOND_SOCKET"), sizeof(addr.sun_path) - 1);
+  else
+    strncpy(addr.sun_path, M65MOND_DEFAULT_SOCKET, sizeof(addr.sun_path) - 1);
+
+  localfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (localfd < 0 || connect(localfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    log_crit("could not connect to m65mond at '%s': %s", addr.sun_path, strerror(errno));
+    if (localfd >= 0)
+      close(localfd);
+    return -1;
+  }
+
+  // the header only arrives once any other client is done
+  time_t waiting = time(0);
+  while (len < (int)sizeof(header) - 1) {
+    fd_set read_set;
+    struct timeval tv = { 1, 0 };
+    FD_ZERO(&read_set);
+    FD_SET(localfd, &read_set);
+    if (select(localfd + 1, &read_set, NULL, NULL, &tv) < 1) {
+      if (waiting && time(0) - waiting >= 1) {
+        log_note("waiting for m65mond, the MEGA65 is in use by another tool...");
+        waiting = 0;
+      }
+      continue;
+    }
+    if ((n = read(localfd, &header[len], 1)) < 1) {
+      log_crit("m65mond closed the connection");
+      close(localfd);
+      return -1;
+    }
+    if (header[len++] == '\n')
+      break;
+  }
+  header[len - 1] = 0;
+
+  p = header;
+  for (n = 0; n < 7; n++)
+    fields[n] = strsep(&p, "|");
+  if (!fields[6] || strcmp(fields[0], "M65MOND")) {
+    log_crit("unexpected greeting from m65mond: '%s'", header);
+    close(localfd);
+    return -1;
+  }
+  no_rxbuff = !atoi(fields[1]);
+  system_hardware_model = atoi(fields[2]);
+  strncpy(system_hardware_model_name, fields[3], sizeof(system_hardware_model_name) - 1);
+  monitor_daemon_mode = atoi(fields[4]);
+  strncpy(system_bitstream_version, fields[5], sizeof(system_bitstream_version) - 1);
+  strncpy(system_rom_version, fields[6], sizeof(system_rom_version) - 1);
+  monitor_daemon = 1;
+  log_info("connected to m65mond at '%s' (%s, %s)", addr.sun_path, system_hardware_model_name, system_rom_version);
+
+  return localfd;
+}
+#endif
+
 void close_default_tcp_port(void)
 {
   close_tcp_port(fd);
@@ -1822,6 +2118,7 @@ void close_default_tcp_port(void)
 
 void close_communication_port(void)
 {
+  monitor_transport_report();
   if (serial_port_is_tcp)
     close_tcp_port(fd);
   else
@@ -1836,6 +2133,15 @@ int open_the_serial_port(char *serial_port)
   }
 
   serial_port_is_tcp = 0;
+#ifndef WINDOWS
+  if (!strncasecmp(serial_port, "unix", 4)) {
+    fd = open_monitor_daemon(serial_port);
+    if (fd < 0)
+      return -1;
+    serial_port_is_tcp = 1;
+    return 0;
+  }
+#endif
   if (!strncasecmp(serial_port, "tcp", 3)) {
     fd = open_tcp_port(serial_port);
     serial_port_is_tcp = 1;
@@ -1956,6 +2262,11 @@ int get_system_bitstream_version(void)
   size_t len = 0;
   time_t timeout;
 
+  if (monitor_daemon) {
+    log_debug("get_system_bitstream_version: cached by m65mond");
+    return system_hardware_model ? 0 : -1;
+  }
+
   // fetch version info via monitor 'h'
   // don' forget to sync console with '\xf#\r'
   log_debug("get_system_bitstream_version: writing reset/help");
@@ -2056,6 +2367,9 @@ int get_system_bitstream_version(void)
 char system_rom_version[18] = "UNKNOWN";
 char *get_system_rom_version(void)
 {
+  if (monitor_daemon_fresh() && strcmp(system_rom_version, "UNKNOWN"))
+    return system_rom_version;
+
   // Check for C65 ROM via version string
   fetch_ram(0x20016L, 7, (unsigned char *)system_rom_version + 4);
   if ((system_rom_version[4] == 'V') && (system_rom_version[5] == '9')) {
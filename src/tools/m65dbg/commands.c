@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <limits.h>
 #include "m65common.h"
 #include "commands.h"
 #include "serial.h"
@@ -19,7 +20,12 @@
 char pathBitstream[PATHBITSTREAMSIZE] = "";
 char devSerial[DEVSERIALSIZE] = "/dev/ttyUSB1";
 
+extern int cpu_stopped;
+
 int get_sym_value(char *token);
+int trace_steps(int count, bool hard);
+int put_mem_block(int addr, unsigned char *data, int size, bool verify);
+int fetch_mem(int addr, int count, unsigned char *buffer);
 
 typedef struct {
   int pc;
@@ -61,6 +67,7 @@ int dis_offs = 0;
 int dis_scope = 10;
 
 int softbrkaddr = 0;
+int hardbrkaddr = -1;
 unsigned char softbrkmem[3] = { 0 };
 
 type_command_details command_details[] = { { "?", cmdRawHelp, NULL,
@@ -88,6 +95,12 @@ type_command_details command_details[] = { { "?", cmdRawHelp, NULL,
   { "next", cmdHardNext, "[<count>]",
       "Step over to next instruction (hardware-based, fast, xemu-only, for now). If <count> is specified, perform that many "
       "steps" },
+  { "trace", cmdTrace, "<count> [n]",
+      "Steps <count> times (step-over with 'n'), recording the registers after every step for 'tb'/'tf'/'tsave'" },
+  { "tb", cmdTraceBack, "[<count>]", "Shows the recorded trace state <count> steps further back" },
+  { "tf", cmdTraceForward, "[<count>]", "Shows the recorded trace state <count> steps further forward" },
+  { "tsave", cmdTraceSave, "<filename>", "Exports the recorded trace to a text file" },
+  { "tclear", cmdTraceClear, NULL, "Forgets the recorded trace" },
   { "finish", cmdFinish, NULL, "Continue running until function returns (ie, step-out-from)" },
   { "pb", cmdPrintByte, "<addr>", "Prints the byte-value of the given address" },
   { "pw", cmdPrintWord, "<addr>", "Prints the word-value of the given address" },
@@ -116,7 +129,8 @@ type_command_details command_details[] = { { "?", cmdRawHelp, NULL,
   { "down", cmdDownFrame, NULL,
       "The 'dis' disassembly command will disassemble one stack-level down from the current frame" },
   { "se", cmdSearch, "<addr28> <len> <values>",
-      "Searches the range you specify for the given values (either a list of hex bytes or a \"string\"" },
+      "Searches the range you specify for the given values (either a list of hex bytes, with ?? for any byte, or a "
+      "\"string\"). Several patterns can be given separated by '|'" },
   { "ss", cmdScreenshot, NULL, "Takes an ascii screenshot of the mega65's screen" },
   { "ty", cmdType, "[<string>]",
       "Remote keyboard mode (if optional string provided, acts as one-shot message with carriage-return)" },
@@ -143,18 +157,40 @@ typedef struct tfl {
   char *file;
   char *module;
   int lineno;
-  struct tfl *next;
+  int seq; // insertion order, so that later entries win
 } type_fileloc;
 
-type_fileloc *lstFileLoc = NULL;
-
-type_fileloc *cur_file_loc = NULL;
-
-type_symmap_entry *lstSymMap = NULL;
+/*
+ * Source lines and symbols are appended to flat arrays while loading and
+ * only sorted and hashed in one go when they are first looked up (see
+ * index_filelocs() and index_symmap()). That keeps loading linear in the
+ * size of the listing, and lookups binary searches or hash probes.
+ */
+type_fileloc *fileLocs = NULL;
+int fileLocCount = 0;
+int fileLocAlloc = 0;
+bool fileLocsIndexed = true;
+int *fileLocHash = NULL; // (file, lineno) -> index into fileLocs, -1 if empty
+int fileLocHashSize = 0;
+
+char **fileNames = NULL; // interned file names, so files can be compared by pointer
+int fileNameCount = 0;
+
+int cur_file_loc = -1; // index into fileLocs, which add_to_list() may move
+
+type_symmap_entry *symMap = NULL;
+int symMapCount = 0;
+int symMapAlloc = 0;
+bool symMapIndexed = true;
+int *symMapHash = NULL; // symbol name -> index into symMap, -1 if empty
+int symMapHashSize = 0;
 
 type_offsets segmentOffsets = { { 0 } };
 
 type_offsets *lstModuleOffsets = NULL;
+type_offsets *lstModuleOffsetsTail = NULL;
+#define MODULE_HASH_SIZE 1024
+type_offsets *moduleHash[MODULE_HASH_SIZE] = { NULL };
 
 type_watch_entry *lstWatches = NULL;
 
@@ -163,132 +199,199 @@ int isCpuStopped(void);
 void setSoftBreakpoint(int addr);
 void step(void);
 
-void add_to_offsets_list(type_offsets mo)
+static unsigned int str_hash(const char *s, int maxlen)
 {
-  type_offsets *iter = lstModuleOffsets;
-  mo.enabled = 1;
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for (int k = 0; k < maxlen && s[k]; k++)
+    h = (h ^ (unsigned char)s[k]) * 16777619u;
+  return h;
+}
 
-  if (iter == NULL) {
-    lstModuleOffsets = malloc(sizeof(type_offsets));
-    memcpy(lstModuleOffsets, &mo, sizeof(type_offsets));
-    lstModuleOffsets->next = NULL;
-    return;
-  }
+static unsigned int fileloc_hash(const char *file, int lineno)
+{
+  unsigned long p = (unsigned long)file;
+  unsigned int h = (unsigned int)(p ^ (p >> 32)) * 2654435761u;
+  return (h ^ lineno) * 2654435761u;
+}
 
-  while (iter != NULL) {
-    // printf("iterating %s\n", iter->modulename);
-    //  add to end?
-    if (iter->next == NULL) {
-      type_offsets *mo_new = malloc(sizeof(type_offsets));
-      memcpy(mo_new, &mo, sizeof(type_offsets));
-      mo_new->next = NULL;
-      // printf("adding %s\n\n", mo_new->modulename);
+// hash tables are power of two sized, with at least half of the slots free
+static int *alloc_hash(int count, int *size)
+{
+  *size = 16;
+  while (*size < count * 2)
+    *size <<= 1;
+  int *hash = malloc(*size * sizeof(int));
+  memset(hash, 0xff, *size * sizeof(int));
+  return hash;
+}
 
-      iter->next = mo_new;
-      return;
+static char *find_filename(const char *file)
+{
+  static int last = -1;
+
+  // listings are loaded one file at a time, so the last hit is usually right
+  if (last >= 0 && last < fileNameCount && !strcmp(fileNames[last], file))
+    return fileNames[last];
+  for (int k = 0; k < fileNameCount; k++)
+    if (!strcmp(fileNames[k], file)) {
+      last = k;
+      return fileNames[k];
     }
-    iter = iter->next;
+  return NULL;
+}
+
+static char *intern_filename(const char *file)
+{
+  char *name = find_filename(file);
+  if (name)
+    return name;
+  fileNames = realloc(fileNames, (fileNameCount + 1) * sizeof(char *));
+  fileNames[fileNameCount] = strdup(file);
+  return fileNames[fileNameCount++];
+}
+
+type_offsets *find_module(const char *modulename)
+{
+  type_offsets *iter = moduleHash[str_hash(modulename, TOFFSETS_MODULENAME_SIZE) % MODULE_HASH_SIZE];
+
+  for (; iter != NULL; iter = iter->hash_next)
+    if (strncmp(modulename, iter->modulename, TOFFSETS_MODULENAME_SIZE) == 0)
+      return iter;
+  return NULL;
+}
+
+void add_to_offsets_list(type_offsets mo)
+{
+  type_offsets *mo_new = malloc(sizeof(type_offsets));
+  unsigned int h = str_hash(mo.modulename, TOFFSETS_MODULENAME_SIZE) % MODULE_HASH_SIZE;
+
+  memcpy(mo_new, &mo, sizeof(type_offsets));
+  mo_new->enabled = 1;
+  mo_new->next = NULL;
+
+  if (lstModuleOffsetsTail == NULL)
+    lstModuleOffsets = mo_new;
+  else
+    lstModuleOffsetsTail->next = mo_new;
+  lstModuleOffsetsTail = mo_new;
+
+  // keep the first module of a given name, as the list walk used to
+  if (!find_module(mo.modulename)) {
+    mo_new->hash_next = moduleHash[h];
+    moduleHash[h] = mo_new;
   }
+  else
+    mo_new->hash_next = NULL;
 }
 
 void add_to_list(type_fileloc fl)
 {
-  type_fileloc *iter = lstFileLoc;
+  if (fileLocCount == fileLocAlloc) {
+    fileLocAlloc = fileLocAlloc ? fileLocAlloc * 2 : 4096;
+    fileLocs = realloc(fileLocs, fileLocAlloc * sizeof(type_fileloc));
+  }
+  fl.file = intern_filename(fl.file);
+  fl.seq = fileLocCount;
+  fileLocs[fileLocCount++] = fl;
+  fileLocsIndexed = false;
+}
 
-  // first entry in list?
-  if (lstFileLoc == NULL) {
-    lstFileLoc = malloc(sizeof(type_fileloc));
-    lstFileLoc->addr = fl.addr;
-    lstFileLoc->file = strdup(fl.file);
-    lstFileLoc->lineno = fl.lineno;
-    lstFileLoc->module = fl.module;
-    lstFileLoc->next = NULL;
+static int cmp_fileloc(const void *a, const void *b)
+{
+  const type_fileloc *fa = a, *fb = b;
+  if (fa->addr != fb->addr)
+    return fa->addr < fb->addr ? -1 : 1;
+  return fa->seq - fb->seq;
+}
+
+static void index_filelocs(void)
+{
+  int n = 0;
+
+  if (fileLocsIndexed)
     return;
-  }
 
-  while (iter != NULL) {
-    // replace existing?
-    if (iter->addr == fl.addr) {
-      iter->file = strdup(fl.file);
-      iter->lineno = fl.lineno;
-      return;
-    }
-    // insert entry?
-    if (iter->addr > fl.addr) {
-      type_fileloc *flcpy = malloc(sizeof(type_fileloc));
-      flcpy->addr = iter->addr;
-      flcpy->file = iter->file;
-      flcpy->lineno = iter->lineno;
-      flcpy->module = iter->module;
-      flcpy->next = iter->next;
-
-      iter->addr = fl.addr;
-      iter->file = strdup(fl.file);
-      iter->lineno = fl.lineno;
-      iter->module = fl.module;
-      iter->next = flcpy;
-      return;
+  qsort(fileLocs, fileLocCount, sizeof(type_fileloc), cmp_fileloc);
+  // a later entry for the same address replaces the file and line of the first
+  for (int k = 0; k < fileLocCount; k++) {
+    if (n && fileLocs[n - 1].addr == fileLocs[k].addr) {
+      fileLocs[n - 1].file = fileLocs[k].file;
+      fileLocs[n - 1].lineno = fileLocs[k].lineno;
     }
-    // add to end?
-    if (iter->next == NULL) {
-      type_fileloc *flnew = malloc(sizeof(type_fileloc));
-      flnew->addr = fl.addr;
-      flnew->file = strdup(fl.file);
-      flnew->lineno = fl.lineno;
-      flnew->module = fl.module;
-      flnew->next = NULL;
-
-      iter->next = flnew;
-      return;
+    else
+      fileLocs[n++] = fileLocs[k];
+  }
+  fileLocCount = n;
+
+  // file:line -> lowest address for that line
+  free(fileLocHash);
+  fileLocHash = alloc_hash(n, &fileLocHashSize);
+  for (int k = 0; k < n; k++) {
+    unsigned int h = fileloc_hash(fileLocs[k].file, fileLocs[k].lineno) & (fileLocHashSize - 1);
+    while (fileLocHash[h] != -1) {
+      type_fileloc *o = &fileLocs[fileLocHash[h]];
+      if (o->file == fileLocs[k].file && o->lineno == fileLocs[k].lineno)
+        break;
+      h = (h + 1) & (fileLocHashSize - 1);
     }
-
-    iter = iter->next;
+    if (fileLocHash[h] == -1)
+      fileLocHash[h] = k;
   }
+
+  fileLocsIndexed = true;
+  // entries have moved
+  cur_file_loc = -1;
 }
 
 void add_to_symmap(type_symmap_entry sme)
 {
-  type_symmap_entry *iter = lstSymMap;
-
-  // first entry in list?
-  if (lstSymMap == NULL) {
-    lstSymMap = malloc(sizeof(type_symmap_entry));
-    lstSymMap->addr = sme.addr;
-    lstSymMap->sval = strdup(sme.sval);
-    lstSymMap->symbol = strdup(sme.symbol);
-    lstSymMap->next = NULL;
-    return;
+  if (symMapCount == symMapAlloc) {
+    symMapAlloc = symMapAlloc ? symMapAlloc * 2 : 4096;
+    symMap = realloc(symMap, symMapAlloc * sizeof(type_symmap_entry));
   }
+  sme.sval = strdup(sme.sval);
+  sme.symbol = strdup(sme.symbol);
+  sme.seq = symMapCount;
+  symMap[symMapCount++] = sme;
+  symMapIndexed = false;
+}
 
-  while (iter != NULL) {
-    // insert entry?
-    if (iter->addr >= sme.addr) {
-      type_symmap_entry *smecpy = malloc(sizeof(type_symmap_entry));
-      smecpy->addr = iter->addr;
-      smecpy->sval = iter->sval;
-      smecpy->symbol = iter->symbol;
-      smecpy->next = iter->next;
-
-      iter->addr = sme.addr;
-      iter->sval = strdup(sme.sval);
-      iter->symbol = strdup(sme.symbol);
-      iter->next = smecpy;
-      return;
-    }
-    // add to end?
-    if (iter->next == NULL) {
-      type_symmap_entry *smenew = malloc(sizeof(type_symmap_entry));
-      smenew->addr = sme.addr;
-      smenew->sval = strdup(sme.sval);
-      smenew->symbol = strdup(sme.symbol);
-      smenew->next = NULL;
+static int cmp_symmap(const void *a, const void *b)
+{
+  const type_symmap_entry *sa = a, *sb = b;
+  if (sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+  // newer symbols go before older ones at the same address
+  return sb->seq - sa->seq;
+}
 
-      iter->next = smenew;
-      return;
-    }
+static void index_symmap(void)
+{
+  if (symMapIndexed)
+    return;
 
-    iter = iter->next;
+  qsort(symMap, symMapCount, sizeof(type_symmap_entry), cmp_symmap);
+
+  // symbol -> first entry of that name, in address order
+  free(symMapHash);
+  symMapHash = alloc_hash(symMapCount, &symMapHashSize);
+  for (int k = 0; k < symMapCount; k++) {
+    unsigned int h = str_hash(symMap[k].symbol, INT_MAX) & (symMapHashSize - 1);
+    while (symMapHash[h] != -1 && strcmp(symMap[symMapHash[h]].symbol, symMap[k].symbol))
+      h = (h + 1) & (symMapHashSize - 1);
+    if (symMapHash[h] == -1)
+      symMapHash[h] = k;
   }
+
+  symMapIndexed = true;
+}
+
+type_symmap_entry *get_symmap(int *count)
+{
+  index_symmap();
+  *count = symMapCount;
+  return symMap;
 }
 
 void copy_watch(type_watch_entry *dest, type_watch_entry *src)
@@ -325,59 +428,66 @@ void add_to_watchlist(type_watch_entry we)
 
 type_fileloc *find_in_list(int addr)
 {
-  type_fileloc *iter = lstFileLoc;
+  int lo = 0, hi;
 
-  while (iter != NULL) {
-    // printf("%s : addr=$%04X : line=%d\n", iter->file, iter->addr, iter->lineno);
-    if (iter->addr == addr)
-      return iter;
-
-    iter = iter->next;
+  index_filelocs();
+  hi = fileLocCount - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (fileLocs[mid].addr == addr)
+      return &fileLocs[mid];
+    if (fileLocs[mid].addr < addr)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
   }
 
   return NULL;
 }
 
-int find_addr_in_list(char *file, int line)
+static type_fileloc *find_fileloc(char *file, int line)
 {
-  type_fileloc *iter = lstFileLoc;
-
-  while (iter != NULL) {
-    if (!strcmp(file, iter->file) && iter->lineno == line)
-      return iter->addr;
+  index_filelocs();
+  if (!fileLocCount || !(file = find_filename(file)))
+    return NULL;
 
-    iter = iter->next;
+  unsigned int h = fileloc_hash(file, line) & (fileLocHashSize - 1);
+  while (fileLocHash[h] != -1) {
+    type_fileloc *fl = &fileLocs[fileLocHash[h]];
+    if (fl->file == file && fl->lineno == line)
+      return fl;
+    h = (h + 1) & (fileLocHashSize - 1);
   }
 
-  return -1;
+  return NULL;
 }
 
-type_fileloc *find_lineno_in_list(int lineno)
+int find_addr_in_list(char *file, int line)
 {
-  type_fileloc *iter = lstFileLoc;
-
-  if (!cur_file_loc)
-    return NULL;
+  type_fileloc *fl = find_fileloc(file, line);
 
-  while (iter != NULL) {
-    if (strcmp(cur_file_loc->file, iter->file) == 0 && iter->lineno == lineno)
-      return iter;
+  return fl ? fl->addr : -1;
+}
 
-    iter = iter->next;
-  }
+type_fileloc *find_lineno_in_list(int lineno)
+{
+  if (cur_file_loc < 0)
+    return NULL;
 
-  return NULL;
+  return find_fileloc(fileLocs[cur_file_loc].file, lineno);
 }
 
 type_symmap_entry *find_in_symmap(char *sym)
 {
-  type_symmap_entry *iter = lstSymMap;
-
-  while (iter != NULL) {
-    if (strcmp(sym, iter->symbol) == 0)
-      return iter;
+  index_symmap();
+  if (!symMapCount)
+    return NULL;
 
-    iter = iter->next;
+  unsigned int h = str_hash(sym, INT_MAX) & (symMapHashSize - 1);
+  while (symMapHash[h] != -1) {
+    if (strcmp(sym, symMap[symMapHash[h]].symbol) == 0)
+      return &symMap[symMapHash[h]];
+    h = (h + 1) & (symMapHashSize - 1);
   }
 
   return NULL;
@@ -714,32 +824,23 @@ int get_segment_offset(const char *current_segment)
 
 int get_module_offset(const char *current_module, const char *current_segment)
 {
-  type_offsets *iter = lstModuleOffsets;
+  type_offsets *iter = find_module(current_module);
 
-  while (iter != NULL) {
-    if (strncmp(current_module, iter->modulename, TOFFSETS_MODULENAME_SIZE) == 0) {
-      for (int k = 0; k < iter->seg_cnt; k++) {
-        if (strncmp(current_segment, iter->segments[k].name, TSEGMENT_NAME_SIZE) == 0) {
-          return iter->segments[k].offset;
-        }
+  if (iter != NULL) {
+    for (int k = 0; k < iter->seg_cnt; k++) {
+      if (strncmp(current_segment, iter->segments[k].name, TSEGMENT_NAME_SIZE) == 0) {
+        return iter->segments[k].offset;
       }
     }
-    iter = iter->next;
   }
   return 0;
 }
 
 char *get_module_string(const char *current_module)
 {
-  type_offsets *iter = lstModuleOffsets;
+  type_offsets *iter = find_module(current_module);
 
-  while (iter != NULL) {
-    if (strncmp(current_module, iter->modulename, TOFFSETS_MODULENAME_SIZE) == 0) {
-      return iter->modulename;
-    }
-    iter = iter->next;
-  }
-  return 0;
+  return iter ? iter->modulename : NULL;
 }
 
 void load_ca65_list(const char *fname, FILE *f)
@@ -1078,6 +1179,13 @@ void listSearch(void)
   }
 }
 
+// parses the values line of the monitor's register dump
+static int parse_regs(char *line, reg_data *reg)
+{
+  return sscanf(line, "%04X %02X %02X %02X %02X %02X %04X %04X %04X %02X %02X %02X %15s", &reg->pc, &reg->a, &reg->x,
+      &reg->y, &reg->z, &reg->b, &reg->sp, &reg->maph, &reg->mapl, &reg->lastop, &reg->odd1, &reg->odd2, reg->flags);
+}
+
 reg_data get_regs(void)
 {
   reg_data reg = { 0 };
@@ -1089,8 +1197,7 @@ reg_data get_regs(void)
     if (!line) // did we hit a null+1? try again
       continue;
     line++;
-    sscanf(line, "%04X %02X %02X %02X %02X %02X %04X %04X %04X %02X %02X %02X %s", &reg.pc, &reg.a, &reg.x, &reg.y, &reg.z,
-        &reg.b, &reg.sp, &reg.maph, &reg.mapl, &reg.lastop, &reg.odd1, &reg.odd2, reg.flags);
+    parse_regs(line, &reg);
     break;
   }
 
@@ -1104,10 +1211,131 @@ void show_regs(reg_data *reg)
       reg->b, reg->sp, reg->maph, reg->mapl, reg->lastop, reg->odd1, reg->odd2, reg->flags);
 }
 
+// fetch_ram() brackets every command with t1/t0 unless it believes the
+// CPU is stopped. m65dbg leaves run control to the user (get_mem() reads
+// while the CPU runs, too), so keep it from touching it.
+int fetch_mem(int addr, int count, unsigned char *buffer)
+{
+  int was_stopped = cpu_stopped;
+  serialFlush();
+  cpu_stopped = 1;
+  int ret = fetch_ram(addr, count, buffer);
+  cpu_stopped = was_stopped;
+  return ret;
+}
+
+/*
+ * Memory cache
+ *
+ * 256 byte pages read with fetch_ram() are kept until mem_generation
+ * changes (see serialWrite()), so that the disassembly, the watches and
+ * the backtrace shown after a step share a few 'M' commands instead of an
+ * 'm' each. The cache is only used while the CPU is held in trace mode,
+ * and never for the I/O area, which changes on its own.
+ */
+#define MEM_CACHE_PAGES 64
+
+typedef struct {
+  bool valid;
+  int generation;
+  int page; // 28-bit address >> 8
+  unsigned char b[256];
+} type_mem_page;
+
+type_mem_page memCache[MEM_CACHE_PAGES];
+
+static int mem_full_addr(int addr, bool useAddr28)
+{
+  // CPU context is $777xxxx, as with "m777xxxx"
+  return useAddr28 ? (addr & 0xfffffff) : (0x7770000 | (addr & 0xffff));
+}
+
+static bool mem_cacheable(int full)
+{
+  if (!cpu_held)
+    return false;
+  // $Dxxx in CPU context may be I/O, depending on the mapping
+  if ((full & 0xfff0000) == 0x7770000 && (full & 0xf000) == 0xd000)
+    return false;
+  if ((full & 0xfff0000) == 0xffd0000)
+    return false;
+  return true;
+}
+
+static type_mem_page *mem_cache_slot(int page)
+{
+  return &memCache[(page ^ (page >> 6)) % MEM_CACHE_PAGES];
+}
+
+static bool mem_cache_hit(int page)
+{
+  type_mem_page *p = mem_cache_slot(page);
+  return p->valid && p->page == page && p->generation == mem_generation;
+}
+
+// fetches a run of pages in one go
+static void mem_cache_fill(int first, int count)
+{
+  unsigned char *buf = malloc(count * 256);
+  if (!buf)
+    return;
+  fetch_mem(first << 8, count * 256, buf);
+  for (int k = 0; k < count; k++) {
+    type_mem_page *p = mem_cache_slot(first + k);
+    memcpy(p->b, &buf[k * 256], 256);
+    p->page = first + k;
+    p->generation = mem_generation;
+    p->valid = true;
+  }
+  free(buf);
+}
+
+static unsigned char *mem_cache_page(int page)
+{
+  if (!mem_cache_hit(page))
+    mem_cache_fill(page, 1);
+  return mem_cache_slot(page)->b;
+}
+
+// makes sure all of addr..addr+len-1 is cached, fetching missing pages in
+// as few runs as possible
+void mem_cache_prefetch(int addr, int len, bool useAddr28)
+{
+  int full = mem_full_addr(addr, useAddr28);
+
+  if (len < 1 || !mem_cacheable(full) || !mem_cacheable(full + len - 1))
+    return;
+  int first = full >> 8, last = (full + len - 1) >> 8;
+  for (int page = first; page <= last;) {
+    if (mem_cache_hit(page)) {
+      page++;
+      continue;
+    }
+    int run = 1;
+    while (page + run <= last && !mem_cache_hit(page + run) && run < MEM_CACHE_PAGES / 2)
+      run++;
+    mem_cache_fill(page, run);
+    page += run;
+  }
+}
+
 mem_data get_mem(int addr, bool useAddr28)
 {
   mem_data mem = { 0 };
   char str[100];
+  int full = mem_full_addr(addr, useAddr28);
+
+  if (mem_cacheable(full) && mem_cacheable(full + 15)) {
+    unsigned char *p = mem_cache_page(full >> 8);
+    mem.addr = full;
+    for (int k = 0; k < 16; k++) {
+      if (((full + k) & 0xff) == 0 && k)
+        p = mem_cache_page((full + k) >> 8);
+      mem.b[k] = p[(full + k) & 0xff];
+    }
+    return mem;
+  }
+
   if (useAddr28)
     sprintf(str, "m%07X\n", addr); // use 'm' (for 28-bit memory addresses)
   else
@@ -1150,23 +1378,69 @@ mem_data *get_mem28array(int addr)
 }
 
 // write buffer to client ram
+//
+// Small writes go out as one 's' command. Anything bigger uses the binary
+// 'l' transfer of push_ram(), which sends the bytes as they are instead
+// of three characters each.
+#define PUT_MEM_S_MAX 16
+
 void put_mem28array(int addr, unsigned char *data, int size)
 {
-  char str[10];
-  sprintf(outbuf, "s%08X", addr);
-
-  int i = 0;
-  while (i < size) {
-    sprintf(str, " %02X", data[i]);
-    strlcat(outbuf, str, BUFSIZE);
-    i++;
+  if (size > PUT_MEM_S_MAX) {
+    put_mem_block(addr, data, size, false);
+    return;
   }
-  strlcat(outbuf, "\n", BUFSIZE);
+
+  char *p = outbuf + sprintf(outbuf, "s%08X", addr);
+  for (int i = 0; i < size; i++)
+    p += sprintf(p, " %02X", data[i]);
+  strcpy(p, "\n");
 
   serialWrite(outbuf);
   serialRead(inbuf, BUFSIZE);
 }
 
+// writes a block with push_ram(), optionally reading it back to check.
+// Returns the number of bytes that did not verify.
+int put_mem_block(int addr, unsigned char *data, int size, bool verify)
+{
+  int bad = 0, old_cpu_stopped = cpu_stopped;
+
+  serialFlush();
+  // push_ram() stops the CPU for the transfer and only restarts it if it
+  // was running before, so tell it how we left it
+  cpu_stopped = cpu_held;
+  push_ram(addr, size, data);
+  // the monitor was talked to behind serialWrite()'s back
+  mem_generation++;
+
+  unsigned char *check = verify ? malloc(size) : NULL;
+  if (!check) {
+    cpu_stopped = old_cpu_stopped;
+    return verify ? -1 : 0;
+  }
+  fetch_mem(addr, size, check);
+  for (int i = 0; i < size; i++) {
+    if (check[i] == data[i])
+      continue;
+    if (!bad)
+      printf("- Verify failed at $%07X (wrote $%02X, read $%02X)\n", addr + i, data[i], check[i]);
+    bad++;
+  }
+  if (bad) {
+    // one more go, in case a byte got lost on the way
+    push_ram(addr, size, data);
+    fetch_mem(addr, size, check);
+    bad = 0;
+    for (int i = 0; i < size; i++)
+      if (check[i] != data[i])
+        bad++;
+  }
+  free(check);
+  cpu_stopped = old_cpu_stopped;
+  return bad;
+}
+
 void cmdRawHelp(void)
 {
   serialWrite("?\n");
@@ -1331,8 +1605,43 @@ void cmdMDump(void)
   mdump(addr, total);
 }
 
+// decoded instructions, valid as long as the memory cache would be
+#define DIS_MEMO_SIZE 256
+
+typedef struct {
+  bool valid;
+  int generation;
+  int addr;
+  bool useAddr28;
+  int bytecount;
+  char str[128];
+} type_dis_memo;
+
+type_dis_memo disMemo[DIS_MEMO_SIZE];
+
+int decode_addr_into_string(char *str, size_t maxsize, int addr, bool useAddr28);
+
 // return the last byte count
 int disassemble_addr_into_string(char *str, size_t maxsize, int addr, bool useAddr28)
+{
+  int full = mem_full_addr(addr, useAddr28);
+  type_dis_memo *memo = &disMemo[(full ^ (full >> 8)) % DIS_MEMO_SIZE];
+
+  if (!mem_cacheable(full) || !mem_cacheable(full + 15))
+    return decode_addr_into_string(str, maxsize, addr, useAddr28);
+
+  if (!memo->valid || memo->generation != mem_generation || memo->addr != addr || memo->useAddr28 != useAddr28) {
+    memo->bytecount = decode_addr_into_string(memo->str, sizeof(memo->str), addr, useAddr28);
+    memo->addr = addr;
+    memo->useAddr28 = useAddr28;
+    memo->generation = mem_generation;
+    memo->valid = true;
+  }
+  strlcpy(str, memo->str, maxsize);
+  return memo->bytecount;
+}
+
+int decode_addr_into_string(char *str, size_t maxsize, int addr, bool useAddr28)
 {
   int last_bytecount = 0;
   char s[32] = { 0 };
@@ -1550,7 +1859,7 @@ void disassemble(bool useAddr28)
     // print from .list ref? (i.e., find source in .a65 file?)
     if (idx == 0) {
       type_fileloc *found = find_in_list(addr);
-      cur_file_loc = found;
+      cur_file_loc = found ? found - fileLocs : -1;
       if (found) {
         if (found->module)
           printf("> \"%s\"  (%s:%d)\n", found->module, found->file, found->lineno);
@@ -2005,6 +2314,111 @@ void cmdMDisassemble(void)
   disassemble(true);
 }
 
+// How often to ask for the registers while the CPU is running. A hard
+// breakpoint makes the monitor print the registers by itself, so polling
+// is just a fallback there. A soft breakpoint is a JMP to itself, which
+// only shows up by looking at the PC.
+#define BREAK_POLL_HARD_US 1000000
+#define BREAK_POLL_SOFT_MIN_US 5000
+#define BREAK_POLL_SOFT_MAX_US 100000
+#define BREAK_SLICE_US 100000
+
+static bool pc_in_softbrk(int pc)
+{
+  return softbrkaddr && pc >= (softbrkaddr & 0xffff) && pc <= ((softbrkaddr + 3) & 0xffff);
+}
+
+// Pick the PC out of one line of unsolicited monitor output, as printed
+// when a breakpoint triggers ("PC   A  X ..." header, then the values,
+// or ",0777<pc>..." on newer monitors). Returns -1 for anything else.
+static int break_line_pc(char *line, bool *header)
+{
+  unsigned int pc;
+
+  if (!strncmp(line, "PC ", 3)) {
+    *header = true;
+    return -1;
+  }
+  if (line[0] == ',' && strlen(line) >= 9 && sscanf(line + 5, "%04X", &pc) == 1)
+    return pc;
+  if (*header) {
+    *header = false;
+    if (sscanf(line, "%04X", &pc) == 1)
+      return pc;
+  }
+  return -1;
+}
+
+// Block on the serial link until the CPU stops at a breakpoint or ctrl-c
+// is pressed, instead of sampling the registers every 10ms.
+static void wait_for_break(void)
+{
+  char line[256];
+  int len = 0;
+  bool header = false;
+  long long poll_us = softbrkaddr ? BREAK_POLL_SOFT_MIN_US : BREAK_POLL_HARD_US;
+  long long next_poll = gettime_us() + poll_us;
+  int last_pc = -1;
+
+  while (!ctrlcflag) {
+    long long now = gettime_us();
+    long long slice = next_poll - now;
+    if (slice > BREAK_SLICE_US)
+      slice = BREAK_SLICE_US;
+    if (slice < 0)
+      slice = 0;
+
+    if (monitor_wait_readable(slice) > 0) {
+      unsigned char buf[1024];
+      int b = serialport_read(fd, buf, sizeof(buf));
+      for (int i = 0; i < b; i++) {
+        if (buf[i] == '\r')
+          continue;
+        if (buf[i] != '\n') {
+          if (len < (int)sizeof(line) - 1)
+            line[len++] = buf[i];
+          continue;
+        }
+        line[len] = 0;
+        len = 0;
+        int pc = break_line_pc(line, &header);
+        if (pc >= 0 && (!softbrkaddr || pc_in_softbrk(pc))) {
+          if (pc_in_softbrk(pc))
+            clearSoftBreak();
+          else
+            cpu_held = true;
+          return;
+        }
+      }
+      continue;
+    }
+
+    if (ctrlcflag || gettime_us() < next_poll)
+      continue;
+
+    // nothing arrived on its own, so ask
+    reg_data reg = get_regs();
+    if (pc_in_softbrk(reg.pc)) {
+      clearSoftBreak();
+      return;
+    }
+    // a hard breakpoint leaves the CPU stopped at its address
+    if (!softbrkaddr && reg.pc == hardbrkaddr) {
+      cpu_held = true;
+      return;
+    }
+    // breakpoint set behind our back, so fall back to the PC not moving
+    if (!softbrkaddr && hardbrkaddr < 0 && reg.pc == last_pc) {
+      cpu_held = true;
+      return;
+    }
+    last_pc = reg.pc;
+    if (softbrkaddr && poll_us < BREAK_POLL_SOFT_MAX_US)
+      poll_us *= 2;
+    next_poll = gettime_us() + poll_us;
+  }
+}
+
 void do_continue(int do_soft_break)
 {
   traceframe = 0;
@@ -2027,6 +2441,7 @@ void do_continue(int do_soft_break)
       char str[100];
       sprintf(str, "b%04X\n", addr);
       serialWrite(str);
+      hardbrkaddr = addr & 0xffff;
       serialRead(inbuf, BUFSIZE);
     }
   }
@@ -2035,40 +2450,10 @@ void do_continue(int do_soft_break)
   serialWrite("t0\n");
   serialRead(inbuf, BUFSIZE);
 
-  // Try keep this in a loop that tests for a breakpoint
-  // getting hit, or the user pressing CTRL-C to force
-  // a "t1" command to turn trace mode back on
-  int cur_pc = -1;
-  int same_cnt = 0;
+  // Wait for a breakpoint to get hit, or the user pressing CTRL-C to
+  // force a "t1" command to turn trace mode back on
   continue_mode = true;
-  while (1) {
-    usleep(10000);
-
-    if (ctrlcflag) {
-      break;
-    }
-
-    // get current register values
-    reg_data reg = get_regs();
-
-    if (reg.pc == cur_pc || (softbrkaddr && (reg.pc >= (softbrkaddr & 0xffff) && reg.pc <= ((softbrkaddr + 3) & 0xffff)))) {
-      same_cnt++;
-      // printf("good addr=$%04X : same_cnt=%d (soft=$%04X)\n", reg.pc, same_cnt, softbrkaddr);
-      if (same_cnt == 5) {
-        if (reg.pc >= (softbrkaddr & 0xffff) && reg.pc <= ((softbrkaddr + 3) & 0xffff)) {
-          clearSoftBreak();
-          // doOneShotAssembly("cli");
-        }
-        break;
-      }
-    }
-    else {
-      // printf("lost addr=$%04X (soft=$%04X)\n", reg.pc, softbrkaddr);
-      same_cnt = 0;
-      cur_pc = reg.pc;
-    }
-  }
-
+  wait_for_break();
   continue_mode = false;
   if (autocls)
     cmdClearScreen();
@@ -2128,9 +2513,13 @@ void cmdHardNext(void)
     sscanf(token, "%d", &count);
   }
 
-  for (int k = 0; k < count; k++) {
-    hard_next();
+  if (count > 1) {
+    trace_steps(count, true);
+    serialWrite("r\n");
+    serialRead(inbuf, BUFSIZE);
   }
+  else
+    hard_next();
 
   if (outputFlag) {
     if (autocls)
@@ -2154,9 +2543,13 @@ void cmdStep(void)
     sscanf(token, "%d", &count);
   }
 
-  for (int k = 0; k < count; k++) {
-    step();
+  if (count > 1) {
+    trace_steps(count, false);
+    serialWrite("r\n");
+    serialRead(inbuf, BUFSIZE);
   }
+  else
+    step();
 
   if (outputFlag) {
     if (autocls)
@@ -2221,6 +2614,214 @@ void cmdNext(void)
   }
 }
 
+/*
+ * Trace recording
+ *
+ * Steps are sent to the monitor TRACE_WINDOW at a time instead of one
+ * command per round trip (if it has an RX buffer to take them), and the
+ * register dump that answers each of them is kept in a ring buffer, so
+ * that the recorded states can be browsed backwards and forwards
+ * ("tb"/"tf") and exported ("tsave") afterwards.
+ */
+#define TRACE_RING_SIZE 65536
+#define TRACE_WINDOW 8
+#define TRACE_TIMEOUT_MS 1000
+
+reg_data traceRing[TRACE_RING_SIZE];
+int traceHead = 0;     // where the next state goes
+int traceCount = 0;    // number of valid states
+int traceBrowse = 0;   // how far back from the newest state tb/tf are
+long traceTotal = 0;   // states recorded since the last tclear
+
+static void trace_record(reg_data *reg)
+{
+  traceRing[traceHead] = *reg;
+  traceHead = (traceHead + 1) % TRACE_RING_SIZE;
+  if (traceCount < TRACE_RING_SIZE)
+    traceCount++;
+  traceTotal++;
+}
+
+// the state <back> steps before the newest one
+static reg_data *trace_get(int back)
+{
+  if (back < 0 || back >= traceCount)
+    return NULL;
+  return &traceRing[(traceHead - 1 - back + TRACE_RING_SIZE) % TRACE_RING_SIZE];
+}
+
+// pipelines <count> steps (or step-overs, if hard is set) and records the
+// register state after each of them. Returns the number of steps done.
+int trace_steps(int count, bool hard)
+{
+  char line[256];
+  int len = 0, sent = 0, done = 0;
+  bool header = false;
+  char *cmd = hard ? "N\n" : "\n";
+  long long start = gettime_ms(), last_rx = start;
+  // without an RX buffer, steps sent ahead would be dropped
+  int window = no_rxbuff ? 1 : TRACE_WINDOW;
+
+  serialFlush();
+  while (done < count) {
+    // keep a few steps in flight, but stop sending on ctrl-c
+    while (!ctrlcflag && sent < count && sent - done < window) {
+      serialSend(cmd);
+      sent++;
+    }
+    if (done == sent)
+      break;
+
+    if (monitor_wait_readable(100000) <= 0) {
+      if (gettime_ms() - last_rx > TRACE_TIMEOUT_MS) {
+        printf("- monitor stopped answering after %d of %d steps\n", done, count);
+        break;
+      }
+      continue;
+    }
+    unsigned char buf[1024];
+    int b = serialport_read(fd, buf, sizeof(buf));
+    if (b > 0)
+      last_rx = gettime_ms();
+    for (int i = 0; i < b; i++) {
+      if (buf[i] == '\r')
+        continue;
+      if (buf[i] != '\n') {
+        if (len < (int)sizeof(line) - 1)
+          line[len++] = buf[i];
+        continue;
+      }
+      line[len] = 0;
+      len = 0;
+      if (!strncmp(line, "PC ", 3)) {
+        header = true;
+        continue;
+      }
+      if (header) {
+        reg_data reg = { 0 };
+        header = false;
+        if (parse_regs(line, &reg) >= 12) {
+          trace_record(&reg);
+          done++;
+        }
+      }
+    }
+  }
+  // let the last prompt arrive, so that it doesn't confuse the next command
+  serialRead(inbuf, BUFSIZE);
+  traceBrowse = 0;
+
+  long long ms = gettime_ms() - start;
+  if (count > 1)
+    printf("- %d steps in %lldms (%lld steps/sec)\n", done, ms, ms ? done * 1000LL / ms : (long long)done);
+  return done;
+}
+
+void cmdTrace(void)
+{
+  int count = 1;
+  bool hard = false;
+
+  char *token = strtok(NULL, " ");
+  if (token)
+    sscanf(token, "%d", &count);
+  token = strtok(NULL, " ");
+  if (token && !strcmp(token, "n"))
+    hard = true;
+
+  traceframe = 0;
+  trace_steps(count, hard);
+
+  if (outputFlag) {
+    if (autocls)
+      cmdClearScreen();
+    cmdDisassemble();
+  }
+}
+
+static void trace_show(void)
+{
+  static char s[64];
+  reg_data *reg = trace_get(traceBrowse);
+
+  if (!reg) {
+    printf("- No trace recorded (use 'trace <count>')\n");
+    return;
+  }
+  if (autocls)
+    cmdClearScreen();
+  printf("<<< TRACE: %d of %d steps back >>>\n", traceBrowse, traceCount - 1);
+  show_regs(reg);
+  printf("---------------------------------------\n");
+
+  // memory may have changed since, but it's the best we've got
+  sprintf(s, "dis %04X", reg->pc);
+  strtok(s, " ");
+  disassemble(false);
+}
+
+void cmdTraceBack(void)
+{
+  int cnt = 1;
+  char *token = strtok(NULL, " ");
+  if (token)
+    sscanf(token, "%d", &cnt);
+
+  traceBrowse += cnt;
+  if (traceBrowse > traceCount - 1)
+    traceBrowse = traceCount - 1;
+  if (traceBrowse < 0)
+    traceBrowse = 0;
+  trace_show();
+}
+
+void cmdTraceForward(void)
+{
+  int cnt = 1;
+  char *token = strtok(NULL, " ");
+  if (token)
+    sscanf(token, "%d", &cnt);
+
+  traceBrowse -= cnt;
+  if (traceBrowse < 0)
+    traceBrowse = 0;
+  trace_show();
+}
+
+void cmdTraceSave(void)
+{
+  char *token = strtok(NULL, " ");
+
+  if (!token) {
+    printf("Missing <filename> parameter!\n");
+    return;
+  }
+  FILE *f = fopen(token, "w");
+  if (!f) {
+    printf("Could not open \"%s\" for writing\n", token);
+    return;
+  }
+
+  fprintf(f, "STEP     PC   A  X  Y  Z  B  SP   MAPH MAPL LAST-OP P  P-FLAGS  SOURCE\n");
+  for (int back = traceCount - 1; back >= 0; back--) {
+    reg_data *reg = trace_get(back);
+    type_fileloc *fl = find_in_list(reg->pc);
+    fprintf(f, "%-8ld %04X %02X %02X %02X %02X %02X %04X %04X %04X %02X      %02X %02X %-8s", traceTotal - 1 - back, reg->pc,
+        reg->a, reg->x, reg->y, reg->z, reg->b, reg->sp, reg->maph, reg->mapl, reg->lastop, reg->odd1, reg->odd2, reg->flags);
+    if (fl)
+      fprintf(f, " %s:%d", fl->file, fl->lineno);
+    fprintf(f, "\n");
+  }
+  fclose(f);
+  printf("- Saved %d steps to \"%s\"\n", traceCount, token);
+}
+
+void cmdTraceClear(void)
+{
+  traceHead = traceCount = traceBrowse = 0;
+  traceTotal = 0;
+}
+
 void cmdFinish(void)
 {
   traceframe = 0;
@@ -2260,12 +2861,12 @@ int get_sym_value(char *token)
     int lineno = 0;
     sscanf(&token[1], "%d", &lineno);
     type_fileloc *fl = find_lineno_in_list(lineno);
-    if (!cur_file_loc) {
+    if (cur_file_loc < 0) {
       printf("- Current source file unknown\n");
       return -1;
     }
     if (!fl) {
-      printf("- Could not locate code at \"%s:%d\"\n", cur_file_loc->file, lineno);
+      printf("- Could not locate code at \"%s:%d\"\n", fileLocs[cur_file_loc].file, lineno);
       return -1;
     }
     addr = fl->addr;
@@ -2440,6 +3041,7 @@ void cmdSetBreakpoint(void)
 
     sprintf(str, "b%04X\n", addr);
     serialWrite(str);
+    hardbrkaddr = addr & 0xffff;
     serialRead(inbuf, BUFSIZE);
   }
 }
@@ -2604,12 +3206,43 @@ void cmdWatchMDump(void)
   cmd_watch(TYPE_MDUMP);
 }
 
+// reads the memory of all watches into the cache up front, so that
+// watches sharing pages cost one read between them
+static void prefetch_watches(void)
+{
+  for (type_watch_entry *iter = lstWatches; iter != NULL; iter = iter->next) {
+    int addr = get_sym_value(iter->name);
+    int count = 16;
+
+    if (iter->param1)
+      sscanf(iter->param1, "%X", &count);
+    switch (iter->type) {
+    case TYPE_BYTE:
+    case TYPE_WORD:
+    case TYPE_DWORD:
+      mem_cache_prefetch(addr, 16, false);
+      break;
+    case TYPE_STRING:
+      // print_string() gives up after about 100 characters
+      mem_cache_prefetch(addr, 112, false);
+      break;
+    case TYPE_DUMP:
+      mem_cache_prefetch(addr, (count + 15) & ~15, false);
+      break;
+    case TYPE_MDUMP:
+      mem_cache_prefetch(addr, (count + 15) & ~15, true);
+      break;
+    }
+  }
+}
+
 void cmdWatches(void)
 {
   type_watch_entry *iter = lstWatches;
   int cnt = 0;
 
   printf("---------------------------------------\n");
+  prefetch_watches();
 
   while (iter != NULL) {
     cnt++;
@@ -2999,16 +3632,14 @@ void cmdLoad(void)
     if (buffer) {
       fread(buffer, fsize, 1, fload);
 
-      int i = 0;
-      while (i < fsize) {
-        int outSize = fsize - i;
-        if (outSize > 16) {
-          outSize = 16;
-        }
-
-        put_mem28array(addr + i, (unsigned char *)(buffer + i), outSize);
-        i += outSize;
-      }
+      long long start = gettime_ms();
+      int bad = put_mem_block(addr, (unsigned char *)buffer, fsize, true);
+      long long ms = gettime_ms() - start;
+      if (bad)
+        printf("- %d of %d bytes did not verify!\n", bad, fsize);
+      else
+        printf("- Loaded and verified %d bytes in %lldms (%lld bytes/sec)\n", fsize, ms,
+            ms ? fsize * 1000LL / ms : (long long)fsize);
 
       free(buffer);
     }
@@ -3072,76 +3703,271 @@ void cmdDownFrame(void)
   cmdDisassemble();
 }
 
-void search_range(int addr, int total, unsigned char *bytes, int length)
+/*
+ * Memory search
+ *
+ * The range is fetched once into a host-side snapshot with fetch_ram()
+ * (which keeps the monitor streaming instead of one 'M' round trip per
+ * 256 bytes), and kept for the next search until mem_generation says
+ * something may have written to memory. All patterns are then found in a
+ * single pass with an Aho-Corasick automaton built over the longest run
+ * of fixed bytes of each pattern; wildcard bytes ("??") around that run
+ * are checked at every candidate. Overlapping matches are all reported.
+ */
+#define SEARCH_MAX_PATTERNS 16
+#define SEARCH_MAX_LEN 64
+
+typedef struct {
+  unsigned char b[SEARCH_MAX_LEN];
+  unsigned char mask[SEARCH_MAX_LEN]; // 0 for a wildcard byte
+  int len;
+  int anchor;     // start of the longest run of fixed bytes
+  int anchor_len; // and its length
+} type_search_pattern;
+
+typedef struct {
+  int addr;
+  int pattern;
+} type_search_hit;
+
+unsigned char *searchSnap = NULL;
+int searchSnapAddr = 0;
+int searchSnapLen = 0;
+int searchSnapGeneration = -1;
+
+static unsigned char *search_snapshot(int addr, int total)
 {
-  int cnt = 0;
-  bool found_start = false;
-  int found_count = 0;
-  int start_loc = 0;
-  int results_cnt = 0;
+  if (searchSnap && searchSnapGeneration == mem_generation && addr >= searchSnapAddr
+      && addr + total <= searchSnapAddr + searchSnapLen && cpu_held) {
+    printf("- Using memory snapshot of $%07X-$%07X\n", searchSnapAddr, searchSnapAddr + searchSnapLen - 1);
+    return searchSnap + (addr - searchSnapAddr);
+  }
 
-  printf("Searching for: ");
-  for (int k = 0; k < length; k++) {
-    printf("%02X ", bytes[k]);
+  unsigned char *snap = malloc(total);
+  if (!snap) {
+    printf("- Could not allocate %d bytes for the memory snapshot\n", total);
+    return NULL;
   }
-  printf("\n");
+  long long start = gettime_ms();
+  if (fetch_mem(addr, total, snap)) {
+    printf("- Could not read memory\n");
+    free(snap);
+    return NULL;
+  }
+  long long ms = gettime_ms() - start;
+  printf("- Fetched %d bytes in %lldms (%lld KB/sec)\n", total, ms, ms ? total / ms : (long long)total / 1000);
 
-  while (cnt < total) {
-    // get memory at current pc
-    mem_data *multimem = get_mem28array(addr + cnt);
+  free(searchSnap);
+  searchSnap = snap;
+  searchSnapAddr = addr;
+  searchSnapLen = total;
+  // the CPU may keep running and change memory, so only reuse a snapshot
+  // taken while it was held
+  searchSnapGeneration = cpu_held ? mem_generation : -1;
+  return snap;
+}
 
-    for (int m = 0; m < 32; m++) {
-      mem_data mem = multimem[m];
+static int search_hit_cmp(const void *a, const void *b)
+{
+  const type_search_hit *x = a, *y = b;
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  return x->pattern - y->pattern;
+}
 
-      for (int k = 0; k < 16; k++) {
-        if (!found_start) {
-          if (mem.b[k] == bytes[0]) {
-            found_start = true;
-            start_loc = mem.addr + k;
-            found_count++;
-          }
-        }
-        else // matched till the end?
-        {
-          if (mem.b[k] == bytes[found_count]) {
-            found_count++;
-            // we found a complete match?
-            if (found_count == length) {
-              printf("%07X\n", start_loc);
-              found_start = false;
-              found_count = 0;
-              start_loc = 0;
-              results_cnt++;
-            }
-          }
-          else {
-            found_start = false;
-            start_loc = 0;
-            found_count = 0;
-          }
-        }
-      } // end for k
+static void add_search_hit(type_search_hit **hits, int *count, int *alloc, int addr, int pattern)
+{
+  if (*count == *alloc) {
+    *alloc = *alloc ? *alloc * 2 : 256;
+    *hits = realloc(*hits, *alloc * sizeof(type_search_hit));
+  }
+  (*hits)[*count].addr = addr;
+  (*hits)[*count].pattern = pattern;
+  (*count)++;
+}
 
-      cnt += 16;
+void search_range(int addr, int total, type_search_pattern *pats, int npats)
+{
+  int (*go)[256];
+  int *fail, *out, *out_next, *queue;
+  int nodes = 1, maxnodes = 1;
+  type_search_hit *hits = NULL;
+  int hit_count = 0, hit_alloc = 0;
 
-      if (cnt > total)
-        break;
-    } // end for m
+  for (int p = 0; p < npats; p++) {
+    printf("Searching for: ");
+    for (int k = 0; k < pats[p].len; k++) {
+      if (pats[p].mask[k])
+        printf("%02X ", pats[p].b[k]);
+      else
+        printf("?? ");
+    }
+    printf("\n");
+    maxnodes += pats[p].anchor_len;
+  }
 
+  unsigned char *mem = search_snapshot(addr, total);
+  if (!mem)
+    return;
+  long long start = gettime_ms();
+
+  // build the trie over the anchors; out[] chains the patterns ending at
+  // a node, including those ending at its fail links
+  go = malloc(maxnodes * sizeof(*go));
+  fail = calloc(maxnodes, sizeof(int));
+  out = malloc(maxnodes * sizeof(int));
+  out_next = malloc(npats * sizeof(int));
+  queue = malloc(maxnodes * sizeof(int));
+  memset(go, -1, maxnodes * sizeof(*go));
+  memset(out, -1, maxnodes * sizeof(int));
+  for (int p = 0; p < npats; p++) {
+    int n = 0;
+    for (int k = 0; k < pats[p].anchor_len; k++) {
+      unsigned char c = pats[p].b[pats[p].anchor + k];
+      if (go[n][c] < 0)
+        go[n][c] = nodes++;
+      n = go[n][c];
+    }
+    out_next[p] = out[n];
+    out[n] = p;
+  }
+
+  // breadth first, turning the trie into a full transition table
+  int qh = 0, qt = 0;
+  for (int c = 0; c < 256; c++) {
+    if (go[0][c] < 0)
+      go[0][c] = 0;
+    else {
+      fail[go[0][c]] = 0;
+      queue[qt++] = go[0][c];
+    }
+  }
+  while (qh < qt) {
+    int n = queue[qh++];
+    for (int c = 0; c < 256; c++) {
+      int m = go[n][c];
+      if (m < 0) {
+        go[n][c] = go[fail[n]][c];
+        continue;
+      }
+      fail[m] = go[fail[n]][c];
+      queue[qt++] = m;
+    }
+  }
+
+  int n = 0;
+  for (int i = 0; i < total; i++) {
+    n = go[n][mem[i]];
+    for (int m = n; m > 0; m = fail[m]) {
+      for (int p = out[m]; p >= 0; p = out_next[p]) {
+        // i is the last byte of the anchor, so check the whole pattern
+        int s = i - pats[p].anchor - pats[p].anchor_len + 1;
+        if (s < 0 || s + pats[p].len > total)
+          continue;
+        int k;
+        for (k = 0; k < pats[p].len; k++)
+          if (pats[p].mask[k] && mem[s + k] != pats[p].b[k])
+            break;
+        if (k == pats[p].len)
+          add_search_hit(&hits, &hit_count, &hit_alloc, addr + s, p);
+      }
+    }
     if (ctrlcflag)
       break;
   }
 
-  if (results_cnt == 0) {
+  qsort(hits, hit_count, sizeof(type_search_hit), search_hit_cmp);
+  for (int k = 0; k < hit_count; k++) {
+    if (npats > 1)
+      printf("%07X  #%d\n", hits[k].addr, hits[k].pattern + 1);
+    else
+      printf("%07X\n", hits[k].addr);
+  }
+
+  if (hit_count == 0) {
     printf("None found...\n");
   }
+  printf("- Searched %d bytes in %lldms\n", total, gettime_ms() - start);
+
+  free(hits);
+  free(go);
+  free(fail);
+  free(out);
+  free(out_next);
+  free(queue);
+}
+
+// finds the longest run of fixed bytes, which drives the automaton
+static bool finish_search_pattern(type_search_pattern *pat)
+{
+  int run = 0;
+
+  pat->anchor_len = 0;
+  for (int k = 0; k < pat->len; k++) {
+    run = pat->mask[k] ? run + 1 : 0;
+    if (run > pat->anchor_len) {
+      pat->anchor_len = run;
+      pat->anchor = k - run + 1;
+    }
+  }
+  return pat->anchor_len > 0;
+}
+
+// <values> is one or more patterns separated by '|'. Each is a "string"
+// or a list of hex bytes, where ?? matches any byte.
+static int parse_search_patterns(char *str, type_search_pattern *pats)
+{
+  int npats = 0;
+  type_search_pattern *pat = &pats[0];
+
+  memset(pat, 0, sizeof(type_search_pattern));
+  while (*str) {
+    if (*str == ' ') {
+      str++;
+    }
+    else if (*str == '|') {
+      if (!finish_search_pattern(pat) || npats + 1 == SEARCH_MAX_PATTERNS)
+        return -1;
+      pat = &pats[++npats];
+      memset(pat, 0, sizeof(type_search_pattern));
+      str++;
+    }
+    else if (*str == '\"') {
+      for (str++; *str && *str != '\"'; str++) {
+        if (pat->len == SEARCH_MAX_LEN)
+          return -1;
+        pat->b[pat->len] = *str;
+        pat->mask[pat->len++] = 1;
+      }
+      if (*str)
+        str++;
+    }
+    else {
+      if (pat->len == SEARCH_MAX_LEN)
+        return -1;
+      if (str[0] == '?') {
+        pat->mask[pat->len++] = 0;
+        str += str[1] == '?' ? 2 : 1;
+        continue;
+      }
+      char *end;
+      long val = strtol(str, &end, 16);
+      if (end == str || val < 0 || val > 0xff)
+        return -1;
+      pat->b[pat->len] = val;
+      pat->mask[pat->len++] = 1;
+      str = end;
+    }
+  }
+  if (!finish_search_pattern(pat))
+    return -1;
+  return npats + 1;
 }
 
 void cmdSearch(void)
 {
   char *strAddr = strtok(NULL, " ");
-  char bytevals[64] = { 0 };
-  int len = 0;
+  static type_search_pattern pats[SEARCH_MAX_PATTERNS];
 
   if (strAddr == NULL) {
     printf("Missing <addr28> parameter!\n");
@@ -3158,23 +3984,19 @@ void cmdSearch(void)
   }
 
   char *strValues = strtok(NULL, "\0");
-
-  // provided a string?
-  if (strValues[0] == '\"') {
-    search_range(addr, total, (unsigned char *)&strValues[1], strlen(strValues) - 2);
+  if (strValues == NULL) {
+    printf("Missing <values> parameter!\n");
+    return;
   }
-  else {
 
-    char *sval = strtok(strValues, " ");
-    do {
-      int ival;
-      sscanf(sval, "%X", &ival);
-      bytevals[len] = ival;
-      len++;
-    } while ((sval = strtok(NULL, " ")) != NULL);
-
-    search_range(addr, total, (unsigned char *)bytevals, len);
+  int npats = parse_search_patterns(strValues, pats);
+  if (npats < 1) {
+    printf("Invalid search values (up to %d patterns of %d bytes, each with at least one fixed byte)\n",
+        SEARCH_MAX_PATTERNS, SEARCH_MAX_LEN);
+    return;
   }
+
+  search_range(addr, total, pats, npats);
 }
 
 void cmdScreenshot(void)
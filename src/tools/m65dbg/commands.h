@@ -20,6 +20,11 @@ void cmdSetContinueMode(bool val);
 void cmdStep(void);
 void cmdHardNext(void);
 void cmdNext(void);
+void cmdTrace(void);
+void cmdTraceBack(void);
+void cmdTraceForward(void);
+void cmdTraceSave(void);
+void cmdTraceClear(void);
 void cmdFinish(void);
 void cmdPrintByte(void);
 void cmdPrintWord(void);
@@ -85,7 +90,7 @@ typedef struct tse {
   char *symbol;
   int addr;   // integer value of symbol
   char *sval; // string value of symbol
-  struct tse *next;
+  int seq;    // insertion order
 } type_symmap_entry;
 
 #define TSEGMENT_NAME_SIZE 64
@@ -101,6 +106,7 @@ typedef struct t_o {
   int seg_cnt;
   int enabled;
   struct t_o *next;
+  struct t_o *hash_next; // next module with the same name hash
 } type_offsets;
 
 typedef enum { TYPE_BYTE, TYPE_WORD, TYPE_DWORD, TYPE_STRING, TYPE_DUMP, TYPE_MDUMP } type_watch;
@@ -114,7 +120,7 @@ typedef struct we {
 } type_watch_entry;
 
 extern type_command_details command_details[];
-extern type_symmap_entry *lstSymMap;
+type_symmap_entry *get_symmap(int *count); // sorted by address
 extern type_watch_entry *lstWatches;
 
 extern bool fastmode;
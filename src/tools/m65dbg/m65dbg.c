@@ -120,24 +120,22 @@ void ctrlc_handler(int s)
 char *my_generator(const char *text, int state)
 {
   static int len;
-  static type_symmap_entry *iter = NULL;
+  static int sym_idx = 0;
   static int cmd_idx = 0;
+  int sym_count;
+  type_symmap_entry *syms = get_symmap(&sym_count);
 
   if (!state) {
     len = strlen(text);
-    iter = lstSymMap;
+    sym_idx = 0;
     cmd_idx = 0;
   }
 
   // check if it is a symbol name
-  while (iter != NULL) {
-    if (strncmp(iter->symbol, text, len) == 0) {
-      char *s = strdup(iter->symbol);
-      iter = iter->next;
-      return s;
-    }
-
-    iter = iter->next;
+  while (sym_idx < sym_count) {
+    if (strncmp(syms[sym_idx].symbol, text, len) == 0)
+      return strdup(syms[sym_idx++].symbol);
+    sym_idx++;
   }
 
   while (cmd_idx < cmdGetCmdCount()) {
@@ -3,9 +3,25 @@
 #include "m65common.h"
 #include "serial.h"
 
+int mem_generation = 0;
+bool cpu_held = false;
+
 void serialWrite(char *string)
 {
   serialFlush();
+  serialSend(string);
+}
+
+void serialSend(char *string)
+{
+  // anything but a read (memory, registers, disassembly, history, help,
+  // breakpoints) may have changed memory
+  if (!strchr("mMrdz?b", string[0]))
+    mem_generation++;
+  if (!strncmp(string, "t1", 2))
+    cpu_held = true;
+  else if (!strncmp(string, "t0", 2))
+    cpu_held = false;
 
   int i = strlen(string);
   char *out = malloc(i + 2);
@@ -93,6 +109,9 @@ void serialFlush(void)
 {
   int bytes_available = 0;
   static char tmp[16384];
+  // anything the monitor transport already read ahead goes too
+  if (monitor_wait_readable(0) > 0)
+    serialport_read(fd, (uint8_t *)tmp, sizeof(tmp));
 #ifdef FIONREAD
   ioctl(fd, FIONREAD, &bytes_available);
 #else
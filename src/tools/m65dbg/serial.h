@@ -18,6 +18,30 @@
  */
 void serialWrite(char *string);
 
+/**
+ * @brief Writes a string to the serial port like serialWrite(), but
+ *     keeps any unread input.
+ *
+ * For commands sent while the answers to earlier ones are still coming.
+ *
+ * @param string ptr to null-terminated string to write
+ */
+void serialSend(char *string);
+
+/**
+ * @brief Counts serialWrite() commands that may have changed memory.
+ *
+ * Host-side copies of the MEGA65's memory are only valid while this
+ * stays the same.
+ */
+extern int mem_generation;
+
+/**
+ * @brief Whether the CPU was last put into trace mode ('t1') rather than
+ *     set running ('t0').
+ */
+extern bool cpu_held;
+
 /**
  * @brief Reads serial data up to the command prompt.
  *
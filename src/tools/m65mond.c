@@ -0,0 +1,300 @@
+/*
+  Monitor multiplexing daemon: share one MEGA65 serial link between tools.
+
+  m65mond owns the UART (or tcp# link), keeps the serial monitor
+  synchronised and remembers the bitstream and ROM versions, the RX
+  buffer state and the C64/C65 mode. Tools connect with -l unix[#<path>]
+  (see open_monitor_daemon() in m65common.c) and are served one at a time
+  over a Unix socket. Each session starts with a header carrying the
+  cached state, so the tools can skip monitor_sync(), rxbuff_detect(),
+  detect_mode() and version probing, and then becomes a plain byte pipe
+  to the monitor. Other clients queue up in the socket backlog until the
+  current one disconnects.
+
+  Copyright (C) 2014-2023 Paul Gardner-Stephen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <strings.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <m65common.h>
+#include <logging.h>
+
+#define TOOLNAME "MEGA65 Monitor Daemon"
+
+extern const char *version_string;
+extern int no_rxbuff;
+
+// needed by fpgajtag
+FILE *logfile = NULL;
+
+char *serial_port = NULL;
+char *socket_path = NULL;
+int refresh_interval = 60;
+int listen_fd = -1;
+int cached_mode = 0;
+
+void usage(int exitcode, char *message)
+{
+  fprintf(stderr, TOOLNAME "\n");
+  fprintf(stderr, "Version: %s\n\n", version_string);
+  fprintf(stderr, "m65mond [options] -l <port>\n");
+  fprintf(stderr, "  -l|--device <port>   serial port (or tcp#host:port) of the MEGA65.\n"
+                  "  -s|--speed <bps>     serial speed (defaults to 2000000).\n"
+                  "  -S|--socket <path>   listen on <path> (default: $M65MOND_SOCKET or " M65MOND_DEFAULT_SOCKET ").\n"
+                  "  -r|--refresh <sec>   re-sync and refresh cached state when idle this long (default 60, 0=never).\n"
+                  "  -0|--log <level>     set log level (0-5).\n"
+                  "\n"
+                  "Tools then use '-l unix' (or '-l unix#<path>') instead of the serial port.\n"
+                  "\n");
+  if (message)
+    fprintf(stderr, "%s\n", message);
+  exit(exitcode);
+}
+
+void stop_daemon(int sig)
+{
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path);
+  }
+  log_note("exiting on signal %d", sig);
+  exit(0);
+}
+
+void refresh_cache(void)
+{
+  unsigned char mem_buff[16];
+  long long start = gettime_ms();
+
+  monitor_sync();
+  get_system_bitstream_version();
+  get_system_rom_version();
+
+  // like detect_mode(), but don't wait around if the machine is busy
+  cached_mode = 0;
+  saw_c64_mode = saw_c65_mode = saw_openrom = 0;
+  fetch_ram(0x20010, 16, mem_buff);
+  mem_buff[9] = 0;
+  if ((mem_buff[0] == 'V' || mem_buff[0] == 'O') && atoi((const char *)&mem_buff[1]) > 2000000)
+    cached_mode = 1;
+  else if (!(mega65_peek(0xffd3030) & 0x01) && !(mega65_peek(0xffd3054) & 7) && !detect_mode_probe())
+    cached_mode = saw_c65_mode ? 65 : 64;
+
+  log_info("cached state: %s, bitstream %s, ROM %s, mode %d (took %lldms)", system_hardware_model_name,
+      system_bitstream_version, system_rom_version, cached_mode, gettime_ms() - start);
+}
+
+// fields are '|' separated, so keep them out of the values
+static void header_field(char *out, int len, const char *in)
+{
+  int i;
+  for (i = 0; i < len - 1 && in[i]; i++)
+    out[i] = (in[i] == '|' || in[i] == '\n' || in[i] == '\r') ? ' ' : in[i];
+  out[i] = 0;
+}
+
+int write_all(int c, unsigned char *buf, int len)
+{
+  while (len > 0) {
+    int w = write(c, buf, len);
+    if (w < 1)
+      return -1;
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+void serve_client(int c)
+{
+  char header[512], name[64], bitstream[64], rom[32];
+  unsigned char buf[8192];
+  long long start = gettime_ms();
+  unsigned long long to_client = 0, from_client = 0;
+
+  purge_input();
+
+  header_field(name, sizeof(name), system_hardware_model_name);
+  header_field(bitstream, sizeof(bitstream), system_bitstream_version);
+  header_field(rom, sizeof(rom), system_rom_version);
+  snprintf(header, sizeof(header), "M65MOND|%d|%d|%s|%d|%s|%s\n", !no_rxbuff, system_hardware_model, name, cached_mode,
+      bitstream, rom);
+  if (write_all(c, (unsigned char *)header, strlen(header)))
+    return;
+
+  while (1) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(fd, &read_set);
+    FD_SET(c, &read_set);
+    if (select((fd > c ? fd : c) + 1, &read_set, NULL, NULL, NULL) < 1)
+      continue;
+
+    if (FD_ISSET(fd, &read_set)) {
+      int b = serialport_read(fd, buf, sizeof(buf));
+      if (b > 0) {
+        if (write_all(c, buf, b))
+          break;
+        to_client += b;
+      }
+    }
+    if (FD_ISSET(c, &read_set)) {
+      int b = read(c, buf, sizeof(buf));
+      if (b < 1)
+        break;
+      serialport_write(fd, buf, b);
+      from_client += b;
+    }
+  }
+
+  log_info("session ended after %lldms (%llu bytes to the MEGA65, %llu back)", gettime_ms() - start, from_client,
+      to_client);
+}
+
+int open_listen_socket(void)
+{
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) {
+    log_crit("could not create socket: %s", strerror(errno));
+    return -1;
+  }
+  // a stale socket from a previous run would stop bind()
+  unlink(socket_path);
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s, 16) < 0) {
+    log_crit("could not listen on '%s': %s", socket_path, strerror(errno));
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+int main(int argc, char **argv)
+{
+  // clang-format off
+  struct option long_opts[] = {
+    { "device",  required_argument, 0, 'l' },
+    { "speed",   required_argument, 0, 's' },
+    { "socket",  required_argument, 0, 'S' },
+    { "refresh", required_argument, 0, 'r' },
+    { "log",     required_argument, 0, '0' },
+    { "help",    no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  // clang-format on
+  int opt, loglevel;
+  time_t last_activity;
+
+  start_time = time(0);
+  log_setup(stderr, LOG_NOTE);
+
+  while ((opt = getopt_long(argc, argv, "l:s:S:r:0:h", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'l':
+      serial_port = strdup(optarg);
+      break;
+    case 's':
+      serial_speed = atoi(optarg);
+      break;
+    case 'S':
+      socket_path = strdup(optarg);
+      break;
+    case 'r':
+      refresh_interval = atoi(optarg);
+      break;
+    case '0':
+      loglevel = log_parse_level(optarg);
+      if (loglevel == -1)
+        usage(-3, "failed to parse log level!");
+      log_setup(stderr, loglevel);
+      break;
+    case 'h':
+      usage(0, NULL);
+    default:
+      usage(-3, "Unknown option.");
+    }
+  }
+
+  if (!serial_port)
+    usage(-3, "No serial port given.");
+  if (!strncasecmp(serial_port, "unix", 4))
+    usage(-3, "m65mond can't be chained to another m65mond.");
+  if (!socket_path)
+    socket_path = getenv("M65MOND_SOCKET") ? getenv("M65MOND_SOCKET") : M65MOND_DEFAULT_SOCKET;
+
+  log_note("%s %s", TOOLNAME, version_string);
+
+  if (open_the_serial_port(serial_port))
+    exit(-1);
+  rxbuff_detect();
+  refresh_cache();
+
+  if ((listen_fd = open_listen_socket()) < 0)
+    exit(-1);
+  signal(SIGINT, stop_daemon);
+  signal(SIGTERM, stop_daemon);
+  signal(SIGPIPE, SIG_IGN);
+  log_note("serving %s on '%s'", serial_port, socket_path);
+
+  last_activity = time(0);
+  while (1) {
+    fd_set read_set;
+    struct timeval tv = { 1, 0 };
+    FD_ZERO(&read_set);
+    FD_SET(listen_fd, &read_set);
+    FD_SET(fd, &read_set);
+    if (select((fd > listen_fd ? fd : listen_fd) + 1, &read_set, NULL, NULL, &tv) > 0) {
+      // nobody is listening, so whatever the MEGA65 says between sessions is dropped
+      if (FD_ISSET(fd, &read_set))
+        purge_input();
+      if (FD_ISSET(listen_fd, &read_set)) {
+        int c = accept(listen_fd, NULL, NULL);
+        if (c >= 0) {
+          log_info("client connected");
+          serve_client(c);
+          close(c);
+          // the client may have reset the machine, loaded a ROM, etc.
+          refresh_cache();
+          last_activity = time(0);
+        }
+      }
+    }
+    if (refresh_interval && time(0) - last_activity >= refresh_interval) {
+      refresh_cache();
+      last_activity = time(0);
+    }
+  }
+}
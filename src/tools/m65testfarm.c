@@ -0,0 +1,877 @@
+/*
+  Run unit tests against a farm of MEGA65 boards in parallel.
+
+  This is the native replacement for looping regression-test.sh over
+  one device at a time. Each board gets its own worker process that
+  keeps its serial monitor connection open for the whole run (and only
+  loads the bitstream once), while the parent hands out tests from the
+  list to whichever board becomes idle first. The unit test tokens
+  produced by the on-target test framework (see unit_test_logline() in
+  m65.c) are collected per test and merged into one JUnit or TAP report
+  with per-test timing.
+
+  Copyright (C) 2014-2023 Paul Gardner-Stephen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <strings.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <libusb.h>
+
+#include <m65common.h>
+#include <logging.h>
+#include <fpgajtag.h>
+
+#define TOOLNAME "MEGA65 Unit Test Farm"
+
+#define UT_TIMEOUT 10
+#define MAX_DEVICES 32
+#define MAX_TESTS 1024
+#define MAX_TEST_LOG 8192
+
+#define RESULT_PASS 0
+#define RESULT_FAIL 1
+#define RESULT_TIMEOUT 2
+#define RESULT_ERROR 3
+
+extern const char *version_string;
+
+// needed by fpgajtag
+FILE *logfile = NULL;
+
+struct farm_device {
+  char *serial_port;
+  char *jtag_serial;
+  pid_t pid;
+  int to_worker;
+  int from_worker;
+  int current_test;
+  int alive;
+  int ready; // has reported its version, so takes tests
+  int tests_run;
+  long long busy_ms;
+  char linebuf[MAX_TEST_LOG];
+  int linelen;
+};
+
+struct farm_test {
+  char *name;
+  char *path;
+  int timeout;
+  int device;
+  int result;
+  int failcount;
+  long long duration_ms;
+  char *log;
+  int loglen;
+  int retried;
+};
+
+struct farm_device devices[MAX_DEVICES];
+int device_count = 0;
+
+struct farm_test tests[MAX_TESTS];
+int test_count = 0;
+
+char *bitstream = NULL;
+char *model = NULL;
+char *report_file = NULL;
+int report_tap = 0;
+int loglevel = LOG_NOTE;
+
+// which worker are we (only valid inside a worker process)
+int worker_index = -1;
+
+void usage(int exitcode, char *message)
+{
+  fprintf(stderr, TOOLNAME "\n");
+  fprintf(stderr, "Version: %s\n\n", version_string);
+  fprintf(stderr, "m65testfarm [options] -d <port>[,<jtagser>] [-d ...] [-t <testlist>] [test.prg[:timeout] ...]\n");
+  fprintf(stderr, "  -d|--device <port>[,<jtagser>]  add a board to the farm (repeat for each board).\n"
+                  "  -b|--bit <file>      load FPGA bitstream <file> once on every board before testing.\n"
+                  "  -t|--tests <file>    read tests from <file> (regression-tests.lst format).\n"
+                  "  -m|--model <model>   only run tests valid for <model> (defaults to bitstream prefix).\n"
+                  "  -o|--output <file>   write merged report to <file> (default: stdout).\n"
+                  "  -T|--tap             write a TAP report instead of JUnit XML.\n"
+                  "  -s|--speed <bps>     serial speed (defaults to 2000000).\n"
+                  "  -0|--log <level>     set log level (0-5).\n"
+                  "\n");
+  if (message)
+    fprintf(stderr, "%s\n", message);
+  exit(exitcode);
+}
+
+void add_device(char *arg)
+{
+  char *comma;
+
+  if (device_count >= MAX_DEVICES)
+    usage(-3, "too many devices.");
+
+  bzero(&devices[device_count], sizeof(struct farm_device));
+  devices[device_count].serial_port = strdup(arg);
+  comma = strchr(devices[device_count].serial_port, ',');
+  if (comma) {
+    *comma = 0;
+    devices[device_count].jtag_serial = strdup(comma + 1);
+  }
+  devices[device_count].current_test = -1;
+  device_count++;
+}
+
+void add_test(const char *dir, const char *name, int timeout)
+{
+  char path[8192];
+
+  if (test_count >= MAX_TESTS)
+    usage(-3, "too many tests.");
+
+  if (dir && name[0] != '/')
+    snprintf(path, 8192, "%s/%s", dir, name);
+  else
+    snprintf(path, 8192, "%s", name);
+
+  bzero(&tests[test_count], sizeof(struct farm_test));
+  tests[test_count].name = strdup(name);
+  tests[test_count].path = strdup(path);
+  tests[test_count].timeout = timeout < UT_TIMEOUT ? UT_TIMEOUT : timeout;
+  tests[test_count].device = -1;
+  tests[test_count].result = RESULT_ERROR;
+  test_count++;
+}
+
+/*
+ * read_test_list(listfile)
+ *
+ * parses a regression-tests.lst style file:
+ *   TESTNAME TIMEOUT PLATFORM
+ * test names are relative to the directory of the list file.
+ */
+void read_test_list(const char *listfile)
+{
+  char line[1024], name[1024], timeout_str[64], models[1024], dir[8192];
+  char *slash;
+  FILE *f;
+  int n, timeout;
+
+  f = fopen(listfile, "r");
+  if (!f) {
+    log_crit("could not open test list '%s'", listfile);
+    exit(-1);
+  }
+
+  snprintf(dir, 8192, "%s", listfile);
+  slash = strrchr(dir, '/');
+  if (slash)
+    *slash = 0;
+  else
+    strcpy(dir, ".");
+
+  while (fgets(line, 1024, f)) {
+    n = sscanf(line, "%1023s %63s %1023s", name, timeout_str, models);
+    if (n < 1 || name[0] == '#')
+      continue;
+    if (n < 3)
+      strcpy(models, "all");
+    if (model && strcmp(models, "all") && !strstr(models, model)) {
+      log_note("skipping %s (%s not in %s)", name, model, models);
+      continue;
+    }
+    timeout = UT_TIMEOUT;
+    if (n >= 2 && isdigit(timeout_str[0]))
+      timeout = atoi(timeout_str);
+    add_test(dir, name, timeout);
+  }
+  fclose(f);
+}
+
+/*
+ * Worker side
+ *
+ * Everything below runs in a forked child, so the global serial state
+ * in m65common.c belongs to exactly one board.
+ */
+
+struct ut_stream {
+  unsigned char recent[4];
+  int recent_fill;
+  int receive_string;
+  int msg_pos;
+  char msgbuf[160];
+  char testname[160];
+  char testlog[160];
+  unsigned int last_issue, last_sub;
+  int failcount;
+  int tokens;
+  int done;
+};
+
+char *test_states[16] = { "START", " SKIP", " PASS", " FAIL", "ERROR", "C#$05", "C#$06", "C#$07", "C#$08", "C#$09", "C#$0A",
+  "C#$0B", "C#$0C", "  LOG", " NAME", " DONE" };
+
+void worker_send(const char *fmt, ...)
+{
+  char buf[MAX_TEST_LOG];
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(buf, MAX_TEST_LOG - 1, fmt, args);
+  va_end(args);
+  if (len > MAX_TEST_LOG - 2)
+    len = MAX_TEST_LOG - 2;
+  buf[len++] = '\n';
+  if (write(devices[worker_index].from_worker, buf, len) != len)
+    log_error("worker %d: short write to farm", worker_index);
+}
+
+void ut_logline(struct ut_stream *ut, unsigned int issue, unsigned int sub, unsigned char state, char *msg)
+{
+  // same layout as unit_test_logline() in m65.c, minus the timestamp
+  log_info("[%s] %s (Issue#%04d, Test #%03d%s%s)", devices[worker_index].serial_port, test_states[state & 0xf], issue, sub,
+      msg ? " - " : "", msg ? msg : "");
+  worker_send("L %s (Issue#%04d, Test #%03d%s%s)", test_states[state & 0xf], issue, sub, msg ? " - " : "", msg ? msg : "");
+}
+
+void ut_token(struct ut_stream *ut)
+{
+  unsigned int issue = ut->recent[0] + (ut->recent[1] << 8);
+  unsigned int sub = ut->recent[2];
+  unsigned char token = ut->recent[3];
+
+  if (ut->testlog[0] && token != 0xf2 && token != 0xf3) {
+    ut_logline(ut, ut->last_issue, ut->last_sub, 0xd, ut->testlog);
+    ut->testlog[0] = 0;
+  }
+  ut_logline(ut, issue, sub, token - 0xf0, ut->testlog[0] ? ut->testlog : (ut->testname[0] ? ut->testname : NULL));
+  ut->testlog[0] = 0;
+  ut->last_issue = issue;
+  ut->last_sub = sub;
+  ut->tokens++;
+
+  switch (token) {
+  case 0xf3: // test failure
+  case 0xf4: // error trying to run test
+    ut->failcount++;
+    break;
+  case 0xff: // last test complete
+    ut->done = 1;
+    break;
+  }
+}
+
+/*
+ * ut_feed(ut, buf, len)
+ *
+ * feeds serial bytes into the unit test token parser. This follows the
+ * protocol handled by enterTestMode() in m65.c: 4 byte tokens with the
+ * state in the last byte, and 0xfd/0xfe introducing a string that is
+ * terminated by a pound sign.
+ */
+void ut_feed(struct ut_stream *ut, unsigned char *buf, int len)
+{
+  for (int i = 0; i < len && !ut->done; i++) {
+    if (ut->receive_string) {
+      if (buf[i] == 92 || ut->msg_pos >= 159) {
+        ut->msgbuf[ut->msg_pos] = 0;
+        ut->receive_string = 0;
+        if (ut->recent[3] == 0xfd)
+          strncpy(ut->testlog, ut->msgbuf, 160);
+        else if (ut->recent[3] == 0xfe)
+          strncpy(ut->testname, ut->msgbuf, 160);
+        bzero(ut->recent, 4);
+        ut->recent_fill = 0;
+      }
+      else
+        ut->msgbuf[ut->msg_pos++] = buf[i];
+      continue;
+    }
+
+    ut->recent[0] = ut->recent[1];
+    ut->recent[1] = ut->recent[2];
+    ut->recent[2] = ut->recent[3];
+    ut->recent[3] = buf[i];
+    if (ut->recent_fill < 4)
+      ut->recent_fill++;
+    if (ut->recent_fill < 4)
+      continue;
+
+    if (ut->recent[3] == 0xfe || ut->recent[3] == 0xfd) {
+      if (ut->recent[3] == 0xfd && ut->testlog[0]) {
+        ut_logline(ut, ut->last_issue, ut->last_sub, 0xd, ut->testlog);
+        ut->testlog[0] = 0;
+      }
+      ut->receive_string = 1;
+      ut->msg_pos = 0;
+    }
+    else if (ut->recent[3] >= 0xf0) {
+      ut_token(ut);
+      ut->recent_fill = 0;
+    }
+  }
+}
+
+int worker_load_prg(const char *path)
+{
+  unsigned char buf[32768];
+  unsigned char header[2];
+  int load_addr, b;
+  FILE *f;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    log_error("could not open test '%s'", path);
+    return -1;
+  }
+  if (fread(header, 1, 2, f) != 2) {
+    log_error("test '%s' is too short", path);
+    fclose(f);
+    return -1;
+  }
+  load_addr = header[0] | (header[1] << 8);
+
+  // Reset the board, so every test starts from a clean machine, but keep
+  // the monitor connection (and the bitstream) we already have.
+  start_cpu();
+  slow_write(fd, "\r!\r", 3);
+  monitor_sync();
+  sleep(2);
+
+  detect_mode();
+  if (load_addr == 0x0801 && !saw_c64_mode) {
+    switch_to_c64mode();
+    usleep(200000);
+  }
+
+  real_stop_cpu();
+  b = fread(buf, 1, sizeof(buf), f);
+  while (b > 0) {
+    push_ram(load_addr, b, buf);
+    load_addr += b;
+    b = fread(buf, 1, sizeof(buf), f);
+  }
+  fclose(f);
+  monitor_sync();
+
+  // set end of BASIC program pointer, as m65 does
+  header[0] = load_addr;
+  header[1] = load_addr >> 8;
+  push_ram(saw_c65_mode ? 0x82 : 0x2d, 2, header);
+
+  start_cpu();
+  monitor_sync();
+  stuff_keybuffer("RUN:\r");
+  return 0;
+}
+
+void worker_run_test(int index)
+{
+  struct ut_stream ut;
+  unsigned char inbuf[8192];
+  long long start = gettime_ms();
+  time_t last_activity;
+  int result;
+
+  bzero(&ut, sizeof(ut));
+  log_note("[%s] running %s", devices[worker_index].serial_port, tests[index].name);
+
+  if (worker_load_prg(tests[index].path)) {
+    worker_send("R %d %d 0 %lld", index, RESULT_ERROR, gettime_ms() - start);
+    return;
+  }
+
+  last_activity = time(NULL);
+  while (!ut.done && time(NULL) - last_activity < tests[index].timeout) {
+    if (!wait_for_serial(WAIT_READ, 1, 0))
+      continue;
+    int b = serialport_read(fd, inbuf, 8192);
+    if (b > 0) {
+      // every unit test token restarts the timeout, as in m65 --unittest
+      int tokens = ut.tokens;
+      ut_feed(&ut, inbuf, b);
+      if (ut.tokens != tokens)
+        last_activity = time(NULL);
+    }
+  }
+
+  if (!ut.done)
+    result = RESULT_TIMEOUT;
+  else if (ut.failcount)
+    result = RESULT_FAIL;
+  else
+    result = RESULT_PASS;
+  worker_send("R %d %d %d %lld", index, result, ut.failcount, gettime_ms() - start);
+}
+
+int worker_main(int index)
+{
+  char line[64];
+  FILE *in;
+
+  worker_index = index;
+  in = fdopen(devices[index].to_worker, "r");
+
+  if (bitstream) {
+    char *detected_port
+        = init_fpgajtag(devices[index].jtag_serial, devices[index].serial_port, get_bitstream_fpgaid(bitstream));
+    if (!detected_port) {
+      log_crit("[%s] no matching JTAG device found", devices[index].serial_port);
+      worker_send("X no JTAG device");
+      return -1;
+    }
+    fpgajtag_main(bitstream);
+    log_note("[%s] waiting for the system to settle...", devices[index].serial_port);
+    sleep(4);
+  }
+
+  if (open_the_serial_port(devices[index].serial_port)) {
+    worker_send("X could not open serial port");
+    return -1;
+  }
+  xemu_flag = mega65_peek(0xffd360f) & 0x20 ? 0 : 1;
+  rxbuff_detect();
+  monitor_sync();
+  get_system_bitstream_version();
+  get_system_rom_version();
+  worker_send("V %s|%s|%s", system_hardware_model_name, system_bitstream_version, system_rom_version);
+
+  while (fgets(line, 64, in)) {
+    if (line[0] == 'Q')
+      break;
+    worker_run_test(atoi(line));
+  }
+
+  close_communication_port();
+  return 0;
+}
+
+/*
+ * Farm side
+ */
+
+void test_append_log(struct farm_test *t, const char *line)
+{
+  int len = strlen(line);
+  t->log = realloc(t->log, t->loglen + len + 2);
+  memcpy(t->log + t->loglen, line, len);
+  t->loglen += len;
+  t->log[t->loglen++] = '\n';
+  t->log[t->loglen] = 0;
+}
+
+int next_test = 0;
+
+// tests whose worker died before reporting a result, to be run again
+int requeued[MAX_TESTS];
+int requeued_count = 0;
+
+void send_worker(int d, char *cmd)
+{
+  if (write(devices[d].to_worker, cmd, strlen(cmd)) != strlen(cmd))
+    log_error("could not dispatch to %s", devices[d].serial_port);
+}
+
+/*
+ * gives worker d its next test. Workers with nothing to do are kept
+ * idle rather than told to quit, while tests are still running
+ * elsewhere: a worker may yet die and leave its test to be run again.
+ */
+void dispatch(int d)
+{
+  char cmd[64];
+  int busy = 0;
+
+  devices[d].current_test = -1;
+  if (requeued_count || next_test < test_count) {
+    devices[d].current_test = requeued_count ? requeued[--requeued_count] : next_test++;
+    tests[devices[d].current_test].device = d;
+    snprintf(cmd, 64, "%d\n", devices[d].current_test);
+    send_worker(d, cmd);
+    return;
+  }
+
+  for (int e = 0; e < device_count; e++)
+    if (devices[e].alive && devices[e].current_test >= 0)
+      busy++;
+  if (busy)
+    return;
+  for (int e = 0; e < device_count; e++)
+    if (devices[e].alive && devices[e].ready) {
+      send_worker(e, "Q\n");
+      devices[e].ready = 0;
+    }
+}
+
+void worker_died(int d)
+{
+  int index = devices[d].current_test;
+
+  devices[d].alive = 0;
+  devices[d].current_test = -1;
+  close(devices[d].from_worker);
+  close(devices[d].to_worker);
+  if (index < 0)
+    return;
+
+  log_error("%s died while running %s", devices[d].serial_port, tests[index].name);
+  tests[index].result = RESULT_ERROR;
+  // only once, in case it is the test that takes its worker down
+  if (!tests[index].retried++) {
+    tests[index].device = -1;
+    requeued[requeued_count++] = index;
+  }
+
+  // an idle worker takes it, or quits if nothing is left
+  for (int e = 0; e < device_count; e++)
+    if (devices[e].alive && devices[e].ready && devices[e].current_test < 0) {
+      dispatch(e);
+      return;
+    }
+}
+
+void handle_worker_line(int d, char *line)
+{
+  int index, result, failcount;
+  long long ms;
+
+  switch (line[0]) {
+  case 'V':
+    log_note("%s: %s", devices[d].serial_port, line + 2);
+    devices[d].ready = 1;
+    dispatch(d);
+    break;
+  case 'L':
+    if (devices[d].current_test >= 0)
+      test_append_log(&tests[devices[d].current_test], line + 2);
+    break;
+  case 'R':
+    if (sscanf(line + 2, "%d %d %d %lld", &index, &result, &failcount, &ms) == 4 && index >= 0 && index < test_count) {
+      tests[index].result = result;
+      tests[index].failcount = failcount;
+      tests[index].duration_ms = ms;
+      devices[d].tests_run++;
+      devices[d].busy_ms += ms;
+      log_note("%-20s %-16s %s (%.2fs)", tests[index].name, devices[d].serial_port,
+          result == RESULT_PASS      ? "ok"
+          : result == RESULT_TIMEOUT ? "timeout"
+          : result == RESULT_FAIL    ? "failed"
+                                     : "error",
+          ms / 1000.0);
+    }
+    dispatch(d);
+    break;
+  case 'X':
+    log_error("%s: %s", devices[d].serial_port, line + 2);
+    break;
+  }
+}
+
+void xml_escape(FILE *o, const char *s)
+{
+  for (; s && *s; s++) {
+    switch (*s) {
+    case '<':
+      fputs("&lt;", o);
+      break;
+    case '>':
+      fputs("&gt;", o);
+      break;
+    case '&':
+      fputs("&amp;", o);
+      break;
+    case '"':
+      fputs("&quot;", o);
+      break;
+    default:
+      if ((unsigned char)*s >= ' ' || *s == '\n')
+        fputc(*s, o);
+    }
+  }
+}
+
+void write_report(FILE *o, long long total_ms)
+{
+  int failures = 0, errors = 0;
+
+  for (int i = 0; i < test_count; i++) {
+    if (tests[i].result == RESULT_FAIL)
+      failures++;
+    else if (tests[i].result != RESULT_PASS)
+      errors++;
+  }
+
+  if (report_tap) {
+    fprintf(o, "TAP version 13\n1..%d\n", test_count);
+    for (int i = 0; i < test_count; i++) {
+      fprintf(o, "%s %d - %s # %s %.3fs\n", tests[i].result == RESULT_PASS ? "ok" : "not ok", i + 1, tests[i].name,
+          tests[i].device >= 0 ? devices[tests[i].device].serial_port : "-", tests[i].duration_ms / 1000.0);
+      for (char *l = tests[i].log; l && *l;) {
+        char *e = strchr(l, '\n');
+        fprintf(o, "  # %.*s\n", e ? (int)(e - l) : (int)strlen(l), l);
+        l = e ? e + 1 : NULL;
+      }
+    }
+    return;
+  }
+
+  fprintf(o, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(o, "<testsuites tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n", test_count, failures, errors,
+      total_ms / 1000.0);
+  fprintf(o, "  <testsuite name=\"");
+  xml_escape(o, bitstream ? bitstream : "mega65");
+  fprintf(o, "\" tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n", test_count, failures, errors,
+      total_ms / 1000.0);
+  for (int i = 0; i < test_count; i++) {
+    fprintf(o, "    <testcase name=\"");
+    xml_escape(o, tests[i].name);
+    fprintf(o, "\" classname=\"");
+    xml_escape(o, tests[i].device >= 0 ? devices[tests[i].device].serial_port : "unassigned");
+    fprintf(o, "\" time=\"%.3f\">\n", tests[i].duration_ms / 1000.0);
+    switch (tests[i].result) {
+    case RESULT_FAIL:
+      fprintf(o, "      <failure message=\"%d failures\"/>\n", tests[i].failcount);
+      break;
+    case RESULT_TIMEOUT:
+      fprintf(o, "      <error message=\"timeout after %d seconds\"/>\n", tests[i].timeout);
+      break;
+    case RESULT_ERROR:
+      fprintf(o, "      <error message=\"test could not be run\"/>\n");
+      break;
+    }
+    if (tests[i].log) {
+      fprintf(o, "      <system-out>");
+      xml_escape(o, tests[i].log);
+      fprintf(o, "</system-out>\n");
+    }
+    fprintf(o, "    </testcase>\n");
+  }
+  fprintf(o, "  </testsuite>\n</testsuites>\n");
+}
+
+int run_farm(void)
+{
+  int alive = 0, failed = 0;
+  long long start = gettime_ms();
+
+  for (int d = 0; d < device_count; d++) {
+    int to_worker[2], from_worker[2];
+    if (pipe(to_worker) || pipe(from_worker)) {
+      log_crit("could not create pipes: %s", strerror(errno));
+      exit(-1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    devices[d].pid = fork();
+    if (devices[d].pid < 0) {
+      log_crit("could not fork worker: %s", strerror(errno));
+      exit(-1);
+    }
+    if (!devices[d].pid) {
+      close(to_worker[1]);
+      close(from_worker[0]);
+      // without the other workers' pipe ends, a dead worker's pipe reports EOF
+      for (int e = 0; e < d; e++) {
+        close(devices[e].to_worker);
+        close(devices[e].from_worker);
+      }
+      devices[d].to_worker = to_worker[0];
+      devices[d].from_worker = from_worker[1];
+      exit(worker_main(d) ? 1 : 0);
+    }
+    close(to_worker[0]);
+    close(from_worker[1]);
+    devices[d].to_worker = to_worker[1];
+    devices[d].from_worker = from_worker[0];
+    devices[d].alive = 1;
+    alive++;
+  }
+
+  while (alive) {
+    fd_set read_set;
+    int maxfd = -1;
+
+    FD_ZERO(&read_set);
+    for (int d = 0; d < device_count; d++)
+      if (devices[d].alive) {
+        FD_SET(devices[d].from_worker, &read_set);
+        if (devices[d].from_worker > maxfd)
+          maxfd = devices[d].from_worker;
+      }
+    if (select(maxfd + 1, &read_set, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR)
+        continue;
+      log_crit("select failed: %s", strerror(errno));
+      break;
+    }
+
+    for (int d = 0; d < device_count; d++) {
+      if (!devices[d].alive || !FD_ISSET(devices[d].from_worker, &read_set))
+        continue;
+      int b = read(devices[d].from_worker, devices[d].linebuf + devices[d].linelen, MAX_TEST_LOG - 1 - devices[d].linelen);
+      if (b <= 0) {
+        // worker is gone: its current test is run again by another one
+        worker_died(d);
+        alive--;
+        continue;
+      }
+      devices[d].linelen += b;
+      char *nl;
+      while ((nl = memchr(devices[d].linebuf, '\n', devices[d].linelen))) {
+        *nl = 0;
+        handle_worker_line(d, devices[d].linebuf);
+        int used = nl - devices[d].linebuf + 1;
+        memmove(devices[d].linebuf, nl + 1, devices[d].linelen - used);
+        devices[d].linelen -= used;
+      }
+      if (devices[d].linelen == MAX_TEST_LOG - 1)
+        devices[d].linelen = 0;
+    }
+  }
+
+  for (int d = 0; d < device_count; d++)
+    waitpid(devices[d].pid, NULL, 0);
+
+  long long total_ms = gettime_ms() - start;
+
+  FILE *o = stdout;
+  if (report_file) {
+    o = fopen(report_file, "w");
+    if (!o) {
+      log_crit("could not write report '%s'", report_file);
+      exit(-1);
+    }
+  }
+  write_report(o, total_ms);
+  if (o != stdout)
+    fclose(o);
+
+  for (int i = 0; i < test_count; i++)
+    if (tests[i].result != RESULT_PASS)
+      failed++;
+  for (int d = 0; d < device_count; d++)
+    log_note("%s: %d tests, %.2fs busy of %.2fs", devices[d].serial_port, devices[d].tests_run, devices[d].busy_ms / 1000.0,
+        total_ms / 1000.0);
+  log_note("executed %d tests on %d boards in %.2fs with %d failed", test_count, device_count, total_ms / 1000.0, failed);
+
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  // clang-format off
+  struct option long_opts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "bit",    required_argument, 0, 'b' },
+    { "tests",  required_argument, 0, 't' },
+    { "model",  required_argument, 0, 'm' },
+    { "output", required_argument, 0, 'o' },
+    { "tap",    no_argument,       0, 'T' },
+    { "speed",  required_argument, 0, 's' },
+    { "log",    required_argument, 0, '0' },
+    { "help",   no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  // clang-format on
+  char *test_list = NULL;
+  int opt;
+
+  start_time = time(0);
+  log_setup(stderr, LOG_NOTE);
+
+  while ((opt = getopt_long(argc, argv, "d:b:t:m:o:Ts:0:h", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      add_device(optarg);
+      break;
+    case 'b':
+      bitstream = strdup(optarg);
+      break;
+    case 't':
+      test_list = strdup(optarg);
+      break;
+    case 'm':
+      model = strdup(optarg);
+      break;
+    case 'o':
+      report_file = strdup(optarg);
+      break;
+    case 'T':
+      report_tap = 1;
+      break;
+    case 's':
+      serial_speed = atoi(optarg);
+      break;
+    case '0':
+      loglevel = log_parse_level(optarg);
+      if (loglevel == -1)
+        usage(-3, "failed to parse log level!");
+      log_setup(stderr, loglevel);
+      break;
+    case 'h':
+      usage(0, NULL);
+    default:
+      usage(-3, "Unknown option.");
+    }
+  }
+
+  if (!device_count)
+    usage(-3, "No devices given.");
+
+  // like regression-test.sh, derive the model from the bitstream name (mega65r3-...)
+  if (!model && bitstream) {
+    char *base = strrchr(bitstream, '/');
+    model = strdup(base ? base + 1 : bitstream);
+    if (strchr(model, '-'))
+      *strchr(model, '-') = 0;
+  }
+
+  if (test_list)
+    read_test_list(test_list);
+  for (int i = optind; i < argc; i++) {
+    char *colon = strrchr(argv[i], ':');
+    int timeout = UT_TIMEOUT;
+    if (colon && isdigit(colon[1])) {
+      *colon = 0;
+      timeout = atoi(colon + 1);
+    }
+    add_test(NULL, argv[i], timeout);
+  }
+
+  if (!test_count)
+    usage(-3, "No tests given.");
+
+  log_note("%s %s", TOOLNAME, version_string);
+  log_note("running %d tests on %d boards", test_count, device_count);
+
+  signal(SIGPIPE, SIG_IGN);
+  return run_farm();
+}
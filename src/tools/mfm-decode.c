@@ -1,6 +1,26 @@
+/*
+  Decodes MEGA65 FDC read captures: one byte per gap between flux
+  transitions, as captured by DMA.
+
+  The capture is streamed through
+
+    gap reader -> timing correction -> MFM/RLL bit decoder -> sync/CRC framer
+
+  one gap at a time, so captures of any length can be decoded from files
+  or stdin in constant memory. The gap statistics for tuning write
+  pre-compensation are optional (-s), and are kept sparse.
+
+  For recovering marginal disks, -w sweeps the captures over a range of
+  rates as both MFM and RLL2,7 in parallel, and writes the best copy of
+  every sector that was read to a disk image.
+*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 int show_gaps = 0;
 int show_bits = 0;
@@ -74,7 +94,7 @@ int q_gap(float gap)
   return b;
 }
 
-int last_pulse = 0;
+long long last_pulse = 0;
 float last_gap = 0;
 int last_bit = 0;
 unsigned char byte = 0;
@@ -85,19 +105,6 @@ int sync_count = 0;
 int field_ofs = 0;
 unsigned char data_field[1024];
 
-#define MAX_GAPS 65536 * 4
-float corrected_deltas[MAX_GAPS];
-float uncorrected_deltas[MAX_GAPS];
-int cdelta_count = 0;
-int ucdelta_count = 0;
-int start_data = 0;
-
-#define MAX_SIGNALS 64
-#define MAX_SAMPLES 65536 * 4
-float traces[MAX_SIGNALS][MAX_SAMPLES];
-int sample_counts[MAX_SIGNALS] = { 0 };
-float max_time = 0;
-
 // CRC16 algorithm from:
 // https://github.com/psbhlw/floppy-disk-ripper/blob/master/fdrc/mfm.cpp
 // GPL3+, Copyright (C) 2014, psb^hlw, ts-labs.
@@ -123,6 +130,19 @@ unsigned short crc16(unsigned short crc, unsigned short b)
   return crc;
 }
 
+/*
+  In sweep mode (-w), every sector whose header and data CRCs are good is
+  written to sector_log, for the sweep to build its disk image from.
+*/
+struct sector_copy {
+  unsigned char track, side, sector;
+  unsigned char data[512];
+};
+
+FILE *sector_log = NULL;
+int header_ok = 0;
+unsigned char header[4]; // track, side, sector, size of the last sector header
+
 void describe_data(void)
 {
   unsigned short crc_calc;
@@ -142,7 +162,6 @@ void describe_data(void)
         rate = data_field[2];
         rll_encoding = 0;
       }
-      start_data = ucdelta_count;
 
       unsigned short crc = 0xffff;
       printf("CRC Calc over:");
@@ -180,6 +199,8 @@ void describe_data(void)
       printf("CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
     else
       printf("CRC ok\n");
+    header_ok = !crc;
+    memcpy(header, &data_field[1], 4);
     break;
   case 0xfb:
     // Sector data
@@ -229,8 +250,15 @@ void describe_data(void)
         }
       }
     }
-    else
+    else {
       printf("CRC ok\n");
+      if (sector_log && header_ok && header[3] == 2) {
+        struct sector_copy copy = { header[0], header[1], header[2] };
+        memcpy(copy.data, &data_field[1], 512);
+        fwrite(&copy, sizeof(copy), 1, sector_log);
+      }
+    }
+    header_ok = 0;
     // Clear sector between operations
     bzero(data_field, 512);
     break;
@@ -521,11 +549,6 @@ float mfm_decode(float gap)
   return gap;
 }
 
-struct precomp_rule {
-  float before, me, after;
-  float shift;
-};
-
 float absf(float f)
 {
   if (f < 0)
@@ -533,450 +556,600 @@ float absf(float f)
   return f;
 }
 
-#define RULE_COUNT 13
-// clang-format off
-struct precomp_rule rules[RULE_COUNT]
-={
-  { 1.0,1.0,1.5,+0.10 }, //
-  { 1.0,1.0,2.0,+0.15 }, //
-
-  { 1.0,1.5,1.0,-0.20 }, //
-  { 1.0,1.5,1.5,-0.15 },
-  { 1.0,1.5,2.0,-0.05 },
-
-  { 1.0,2.0,1.0,-0.25 }, //
-  { 1.0,2.0,1.5,-0.20 }, 
-  
-  { 1.5,1.0,1.0,+0.10 },
-  { 1.5,1.0,2.0,+0.20 }, //
-
-  { 1.5,1.5,1.0,-0.05 }, //
-  { 1.5,2.0,1.0,-0.15 }, //
-  
-  { 2.0,1.0,1.00,+0.15},
-  { 2.0,1.0,1.50,+0.20}  //
+/*
+  Gap reader: captures are read a block at a time, from a file or stdin.
+*/
+#define READ_BLOCK 65536
+
+struct gap_reader {
+  FILE *f;
+  unsigned char buffer[READ_BLOCK];
+  int len, ofs;
+  long long total;
 };
-// clang-format on
 
-// Frequency of a gap following the two previously indicate gap values
-unsigned int gap_freqs[256][256][256];
+// Returns the next byte of the capture, or -1 at its end
+int next_gap(struct gap_reader *r)
+{
+  if (r->ofs == r->len) {
+    r->len = fread(r->buffer, 1, READ_BLOCK, r->f);
+    r->ofs = 0;
+    if (r->len <= 0)
+      return -1;
+  }
+  r->total++;
+  return r->buffer[r->ofs++];
+}
+
+/*
+  Gap statistics (-s): how often each gap follows each pair of gaps, to
+  help tune our write pre-comp logic. Only the combinations that occur
+  are stored, in an open addressed table keyed by the three gaps.
+*/
+struct gap_triple {
+  unsigned int key; // gaps a, b, c as $aabbcc
+  unsigned int count;
+};
 
-int main(int argc, char **argv)
+struct gap_stats {
+  struct gap_triple *triples;
+  int count, size;
+  unsigned int cs[256];
+  int recent[2], seen;
+};
+
+unsigned int triple_slot(struct gap_stats *st, unsigned int key)
 {
-  if (argc < 2) {
-    fprintf(stderr, "usage: mfm-decode <MEGA65 FDC read capture ...>\n");
-    exit(-1);
+  return (key * 2654435761u) & (st->size - 1);
+}
+
+void stats_add(struct gap_stats *st, int gap)
+{
+  unsigned int key = (st->recent[0] << 16) | (st->recent[1] << 8) | gap;
+  st->recent[0] = st->recent[1];
+  st->recent[1] = gap;
+  if (++st->seen < 3)
+    return;
+  st->cs[gap]++;
+
+  if ((st->count + 1) * 2 > st->size) {
+    struct gap_triple *old = st->triples;
+    int old_size = st->size;
+    st->size = st->size ? st->size * 2 : 4096;
+    st->triples = calloc(st->size, sizeof(struct gap_triple));
+    if (!st->triples) {
+      fprintf(stderr, "ERROR: Could not allocate gap statistics.\n");
+      exit(-1);
+    }
+    for (int i = 0; i < old_size; i++)
+      if (old[i].count) {
+        unsigned int slot = triple_slot(st, old[i].key);
+        while (st->triples[slot].count)
+          slot = (slot + 1) & (st->size - 1);
+        st->triples[slot] = old[i];
+      }
+    free(old);
   }
 
-  for (int i = 0; i < MAX_SIGNALS; i++) {
-    sample_counts[i] = 0;
+  unsigned int slot = triple_slot(st, key);
+  while (st->triples[slot].count && st->triples[slot].key != key)
+    slot = (slot + 1) & (st->size - 1);
+  if (!st->triples[slot].count) {
+    st->triples[slot].key = key;
+    st->count++;
   }
+  st->triples[slot].count++;
+}
+
+// the gaps were captured shifted right one, so are read as RLL2,7 at half the rate
+int stats_bucket(int gap)
+{
+  return q_gap(quantise_gap_rll27(gap / (rate / 2)));
+}
 
-  for (int arg = 1; arg < argc; arg++) {
-    FILE *f = fopen(argv[arg], "r");
-    unsigned char buffer[MAX_SAMPLES];
-    int count = fread(buffer, 1, MAX_SAMPLES, f);
-    printf("Read %d bytes\n", count);
+void stats_report(struct gap_stats *st)
+{
+  for (int c = 0; c < 256; c++) {
+    if (st->cs[c])
+      printf("%3d : %d\n", c, st->cs[c]);
+  }
+
+  unsigned int bc[10];
+  bzero(bc, sizeof(bc));
+  for (int i = 0; i < st->size; i++)
+    if (st->triples[i].count)
+      bc[stats_bucket(st->triples[i].key & 0xff)] += st->triples[i].count;
+
+  for (int c = 0; c < 10; c++) {
+    if (bc[c]) {
+      printf("%d (%6d) : ", c, bc[c]);
+
+      int tally[10][10];
+
+      for (int c0 = 0; c0 < 256; c0++) {
+        if (stats_bucket(c0) != c)
+          continue;
+        bzero(tally, sizeof(tally));
+        for (int i = 0; i < st->size; i++)
+          if (st->triples[i].count && (st->triples[i].key & 0xff) == c0)
+            tally[stats_bucket(st->triples[i].key >> 16)][stats_bucket((st->triples[i].key >> 8) & 0xff)]
+                += st->triples[i].count;
+
+        printf("\n      c0=%d : ", c0);
+        for (int a = 0; a < 10; a++) {
+          for (int b = 0; b < 10; b++) {
+            if (tally[a][b])
+              printf(" %d@%d,%d", tally[a][b], a, b);
+          }
+        }
+      }
 
-    crc16_init();
+      printf("\n");
+    }
+  }
+}
 
-    int i;
+/*
+  Timing correction: registers each pulse against the recent ones, then
+  hands the gap to mfm_decode(). The state is that of one capture.
+*/
+struct capture {
+  float divisor;
+  long long current_pulse, last_pulse_uncorrected;
+  int early, late, n, samples;
+  // pulse times in bit cells; doubles, as they grow with the capture
+  double recent[8];
+  int recent_q[8];
+  float esum;
+  FILE *raw; // rawgaps.csv (-r)
+};
 
-    fprintf(stderr, "NOTE: Assuming DMA floppy gap capture.\n");
-    fprintf(stderr, "      %d samples.\n", count);
+void decode_gap(struct capture *cap, int raw_gap)
+{
+  int pulse_adjust = 0;
+  float gap = raw_gap;
+  float divisor = cap->divisor;
 
-    // Obtain data rate from filename if present
-    sscanf(argv[arg], "rate%f", &rate);
-    fprintf(stderr, "Rate = %f\n", rate);
+  cap->current_pulse += raw_gap;
+  double now = cap->current_pulse / (double)divisor;
 
-    last_pulse = 0;
-    found_sync3 = 0;
+  if (show_gaps)
+    printf(" $%03x(%3d) ", (int)(gap * 3.0 / 2), (int)(gap * 3.0 / 2));
+  gap /= divisor;
 
-    float divisor = rate;
-    int pulse_adjust = 0;
-    int last_pulse_uncorrected = 9;
-    int early = 0;
-    int late = 0;
-    int n = 0;
+  cap->n++;
+
+  float v[8];
+  for (int i = 0; i < 8; i++) {
+    double d = now - cap->recent[i];
+    for (int j = i + 1; j < 8; j++)
+      d -= cap->recent_q[j];
+    v[i] = d;
+  }
+
+  // Rule 1: Fall-back is to average the registration against the past five pulses
+  float avg = 0;
+  for (int i = 0; i < 8; i++)
+    avg += v[i];
+  avg /= 8;
+  float e1, e2;
+  e1 = gap - quantise_gap(gap) - 1;
+
+  // Rule 2: If the gap is an integer number of gaps vs any of the past five pulses,
+  // then use the one that had the most hits
+  int best_count = 0;
+  int best_int = 0;
+  int counts[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  for (int i = 0; i < 8; i++) {
+    if (absf(v[i]) - ((int)absf(v[i])) < 0.02) {
+      int bin = (int)absf(v[i]);
+      if (bin >= 0 && bin < 9)
+        counts[bin]++;
+    }
+  }
+  for (int i = 3; i <= 8; i++) {
+    if (counts[i] > best_count) {
+      best_count = counts[i];
+      best_int = i;
+    }
+  }
+  if (best_count > 0)
+    avg = best_int;
+
+  e2 = avg - quantise_gap(gap) - 1;
+  if (cap->n >= 186)
+    cap->esum += absf(e2 * 100) * absf(e2 * 100);
+
+  if (cap->raw)
+    fprintf(cap->raw,
+        "%-4d,% -9.2f"
+        ",% -5.2f"
+        ",% -5.2f"
+        ",%5lld"
+        ",% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f"
+        ",% -7.2f,% -7.2f,% -7.2f"
+        "\n",
+        cap->n, now, (cap->current_pulse - last_pulse) / divisor, avg, cap->current_pulse - last_pulse, v[0], v[1], v[2],
+        v[3], v[4], v[5], v[6], v[7], e1, e2, cap->esum);
+  for (int r = 0; r < (8 - 1); r++)
+    cap->recent[r] = cap->recent[r + 1];
+  for (int r = 0; r < (8 - 1); r++)
+    cap->recent_q[r] = cap->recent_q[r + 1];
+  cap->recent[7] = now;
+  cap->recent_q[7] = quantise_gap(gap) + 1;
+
+  if (show_gaps)
+    printf("%.2f (%lld-%lld=%lld)\n", gap, cap->current_pulse, last_pulse, cap->current_pulse - last_pulse);
+
+  if (found_sync3 == 1) {
+    printf("Harmonising at Sync3 after %d samples\n", cap->samples);
+    cap->samples = 0;
+    found_sync3++;
+  }
+  cap->samples++;
+
+  float quantised = mfm_decode(gap);
+  if (show_quantised_gaps) {
+    float uncorrected_gap = cap->current_pulse - cap->last_pulse_uncorrected;
+    uncorrected_gap /= divisor;
+    float uc_delta = quantise_gap(uncorrected_gap) - uncorrected_gap + 1;
+    printf("     uncorrected gap=%.2f, delta=%.2f\n", uncorrected_gap, uc_delta);
+  }
+  if (rll_encoding) {
+    float delta = (gap - 1) - quantised;
+    if (reset_delta) {
+      delta = 0;
+      reset_delta = 0;
+    }
+    if (delta > 0 && delta <= 0.5) {
+      // Pulse is a bit late, so adjust last_pulse backwards a bit
+      pulse_adjust = (int)(delta * divisor);
+      //		printf("rewind last_pulse by %d\n",pulse_adjust);
+    }
+    if (delta < 0 && delta >= -0.5) {
+      // Pulse is a bit late, so adjust last_pulse backwards a bit
+      pulse_adjust = (int)(delta * divisor);
+      //		printf("advance last_pulse by %d\n",-pulse_adjust);
+    }
+    if (delta < 0)
+      cap->early++;
+    if (delta > 0)
+      cap->late++;
+    if (cap->late > 5) {
+      if (show_post_correction)
+        printf("     LATE\n");
+      cap->late = 0;
+      pulse_adjust--;
+    }
+    if (cap->early > 5) {
+      if (show_post_correction)
+        printf("     EARLY\n");
+      cap->early = 0;
+      pulse_adjust++;
+    }
 
-    FILE *raw = fopen("rawgaps.csv", "w");
-    float recent[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    int recent_q[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    float esum = 0;
+    if (show_post_correction)
+      printf("     post-correction delta=%.2f\n", delta);
+  }
+  last_pulse = cap->current_pulse - pulse_adjust;
+  cap->last_pulse_uncorrected = cap->current_pulse;
+}
 
-    int current_pulse = 0;
+// Decodes one capture; the rate is taken from its name ("rate%f") unless one is given
+void decode_capture(char *name, float capture_rate, int statistics, int raw_gaps)
+{
+  static struct gap_reader reader;
+  reader = (struct gap_reader) { .f = strcmp(name, "-") ? fopen(name, "r") : stdin };
+  if (!reader.f) {
+    fprintf(stderr, "ERROR: Could not open capture '%s'\n", name);
+    exit(-1);
+  }
 
-    for (i = 1; i < count; i++) {
-      pulse_adjust = 0;
-      float gap = buffer[i];
+  fprintf(stderr, "NOTE: Assuming DMA floppy gap capture.\n");
 
-      current_pulse += buffer[i];
+  // Obtain data rate from filename if present
+  if (capture_rate)
+    rate = capture_rate;
+  else
+    sscanf(name, "rate%f", &rate);
+  fprintf(stderr, "Rate = %f\n", rate);
+
+  last_pulse = 0;
+  found_sync3 = 0;
+
+  struct capture cap = { .divisor = rate, .last_pulse_uncorrected = 9 };
+  if (raw_gaps)
+    cap.raw = fopen("rawgaps.csv", "w");
+  struct gap_stats stats = { 0 };
+
+  // The first byte of a capture is not a gap
+  int gap = next_gap(&reader);
+  if (statistics && gap >= 0)
+    stats_add(&stats, gap);
+  while ((gap = next_gap(&reader)) >= 0) {
+    if (statistics)
+      stats_add(&stats, gap);
+    decode_gap(&cap, gap);
+  }
 
-      if (show_gaps)
-        printf(" $%03x(%3d) ", (int)(gap * 3.0 / 2), (int)(gap * 3.0 / 2));
-      gap /= divisor;
+  // The last field is otherwise only checked when another sync follows it
+  if (sector_log && bytes_emitted)
+    describe_data();
 
-      n++;
+  if (cap.raw)
+    fclose(cap.raw);
+  if (reader.f != stdin)
+    fclose(reader.f);
 
-      float v[8] = { current_pulse / divisor - recent[0] - recent_q[1] - recent_q[2] - recent_q[3] - recent_q[4]
-                         - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[1] - recent_q[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6]
-            - recent_q[7],
-        current_pulse / divisor - recent[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
+  printf("\n");
+  printf("Read %lld bytes\n", reader.total);
+  fprintf(stderr, "      %lld samples.\n", reader.total);
 
-        current_pulse / divisor - recent[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[4] - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[5] - recent_q[6] - recent_q[7], current_pulse / divisor - recent[6] - recent_q[7],
-        current_pulse / divisor - recent[7] };
+  if (statistics) {
+    stats_report(&stats);
+    free(stats.triples);
+  }
+}
 
-      // Rule 1: Fall-back is to average the registration against the past five pulses
-      float avg = 0;
-      for (int i = 0; i < 8; i++)
-        avg += v[i];
-      avg /= 8;
-      float e1, e2;
-      e1 = gap - quantise_gap(gap) - 1;
+/*
+  Sweep mode (-w): every capture is decoded at every candidate rate, as
+  both MFM and RLL2,7, one candidate per child process so the decoder's
+  globals need no sharing. Each candidate scores the number of distinct
+  sectors it read with good CRCs, and the disk image is built from the
+  best scoring candidate that read each sector.
+*/
+struct candidate {
+  char *capture;
+  float rate;
+  int rll;
+  FILE *log; // struct sector_copy records from the child
+  pid_t pid;
+  int failed, score;
+};
 
-      // Rule 2: If the gap is an integer number of gaps vs any of the past five pulses,
-      // then use the one that had the most hits
-      int best_count = 0;
-      int best_int = 0;
-      int counts[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-      for (int i = 0; i < 8; i++) {
-        if (absf(v[i]) - ((int)absf(v[i])) < 0.02) {
-          int bin = (int)absf(v[i]);
-          if (bin >= 0 && bin < 10)
-            counts[bin]++;
-        }
-      }
-      for (int i = 3; i <= 8; i++) {
-        if (counts[i] > best_count) {
-          best_count = counts[i];
-          best_int = i;
-        }
-      }
-      if (best_count > 0)
-        avg = best_int;
-
-      e2 = avg - quantise_gap(gap) - 1;
-      if (n >= 186)
-        esum += absf(e2 * 100) * absf(e2 * 100);
-
-      fprintf(raw,
-          "%-4d,% -9.2f"
-          ",% -5.2f"
-          ",% -5.2f"
-          ",%5d"
-          ",% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f"
-          ",% -7.2f,% -7.2f,% -7.2f"
-          "\n",
-          n, current_pulse / divisor, (current_pulse - last_pulse) / divisor, avg, current_pulse - last_pulse, v[0], v[1],
-          v[2], v[3], v[4], v[5], v[6], v[7], e1, e2, esum);
-      for (int r = 0; r < (8 - 1); r++)
-        recent[r] = recent[r + 1];
-      for (int r = 0; r < (8 - 1); r++)
-        recent_q[r] = recent_q[r + 1];
-      recent[7] = current_pulse / divisor;
-      recent_q[7] = quantise_gap(gap) + 1;
-
-      if (show_gaps)
-        printf("%.2f (%d-%d=%d)\n", gap, current_pulse, last_pulse, current_pulse - last_pulse);
-
-      if (found_sync3 == 1) {
-        printf("Harmonising at Sync3 after %d samples\n", sample_counts[arg]);
-        sample_counts[arg] = 0;
-        found_sync3++;
+struct sector_copy *best_sectors = NULL;
+int *best_owner = NULL; // the candidate each of best_sectors came from
+int best_count = 0;
+int sector_index[256][2][256]; // best_sectors index + 1, 0 = not read yet
+
+/*
+  Adds the sectors a candidate read to the image, replacing those read by
+  a candidate with a lower score (or the same score, but later in the
+  list). That gives the same image as merging the candidates best first,
+  without keeping every candidate's log until all of them are done.
+*/
+void merge_candidate(struct candidate *c, struct candidate *all)
+{
+  static char seen[256][2][256];
+  struct sector_copy copy;
+
+  bzero(seen, sizeof(seen));
+  c->score = 0;
+  rewind(c->log);
+  while (fread(&copy, sizeof(copy), 1, c->log) == 1)
+    if (!seen[copy.track][copy.side & 1][copy.sector]++)
+      c->score++;
+
+  bzero(seen, sizeof(seen));
+  rewind(c->log);
+  while (fread(&copy, sizeof(copy), 1, c->log) == 1) {
+    int side = copy.side & 1;
+    if (seen[copy.track][side][copy.sector]++)
+      continue;
+    int index = sector_index[copy.track][side][copy.sector];
+    if (index) {
+      struct candidate *owner = &all[best_owner[index - 1]];
+      if (owner->score > c->score || (owner->score == c->score && owner < c))
+        continue;
+    }
+    else {
+      best_sectors = realloc(best_sectors, (best_count + 1) * sizeof(struct sector_copy));
+      best_owner = realloc(best_owner, (best_count + 1) * sizeof(int));
+      if (!best_sectors || !best_owner) {
+        fprintf(stderr, "ERROR: Could not allocate sector image\n");
+        exit(-1);
       }
+      index = ++best_count;
+      sector_index[copy.track][side][copy.sector] = index;
+    }
+    best_sectors[index - 1] = copy;
+    best_owner[index - 1] = c - all;
+  }
+}
 
-      // Log the trace
-      if (sample_counts[arg]) {
-        // Calculate cumulative time
-        traces[arg][sample_counts[arg]] = gap + traces[arg][sample_counts[arg] - 1];
+// Runs the candidates, at most jobs at a time, merging and closing each log as its process ends
+void run_candidates(struct candidate *c, int count, int jobs)
+{
+  int running = 0, next = 0, done = 0;
+
+  while (done < count) {
+    while (running < jobs && next < count) {
+      c[next].log = tmpfile();
+      if (!c[next].log) {
+        fprintf(stderr, "ERROR: Could not create temporary file for sweep\n");
+        exit(-1);
       }
-      else {
-        traces[arg][sample_counts[arg]] = gap;
+      fflush(stdout);
+      c[next].pid = fork();
+      if (c[next].pid < 0) {
+        fprintf(stderr, "ERROR: Could not fork sweep process\n");
+        exit(-1);
       }
-      sample_counts[arg]++;
-      if (traces[arg][sample_counts[arg] - 1] > max_time)
-        max_time = traces[arg][sample_counts[arg] - 1];
-
-      float quantised = mfm_decode(gap);
-      {
-        float uncorrected_gap = current_pulse - last_pulse_uncorrected;
-        uncorrected_gap /= divisor;
-        float uc_delta = quantise_gap(uncorrected_gap) - uncorrected_gap + 1;
-        if (show_quantised_gaps)
-          printf("     uncorrected gap=%.2f, delta=%.2f\n", uncorrected_gap, uc_delta);
-        uncorrected_deltas[ucdelta_count++] = uc_delta;
+      if (!c[next].pid) {
+        if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+          _exit(1);
+        rll_encoding = c[next].rll;
+        sector_log = c[next].log;
+        decode_capture(c[next].capture, c[next].rate, 0, 0);
+        fflush(sector_log);
+        _exit(0);
       }
-      if (rll_encoding) {
-        float delta = (gap - 1) - quantised;
-        if (reset_delta) {
-          delta = 0;
-          reset_delta = 0;
-        }
-        if (delta > 0 && delta <= 0.5) {
-          // Pulse is a bit late, so adjust last_pulse backwards a bit
-          pulse_adjust = (int)(delta * divisor);
-          //		printf("rewind last_pulse by %d\n",pulse_adjust);
-        }
-        if (delta < 0 && delta >= -0.5) {
-          // Pulse is a bit late, so adjust last_pulse backwards a bit
-          pulse_adjust = (int)(delta * divisor);
-          //		printf("advance last_pulse by %d\n",-pulse_adjust);
-        }
-        if (delta < 0)
-          early++;
-        if (delta > 0)
-          late++;
-        if (late > 5) {
-          if (show_post_correction)
-            printf("     LATE\n");
-          late = 0;
-          pulse_adjust--;
-        }
-        if (early > 5) {
-          if (show_post_correction)
-            printf("     EARLY\n");
-          early = 0;
-          pulse_adjust++;
-        }
+      running++;
+      next++;
+    }
 
-        if (show_post_correction)
-          printf("     post-correction delta=%.2f\n", delta);
-        corrected_deltas[ucdelta_count] = delta;
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0)
+      break;
+    for (int i = 0; i < next; i++)
+      if (c[i].pid == pid && c[i].log) {
+        c[i].failed = !WIFEXITED(status) || WEXITSTATUS(status);
+        merge_candidate(&c[i], c);
+        fclose(c[i].log);
+        c[i].log = NULL;
       }
-      last_pulse = current_pulse - pulse_adjust;
-      last_pulse_uncorrected = current_pulse;
-    }
-
-    fclose(raw);
-
-    printf("\n");
-
-    // Record the gap lengths based on the previous two gaps
-    // to help tune our write pre-comp logic
-    bzero(gap_freqs, sizeof(unsigned int) * 256 * 256 * 256);
-    unsigned int cs[256];
-    bzero(cs, sizeof(unsigned int) * 256);
-    for (i = 2; i < count; i++) {
-      gap_freqs[buffer[i - 2]][buffer[i - 1]][buffer[i]]++;
-      cs[buffer[i]]++;
-    }
-    for (int c = 0; c < 256; c++) {
-      if (cs[c])
-        printf("%3d : %d\n", c, cs[c]);
-    }
-
-    unsigned int buckets[10][10][10];
-    bzero(buckets, sizeof(unsigned int) * 10 * 10 * 10);
-    unsigned int bc[10];
-    bzero(bc, sizeof(bc));
-
-    rll_encoding = 1;
-    rate = rate / 2; // because values are shifted right one
-
-    for (int c = 0; c < 256; c++) {
-      //	if (!cs[c]) { skip=1; continue; }
-      for (int a = 0; a < 256; a++) {
-        for (int b = 0; b < 256; b++) {
-          if (gap_freqs[a][b][c]) {
-            //	      printf("%d,%d,%d\n",
-            //		     q_gap(quantise_gap(a/rate)),q_gap(quantise_gap(b/rate)),q_gap(quantise_gap(c/rate)));
-            buckets[q_gap(quantise_gap(a / rate))][q_gap(quantise_gap(b / rate))][q_gap(quantise_gap(c / rate))]
-                += gap_freqs[a][b][c];
-            bc[q_gap(quantise_gap(c / rate))] += gap_freqs[a][b][c];
-          }
-        }
-      }
-      //	printf("\n");
-    }
-
-    // int skip = 0;
-    for (int c = 0; c < 10; c++) {
-      if (bc[c]) {
-        printf("%d (%6d) : ", c, bc[c]);
-
-        int tally[10][10];
-
-        for (int c0 = 0; c0 < 256; c0++) {
-          int cc = q_gap(quantise_gap(c0 / rate));
-          bzero(tally, sizeof(tally));
-          for (int a = 0; a < 256; a++) {
-            for (int b = 0; b < 256; b++) {
-              int aa = q_gap(quantise_gap(a / rate));
-              int bb = q_gap(quantise_gap(b / rate));
-              if (cc == c) {
-                if (gap_freqs[a][b][c0]) {
-                  tally[aa][bb] += gap_freqs[a][b][c0];
-                }
-              }
-            }
-          }
+    running--;
+    done++;
+  }
+}
 
-          if (cc == c) {
-            printf("\n      c0=%d : ", c0);
-            for (int a = 0; a < 10; a++) {
-              for (int b = 0; b < 10; b++) {
-                if (tally[a][b])
-                  printf(" %d@%d,%d", tally[a][b], a, b);
-              }
-            }
-          }
-        }
+int sweep(char **captures, int capture_count, float first_rate, float last_rate, float rate_step, int jobs,
+    char *image_name)
+{
+  int count = 0;
+  struct candidate *c = NULL;
+
+  for (int i = 0; i < capture_count; i++) {
+    FILE *f = fopen(captures[i], "r");
+    if (!f) {
+      fprintf(stderr, "ERROR: Could not open capture '%s'\n", captures[i]);
+      exit(-1);
+    }
+    fclose(f);
 
-        printf("\n");
+    // Without a rate range, sweep around the rate in the capture's name, or over DD and HD
+    float first = first_rate, last = last_rate, named = 0;
+    if (!first && sscanf(captures[i], "rate%f", &named) == 1) {
+      first = named - 3;
+      last = named + 3;
+    }
+    else if (!first) {
+      first = 38;
+      last = 86;
+    }
+
+    for (float r = first; r <= last + rate_step / 2; r += rate_step) {
+      for (int rll = 0; rll < 2; rll++) {
+        c = realloc(c, (count + 1) * sizeof(struct candidate));
+        if (!c) {
+          fprintf(stderr, "ERROR: Could not allocate sweep candidates\n");
+          exit(-1);
+        }
+        c[count++] = (struct candidate) { .capture = captures[i], .rate = r, .rll = rll };
       }
     }
   }
-  return 0;
 
-  FILE *f = fopen("gaps.vcd", "w");
-  if (!f)
-    return -1;
-
-  fprintf(f, "$date\n"
-             "   Mon Feb 17 15:29:53 2020\n"
-             "\n"
-             "$end\n"
-             "$version\n"
-             "   MEGA65 Floppy Decode Trace Tool.\n"
-             "$end\n"
-             "$comment\n"
-             "   No comment.\n"
-             "$end\n"
-             "$timescale 1us $end\n"
-             "$scope module logic $end\n");
-
-  for (int arg = 1; arg < argc + 2; arg++) {
-    if (arg < argc)
-      fprintf(f, "$var wire 1 %c %s $end\n", '@' + arg, argv[arg]);
-    else if (arg == argc)
-      fprintf(f, "$var wire 1 %c model $end\n", '@' + arg);
-    else
-      fprintf(f, "$var wire 1 %c modelerr $end\n", '@' + arg);
+  fprintf(stderr, "Sweeping %d candidates using %d processes.\n", count, jobs);
+  run_candidates(c, count, jobs);
+
+  printf("%-32s %6s %-8s %s\n", "capture", "rate", "encoding", "good sectors");
+  for (int i = 0; i < count; i++) {
+    int best = 1;
+    for (int j = 0; j < count; j++)
+      if (c[j].capture == c[i].capture && c[j].score > c[i].score)
+        best = 0;
+    printf("%-32s %6.2f %-8s %d%s%s\n", c[i].capture, c[i].rate, c[i].rll ? "RLL2,7" : "MFM", c[i].score,
+        c[i].failed ? " (failed)" : "", best && c[i].score ? " *" : "");
   }
 
-  fprintf(f, "$upscope $end\n"
-             "$enddefinitions $end\n"
-             "$dumpvars\n");
-  for (int arg = 1; arg < argc + 2; arg++)
-    fprintf(f, "0%c\n", '@' + arg);
-  fprintf(f, "$end\n"
-             "\n");
+  // The image is laid out like a D81: each track holds side 0, then side 1
+  int tracks = 80, sectors = 10;
+  for (int i = 0; i < best_count; i++) {
+    if (best_sectors[i].track >= tracks)
+      tracks = best_sectors[i].track + 1;
+    if (best_sectors[i].sector > sectors)
+      sectors = best_sectors[i].sector;
+  }
 
-  printf("Determining average time base for fastest rate...\n");
-  float sum = 0;
-  int count = 0;
-  for (int i = 1; i < sample_counts[1]; i++) {
-    float diff = traces[1][i] - traces[1][i - 1];
-    if (diff >= 0.91 && diff <= 1.09) {
-      sum += diff;
-      count++;
-    }
-  }
-  printf("%d samples for slowest rate.\n", sample_counts[argc - 1]);
-  if (count)
-    printf("Renormalising %d samples : 1.0 step on average = %.2f to 1.0\n", sample_counts[1], sum / count);
-  // Renormalise trace 1 to be exactly 1.0 per MFM bit
-  for (int i = 1; i < sample_counts[1]; i++)
-    traces[1][i] /= sum / count;
-
-  // Generate modeled distorted high-data-rate signal
-  // Rule #1: short then long makes the short late, and the long early (draws them together)
-  // Rule #2: long then short makes the long early and short late (pushes them apart)
-  // Rule #3: Double early and double late make no difference
-  // Rule #4: Presumably early + late = ontime ("The Deutsche Bahn Rule")
-  printf("Surrounding gaps:\n");
-  for (int i = 0; i < sample_counts[argc - 1]; i++) {
-    float gap_before = 1.0;
-    float gap_me = 1.0;
-    float gap_after = 1.0;
-    if (i > 1) {
-      gap_before = traces[argc - 1][i - 1] - traces[argc - 1][i - 2];
-    }
-    if (i) {
-      gap_me = traces[argc - 1][i] - traces[argc - 1][i - 1];
-    }
-    if (i < (sample_counts[argc - 1] - 1)) {
-      gap_after = traces[argc - 1][i + 1] - traces[argc - 1][i];
-    }
-    gap_before = quantise_gap(gap_before);
-    gap_me = quantise_gap(gap_me);
-    gap_after = quantise_gap(gap_after);
-
-    float gap_munged = gap_me;
-
-    for (int j = 0; j < RULE_COUNT; j++) {
-      if (gap_before == rules[j].before && gap_me == rules[j].me && gap_after == rules[j].after)
-        gap_munged += rules[j].shift;
-    }
-
-    traces[argc][i] = gap_munged;
-    float ref_gap = 1.0;
-    if (i) {
-      ref_gap = traces[1][i] - traces[1][i - 1];
-      //	traces[argc+1][i]=quantise_gap(ref_gap)-gap_munged;
-      traces[argc + 1][i] = ref_gap - gap_munged;
-      traces[argc][i] += traces[argc][i - 1];
-    }
-    printf("#%-5d : %.2f : %.2f : %.2f : %.2f : M=%.2f vs R=%.2f (%.2f)", i, traces[argc - 1][i], gap_before, gap_me,
-        gap_after, gap_munged, ref_gap, traces[argc - 1][i]);
-    if (absf(traces[argc + 1][i]) >= 0.06)
-      printf("  E=%.2f", traces[argc + 1][i]);
-    printf("\n");
-  }
-
-  float time = 0;
-  int ofs[MAX_SIGNALS] = { 0 };
-  int asserted[MAX_SIGNALS] = { 0 };
-  for (int arg = 1; arg < argc + 2; arg++) {
-    for (int i = 0; i < sample_counts[arg]; i++)
-      printf("#%d : %.2f : %.2f\n", arg, traces[arg][i], i ? traces[arg][i] - traces[arg][i - 1] : traces[arg][i]);
-  }
-
-  for (time = 0; time < (max_time + 0.01); time += 0.01) {
-    for (int arg = 1; arg < argc + 2; arg++) {
-      if (ofs[arg] < sample_counts[arg]) {
-        if (asserted[arg]) {
-          fprintf(f, "#%d\n0%c\n", (int)(time * 100), '@' + arg);
-          asserted[arg] = 0;
-          ofs[arg]++;
-        }
-        else if (traces[arg][ofs[arg]] <= time) {
-          fprintf(f, "#%d\n1%c\n", (int)(time * 100), '@' + arg);
-          asserted[arg] = 1;
-        }
+  FILE *o = fopen(image_name, "w");
+  if (!o) {
+    fprintf(stderr, "ERROR: Could not open image '%s' for writing\n", image_name);
+    exit(-1);
+  }
+  unsigned char blank[512];
+  bzero(blank, sizeof(blank));
+  int missing = 0;
+  for (int track = 0; track < tracks; track++) {
+    int track_missing = 0;
+    for (int side = 0; side < 2; side++) {
+      for (int sector = 1; sector <= sectors; sector++) {
+        int index = sector_index[track][side][sector];
+        fwrite(index ? best_sectors[index - 1].data : blank, 512, 1, o);
+        if (!index)
+          track_missing++;
       }
     }
+    if (track_missing && track_missing < 2 * sectors)
+      printf("Track %d: %d of %d sectors missing\n", track, track_missing, 2 * sectors);
+    missing += track_missing;
   }
-  fclose(f);
+  fclose(o);
+
+  printf("Wrote %s: %d tracks of 2 x %d sectors, %d sectors recovered, %d missing.\n", image_name, tracks, sectors,
+      best_count, missing);
+
+  free(c);
+  free(best_sectors);
+  free(best_owner);
+  return 0;
+}
 
-  f = fopen("gaps.csv", "w");
-  if (!f)
-    return -1;
-  for (int i = 0; i < sample_counts[1]; i++) {
-    fprintf(f, "%5d, ", i);
-    for (int arg = 1; arg < argc + 2; arg++) {
-      fprintf(f, "%.2f, ", traces[arg][i] - (i ? traces[arg][i - 1] : 0));
+void usage(void)
+{
+  fprintf(stderr, "usage: mfm-decode [-s] [-r] <MEGA65 FDC read capture ...>\n");
+  fprintf(stderr, "       mfm-decode -w <image> [-R <first>:<last>[:<step>]] [-j <jobs>] <capture ...>\n");
+  fprintf(stderr, "  -s   print gap statistics for tuning write pre-compensation\n");
+  fprintf(stderr, "  -r   write the timing of every gap to rawgaps.csv\n");
+  fprintf(stderr, "  -w   sweep the captures over a range of rates as MFM and RLL2,7, and write the\n");
+  fprintf(stderr, "       best copy of every sector to a D81 style image\n");
+  fprintf(stderr, "  -R   rates to sweep (default: 3 either side of the rate in the capture's name, or 38:86)\n");
+  fprintf(stderr, "  -j   number of decoding processes (default: one per CPU)\n");
+  fprintf(stderr, "  A capture of - is read from stdin, except when sweeping.\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+  int statistics = 0, raw_gaps = 0;
+  char *image_name = NULL;
+  float first_rate = 0, last_rate = 0, rate_step = 1;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int arg;
+
+  for (arg = 1; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg++) {
+    if (!strcmp(argv[arg], "-s"))
+      statistics = 1;
+    else if (!strcmp(argv[arg], "-r"))
+      raw_gaps = 1;
+    else if (!strcmp(argv[arg], "-w") && arg + 1 < argc)
+      image_name = argv[++arg];
+    else if (!strcmp(argv[arg], "-R") && arg + 1 < argc) {
+      if (sscanf(argv[++arg], "%f:%f:%f", &first_rate, &last_rate, &rate_step) < 2 || first_rate <= 0
+          || last_rate < first_rate || rate_step <= 0)
+        usage();
     }
-    fprintf(f, "\n");
+    else if (!strcmp(argv[arg], "-j") && arg + 1 < argc)
+      jobs = atoi(argv[++arg]);
+    else
+      usage();
   }
-  fclose(f);
-
-  f = fopen("deltacompare.csv", "w");
-  float ucsum = 0, csum = 0, ucmax = 0, cmax = 0;
-  for (int i = start_data; i < ucdelta_count; i++) {
-    if (absf(uncorrected_deltas[i]) > ucmax)
-      ucmax = uncorrected_deltas[i];
-    if (absf(corrected_deltas[i]) > cmax)
-      cmax = corrected_deltas[i];
-    ucsum += absf(uncorrected_deltas[i]);
-    csum += absf(corrected_deltas[i]);
-    fprintf(f, "%-4d,% -5.2f,% -5.2f,% -5.2f,% -6.2f,% -5.2f,% -6.2f\n", i, uncorrected_deltas[i], corrected_deltas[i], cmax,
-        ucmax, csum, ucsum);
+  if (arg >= argc)
+    usage();
+  if (jobs < 1)
+    jobs = 1;
+
+  crc16_init();
+
+  if (image_name) {
+    for (int i = arg; i < argc; i++)
+      if (!strcmp(argv[i], "-"))
+        usage();
+    return sweep(&argv[arg], argc - arg, first_rate, last_rate, rate_step, jobs, image_name);
   }
-  fclose(f);
 
+  for (; arg < argc; arg++)
+    decode_capture(argv[arg], 0, statistics, raw_gaps);
   return 0;
 }
@@ -61,6 +61,8 @@
 #include FT_FREETYPE_H
 #include <unistd.h>
 
+#include "quantise.h"
+
 extern unsigned char ascii_font[4097];
 
 struct tile_set *ts = NULL;
@@ -93,12 +95,33 @@ FT_Library library;
 #define MAX_TYPEFACES (FONT_PARAGRAPH_ITALIC + 1)
 FT_Face type_faces[MAX_TYPEFACES];
 int current_font = FONT_PARAGRAPH;
+// "file,size" each face was loaded from, and a count that changes whenever that does
+char font_specs[MAX_TYPEFACES][2048];
+int font_generation[MAX_TYPEFACES];
+int font_loads = 0;
 
 FT_GlyphSlot glyph_slot;
 FT_Error error;
 
 int n;
 
+// Show rendering traces (-v)
+int verbose = 0;
+
+// Files the output was built from, for the build cache (see cache_check())
+#define MAX_DEPENDENCIES 256
+char *dependencies[MAX_DEPENDENCIES];
+int dependency_count = 0;
+
+void add_dependency(char *file_name)
+{
+  for (int i = 0; i < dependency_count; i++)
+    if (!strcmp(dependencies[i], file_name))
+      return;
+  if (dependency_count < MAX_DEPENDENCIES)
+    dependencies[dependency_count++] = strdup(file_name);
+}
+
 /* ============================================================= */
 
 void abort_(const char *s, ...)
@@ -126,82 +149,55 @@ struct rgb {
 // We only have 128KB of tile RAM, so we can't have more than 128K different
 // coloured pixels
 #define MAX_COLOURS (128 * 1024)
+// Palette entries are found by packed RGB through an open addressed hash
+#define COLOUR_HASH_BITS 18
+#define COLOUR_HASH_SIZE (1 << COLOUR_HASH_BITS)
 
 // If we have >256 colours, though, we do need to reduce the final palette down
 // to 256 colours.
 int second_pass_required = 0;
 int pass_num = 1;
 
+// The palette the second pass draws with, and if images are dithered onto it (-d)
+struct quant_colour quant_palette[256];
+int quant_palette_size = 0;
+int dither = 0;
+
 struct tile_set {
   struct tile *tiles;
   int tile_count;
   int max_tiles;
 
-  // Palette
-  struct rgb colours[MAX_COLOURS];
-  int colour_counts[MAX_COLOURS];
-  int target_colours[MAX_COLOURS];
+  // Tiles by the hash of their canonical orientation (see tile_lookup())
+  int *hash_index;
+  int hash_size;
+  unsigned short *canonical_flip;
+  unsigned char *tile_ncm;
+
+  // Palette, with room for a quantised palette in front of all the colours (see quantise_colours())
+  struct rgb colours[MAX_COLOURS + 256];
+  int colour_counts[MAX_COLOURS + 256];
+  int target_colours[MAX_COLOURS + 256];
   int colour_count;
+  int colour_hash[COLOUR_HASH_SIZE]; // palette index + 1, 0 = empty
 
   struct tile_set *next;
 };
 
-int find_nearest_colour(struct tile_set *ts, int c)
+unsigned int colour_slot(int r, int g, int b)
 {
-  int nearest_id = 0;
-  int error = 999999999;
-
-  for (int i = 0; i < ts->colour_count; i++)
-    // Has colour been remapped already, or is it the same colour we are looking to approximate?
-    if ((i != c) && ts->target_colours[i] == i) {
-      int this_error = 0 + abs(ts->colours[i].r - ts->colours[c].r) * abs(ts->colours[i].r - ts->colours[c].r)
-                     + abs(ts->colours[i].g - ts->colours[c].g) * abs(ts->colours[i].g - ts->colours[c].g)
-                     + abs(ts->colours[i].b - ts->colours[c].b) * abs(ts->colours[i].b - ts->colours[c].b);
-      if (this_error < error) {
-        nearest_id = i;
-        error = this_error;
-      }
-    }
-
-  return nearest_id;
+  return ((unsigned int)((r << 16) | (g << 8) | b) * 2654435761u) >> (32 - COLOUR_HASH_BITS);
 }
 
-void quantise_colours(struct tile_set *ts)
+// Returns the palette index of the colour or -1, and sets *slot to where it is or would go in the hash
+int colour_find(struct tile_set *ts, int r, int g, int b, unsigned int *slot)
 {
-  // Start with all colours mapped to themselves.
-  for (int i = 0; i < ts->colour_count; i++)
-    ts->target_colours[i] = i;
-
-  int colour_count = ts->colour_count;
-  // Colour $FF = 255 has trouble in FCM chars, so don't use it
-  while (colour_count > 254) {
-    int freq = 999999999;
-    int colour_num = 99999999;
-    // Don't remap the C64 normal 16 colours
-    for (int i = 16; i < ts->colour_count; i++) {
-      // Has colour been remapped already?
-      if (ts->target_colours[i] == i) {
-        // No, so check its frequency to see if it is the next rarest colour
-        if (ts->colour_counts[i] < freq) {
-          freq = ts->colour_counts[i];
-          colour_num = i;
-        }
-      }
-    }
-
-    // Find the nearest colour to this one
-    int nearest_colour = find_nearest_colour(ts, colour_num);
-    ts->target_colours[colour_num] = nearest_colour;
-
-    // Increase the weighting of the colour we have switched to
-    ts->colour_counts[nearest_colour] += ts->colour_counts[colour_num];
-
-    printf("Removing rarely used colour #%d (used %d times): Mapping #%02x%02x%02x -> #%02x%02x%02x\n", colour_num, freq,
-        ts->colours[colour_num].r, ts->colours[colour_num].g, ts->colours[colour_num].b, ts->colours[nearest_colour].r,
-        ts->colours[nearest_colour].g, ts->colours[nearest_colour].b);
-
-    colour_count--;
+  for (*slot = colour_slot(r, g, b); ts->colour_hash[*slot]; *slot = (*slot + 1) & (COLOUR_HASH_SIZE - 1)) {
+    int i = ts->colour_hash[*slot] - 1;
+    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b)
+      return i;
   }
+  return -1;
 }
 
 void palette_c64_init(struct tile_set *ts)
@@ -225,26 +221,30 @@ void palette_c64_init(struct tile_set *ts)
   ts->colours[14] = (struct rgb) { .r = 0xaa, .g = 0x9d, .b = 0xef };
   ts->colours[15] = (struct rgb) { .r = 0xb8, .g = 0xb8, .b = 0xb8 };
   ts->colour_count = 16;
+  for (int i = 0; i < ts->colour_count; i++) {
+    unsigned int slot;
+    if (colour_find(ts, ts->colours[i].r, ts->colours[i].g, ts->colours[i].b, &slot) < 0)
+      ts->colour_hash[slot] = i + 1;
+  }
   fprintf(stderr, "Setup C64 palette.\n");
 }
 
 int palette_lookup(struct tile_set *ts, int r, int g, int b)
 {
-  int i;
+  unsigned int slot;
+  int i = colour_find(ts, r, g, b, &slot);
 
   // Do we know this colour already?
-  for (i = 0; i < ts->colour_count; i++) {
-    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b) {
-      // It's a colour we have seen before, so return the index
-      if (pass_num == 1)
-        ts->colour_counts[i]++;
-      if (pass_num == 2) {
-        // Resolve remapped/merged colours
-        while (ts->target_colours[i] != i)
-          i = ts->target_colours[i];
-      }
-      return i;
+  if (i >= 0) {
+    // It's a colour we have seen before, so return the index
+    if (pass_num == 1)
+      ts->colour_counts[i]++;
+    if (pass_num == 2) {
+      // Resolve remapped/merged colours
+      while (ts->target_colours[i] != i)
+        i = ts->target_colours[i];
     }
+    return i;
   }
 
   // new colour, check if palette has space
@@ -258,9 +258,47 @@ int palette_lookup(struct tile_set *ts, int r, int g, int b)
   ts->colours[ts->colour_count].g = g;
   ts->colours[ts->colour_count].b = b;
   ts->colour_counts[ts->colour_count] = 1;
+  ts->colour_hash[slot] = ts->colour_count + 1;
   return ts->colour_count++;
 }
 
+void quantise_colours(struct tile_set *ts)
+{
+  struct quant_colour *colours = malloc(ts->colour_count * sizeof(struct quant_colour));
+  int *map = malloc(ts->colour_count * sizeof(int));
+  if (!colours || !map) {
+    fprintf(stderr, "ERROR: Could not allocate memory to quantise colours.\n");
+    exit(-1);
+  }
+  for (int i = 0; i < ts->colour_count; i++)
+    colours[i] = (struct quant_colour) {
+      .r = ts->colours[i].r, .g = ts->colours[i].g, .b = ts->colours[i].b, .count = ts->colour_counts[i]
+    };
+
+  // Don't remap the C64 normal 16 colours, and colour $FF = 255 has trouble in FCM chars, so don't use it
+  for (int i = 0; i < 16; i++)
+    quant_palette[i] = colours[i];
+  quant_palette_size = quantise(colours, ts->colour_count, quant_palette, 16, 254, map);
+  printf("Quantised %d colours to %d.\n", ts->colour_count, quant_palette_size);
+
+  // The palette goes first, followed by the original colours that map onto it
+  int colour_count = ts->colour_count;
+  bzero(ts->colour_hash, sizeof(ts->colour_hash));
+  ts->colour_count = 0;
+  for (int i = 0; i < quant_palette_size + colour_count; i++) {
+    struct quant_colour *c = i < quant_palette_size ? &quant_palette[i] : &colours[i - quant_palette_size];
+    unsigned int slot;
+    if (colour_find(ts, c->r, c->g, c->b, &slot) >= 0)
+      continue;
+    ts->colours[ts->colour_count] = (struct rgb) { .r = c->r, .g = c->g, .b = c->b };
+    ts->colour_counts[ts->colour_count] = c->count;
+    ts->target_colours[ts->colour_count] = i < quant_palette_size ? i : map[i - quant_palette_size];
+    ts->colour_hash[slot] = ++ts->colour_count;
+  }
+  free(colours);
+  free(map);
+}
+
 unsigned char nonyblswap(unsigned char in)
 {
   return in;
@@ -284,6 +322,15 @@ struct tile_set *new_tileset(int max_tiles)
     exit(-3);
   }
   ts->max_tiles = max_tiles;
+  for (ts->hash_size = 64; ts->hash_size < max_tiles * 2;)
+    ts->hash_size *= 2;
+  ts->hash_index = calloc(sizeof(int), ts->hash_size);
+  ts->canonical_flip = calloc(sizeof(unsigned short), max_tiles);
+  ts->tile_ncm = calloc(sizeof(unsigned char), max_tiles);
+  if (!ts->hash_index || !ts->canonical_flip || !ts->tile_ncm) {
+    perror("calloc() failed");
+    exit(-3);
+  }
   return ts;
 }
 
@@ -334,49 +381,71 @@ struct screen *new_screen(int id, struct tile_set *tiles, int width, int height)
   return s;
 }
 
-int tile_lookup(struct tile_set *ts, struct tile *t)
+#define TILE_NUMBER(t) ((t) & 0x3fff)
+#define TILE_FLIP_BITS(t) (((t) >> 8) & 0xc0)
+
+// NCM tiles hold two pixels per byte, the left one in the low nibble,
+// so flipping them in X also swaps the nibbles.
+void tile_flip(struct tile *out, struct tile *in, int flip, int ncm)
 {
-  // See if tile matches any that we have already stored.
-  // (Also check if it matches flipped in either or both X,Y
-  // axes.
-  for (int i = 0; i < ts->tile_count; i++) {
-    int matches = 1;
-    // Compare unflipped
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i;
-    // Compare with flipped X
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x4000;
-    // Compare with flipped Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x8000;
-    // Compare with flipped X and Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0xC000;
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 8; x++) {
+      unsigned char b = in->bytes[flip & 0x4000 ? 7 - x : x][flip & 0x8000 ? 7 - y : y];
+      out->bytes[x][y] = (ncm && (flip & 0x4000)) ? nyblswap(b) : b;
+    }
+}
+
+// Returns the flip that turns t into the smallest of its four orientations
+int tile_canonical(struct tile *t, struct tile *canonical, int ncm)
+{
+  int best = 0;
+  struct tile flipped;
+
+  *canonical = *t;
+  for (int flip = 0x4000; flip <= 0xC000; flip += 0x4000) {
+    tile_flip(&flipped, t, flip, ncm);
+    if (memcmp(&flipped, canonical, sizeof(struct tile)) < 0) {
+      *canonical = flipped;
+      best = flip;
+    }
+  }
+  return best;
+}
+
+unsigned int tile_hash(struct tile *t)
+{
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < 64; i++)
+    h = (h ^ ((unsigned char *)t->bytes)[i]) * 16777619u;
+  return h;
+}
+
+/*
+ * Returns the tile number, with the flip that shows the stored tile as t
+ * in bits 14 (X) and 15 (Y). The flip doesn't go into screen RAM, whose
+ * upper bits hold the trim count, but into bits 6 and 7 of the first
+ * colour RAM byte, see TILE_NUMBER() and TILE_FLIP_BITS(). ncm is set
+ * for nibble colour mode tiles.
+ */
+int tile_lookup(struct tile_set *ts, struct tile *t, int ncm)
+{
+  // See if tile matches any that we have already stored, also flipped
+  // in either or both X,Y axes. Tiles are hashed in their canonical
+  // orientation, so all four orientations land on the same entry.
+  // FCM and NCM tiles flip differently, so they never match each other.
+  struct tile canonical, stored;
+  int flip = tile_canonical(t, &canonical, ncm);
+  unsigned int slot = tile_hash(&canonical) & (ts->hash_size - 1);
+
+  for (; ts->hash_index[slot]; slot = (slot + 1) & (ts->hash_size - 1)) {
+    int i = ts->hash_index[slot] - 1;
+    if (ts->tile_ncm[i] != ncm)
+      continue;
+    tile_flip(&stored, &ts->tiles[i], ts->canonical_flip[i], ncm);
+    // t = canonical flipped back, and the flips are their own inverses
+    if (!memcmp(&stored, &canonical, sizeof(struct tile)))
+      return i | (ts->canonical_flip[i] ^ flip);
   }
 
   // The tile is new.
@@ -389,6 +458,9 @@ int tile_lookup(struct tile_set *ts, struct tile *t)
   for (int y = 0; y < 8; y++)
     for (int x = 0; x < 8; x++)
       ts->tiles[ts->tile_count].bytes[x][y] = t->bytes[x][y];
+  ts->canonical_flip[ts->tile_count] = flip;
+  ts->tile_ncm[ts->tile_count] = ncm;
+  ts->hash_index[slot] = ts->tile_count + 1;
   return ts->tile_count++;
 }
 
@@ -448,14 +520,14 @@ struct screen *png_to_screen(int id, struct tile_set *ts)
       else {
         // Block has non-transparent pixels, so add to tileset,
         // or lookup to see if it is already there.
-        int tile_number = tile_lookup(ts, &t);
+        int tile = tile_lookup(ts, &t, 0);
 
         // Adjust tile number in screen data for address of tile in RAM
-        tile_number += (0x40000 / 0x40);
+        int tile_number = TILE_NUMBER(tile) + (0x40000 / 0x40);
 
         s->screen_rows[y / 8][x / 8 * 2 + 0] = tile_number & 0xff;
         s->screen_rows[y / 8][x / 8 * 2 + 1] = (tile_number >> 8) & 0xff;
-        s->colourram_rows[y / 8][x / 8 * 2 + 0] = 0x00;
+        s->colourram_rows[y / 8][x / 8 * 2 + 0] = TILE_FLIP_BITS(tile);
         // FG colour
         // XXX Must be <$10, as we have VIC-III attributes enabled
         s->colourram_rows[y / 8][x / 8 * 2 + 1] = 0x00;
@@ -472,6 +544,7 @@ void read_png_file(char *file_name)
   FILE *infile = fopen(file_name, "rb");
   if (infile == NULL)
     abort_("[read_png_file] File %s could not be opened for reading", file_name);
+  add_dependency(file_name);
 
   fread(header, 1, 8, infile);
   if (png_sig_cmp(header, 0, 8))
@@ -589,7 +662,7 @@ int link_count = 0;
 
 void register_box(int url_id, int x1, int y1, int x2, int y2)
 {
-  fprintf(stderr,"DEBUG: register_box(%d,%d,%d,%d,%d)\n",url_id,x1,y1,x2,y2);
+  if (verbose) fprintf(stderr,"DEBUG: register_box(%d,%d,%d,%d,%d)\n",url_id,x1,y1,x2,y2);
   for (int i = 0; i < link_count; i++) {
     if (url_boxes[i].url_id == url_id && url_boxes[i].x1 == x1 && url_boxes[i].y1 == y1 && url_boxes[i].x2 == x2
         && url_boxes[i].y2 == y2)
@@ -703,10 +776,10 @@ void emit_accumulated_line(void)
     // XXX - Emit accumulated line by copying the rows of screen and colour RAM into place.
     int first_row = MAX_LINE_HEIGHT - accline_height;
     int last_row = MAX_LINE_HEIGHT -1 + accline_depth;
-    printf("[Line = +%d,-%d, first=%d, last=%d, accline_len=%d]\n",
+    if (verbose) printf("[Line = +%d,-%d, first=%d, last=%d, accline_len=%d]\n",
 	   accline_height,accline_depth, first_row, last_row, accline_len);
     for(int row = first_row; row <= last_row; row++) {
-      printf("DEBUG: Emitting row %d into y=%d\n",row,screen_y);
+      if (verbose) printf("DEBUG: Emitting row %d into y=%d\n",row,screen_y);
       
       if (screen_y * (MAX_LINE_LENGTH*2) >= MAX_COLOURRAM_SIZE) {
 	fprintf(stderr,"ERROR: Page too long. Split into separate files, or use smaller fonts.\n");
@@ -793,8 +866,166 @@ struct tile blank_tile = {
 
 #define MAX_BITMAP_SIZE 640
 #define BITMAP_BASELINE (MAX_BITMAP_SIZE/2)
+// All clear between renders: glyphs_draw() clears exactly what it drew
 unsigned char glyph_bitmap[MAX_BITMAP_SIZE][MAX_BITMAP_SIZE];
 
+/*
+  FreeType renders each glyph once: the bitmaps are kept by font,
+  font generation and code point. The cards that a run of glyphs encodes
+  to are kept the same way, so a repeated word costs only hash lookups.
+  Both tables only grow, and when one is 3/4 full, new entries are
+  rendered each time instead of being cached.
+*/
+struct glyph {
+  int font, generation, code_point;
+  unsigned int width, rows; // as in FT_Bitmap
+  int top, advance;
+  unsigned char *bitmap;
+};
+
+#define GLYPH_CACHE_BITS 12
+#define GLYPH_CACHE_SIZE (1 << GLYPH_CACHE_BITS)
+struct glyph glyph_cache[GLYPH_CACHE_SIZE];
+int glyph_cache_count = 0;
+struct glyph uncached_glyph;
+
+// Longest run of glyphs render_codepoints() will cache
+#define MAX_RUN_GLYPHS 16
+struct glyph_run {
+  int font, generation, count;
+  int code_points[MAX_RUN_GLYPHS];
+  // card numbers, column by column, each from the top row down
+  int *cards;
+};
+
+#define RUN_CACHE_BITS 14
+#define RUN_CACHE_SIZE (1 << RUN_CACHE_BITS)
+struct glyph_run run_cache[RUN_CACHE_SIZE];
+int run_cache_count = 0;
+struct glyph_run uncached_run;
+
+unsigned int glyph_hash(int font, int generation, int *code_points, int count)
+{
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  h = (h ^ font) * 16777619u;
+  h = (h ^ generation) * 16777619u;
+  for (int i = 0; i < count; i++)
+    h = (h ^ code_points[i]) * 16777619u;
+  return h;
+}
+
+struct glyph *glyph_get(int code_point)
+{
+  int font = current_font, generation = font_generation[current_font];
+  unsigned int slot = glyph_hash(font, generation, &code_point, 1) & (GLYPH_CACHE_SIZE - 1);
+
+  for (; glyph_cache[slot].bitmap; slot = (slot + 1) & (GLYPH_CACHE_SIZE - 1)) {
+    struct glyph *g = &glyph_cache[slot];
+    if (g->font == font && g->generation == generation && g->code_point == code_point)
+      return g;
+  }
+
+  struct glyph *g = &glyph_cache[slot];
+  if (glyph_cache_count >= GLYPH_CACHE_SIZE * 3 / 4) {
+    g = &uncached_glyph;
+    free(g->bitmap);
+  }
+  else
+    glyph_cache_count++;
+
+  glyph_slot = type_faces[font]->glyph;
+  int glyph_index = FT_Get_Char_Index( type_faces[font], code_point );
+  error = FT_Load_Glyph( type_faces[font], glyph_index, FT_LOAD_RENDER );
+  if (error) {
+    fprintf(stderr,"ERROR: Could not find glyph for Unicode Point 0x%x in font.\n",code_point);
+    exit(-1);
+  }
+  if (verbose) {
+    printf("bitmap_left=%d, bitmap_top=%d\n", glyph_slot->bitmap_left, glyph_slot->bitmap_top);
+    printf("bitmap_width=%d, bitmap_rows=%d\n", glyph_slot->bitmap.width, glyph_slot->bitmap.rows);
+  }
+
+  g->font = font;
+  g->generation = generation;
+  g->code_point = code_point;
+  g->width = glyph_slot->bitmap.width;
+  g->rows = glyph_slot->bitmap.rows;
+  g->top = glyph_slot->bitmap_top;
+  g->advance = glyph_slot->metrics.horiAdvance/64;
+  // rows are width bytes apart, as render_codepoints() always read them
+  g->bitmap = malloc(g->width * g->rows + 1);
+  if (!g->bitmap) {
+    fprintf(stderr,"ERROR: Could not allocate glyph bitmap.\n");
+    exit(-1);
+  }
+  if (g->width && g->rows)
+    memcpy(g->bitmap, glyph_slot->bitmap.buffer, g->width * g->rows);
+  return g;
+}
+
+// Copies the glyphs into glyph_bitmap, or clears them from it again
+void glyphs_draw(int *code_points, int count, int clear)
+{
+  int x_pos=0;
+  for(int i=0;i<count;i++) {
+    struct glyph *g = glyph_get(code_points[i]);
+    // XXX - We ignore bitmap_left, which is used for some kerning functions
+    if (!g->width) {
+      x_pos+=g->advance;
+      continue;
+    }
+    int y_start=BITMAP_BASELINE-g->top;
+    for(int x=0;x<g->width;x++) {
+      if (clear) {
+        memset(&glyph_bitmap[x_pos+x][y_start],0,g->rows);
+        continue;
+      }
+      for(int y=0;y<g->rows;y++)
+        glyph_bitmap[x_pos+x][y_start+y]=g->bitmap[x+y*g->width];
+    }
+    if (verbose && !clear) {
+      printf("y_start=%d\n",y_start);
+      for(int y=0;y<g->rows;y++) {
+        printf("  row %d : ",y);
+        for(int x=0;x<g->width;x++) printf("%c", g->bitmap[x+y*g->width] ? '+' : '.');
+        printf("\n");
+      }
+    }
+    x_pos+=g->width;
+  }
+}
+
+// Returns the cached run, or one with no cards yet for the caller to fill in
+struct glyph_run *glyph_run_get(int *code_points, int count)
+{
+  int font = current_font, generation = font_generation[current_font];
+  unsigned int slot = glyph_hash(font, generation, code_points, count) & (RUN_CACHE_SIZE - 1);
+
+  if (count <= MAX_RUN_GLYPHS) {
+    for (; run_cache[slot].cards; slot = (slot + 1) & (RUN_CACHE_SIZE - 1)) {
+      struct glyph_run *r = &run_cache[slot];
+      if (r->font == font && r->generation == generation && r->count == count
+          && !memcmp(r->code_points, code_points, count * sizeof(int)))
+        return r;
+    }
+  }
+
+  struct glyph_run *r = &run_cache[slot];
+  if (count > MAX_RUN_GLYPHS || run_cache_count >= RUN_CACHE_SIZE * 3 / 4) {
+    r = &uncached_run;
+    free(r->cards);
+    r->cards = NULL;
+    return r;
+  }
+  run_cache_count++;
+  r->font = font;
+  r->generation = generation;
+  r->count = count;
+  memcpy(r->code_points, code_points, count * sizeof(int));
+  return r;
+}
+
 int encode_glyph_card(FT_GlyphSlot glyphSlot, int card_x, int card_y, struct tile_set *ts)
 {
   int base_x=card_x*16;
@@ -842,59 +1073,33 @@ int encode_glyph_card(FT_GlyphSlot glyphSlot, int card_x, int card_y, struct til
     }
   }
 
-  return tile_lookup(ts, &t)
-       // Adjust tile number in screen data for address of tile in RAM
-       + (0x40000 / 0x40);
+  int tile = tile_lookup(ts, &t, 1);
+  // Adjust tile number in screen data for address of tile in RAM, keeping the flip bits
+  return (TILE_NUMBER(tile) + (0x40000 / 0x40)) | (tile & 0xc000);
 }
 
 int render_codepoints(int *code_points,int num)
 {
-  glyph_slot = type_faces[current_font]->glyph;
-
   int total_width=0;
   int count=0;
   
   int max_height=0;
   int max_under=0;
   
-  // Clear bitmap
-  for(int i=0;i<MAX_BITMAP_SIZE;i++) bzero(glyph_bitmap[i],MAX_BITMAP_SIZE);
-  
   // Try to make sure that we can use the full width, by combining glyphs until we have at least 8 in every
   // char block
   while((total_width<=11)&&count<num) {
-    int code_point=code_points[count++];
-
-    int glyph_index = FT_Get_Char_Index( type_faces[current_font], code_point );
-    error = FT_Load_Glyph( type_faces[current_font], glyph_index, FT_LOAD_RENDER );
-    if (error) {
-      fprintf(stderr,"ERROR: Could not find glyph for Unicode Point 0x%x in font.\n",code_point);
-      exit(-1);
-    }
-    printf("bitmap_left=%d, bitmap_top=%d\n", glyph_slot->bitmap_left, glyph_slot->bitmap_top);
-    printf("bitmap_width=%d, bitmap_rows=%d\n", glyph_slot->bitmap.width, glyph_slot->bitmap.rows);
+    struct glyph *g = glyph_get(code_points[count++]);
 
-    // XXX - We ignore bitmap_left, which is used for some kerning functions
-    int glyph_display_width=/* glyph_slot->bitmap_left+ */ glyph_slot->bitmap.width;
+    int glyph_display_width=g->width;
     if (glyph_display_width==0) {
-      glyph_display_width=(glyph_slot->metrics.horiAdvance/64);
-      printf("INFO: Adding %dpx inter-word gap.\n",glyph_display_width);
+      glyph_display_width=g->advance;
+      if (verbose) printf("INFO: Adding %dpx inter-word gap.\n",glyph_display_width);
       total_width+=glyph_display_width;
     } else {
-      // Copy glyph into the bitmap
-      int y_start=BITMAP_BASELINE-glyph_slot->bitmap_top;
-      printf("y_start=%d\n",y_start);
-      for(int y=0;y<glyph_slot->bitmap.rows;y++) {
-	printf("  row %d : ",y);
-	for(int i=0;i<glyph_display_width;i++) {
-	  if (glyph_slot->bitmap.buffer[i+y*glyph_slot->bitmap.width]) printf("+"); else printf(".");
-	  glyph_bitmap[total_width+i][y_start+y]=glyph_slot->bitmap.buffer[i+y*glyph_slot->bitmap.width];
-	}
-	printf("\n");
-      }
       total_width+=glyph_display_width;
-      if (max_height<glyph_slot->bitmap_top) max_height=glyph_slot->bitmap_top;
-      if (max_under<(glyph_slot->bitmap.rows-glyph_slot->bitmap_top)) max_under=glyph_slot->bitmap.rows-glyph_slot->bitmap_top;
+      if (max_height<g->top) max_height=g->top;
+      if (max_under<(g->rows-g->top)) max_under=g->rows-g->top;
     }
   }
     
@@ -921,6 +1126,26 @@ int render_codepoints(int *code_points,int num)
   if (!(total_width&15)) trim_pixels=0;
   if (0) printf("total_width=%d, trim_pixels=%d\n",total_width,trim_pixels);
     
+  // Blank out entire columns, so that we avoid alignment issues with variable character heights
+  int blank_card = tile_lookup(ts, &blank_tile, 1);
+  blank_card += (0x40000 / 0x40);
+
+  // Render and encode the run the first time it is seen
+  struct glyph_run *run = glyph_run_get(code_points, count);
+  if (!run->cards) {
+    run->cards = malloc(char_columns * (char_rows + under_rows) * sizeof(int) + 1);
+    if (!run->cards) {
+      fprintf(stderr,"ERROR: Could not allocate glyph cards.\n");
+      exit(-1);
+    }
+    glyphs_draw(code_points, count, 0);
+    int *card = run->cards;
+    for(x=0;x<char_columns;x++)
+      for(y=char_rows-1;y>=-under_rows;y--)
+        *card++ = encode_glyph_card(glyph_slot,x,y,ts);
+    glyphs_draw(code_points, count, 1);
+  }
+
   // Now build the glyph map
   
   for(x=0;x<char_columns;x++) {
@@ -935,10 +1160,6 @@ int render_codepoints(int *code_points,int num)
     if (char_rows > accword_height) accword_height = char_rows;
     if (under_rows > accword_depth) accword_depth = under_rows;
     
-    // Blank out entire column, so that we avoid alignment issues with variable character heights
-    int blank_card = tile_lookup(ts, &blank_tile);
-    blank_card += (0x40000 / 0x40);
-
     int this_trim=0;
     if (x==(char_columns-1)) this_trim=trim_pixels;
     
@@ -957,13 +1178,13 @@ int render_codepoints(int *code_points,int num)
 
     for(y=char_rows-1;y>=-under_rows;y--)
       {
-	int card_number=encode_glyph_card(glyph_slot,x,y,ts);
-	printf("  encoding tile (%d,%d) using card $%04x in row store y=%d\n",
+	int card_number=run->cards[x*(char_rows+under_rows)+char_rows-1-y];
+	if (verbose) printf("  encoding tile (%d,%d) using card $%04x in row store y=%d\n",
 	       x,y,card_number,MAX_LINE_HEIGHT-1-y);   
 	// Write tile details into accline_screen_ram and accline_colour_ram
 	accword_screen_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+0]=card_number>>0;
-	accword_screen_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+1]=(card_number>>8)+(this_trim<<5);
-	accword_colour_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+0]=0x20+0x08; // ALPHA + NCM glyph
+	accword_screen_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+1]=(TILE_NUMBER(card_number)>>8)+(this_trim<<5);
+	accword_colour_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+0]=0x20+0x08+TILE_FLIP_BITS(card_number); // ALPHA + NCM glyph
 	if (!y) {
 	  accword_colour_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+1]=text_colour + attributes;
 	} else {
@@ -981,12 +1202,15 @@ int render_codepoints(int *code_points,int num)
 	  accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] |= 0x04; // Trim 8 more pixels
       }
     for (y = char_rows - 1; y >= -under_rows; y--) {
-      int card_number = encode_glyph_card(glyph_slot, x, y, ts);
-      printf("  encoding tile (%d,%d) using card $%04x\n", x, y, card_number);
+      int card_number = run->cards[x * (char_rows + under_rows) + char_rows - 1 - y];
+      if (verbose)
+        printf("  encoding tile (%d,%d) using card $%04x\n", x, y, card_number);
       // Write tile details into accline_screen_ram and accline_colour_ram
       accword_screen_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] = card_number >> 0;
-      accword_screen_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1] = (card_number >> 8) + (trim_pixels << 5);
-      accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] = 0x20 + 0x08; // ALPHA + NCM glyph
+      accword_screen_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1]
+          = (TILE_NUMBER(card_number) >> 8) + (trim_pixels << 5);
+      // ALPHA + NCM glyph
+      accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] = 0x20 + 0x08 + TILE_FLIP_BITS(card_number);
       if (!y) {
         accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1] = text_colour + attributes;
       }
@@ -1025,7 +1249,7 @@ int emit_rendered_word(void)
   }
   accline_len+=accword_len;
   accline_display_len+=accword_display_len;
-  printf("DEBUG: Appended %d columns to accline. accline_len=%d, accword_h=%d,_d=%d\n",
+  if (verbose) printf("DEBUG: Appended %d columns to accline. accline_len=%d, accword_h=%d,_d=%d\n",
 	 accword_len,accline_len,
 	 accword_height,accword_depth);
   if (accword_height>accline_height) accline_height=accword_height;
@@ -1055,7 +1279,7 @@ int emit_word_gap(void)
     accline_len++;
   }
   else {
-    printf("!!!SPACE!!!");
+    if (verbose) printf("!!!SPACE!!!");
     int cp=0x20;
     render_codepoints(&cp,1); // SPACE
     emit_rendered_word();
@@ -1151,9 +1375,11 @@ int emit_accumulated_word(void)
       // we will just make normal NCM blocks for each glyph, with the usual de-duplication
       // logic.
       int num=render_codepoints(&code_points[i],count-i);
-      printf("DEBUG: Output %d codepoints in one char.\n",num);
-      printf("[CP=$%x]\n",code_points[i]);
-      for(int j=1;j<num;j++) printf("+ [CP=$%x]\n",code_points[i+j]);
+      if (verbose) {
+        printf("DEBUG: Output %d codepoints in one char.\n",num);
+        printf("[CP=$%x]\n",code_points[i]);
+        for(int j=1;j<num;j++) printf("+ [CP=$%x]\n",code_points[i+j]);
+      }
 
       i+=num;
     }
@@ -1163,13 +1389,13 @@ int emit_accumulated_word(void)
     //    If starting a new line, emit the accumulated line of text to start the new line.
     if ((accword_len+accline_len>MAX_LINE_LENGTH)
 	||(accword_display_len+accline_display_len>640)) {
-      printf("INFO: Breaking line as either %d+%d>%d chars, or %d+%d>640 px\n",
+      if (verbose) printf("INFO: Breaking line as either %d+%d>%d chars, or %d+%d>640 px\n",
 	     accline_len,accword_len,MAX_LINE_LENGTH,
 	     accline_display_len,accword_display_len);
       
       emit_accumulated_line();
     } else {
-      printf("INFO: Continuing line as neither %d+%d>%d chars, or %d+%d>640 px\n",
+      if (verbose) printf("INFO: Continuing line as neither %d+%d>%d chars, or %d+%d>640 px\n",
 	     accline_len,accword_len,MAX_LINE_LENGTH,
 	     accline_display_len,accword_display_len);
     }
@@ -1179,7 +1405,7 @@ int emit_accumulated_word(void)
     emit_rendered_word();
 
     // Show the user the word we have emitted
-    printf("<"); for(int i=0;i<word_len;i++) { printf("%c",word[i]); } printf(">"); fflush(stdout);
+    if (verbose) { printf("<"); for(int i=0;i<word_len;i++) { printf("%c",word[i]); } printf(">"); fflush(stdout); }
   }
   
   word_len=0; word[0]=0;
@@ -1264,7 +1490,7 @@ void emit_text(char *text)
       fprintf(stderr, "       Offending text is: %s\n", text);
       exit(-1);
     }
-    if (stars)
+    if (stars && verbose)
       printf("{%d stars, wl=%d}", stars, word_len);
 
     // Emit word if we have just cancelled a fancy font face
@@ -1303,6 +1529,8 @@ void emit_text(char *text)
       i += n;
 
       read_png_file(imgname);
+      if (dither && quant_palette_size)
+        quantise_image(row_pointers, width, height, multiplier, quant_palette, quant_palette_size, 1);
       struct screen *s = png_to_screen(0, ts);
 
       // Check if the image has a link
@@ -1432,30 +1660,39 @@ int do_pass(char **argv, struct tile_set *ts)
             font_id_str);
         exit(-1);
       }
-      // Try loading the font
-      // Release old font, first.
-      if (type_faces[font_id]) {
-        FT_Done_Face(type_faces[font_id]);
-        type_faces[font_id] = NULL;
-      }
-      error = FT_New_Face(library, font_file, 0, &type_faces[font_id]);
-      if (error) {
-        fprintf(stderr, "ERROR: Could not load font: %s\n", line);
-        exit(-1);
-      }
-      error = FT_Set_Pixel_Sizes(type_faces[font_id], font_size, font_size);
-      if (error) {
-        fprintf(stderr, "ERROR: Could not set pixel size for font: %s\n", line);
-        exit(-1);
+      // The second pass sees the same definitions, so keep the face and its cached glyphs
+      char font_spec[2048];
+      snprintf(font_spec, sizeof(font_spec), "%s,%d", font_file, font_size);
+      add_dependency(font_file);
+      if (!type_faces[font_id] || strcmp(font_specs[font_id], font_spec)) {
+        strcpy(font_specs[font_id], font_spec);
+        font_generation[font_id] = ++font_loads;
+
+        // Try loading the font
+        // Release old font, first.
+        if (type_faces[font_id]) {
+          FT_Done_Face(type_faces[font_id]);
+          type_faces[font_id] = NULL;
+        }
+        error = FT_New_Face(library, font_file, 0, &type_faces[font_id]);
+        if (error) {
+          fprintf(stderr, "ERROR: Could not load font: %s\n", line);
+          exit(-1);
+        }
+        error = FT_Set_Pixel_Sizes(type_faces[font_id], font_size, font_size);
+        if (error) {
+          fprintf(stderr, "ERROR: Could not set pixel size for font: %s\n", line);
+          exit(-1);
+        }
+        glyph_slot = type_faces[font_id]->glyph;
+        printf("INFO: Loaded font: %s as %s, size %d\n",font_id_str,font_file,font_size);
       }
-      glyph_slot = type_faces[font_id]->glyph;
-      printf("INFO: Loaded font: %s as %s, size %d\n",font_id_str,font_file,font_size);
       
     } else if (!strncmp("# ",line,2)) {
       // Heading H1
-      printf("[in_para=%d]\n", in_paragraph);
+      if (verbose) printf("[in_para=%d]\n", in_paragraph);
       next_paragraph();
-      printf("[in_para=%d]\n", in_paragraph);
+      if (verbose) printf("[in_para=%d]\n", in_paragraph);
       current_font = FONT_H1;
       text_colour = 1;   // white text for headings
       attributes = 0x80; // underline for headings
@@ -1615,8 +1852,10 @@ int do_pass(char **argv, struct tile_set *ts)
         for (x = 0; x < 8; x++)
           tile[y * 8 + x] = ts->tiles[i].bytes[x][y];
       fwrite(tile, 64, 1, outfile);
-      printf(".");
-      fflush(stdout);
+      if (verbose) {
+        printf(".");
+        fflush(stdout);
+      }
     }
     printf("\n");
   }
@@ -1708,13 +1947,111 @@ int do_pass(char **argv, struct tile_set *ts)
 
 /* ============================================================= */
 
+/*
+  The build cache, <output.h65>.cache, lists the hash of every file the
+  output was built from (the page, its fonts and images), and of the
+  output itself. When none of them changed there is nothing to rebuild.
+  The first line also records the md2h65 version and the options that
+  change the output, so a new md2h65 rebuilds everything once.
+*/
+#define CACHE_MAGIC "md2h65 cache 1"
+
+extern const char *version_string;
+
+char *cache_magic(void)
+{
+  static char magic[256];
+  snprintf(magic, sizeof(magic), CACHE_MAGIC " %s dither=%d\n", version_string, dither);
+  return magic;
+}
+
+// FNV-1a of the whole file, returns -1 if it can't be read
+int file_hash(char *file_name, unsigned long long *hash)
+{
+  unsigned char buffer[65536];
+  FILE *f = fopen(file_name, "rb");
+  if (!f)
+    return -1;
+  *hash = 14695981039346656037ULL;
+  for (int len; (len = fread(buffer, 1, sizeof(buffer), f)) > 0;)
+    for (int i = 0; i < len; i++)
+      *hash = (*hash ^ buffer[i]) * 1099511628211ULL;
+  fclose(f);
+  return 0;
+}
+
+// Returns 1 if the cache says the output is up to date
+int cache_check(char *output_name)
+{
+  char cache_name[2048], line[2048], file_name[2048];
+  unsigned long long hash, current;
+  int files = 0, up_to_date;
+
+  snprintf(cache_name, sizeof(cache_name), "%s.cache", output_name);
+  FILE *f = fopen(cache_name, "r");
+  if (!f)
+    return 0;
+  up_to_date = fgets(line, sizeof(line), f) && !strcmp(line, cache_magic());
+  while (up_to_date && fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%llx %2047[^\n]", &hash, file_name) != 2 || file_hash(file_name, &current) || current != hash)
+      up_to_date = 0;
+    files++;
+  }
+  fclose(f);
+  // at least the page and the output
+  return up_to_date && files >= 2;
+}
+
+void cache_write(char *output_name)
+{
+  char cache_name[2048];
+  unsigned long long hash;
+
+  snprintf(cache_name, sizeof(cache_name), "%s.cache", output_name);
+  FILE *f = fopen(cache_name, "w");
+  if (!f) {
+    fprintf(stderr, "WARNING: Could not write build cache '%s'\n", cache_name);
+    return;
+  }
+  fprintf(f, "%s", cache_magic());
+  add_dependency(output_name);
+  for (int i = 0; i < dependency_count; i++)
+    if (!file_hash(dependencies[i], &hash))
+      fprintf(f, "%016llx %s\n", hash, dependencies[i]);
+  fclose(f);
+}
+
 int main(int argc, char **argv)
 {
+  char cache_name[2048];
+  int force = 0;
+  for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+    if (!strcmp(argv[1], "-v"))
+      verbose = 1;
+    else if (!strcmp(argv[1], "-f"))
+      force = 1;
+    else if (!strcmp(argv[1], "-d"))
+      dither = 1;
+    else
+      break;
+  }
   if (argc != 3) {
-    fprintf(stderr, "Usage: md2h65 <input.md> <output.h65>\n");
+    fprintf(stderr, "Usage: md2h65 [-v] [-f] [-d] <input.md> <output.h65>\n");
+    fprintf(stderr, "  -v   show rendering traces\n");
+    fprintf(stderr, "  -f   rebuild even if <output.h65>.cache says the output is up to date\n");
+    fprintf(stderr, "  -d   dither images when their colours have to be reduced\n");
     exit(-1);
   }
 
+  if (!force && cache_check(argv[2])) {
+    printf("%s is up to date.\n", argv[2]);
+    return 0;
+  }
+  // A build that fails part way must not leave a cache that matches
+  snprintf(cache_name, sizeof(cache_name), "%s.cache", argv[2]);
+  unlink(cache_name);
+  add_dependency(argv[1]);
+
   // Default to all fonts using MEGA65 ASCII font
   for (int i = 0; i < MAX_TYPEFACES; i++)
     type_faces[i] = NULL;
@@ -1736,4 +2073,7 @@ int main(int argc, char **argv)
     fprintf(stderr, "Running 2nd pass.\n");
     do_pass(argv, ts);
   }
+
+  cache_write(argv[2]);
+  return 0;
 }
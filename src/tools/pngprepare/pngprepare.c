@@ -15,10 +15,13 @@
 #include <string.h>
 #include <strings.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "quantise.h"
+
 /* ============================================================= */
 
 char *vhdl_prefix = "library IEEE;\n"
@@ -89,6 +92,9 @@ png_bytep *row_pointers;
 FILE *infile;
 FILE *outfile;
 
+// Dither logos that have to be reduced to the free palette entries (-d)
+int dither = 0;
+
 /* ============================================================= */
 
 void abort_(const char *s, ...)
@@ -177,16 +183,31 @@ struct rgb palette[2560];
 int palette_first = 16;
 int palette_index = 16; // only use upper half of palette
 
+// Palette entries from palette_first on, by packed RGB (palette index + 1, 0 = empty)
+#define PALETTE_HASH_BITS 13
+#define PALETTE_HASH_SIZE (1 << PALETTE_HASH_BITS)
+int palette_hash[PALETTE_HASH_SIZE];
+
+// Returns the palette index of the colour or -1, and sets *slot to where it is or would go in the hash
+int palette_find(int r, int g, int b, unsigned int *slot)
+{
+  *slot = ((unsigned int)((r << 16) | (g << 8) | b) * 2654435761u) >> (32 - PALETTE_HASH_BITS);
+  for (; palette_hash[*slot]; *slot = (*slot + 1) & (PALETTE_HASH_SIZE - 1)) {
+    int i = palette_hash[*slot] - 1;
+    if (r == palette[i].r && g == palette[i].g && b == palette[i].b)
+      return i;
+  }
+  return -1;
+}
+
 int palette_lookup(int r, int g, int b)
 {
-  int i;
+  unsigned int slot;
+  int i = palette_find(r, g, b, &slot);
 
   // Do we know this colour already?
-  for (i = palette_first; i < palette_index; i++) {
-    if (r == palette[i].r && g == palette[i].g && b == palette[i].b) {
-      return i;
-    }
-  }
+  if (i >= 0)
+    return i;
 
   // new colour
   if (palette_index > 255) {
@@ -199,6 +220,7 @@ int palette_lookup(int r, int g, int b)
   palette[palette_index].r = r;
   palette[palette_index].g = g;
   palette[palette_index].b = b;
+  palette_hash[slot] = palette_index + 1;
   return palette_index++;
 }
 
@@ -207,9 +229,81 @@ unsigned char nyblswap(unsigned char in)
   return ((in & 0xf) << 4) + ((in & 0xf0) >> 4);
 }
 
+/*
+  Logo conversion first hands out palette entries in raster order, which
+  decides the palette and so stays sequential, and then writes the 8x8
+  cards, which is done for bands of card rows in parallel.
+*/
+int multiplier;
+unsigned char *logo_data;
+struct card_rows {
+  int first, last;
+};
+
+void get_rgb(int x, int y, int *r, int *g, int *b)
+{
+  png_byte *ptr = &(row_pointers[y][x * multiplier]);
+  *r = ptr[0];
+  if (multiplier > 1) {
+    *g = ptr[1];
+    *b = ptr[2]; // a=ptr[3];
+  }
+  else {
+    *g = *r;
+    *b = *r;
+  }
+}
+
+/* work out where in logo file it must be written.
+   image is made of 8x8 blocks.  So every 8 pixels across increases address
+   by 64, and every 8 pixels down increases pixel count by (64*8), and every
+   single pixel down increases address by 8.
+*/
+int logo_address(int x, int y)
+{
+  int address = 0;
+  address += 0x300; // space for palettes
+  address += (x & 7) + (y & 7) * 8;
+  address += (x >> 3) * 64;
+  address += (y >> 3) * 64 * (width / 8);
+  return address;
+}
+
+void *logo_write_cards(void *arg)
+{
+  struct card_rows *rows = arg;
+  for (int y = rows->first * 8; y < rows->last * 8 && y < height; y++)
+    for (int x = 0; x < width; x++) {
+      int r, g, b;
+      unsigned int slot;
+      get_rgb(x, y, &r, &g, &b);
+      logo_data[logo_address(x, y)] = palette_find(r, g, b, &slot);
+    }
+  return NULL;
+}
+
+void for_card_rows(void *(*fn)(void *), int threads)
+{
+  int card_rows = (height + 7) / 8;
+  pthread_t tid[threads];
+  struct card_rows rows[threads];
+  int started[threads];
+
+  for (int t = 0; t < threads; t++) {
+    rows[t].first = card_rows * t / threads;
+    rows[t].last = card_rows * (t + 1) / threads;
+    started[t] = !pthread_create(&tid[t], NULL, fn, &rows[t]);
+    if (!started[t])
+      fn(&rows[t]);
+  }
+  for (int t = 0; t < threads; t++)
+    if (started[t])
+      pthread_join(tid[t], NULL);
+}
+
 void process_file(int mode, char *outputfilename)
 {
-  int multiplier = -1;
+  multiplier = -1;
   if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_RGB)
     multiplier = 3;
 
@@ -258,85 +352,68 @@ void process_file(int mode, char *outputfilename)
     palette[14] = (struct rgb) { .r = 0xaa, .g = 0x9d, .b = 0xef };
     palette[15] = (struct rgb) { .r = 0xb8, .g = 0xb8, .b = 0xb8 };
 
+    // Reduce images with more colours than there are free palette entries
+    if (multiplier > 0) {
+      struct quant_histogram histogram = { 0 };
+      // alpha is ignored here, so transparent pixels need an entry too
+      for (y = 0; multiplier == 4 && y < height; y++)
+        for (x = 0; x < width; x++)
+          row_pointers[y][x * 4 + 3] = 0xff;
+      quantise_histogram_add(&histogram, row_pointers, width, height, multiplier);
+      if (histogram.count > 256 - palette_first) {
+        struct quant_colour reduced[256];
+        int n = quantise(histogram.colours, histogram.count, reduced, 0, 256 - palette_first, NULL);
+        printf("Quantised %d colours to %d.\n", histogram.count, n);
+        quantise_image(row_pointers, width, height, multiplier, reduced, n, dither);
+      }
+      quantise_histogram_free(&histogram);
+    }
+
+    int logo_size = 0x300;
     for (y = 0; y < height; y++) {
-      png_byte *row = row_pointers[y];
       for (x = 0; x < width; x++) {
-        png_byte *ptr = &(row[x * multiplier]);
         int r, g, b;
-        if (ptr) {
-          r = ptr[0];
-          if (multiplier > 1) {
-            g = ptr[1];
-            b = ptr[2]; // a=ptr[3];
-          }
-          else {
-            g = r;
-            b = r;
-          }
-        }
-        else {
-          r = 0;
-          g = 0;
-          b = 0;
-        }
+        get_rgb(x, y, &r, &g, &b);
 
         int c = palette_lookup(r, g, b);
 
         if (c > 255)
           printf("Too many colours at (%d,%d)\n", x, y);
 
-        /* work out where in logo file it must be written.
-           image is made of 8x8 blocks.  So every 8 pixels across increases address
-           by 64, and every 8 pixels down increases pixel count by (64*8), and every
-           single pixel down increases address by 8.
-        */
-        int address = 0;
-        address += 0x300; // space for palettes
-        address += (x & 7) + (y & 7) * 8;
-        address += (x >> 3) * 64;
-        //	if (size==SIZE_LOGO)
-        address += (y >> 3) * 64 * (width / 8);
-        //	else
-        //	  address+=(y>>3)*64*40;
-
-        fseek(outfile, address, SEEK_SET);
-        int n = fwrite(&c, 1, 1, outfile);
-        if (n != 1) {
-          fprintf(stderr, "Could not write pixel (%d,%d) @ $%x\n", x, y, address);
-          if (outfile != NULL) {
-            fclose(outfile);
-            outfile = NULL;
-          }
-          exit(-1);
-        }
+        if (logo_address(x, y) >= logo_size)
+          logo_size = logo_address(x, y) + 1;
       }
     }
 
+    // With a partial card at the end of each row, card rows overlap and the last write must win
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1 || width % 8)
+      threads = 1;
+    logo_data = calloc(logo_size, 1);
+    if (!logo_data) {
+      fprintf(stderr, "Could not allocate %d bytes for the logo\n", logo_size);
+      exit(-1);
+    }
+    for_card_rows(logo_write_cards, threads);
+
     fprintf(stderr, "Writing out palette of %d values\n", palette_index - palette_first);
     for (int i = 0; i < 256; i++) {
-      int address;
-      unsigned char c;
       int v;
 
-      address = i + 0x000;
       v = palette[i].r;
-      c = (v >> 4) | ((v & 0xf) << 4);
-      fseek(outfile, address, SEEK_SET);
-      fwrite(&c, 1, 1, outfile);
-
-      address = i + 0x100;
+      logo_data[i + 0x000] = (v >> 4) | ((v & 0xf) << 4);
       v = palette[i].g;
-      c = (v >> 4) | ((v & 0xf) << 4);
-      fseek(outfile, address, SEEK_SET);
-      fwrite(&c, 1, 1, outfile);
-
-      address = i + 0x200;
+      logo_data[i + 0x100] = (v >> 4) | ((v & 0xf) << 4);
       v = palette[i].b;
-      c = (v >> 4) | ((v & 0xf) << 4);
-      fseek(outfile, address, SEEK_SET);
-      fwrite(&c, 1, 1, outfile);
+      logo_data[i + 0x200] = (v >> 4) | ((v & 0xf) << 4);
     }
 
+    if (fwrite(logo_data, logo_size, 1, outfile) != 1) {
+      fprintf(stderr, "Could not write %d bytes of logo\n", logo_size);
+      exit(-1);
+    }
+    free(logo_data);
+
     if (outfile != NULL) {
       fclose(outfile);
       outfile = NULL;
@@ -735,8 +812,14 @@ void process_file(int mode, char *outputfilename)
 
 int main(int argc, char **argv)
 {
+  if (argc == 5 && !strcmp(argv[1], "-d")) {
+    dither = 1;
+    argc--;
+    argv++;
+  }
   if (argc != 4) {
-    fprintf(stderr, "Usage: program_name <logo|charrom|hires|sprite16> <file_in> <file_out>\n");
+    fprintf(stderr, "Usage: program_name [-d] <logo|charrom|hires|sprite16> <file_in> <file_out>\n");
+    fprintf(stderr, "  -d   dither logos with more colours than the palette can hold\n");
     exit(-1);
   }
 
@@ -751,7 +834,7 @@ int main(int argc, char **argv)
   if (!strcasecmp("sprite16", argv[1]))
     mode = 3;
   if (mode == -1) {
-    fprintf(stderr, "Usage: program_name <logo|charrom|hires|sprite16> <file_in> <file_out>\n");
+    fprintf(stderr, "Usage: program_name [-d] <logo|charrom|hires|sprite16> <file_in> <file_out>\n");
     exit(-1);
   }
 
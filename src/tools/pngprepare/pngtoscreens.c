@@ -19,6 +19,9 @@
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "quantise.h"
+#include "dirtymock.h"
+
 /* ============================================================= */
 
 char *vhdl_prefix = "library IEEE;\n"
@@ -111,28 +114,54 @@ struct rgb {
   int b;
 };
 
+// Palette entries are found by packed RGB through an open addressed hash
+#define COLOUR_HASH_BITS 10
+#define COLOUR_HASH_SIZE (1 << COLOUR_HASH_BITS)
+
 struct tile_set {
   struct tile *tiles;
   int tile_count;
   int max_tiles;
 
+  // Tiles by the hash of their canonical orientation (see tile_lookup())
+  int *hash_index;
+  int hash_size;
+  unsigned short *canonical_flip;
+  unsigned char *tile_ncm;
+
   // Palette
   struct rgb colours[256];
   int colour_count;
+  int colour_hash[COLOUR_HASH_SIZE]; // palette index + 1, 0 = empty
 
   struct tile_set *next;
 };
 
+unsigned int colour_slot(int r, int g, int b)
+{
+  return ((unsigned int)((r << 16) | (g << 8) | b) * 2654435761u) >> (32 - COLOUR_HASH_BITS);
+}
+
+// Returns the palette index of the colour or -1, and sets *slot to where it is or would go in the hash
+int colour_find(struct tile_set *ts, int r, int g, int b, unsigned int *slot)
+{
+  for (*slot = colour_slot(r, g, b); ts->colour_hash[*slot]; *slot = (*slot + 1) & (COLOUR_HASH_SIZE - 1)) {
+    int i = ts->colour_hash[*slot] - 1;
+    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b)
+      return i;
+  }
+  return -1;
+}
+
 int palette_lookup(struct tile_set *ts, int r, int g, int b)
 {
-  int i;
+  unsigned int slot;
+  int i = colour_find(ts, r, g, b, &slot);
 
   // Do we know this colour already?
-  for (i = 0; i < ts->colour_count; i++) {
-    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b) {
-      // It's a colour we have seen before, so return the index
-      return i;
-    }
+  if (i >= 0) {
+    // It's a colour we have seen before, so return the index
+    return i;
   }
 
   // new colour, check if palette has space
@@ -145,6 +174,7 @@ int palette_lookup(struct tile_set *ts, int r, int g, int b)
   ts->colours[ts->colour_count].r = r;
   ts->colours[ts->colour_count].g = g;
   ts->colours[ts->colour_count].b = b;
+  ts->colour_hash[slot] = ts->colour_count + 1;
   return ts->colour_count++;
 }
 
@@ -166,6 +196,15 @@ struct tile_set *new_tileset(int max_tiles)
     exit(-3);
   }
   ts->max_tiles = max_tiles;
+  for (ts->hash_size = 64; ts->hash_size < max_tiles * 2;)
+    ts->hash_size *= 2;
+  ts->hash_index = calloc(sizeof(int), ts->hash_size);
+  ts->canonical_flip = calloc(sizeof(unsigned short), max_tiles);
+  ts->tile_ncm = calloc(sizeof(unsigned char), max_tiles);
+  if (!ts->hash_index || !ts->canonical_flip || !ts->tile_ncm) {
+    perror("calloc() failed");
+    exit(-3);
+  }
   return ts;
 }
 
@@ -216,49 +255,71 @@ struct screen *new_screen(int id, struct tile_set *tiles, int width, int height)
   return s;
 }
 
-int tile_lookup(struct tile_set *ts, struct tile *t)
+#define TILE_NUMBER(t) ((t) & 0x3fff)
+#define TILE_FLIP_BITS(t) (((t) >> 8) & 0xc0)
+
+// NCM tiles hold two pixels per byte, the left one in the low nibble,
+// so flipping them in X also swaps the nibbles.
+void tile_flip(struct tile *out, struct tile *in, int flip, int ncm)
 {
-  // See if tile matches any that we have already stored.
-  // (Also check if it matches flipped in either or both X,Y
-  // axes.
-  for (int i = 0; i < ts->tile_count; i++) {
-    int matches = 1;
-    // Compare unflipped
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i;
-    // Compare with flipped X
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x4000;
-    // Compare with flipped Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x8000;
-    // Compare with flipped X and Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0xC000;
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 8; x++) {
+      unsigned char b = in->bytes[flip & 0x4000 ? 7 - x : x][flip & 0x8000 ? 7 - y : y];
+      out->bytes[x][y] = (ncm && (flip & 0x4000)) ? nyblswap(b) : b;
+    }
+}
+
+// Returns the flip that turns t into the smallest of its four orientations
+int tile_canonical(struct tile *t, struct tile *canonical, int ncm)
+{
+  int best = 0;
+  struct tile flipped;
+
+  *canonical = *t;
+  for (int flip = 0x4000; flip <= 0xC000; flip += 0x4000) {
+    tile_flip(&flipped, t, flip, ncm);
+    if (memcmp(&flipped, canonical, sizeof(struct tile)) < 0) {
+      *canonical = flipped;
+      best = flip;
+    }
+  }
+  return best;
+}
+
+unsigned int tile_hash(struct tile *t)
+{
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < 64; i++)
+    h = (h ^ ((unsigned char *)t->bytes)[i]) * 16777619u;
+  return h;
+}
+
+/*
+ * Returns the tile number, with the flip that shows the stored tile as t
+ * in bits 14 (X) and 15 (Y). The flip doesn't go into screen RAM, whose
+ * upper bits hold the trim count, but into bits 6 and 7 of the first
+ * colour RAM byte, see TILE_NUMBER() and TILE_FLIP_BITS(). ncm is set
+ * for nibble colour mode tiles.
+ */
+int tile_lookup(struct tile_set *ts, struct tile *t, int ncm)
+{
+  // See if tile matches any that we have already stored, also flipped
+  // in either or both X,Y axes. Tiles are hashed in their canonical
+  // orientation, so all four orientations land on the same entry.
+  // FCM and NCM tiles flip differently, so they never match each other.
+  struct tile canonical, stored;
+  int flip = tile_canonical(t, &canonical, ncm);
+  unsigned int slot = tile_hash(&canonical) & (ts->hash_size - 1);
+
+  for (; ts->hash_index[slot]; slot = (slot + 1) & (ts->hash_size - 1)) {
+    int i = ts->hash_index[slot] - 1;
+    if (ts->tile_ncm[i] != ncm)
+      continue;
+    tile_flip(&stored, &ts->tiles[i], ts->canonical_flip[i], ncm);
+    // t = canonical flipped back, and the flips are their own inverses
+    if (!memcmp(&stored, &canonical, sizeof(struct tile)))
+      return i | (ts->canonical_flip[i] ^ flip);
   }
 
   // The tile is new.
@@ -271,6 +332,9 @@ int tile_lookup(struct tile_set *ts, struct tile *t)
   for (int y = 0; y < 8; y++)
     for (int x = 0; x < 8; x++)
       ts->tiles[ts->tile_count].bytes[x][y] = t->bytes[x][y];
+  ts->canonical_flip[ts->tile_count] = flip;
+  ts->tile_ncm[ts->tile_count] = ncm;
+  ts->hash_index[slot] = ts->tile_count + 1;
   return ts->tile_count++;
 }
 
@@ -321,10 +385,11 @@ struct screen *png_to_screen(int id, struct tile_set *ts)
       else {
         // Block has non-transparent pixels, so add to tileset,
         // or lookup to see if it is already there.
-        int tile_number = tile_lookup(ts, &t);
+        int tile = tile_lookup(ts, &t, 0);
+        int tile_number = TILE_NUMBER(tile);
         s->screen_rows[y / 8][x / 8 * 2 + 0] = tile_number & 0xff;
         s->screen_rows[y / 8][x / 8 * 2 + 1] = (tile_number >> 8) & 0xff;
-        s->colourram_rows[y / 8][x / 8 * 2 + 0] = 0x00;
+        s->colourram_rows[y / 8][x / 8 * 2 + 0] = TILE_FLIP_BITS(tile);
         s->colourram_rows[y / 8][x / 8 * 2 + 1] = 0xff; // FG colour
       }
     }
@@ -404,12 +469,19 @@ void read_png_file(char *file_name)
 
 /* ============================================================= */
 
-int main(int argc, char **argv)
+int DIRTYMOCK(main)(int argc, char **argv)
 {
   int i, x, y;
+  int dither = 0;
 
+  if (argc > 1 && !strcmp(argv[1], "-d")) {
+    dither = 1;
+    argc--;
+    argv++;
+  }
   if (argc < 3) {
-    fprintf(stderr, "Usage: pngtoscreens <output file> <png file ...>\n");
+    fprintf(stderr, "Usage: pngtoscreens [-d] <output file> <png file ...>\n");
+    fprintf(stderr, "  -d   dither the images if their colours have to be reduced to 256\n");
     exit(-1);
   }
 
@@ -435,9 +507,34 @@ int main(int argc, char **argv)
 
   int image_tiles = 0;
 
+  // Read all the images first, so that if they have too many colours between them,
+  // they can be reduced to one palette
+  struct image {
+    png_bytep *rows;
+    int width, height, multiplier;
+  } images[256];
+  struct quant_histogram histogram = { 0 };
   for (int i = 2; i < argc; i++) {
     printf("Reading %s\n", argv[i]);
     read_png_file(argv[i]);
+    images[i] = (struct image) { .rows = row_pointers, .width = width, .height = height, .multiplier = multiplier };
+    quantise_histogram_add(&histogram, row_pointers, width, height, multiplier);
+  }
+  struct quant_colour palette[256];
+  int palette_size = 0;
+  if (histogram.count > 256) {
+    palette_size = quantise(histogram.colours, histogram.count, palette, 0, 256, NULL);
+    printf("Quantised %d colours to %d.\n", histogram.count, palette_size);
+  }
+  quantise_histogram_free(&histogram);
+
+  for (int i = 2; i < argc; i++) {
+    row_pointers = images[i].rows;
+    width = images[i].width;
+    height = images[i].height;
+    multiplier = images[i].multiplier;
+    if (palette_size)
+      quantise_image(row_pointers, width, height, multiplier, palette, palette_size, dither);
     image_tiles += width * height / 64;
     struct screen *s = png_to_screen(i - 1, ts);
     if (!s) {
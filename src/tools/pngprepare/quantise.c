@@ -0,0 +1,394 @@
+/*
+ * Colour quantiser shared by pngprepare, pngtoscreens and md2h65.
+ *
+ * Colours are compared in the OKLab colour space, where distance follows
+ * perceived difference much better than in RGB. The palette is seeded by
+ * a pixel weighted median cut and then refined by k-means, which places
+ * each entry at the weighted mean of the colours nearest to it. Both
+ * steps are deterministic, so an image always gets the same palette.
+ * Pinned entries (e.g. the 16 C64 colours) take part in the nearest
+ * colour search but are never moved.
+ *
+ * Copyright 2015-2023 Paul Gardner-Stephen.
+ *
+ * This software may be freely redistributed under the terms
+ * of the X11 license.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "quantise.h"
+
+// k-means stops earlier when no colour changes entry
+#define KMEANS_ITERATIONS 16
+
+struct lab {
+  float l, a, b;
+};
+
+static float srgb_linear[256];
+
+static void oklab(int r, int g, int b, struct lab *out)
+{
+  if (!srgb_linear[255])
+    for (int i = 0; i < 256; i++) {
+      float c = i / 255.0;
+      srgb_linear[i] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+    }
+  float lr = srgb_linear[r], lg = srgb_linear[g], lb = srgb_linear[b];
+  float l = cbrtf(0.4122214708f * lr + 0.5363325363f * lg + 0.0514459929f * lb);
+  float m = cbrtf(0.2119034982f * lr + 0.6806995451f * lg + 0.1073969566f * lb);
+  float s = cbrtf(0.0883024619f * lr + 0.2817188376f * lg + 0.6299787005f * lb);
+  out->l = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+  out->a = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+  out->b = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+static float lab_distance(struct lab *x, struct lab *y)
+{
+  return (x->l - y->l) * (x->l - y->l) + (x->a - y->a) * (x->a - y->a) + (x->b - y->b) * (x->b - y->b);
+}
+
+static int lab_nearest(struct lab *labs, int n, struct lab *c)
+{
+  int best = 0;
+  float best_distance = lab_distance(&labs[0], c);
+  for (int i = 1; i < n; i++) {
+    float d = lab_distance(&labs[i], c);
+    if (d < best_distance) {
+      best = i;
+      best_distance = d;
+    }
+  }
+  return best;
+}
+
+static float lab_axis(struct lab *c, int axis)
+{
+  return axis == 0 ? c->l : axis == 1 ? c->a : c->b;
+}
+
+// median cut sorts by one axis at a time
+static struct lab *sort_labs;
+static int sort_axis;
+
+static int compare_axis(const void *x, const void *y)
+{
+  float a = lab_axis(&sort_labs[*(int *)x], sort_axis), b = lab_axis(&sort_labs[*(int *)y], sort_axis);
+  if (a != b)
+    return a < b ? -1 : 1;
+  // keep the order independent of qsort()
+  return *(int *)x - *(int *)y;
+}
+
+// a median cut box: order[first .. last-1], and how it would best be split
+struct box {
+  int first, last;
+  double error; // pixel weighted squared error along axis
+  int axis;
+};
+
+static void box_measure(struct box *bx, int *order, struct quant_colour *colours, struct lab *labs)
+{
+  bx->error = 0;
+  bx->axis = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    double sum = 0, sum2 = 0, weight = 0;
+    for (int i = bx->first; i < bx->last; i++) {
+      double v = lab_axis(&labs[order[i]], axis);
+      sum += v * colours[order[i]].count;
+      sum2 += v * v * colours[order[i]].count;
+      weight += colours[order[i]].count;
+    }
+    double error = weight ? sum2 - sum * sum / weight : 0;
+    if (error > bx->error) {
+      bx->error = error;
+      bx->axis = axis;
+    }
+  }
+}
+
+int quantise(struct quant_colour *colours, int n, struct quant_colour *palette, int pinned, int max, int *map)
+{
+  struct lab *labs = malloc(n * sizeof(struct lab));
+  struct lab *centres = malloc(max * sizeof(struct lab));
+  int *order = malloc(n * sizeof(int));
+  int *assigned = malloc(n * sizeof(int));
+  struct box *boxes = malloc(max * sizeof(struct box));
+  if (!labs || !centres || !order || !assigned || !boxes) {
+    fprintf(stderr, "ERROR: Could not allocate memory to quantise %d colours.\n", n);
+    exit(-1);
+  }
+
+  for (int i = 0; i < n; i++)
+    oklab(colours[i].r, colours[i].g, colours[i].b, &labs[i]);
+  for (int i = 0; i < pinned; i++)
+    oklab(palette[i].r, palette[i].g, palette[i].b, &centres[i]);
+
+  int size = pinned;
+  if (n + pinned <= max) {
+    // everything fits, only colours already pinned share an entry
+    for (int i = 0; i < n; i++) {
+      int j;
+      for (j = 0; j < pinned; j++)
+        if (colours[i].r == palette[j].r && colours[i].g == palette[j].g && colours[i].b == palette[j].b)
+          break;
+      if (j == pinned) {
+        palette[size] = colours[i];
+        centres[size] = labs[i];
+        j = size++;
+      }
+      assigned[i] = j;
+    }
+  }
+  else {
+    // Median cut: split the box with the largest error at its weighted median
+    int box_count = 1;
+    for (int i = 0; i < n; i++)
+      order[i] = i;
+    boxes[0].first = 0;
+    boxes[0].last = n;
+    box_measure(&boxes[0], order, colours, labs);
+    while (box_count < max - pinned) {
+      int worst = -1;
+      for (int i = 0; i < box_count; i++)
+        if (boxes[i].last - boxes[i].first > 1 && (worst < 0 || boxes[i].error > boxes[worst].error))
+          worst = i;
+      if (worst < 0)
+        break;
+      struct box *bx = &boxes[worst];
+      sort_labs = labs;
+      sort_axis = bx->axis;
+      qsort(&order[bx->first], bx->last - bx->first, sizeof(int), compare_axis);
+
+      double weight = 0, half = 0;
+      for (int i = bx->first; i < bx->last; i++)
+        weight += colours[order[i]].count;
+      int split = bx->first + 1;
+      for (int i = bx->first; i < bx->last - 1; i++) {
+        half += colours[order[i]].count;
+        split = i + 1;
+        if (half * 2 >= weight)
+          break;
+      }
+      boxes[box_count].first = split;
+      boxes[box_count].last = bx->last;
+      bx->last = split;
+      box_measure(bx, order, colours, labs);
+      box_measure(&boxes[box_count++], order, colours, labs);
+    }
+    for (int i = 0; i < box_count; i++)
+      for (int j = boxes[i].first; j < boxes[i].last; j++)
+        assigned[order[j]] = pinned + i;
+    size = pinned + box_count;
+
+    // k-means from there, pinned entries attract colours but stay put
+    for (int iteration = 0;; iteration++) {
+      double *sums = calloc(size * 7, sizeof(double));
+      if (!sums) {
+        fprintf(stderr, "ERROR: Could not allocate memory to quantise %d colours.\n", n);
+        exit(-1);
+      }
+      for (int i = 0; i < n; i++) {
+        double *s = &sums[assigned[i] * 7], w = colours[i].count;
+        s[0] += w;
+        s[1] += labs[i].l * w;
+        s[2] += labs[i].a * w;
+        s[3] += labs[i].b * w;
+        s[4] += colours[i].r * w;
+        s[5] += colours[i].g * w;
+        s[6] += colours[i].b * w;
+      }
+      for (int j = pinned; j < size; j++) {
+        double *s = &sums[j * 7];
+        if (!s[0])
+          continue;
+        centres[j].l = s[1] / s[0];
+        centres[j].a = s[2] / s[0];
+        centres[j].b = s[3] / s[0];
+        palette[j].r = s[4] / s[0] + 0.5;
+        palette[j].g = s[5] / s[0] + 0.5;
+        palette[j].b = s[6] / s[0] + 0.5;
+        palette[j].count = s[0];
+      }
+      free(sums);
+      if (iteration == KMEANS_ITERATIONS)
+        break;
+
+      int changed = 0;
+      for (int i = 0; i < n; i++) {
+        int nearest = lab_nearest(centres, size, &labs[i]);
+        if (nearest != assigned[i]) {
+          assigned[i] = nearest;
+          changed++;
+        }
+      }
+      if (!changed)
+        break;
+    }
+
+    // the entries are drawn with their rounded RGB, so map to the nearest of those
+    for (int j = pinned; j < size; j++)
+      oklab(palette[j].r, palette[j].g, palette[j].b, &centres[j]);
+    for (int i = 0; i < n; i++)
+      assigned[i] = lab_nearest(centres, size, &labs[i]);
+  }
+
+  if (map)
+    memcpy(map, assigned, n * sizeof(int));
+  free(labs);
+  free(centres);
+  free(order);
+  free(assigned);
+  free(boxes);
+  return size;
+}
+
+static unsigned int histogram_slot(struct quant_histogram *h, int r, int g, int b)
+{
+  unsigned int slot = ((r << 16) | (g << 8) | b) * 2654435761u;
+  return (slot ^ (slot >> 15)) & (h->hash_size - 1);
+}
+
+void quantise_histogram_add(struct quant_histogram *h, unsigned char **rows, int width, int height, int bytes_per_pixel)
+{
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      unsigned char *px = &rows[y][x * bytes_per_pixel];
+      int r = px[0], g = px[0], b = px[0];
+      if (bytes_per_pixel >= 3) {
+        g = px[1];
+        b = px[2];
+      }
+      if (bytes_per_pixel == 4 && !px[3])
+        continue;
+
+      if ((h->count + 1) * 2 > h->hash_size) {
+        // grow and rehash
+        h->hash_size = h->hash_size ? h->hash_size * 2 : 4096;
+        free(h->hash);
+        h->hash = calloc(h->hash_size, sizeof(int));
+        if (!h->hash) {
+          fprintf(stderr, "ERROR: Could not allocate colour histogram.\n");
+          exit(-1);
+        }
+        for (int i = 0; i < h->count; i++) {
+          struct quant_colour *c = &h->colours[i];
+          unsigned int slot = histogram_slot(h, c->r, c->g, c->b);
+          while (h->hash[slot])
+            slot = (slot + 1) & (h->hash_size - 1);
+          h->hash[slot] = i + 1;
+        }
+      }
+
+      unsigned int slot = histogram_slot(h, r, g, b);
+      for (; h->hash[slot]; slot = (slot + 1) & (h->hash_size - 1)) {
+        struct quant_colour *c = &h->colours[h->hash[slot] - 1];
+        if (c->r == r && c->g == g && c->b == b)
+          break;
+      }
+      if (h->hash[slot]) {
+        h->colours[h->hash[slot] - 1].count++;
+        continue;
+      }
+
+      if (h->count == h->size) {
+        h->size = h->size ? h->size * 2 : 1024;
+        h->colours = realloc(h->colours, h->size * sizeof(struct quant_colour));
+        if (!h->colours) {
+          fprintf(stderr, "ERROR: Could not allocate colour histogram.\n");
+          exit(-1);
+        }
+      }
+      h->colours[h->count] = (struct quant_colour) { .r = r, .g = g, .b = b, .count = 1 };
+      h->hash[slot] = ++h->count;
+    }
+}
+
+void quantise_histogram_free(struct quant_histogram *h)
+{
+  free(h->colours);
+  free(h->hash);
+  memset(h, 0, sizeof(*h));
+}
+
+// most pixels repeat a colour seen shortly before, so remember the last entry picked for each
+#define NEAREST_CACHE_BITS 16
+#define NEAREST_CACHE_SIZE (1 << NEAREST_CACHE_BITS)
+
+void quantise_image(unsigned char **rows, int width, int height, int bytes_per_pixel, struct quant_colour *palette,
+    int n, int dither)
+{
+  struct lab labs[n];
+  int *cache_key = calloc(NEAREST_CACHE_SIZE, sizeof(int));
+  unsigned char *cache_entry = malloc(NEAREST_CACHE_SIZE);
+  // error carried to this row and the next, with a spare column at either end
+  int(*error)[3] = calloc(width + 2, sizeof(*error));
+  int(*next_error)[3] = calloc(width + 2, sizeof(*next_error));
+  if (!cache_key || !cache_entry || !error || !next_error) {
+    fprintf(stderr, "ERROR: Could not allocate memory to quantise image.\n");
+    exit(-1);
+  }
+  for (int i = 0; i < n; i++)
+    oklab(palette[i].r, palette[i].g, palette[i].b, &labs[i]);
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      unsigned char *px = &rows[y][x * bytes_per_pixel];
+      if (bytes_per_pixel == 4 && !px[3])
+        continue;
+      int want[3] = { px[0], px[0], px[0] };
+      if (bytes_per_pixel >= 3) {
+        want[1] = px[1];
+        want[2] = px[2];
+      }
+      for (int c = 0; dither && c < 3; c++) {
+        want[c] += error[x + 1][c] / 16;
+        want[c] = want[c] < 0 ? 0 : want[c] > 255 ? 255 : want[c];
+      }
+
+      int key = (want[0] << 16) | (want[1] << 8) | want[2];
+      unsigned int slot = (unsigned int)key * 2654435761u >> (32 - NEAREST_CACHE_BITS);
+      int entry;
+      if (cache_key[slot] == key + 1)
+        entry = cache_entry[slot];
+      else {
+        struct lab c;
+        oklab(want[0], want[1], want[2], &c);
+        entry = lab_nearest(labs, n, &c);
+        cache_key[slot] = key + 1;
+        cache_entry[slot] = entry;
+      }
+
+      px[0] = palette[entry].r;
+      if (bytes_per_pixel >= 3) {
+        px[1] = palette[entry].g;
+        px[2] = palette[entry].b;
+      }
+
+      if (dither) {
+        int got[3] = { palette[entry].r, palette[entry].g, palette[entry].b };
+        for (int c = 0; c < 3; c++) {
+          int e = want[c] - got[c];
+          error[x + 2][c] += e * 7;
+          next_error[x][c] += e * 3;
+          next_error[x + 1][c] += e * 5;
+          next_error[x + 2][c] += e;
+        }
+      }
+    }
+    int(*t)[3] = error;
+    error = next_error;
+    next_error = t;
+    memset(next_error, 0, (width + 2) * sizeof(*next_error));
+  }
+
+  free(cache_key);
+  free(cache_entry);
+  free(error);
+  free(next_error);
+}
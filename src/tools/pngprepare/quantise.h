@@ -0,0 +1,48 @@
+#ifndef QUANTISE_H
+#define QUANTISE_H
+
+/*
+ * colour quantiser shared by pngprepare, pngtoscreens and md2h65
+ * (see quantise.c)
+ */
+
+struct quant_colour {
+  int r, g, b;
+  int count; // pixels of this colour
+};
+
+/*
+ * quantise(colours, n, palette, pinned, max, map)
+ *
+ * picks at most max palette entries for the n colours, keeping the
+ * first pinned entries of palette as they are. Returns the palette
+ * size, and sets map[i] (if map is not NULL) to the entry colours[i]
+ * is drawn with.
+ */
+int quantise(struct quant_colour *colours, int n, struct quant_colour *palette, int pinned, int max, int *map);
+
+/*
+ * distinct colours of one or more images, pixels with alpha 0 are left
+ * out. bytes_per_pixel is 1 (grey), 3 (RGB) or 4 (RGBA).
+ */
+struct quant_histogram {
+  struct quant_colour *colours;
+  int count, size;
+  int *hash; // index + 1, 0 = empty
+  int hash_size;
+};
+
+void quantise_histogram_add(
+    struct quant_histogram *h, unsigned char **rows, int width, int height, int bytes_per_pixel);
+void quantise_histogram_free(struct quant_histogram *h);
+
+/*
+ * quantise_image(rows, width, height, bytes_per_pixel, palette, n, dither)
+ *
+ * replaces every pixel by its nearest of the n (at most 256) palette
+ * colours, with Floyd-Steinberg error diffusion if dither is set.
+ */
+void quantise_image(unsigned char **rows, int width, int height, int bytes_per_pixel, struct quant_colour *palette,
+    int n, int dither);
+
+#endif /* QUANTISE_H */
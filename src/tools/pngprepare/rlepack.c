@@ -13,228 +13,326 @@
 
   Dynamic programming is used to select optimal (i.e., shortest) encoding,
   so it will automatically pick which combination of tokens is best.
+
+  The lengths of the byte and byte pair runs ending at each position are
+  worked out first, so the tokens that can end at a position come from a
+  window of start positions. The cheapest start in each window is kept
+  with a sliding window minimum, which makes the DP linear in the input
+  size, and it picks the same tokens as trying every start would.
+
+  Inputs larger than MAX_RAW_SIZE are packed one block at a time into a
+  single stream, so the memory needed does not grow with the input.
 */
 
 #define MAX_RAW_SIZE (128 * 1024)
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/time.h>
+
+#include "dirtymock.h"
 
 unsigned char raw[MAX_RAW_SIZE];
 int raw_size;
 
-typedef struct dp_item {
-  unsigned char code_byte;
-  unsigned char code_byte2;
-  unsigned char *raw_region;
-  int cumulative_cost;
-  int parent;
-  int offset;
-} dp_item;
+// DP table: cheapest encoding of raw[0 .. end-1], and the token ending at end
+int cumulative_cost[MAX_RAW_SIZE + 1];
+int parent[MAX_RAW_SIZE + 1];
+unsigned char code_byte[MAX_RAW_SIZE + 1];
+unsigned char code_byte2[MAX_RAW_SIZE + 1];
+
+// length of the run of one byte value, and of repeated byte pairs, ending at each position
+int run_len[MAX_RAW_SIZE];
+int pair_len[MAX_RAW_SIZE];
 
-dp_item dp_list[MAX_RAW_SIZE + 1];
+// start positions in increasing order, with increasing key, so the first is the cheapest
+typedef struct window {
+  int start[MAX_RAW_SIZE + 1];
+  int head, tail;
+} window;
 
-int main(int argc, char **argv)
+window raw_window, rle_window, pair_window[2];
+
+int queue[MAX_RAW_SIZE + 1];
+unsigned char packed[MAX_RAW_SIZE * 2];
+unsigned char unpacked[MAX_RAW_SIZE];
+
+void window_push(window *w, int start, int key(int))
 {
-  if (argc != 3) {
-    fprintf(stderr, "usage: packtilesest <input tileset> <output compressed file>\n");
-    exit(-3);
-  }
+  // keep earlier starts on ties, as they were tried first
+  while (w->tail > w->head && key(w->start[w->tail - 1]) > key(start))
+    w->tail--;
+  w->start[w->tail++] = start;
+}
 
-  int retVal = 0;
-  do {
+// cheapest start at or after first, or -1
+int window_front(window *w, int first)
+{
+  while (w->head < w->tail && w->start[w->head] < first)
+    w->head++;
+  return w->head < w->tail ? w->start[w->head] : -1;
+}
 
-    FILE *f = fopen(argv[1], "r");
-    if (!f) {
-      retVal = -1;
-      fprintf(stderr, "Could not open file '%s'\n", argv[1]);
-      break;
-    }
+int raw_key(int start)
+{
+  return cumulative_cost[start] - start;
+}
 
-    raw_size = fread(raw, 1, MAX_RAW_SIZE, f);
-    if (raw_size < 1) {
-      retVal = -1;
-      fprintf(stderr, "Couldd not read contents of input file.\n");
-      break;
-    }
-    fclose(f);
+int rle_key(int start)
+{
+  return cumulative_cost[start];
+}
 
-    printf("Compressing file of %d bytes.\n", raw_size);
+void consider(int end, int start, int cost, unsigned char code, unsigned char code2)
+{
+  // On equal cost the earliest start wins, and raw before RLE before pairs
+  if (cost < cumulative_cost[end] || (cost == cumulative_cost[end] && start < parent[end])) {
+    cumulative_cost[end] = cost;
+    parent[end] = start;
+    code_byte[end] = code;
+    code_byte2[end] = code2;
+  }
+}
 
-    // Initialise DP list as infinite cost
-    for (int i = 0; i <= MAX_RAW_SIZE; i++) {
-      dp_list[i].offset = i;
-      dp_list[i].code_byte = 0x00;            // invalid code byte
-      dp_list[i].cumulative_cost = 999999999; // infinite cost
-      dp_list[i].parent = -1;                 // Links to invalid parent
-    }
+// Finds the cheapest encoding of raw[0 .. raw_size-1], returns its size
+int pack_block(void)
+{
+  for (int i = 0; i < raw_size; i++) {
+    run_len[i] = i && raw[i] == raw[i - 1] ? run_len[i - 1] + 1 : 1;
+    pair_len[i] = i >= 2 && raw[i] == raw[i - 2] ? pair_len[i - 1] + 1 : (i ? 2 : 1);
+  }
 
-    // To get to the start of the file has no cost
-    dp_list[0].cumulative_cost = 0;
-
-    // Now iterate through the file
-    for (int start = 0; start < raw_size; start++) {
-      int cumulative_cost = dp_list[start].cumulative_cost;
-
-      // Consider cost of encoding with non-RLE
-      for (int end = start + 1; end <= raw_size && (end - start) < 128; end++) {
-        int this_cost = 1 + (end - start);
-        if (this_cost + cumulative_cost < dp_list[end].cumulative_cost) {
-          // This is a superior option to what is currently recorded.
-          dp_list[end].code_byte = 0x00 + (end - start);
-          dp_list[end].cumulative_cost = this_cost + cumulative_cost;
-          dp_list[end].raw_region = &raw[start];
-          dp_list[end].parent = start;
-        }
-      }
+  raw_window.head = raw_window.tail = 0;
+  rle_window.head = rle_window.tail = 0;
+  pair_window[0].head = pair_window[0].tail = 0;
+  pair_window[1].head = pair_window[1].tail = 0;
+
+  // To get to the start of the file has no cost
+  cumulative_cost[0] = 0;
+  parent[0] = -1;
+
+  for (int end = 1; end <= raw_size; end++) {
+    int start, len;
+
+    // the cost of getting to end-1 is final now
+    window_push(&raw_window, end - 1, raw_key);
+    window_push(&rle_window, end - 1, rle_key);
+    window_push(&pair_window[(end - 1) & 1], end - 1, rle_key);
+
+    cumulative_cost[end] = 999999999; // infinite cost
+    parent[end] = -1;
+
+    // Consider cost of encoding with non-RLE
+    start = window_front(&raw_window, end - 127);
+    consider(end, start, cumulative_cost[start] + 1 + (end - start), 0x00 + (end - start), 0);
+
+    // Now try RLE
+    len = run_len[end - 1] < 127 ? run_len[end - 1] : 127;
+    start = window_front(&rle_window, end - len);
+    if (start >= 0)
+      consider(end, start, cumulative_cost[start] + 1 + 1, 0x80 + (end - start), 0);
+
+    // Now try RLE of pairs of bytes
+    len = (pair_len[end - 1] < 510 ? pair_len[end - 1] : 510) & ~1;
+    start = len ? window_front(&pair_window[end & 1], end - len) : -1;
+    if (start >= 0)
+      consider(end, start, cumulative_cost[start] + 1 + 1 + 2, 0x80, (end - start) >> 1);
+  }
 
-      // Now try RLE
-      for (int end = start + 1; raw[end - 1] == raw[start] && end <= raw_size && (end - start) < 128; end++) {
-        int this_cost = 1 + 1;
-        if (this_cost + cumulative_cost < dp_list[end].cumulative_cost) {
-          // This is a superior option to what is currently recorded.
-          dp_list[end].code_byte = 0x80 + (end - start);
-          dp_list[end].cumulative_cost = this_cost + cumulative_cost;
-          dp_list[end].raw_region = &raw[start];
-          dp_list[end].parent = start;
-        }
-      }
+  return cumulative_cost[raw_size];
+}
 
-      // Now try RLE of pairs of bytes
-      for (int end = start + 2;
-           (raw[end - 2] == raw[start]) && (raw[end - 1] == raw[start + 1]) && end <= raw_size && (end - start) < 512;
-           end += 2) {
-        int this_cost = 1 + 1 + 2;
-        if (this_cost + cumulative_cost < dp_list[end].cumulative_cost) {
-          // This is a superior option to what is currently recorded.
-          dp_list[end].code_byte = 0x80;
-          dp_list[end].code_byte2 = (end - start) >> 1;
-          dp_list[end].cumulative_cost = this_cost + cumulative_cost;
-          dp_list[end].raw_region = &raw[start];
-          dp_list[end].parent = start;
-        }
-      }
+// Writes the tokens chosen by pack_block() to packed[], returns their length
+int write_block(int *tokens)
+{
+  int queue_len = 0;
+  int offset = raw_size;
+  while (offset > 0) {
+    queue[queue_len++] = offset;
+    if (parent[offset] >= offset || parent[offset] < 0) {
+      fprintf(stderr, "ERROR: Circular dynamic programming path detected.\n");
+      exit(-3);
     }
+    offset = parent[offset];
+  }
+  *tokens = queue_len;
+
+  int len = 0;
+  // Write out contents of queue in reverse order
+  for (int i = queue_len - 1; i >= 0; i--) {
+    int end = queue[i], start = parent[end];
+    packed[len++] = code_byte[end];
+    if (code_byte[end] == 0x80) {
+      packed[len++] = code_byte2[end];
+      packed[len++] = raw[start];
+      packed[len++] = raw[start + 1];
+    }
+    else if (code_byte[end] & 0x80)
+      packed[len++] = raw[start];
+    else {
+      memcpy(&packed[len], &raw[start], code_byte[end] & 0x7f);
+      len += code_byte[end] & 0x7f;
+    }
+  }
+  return len;
+}
 
-    // Report on compressed size
-    printf("Compressed size is %d bytes\n", dp_list[raw_size].cumulative_cost);
-
-    dp_item *queue[MAX_RAW_SIZE + 1];
-    int queue_len = 0;
-    int offset = raw_size;
-    while (offset > 0) {
-      queue[queue_len] = &dp_list[offset];
-      queue_len++;
-      if (dp_list[offset].parent >= offset) {
-        fprintf(stderr, "ERROR: Circular dynamic programming path detected.\n");
-        exit(-3);
+/*
+  Unpacks like the on-target unpacker does: one code byte at a time, up
+  to the $00 end marker or the end of the packed data. Returns the number
+  of bytes unpacked, or -1 if they would not fit in out_size.
+*/
+int rle_unpack(unsigned char *packed, int packed_len, unsigned char *out, int out_size)
+{
+  int out_len = 0;
+  for (int offset = 0; offset < packed_len && packed[offset];) {
+    int count = packed[offset] & 0x7f;
+    if (packed[offset] == 0x80) {
+      count = packed[offset + 1];
+      if (out_len + count * 2 > out_size)
+        return -1;
+      for (int i = 0; i < count; i++) {
+        out[out_len++] = packed[offset + 2];
+        out[out_len++] = packed[offset + 3];
       }
-      offset = dp_list[offset].parent;
+      offset += 4;
     }
+    else if (packed[offset] & 0x80) {
+      // Decode RLE
+      if (out_len + count > out_size)
+        return -1;
+      memset(&out[out_len], packed[offset + 1], count);
+      out_len += count;
+      offset += 2;
+    }
+    else {
+      if (out_len + count > out_size)
+        return -1;
+      bcopy(&packed[offset + 1], &out[out_len], count);
+      offset += 1 + count;
+      out_len += count;
+    }
+  }
+  return out_len;
+}
 
-    printf("File encoded using %d tokens\n", queue_len);
+long long time_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
 
-    FILE *o = fopen(argv[2], "w");
-    if (!o) {
+// Unpacks the whole output file repeatedly for a second, to see how fast the unpacker runs
+int benchmark(char *filename, long long total_raw)
+{
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not open output file '%s' for benchmarking\n", filename);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  unsigned char *in = malloc(len);
+  unsigned char *out = malloc(total_raw + 1);
+  if (!in || !out || fread(in, 1, len, f) != len) {
+    fprintf(stderr, "ERROR: Could not read '%s' for benchmarking\n", filename);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  int runs = 0;
+  long long start = time_us(), elapsed;
+  do {
+    if (rle_unpack(in, len, out, total_raw) != total_raw) {
+      fprintf(stderr, "ERROR: Benchmark unpacked the wrong number of bytes.\n");
+      return -1;
+    }
+    runs++;
+  } while ((elapsed = time_us() - start) < 1000000);
+
+  printf("Unpacked %ld bytes to %lld bytes %d times: %.1f us each, %.1f MB/s\n", len, total_raw, runs,
+      elapsed * 1.0 / runs, total_raw * (double)runs / elapsed);
+  free(in);
+  free(out);
+  return 0;
+}
+
+int DIRTYMOCK(main)(int argc, char **argv)
+{
+  int bench = argc == 4 && !strcmp(argv[1], "-b");
+  if (argc != 3 + bench) {
+    fprintf(stderr, "usage: packtilesest [-b] <input tileset> <output compressed file>\n");
+    fprintf(stderr, "  -b   benchmark unpacking of the output afterwards\n");
+    exit(-3);
+  }
+  char *infile = argv[1 + bench], *outfile = argv[2 + bench];
+
+  int retVal = 0;
+  do {
+
+    FILE *f = fopen(infile, "r");
+    if (!f) {
       retVal = -1;
-      fprintf(stderr, "ERROR: Could not open output file '%s'\n", argv[2]);
+      fprintf(stderr, "Could not open file '%s'\n", infile);
       break;
     }
-    // Write out contents of queue in reverse order
-    for (int i = queue_len - 1; i >= 0; i--) {
-      fputc(queue[i]->code_byte, o);
-      if (queue[i]->code_byte == 0x80) {
-        fputc(queue[i]->code_byte2, o);
-        fputc(queue[i]->raw_region[0], o);
-        fputc(queue[i]->raw_region[1], o);
-      }
-      else if (queue[i]->code_byte & 0x80)
-        fputc(*queue[i]->raw_region, o);
-      else
-        fwrite(queue[i]->raw_region, queue[i]->code_byte & 0x7f, 1, o);
-    }
-    // Terminate with $00 char to mark end of packed data
-    fputc(0x00, o);
-    fclose(o);
 
-    // Now verify
-    o = fopen(argv[2], "r");
+    FILE *o = fopen(outfile, "w");
     if (!o) {
       retVal = -1;
-      fprintf(stderr, "ERROR: Could not open output file '%s' for verification\n", argv[2]);
+      fprintf(stderr, "ERROR: Could not open output file '%s'\n", outfile);
+      fclose(f);
       break;
     }
-    unsigned char packed[MAX_RAW_SIZE * 2];
-    int packed_len = fread(packed, 1, MAX_RAW_SIZE * 2, o);
-    printf("Read %d packed bytes for verification.\n", packed_len);
-
-    unsigned char unpacked[MAX_RAW_SIZE];
-    int unpacked_len = 0;
-    offset = 0;
-    while (offset <= packed_len && unpacked_len < raw_size) {
-      int count = packed[offset] & 0x7f;
-      if (packed[offset] == 0x80) {
-        count = packed[offset + 1];
-        for (int i = 0; i < count; i++) {
-          unpacked[unpacked_len++] = packed[offset + 2];
-          unpacked[unpacked_len++] = packed[offset + 3];
-        }
-        offset += 4;
-      }
-      else if (packed[offset] & 0x80) {
-        // Decode RLE
-        for (int i = 0; i < count; i++)
-          unpacked[unpacked_len++] = packed[offset + 1];
-        offset += 2;
-      }
-      else {
-        bcopy(&packed[offset + 1], &unpacked[unpacked_len], count);
-        offset += 1 + count;
-        unpacked_len += count;
-      }
-    }
-    // Skip end $00 marker
-    if (!packed[offset])
-      offset++;
-
-    if (unpacked_len != raw_size) {
-      fprintf(stderr, "ERROR: Unpacked len = %d during verification. Should have been %d\n", unpacked_len, raw_size);
-      retVal = 1;
-      o = fopen("verify.out", "w");
-      if (o) {
-        fwrite(unpacked, unpacked_len, 1, o);
-        fclose(o);
+
+    long long total_raw = 0, total_packed = 0, tokens = 0, start = time_us();
+    while ((raw_size = fread(raw, 1, MAX_RAW_SIZE, f)) > 0) {
+      int block_tokens;
+      pack_block();
+      int packed_len = write_block(&block_tokens);
+
+      // Now verify
+      int unpacked_len = rle_unpack(packed, packed_len, unpacked, MAX_RAW_SIZE);
+      if (unpacked_len != raw_size || memcmp(raw, unpacked, raw_size)) {
+        fprintf(stderr, "ERROR: Verification error in block at offset %lld (unpacked %d of %d bytes)\n", total_raw,
+            unpacked_len, raw_size);
+        retVal = 1;
+        FILE *v = fopen("verify.out", "w");
+        if (v && unpacked_len > 0)
+          fwrite(unpacked, unpacked_len, 1, v);
+        if (v)
+          fclose(v);
+        break;
       }
 
-      break;
+      fwrite(packed, packed_len, 1, o);
+      total_raw += raw_size;
+      total_packed += packed_len;
+      tokens += block_tokens;
     }
-
-    if (offset != packed_len) {
-      fprintf(stderr, "ERROR: Only used %d of %d bytes during unpacking.\n", offset, packed_len);
-      o = fopen("verify.out", "w");
-      if (o) {
-        fwrite(unpacked, unpacked_len, 1, o);
-        fclose(o);
-      }
-      retVal = 1;
+    fclose(f);
+    // Terminate with $00 char to mark end of packed data
+    fputc(0x00, o);
+    fclose(o);
+    if (retVal)
+      break;
+    if (!total_raw) {
+      retVal = -1;
+      fprintf(stderr, "Couldd not read contents of input file.\n");
       break;
     }
 
-    for (int i = 0; i < raw_size; i++) {
-      if (raw[i] != unpacked[i]) {
-        fprintf(stderr, "ERROR: Verification error at offset %d : saw 0x%02x instead of 0x%02x\n", i, unpacked[i], raw[i]);
-        retVal = 1;
-
-        o = fopen("verify.out", "w");
-        if (o) {
-          fwrite(unpacked, unpacked_len, 1, o);
-          fclose(o);
-        }
+    // Report on compressed size
+    printf("Compressed file of %lld bytes to %lld bytes using %lld tokens in %lld ms\n", total_raw, total_packed + 1,
+        tokens, (time_us() - start) / 1000);
 
-        break;
-      }
-    }
+    if (bench)
+      retVal = benchmark(outfile, total_raw);
 
   } while (0);
 
@@ -82,9 +82,10 @@ void get_video_state(void);
 void usage(void)
 {
   fprintf(stderr, "MEGA65 remote disk reading tool.\n");
-  fprintf(stderr, "usage: m65 [-l <serial port>] [-s <230400|2000000|4000000>] [-f] out.d81\n");
+  fprintf(stderr, "usage: readdisk [-l <serial port>] [-s <230400|2000000|4000000>] [-f] [-F] out.d81\n");
 
-  fprintf(stderr, "  -f - Do full copy (instead of only copying sectors likely to contain data.\n"
+  fprintf(stderr, "  -f - Do full copy (instead of only copying tracks the BAM shows to contain data).\n"
+                  "  -F - Start the track reader even if a program is already in memory.\n"
                   "  -l - Name of serial port to use, e.g., /dev/ttyUSB1\n"
                   "  -s - Speed of serial port in bits per second. This must match what your bitstream uses.\n"
                   "       (Typically 2000000 or 4000000).\n"
@@ -1012,108 +1013,256 @@ unsigned char checkUSBPermissions()
   return 1;
 }
 
-unsigned char read_a_sector(unsigned char track_number, unsigned char side, unsigned char sector)
+/*
+  Disks are read by a small helper running on the MEGA65 (see
+  src/utilities/trackread.c), using the same job queue protocol as
+  mega65_ftp's remotesd: jobs are pushed to $C001, and their count is
+  written to $C000. Each job reads a run of sectors of one track side,
+  and the helper streams back a status byte and 512 bytes per sector.
+  Sectors are written to the D81 as they arrive, while the helper is
+  still reading the rest of the batch, and sectors that failed are
+  queued again in the next batch.
+*/
+extern unsigned int trackreadroutine_len;
+extern unsigned char trackreadroutine[];
+
+// Physical layout of a D81: 80 tracks of 2 sides of 10 sectors
+#define TRACKS 80
+#define SIDES 2
+#define SECTORS 10
+#define MAX_TRIES 5
+// Give up if the track reader sends nothing for this long
+#define TRACK_READER_TIMEOUT_US 20000000LL
+
+int force_helper_push = 0;
+
+unsigned char track_wanted[TRACKS];
+unsigned char sector_read[TRACKS][SIDES][SECTORS];
+unsigned char sector_tries[TRACKS][SIDES][SECTORS];
+unsigned char sector_status[TRACKS][SIDES][SECTORS];
+
+struct track_job {
+  int addr;
+  int track, side, sector, count;
+};
+
+struct track_job track_jobs[255];
+int track_job_count = 0;
+uint16_t queue_addr = 0xc001;
+uint8_t queue_cmds[0x0fff];
+
+// Job data currently being received
+struct track_job *rx_job = NULL;
+int rx_left = 0, rx_len = 0, rx_index = 0;
+uint8_t rx_sector[1 + 512];
+
+int load_track_reader(void)
 {
-  // Disable auto-seek, or we can't force seeking to track 0
-  mega65_poke(0xffD3696, 0x00);
+  char buffer[8193];
+  int bytes;
 
-  // Floppy motor on, and select side
-  mega65_poke(0xffD3080, 0x68);
-  if (side)
-    mega65_poke(0xffD3080, 0x60);
+  monitor_sync();
 
-  // Map FDC sector buffer, not SD sector buffer
-  mega65_poke(0xffD3689, mega65_peek(0xffD3689) & 0x7f);
+  // See if the track reader is already running
+  mega65_poke(0xc001, 0x13);
+  mega65_poke(0xc000, 0x01);
+  sleep(1);
+  bytes = serialport_read(fd, (unsigned char *)buffer, 8192);
+  buffer[bytes > 0 ? bytes : 0] = 0;
+  if (strstr(buffer, "MEGA65RD1.0")) {
+    log_debug("track reader already running. Nothing to do");
+    return 0;
+  }
 
-  // Disable matching on any sector, use real drive
-  mega65_poke(0xffd36A1, 0x01);
+  detect_mode();
 
-  // Wait until busy flag clears
-  while (mega65_peek(0xffD3082) & 0x80) {
-    continue;
+  // Don't destroy a program in memory
+  snprintf(buffer, 80, saw_c64_mode ? "m0801\n" : "m2001\n");
+  serialport_write(fd, (unsigned char *)buffer, strlen(buffer));
+  usleep(20000);
+  bytes = serialport_read(fd, (unsigned char *)buffer, 8192);
+  buffer[bytes > 0 ? bytes : 0] = 0;
+  if (!strstr(buffer, "01:0000")) {
+    if (force_helper_push)
+      log_warn("trying to overwriting program in memory!");
+    else {
+      log_error("a program is already in memory, refusing to start track reader! (-F to override)");
+      return -1;
+    }
   }
 
-#if 0
-  // Seek to track 0
-  goto_track0();
-  
-  // Seek to the requested track
-  while(PEEK(0xD082)&0x80) continue;
-  for(i=0;i<track_number;i++) {
-    while(PEEK(0xD082)&0x80) continue;
-    POKE(0xD081,0x18);
-    while(PEEK(0xD082)&0x80) continue;
-    }
-#endif
+  if (!saw_c64_mode) {
+    start_cpu();
+    switch_to_c64mode();
+  }
+
+  fake_stop_cpu();
+
+  // Load track reader, minus the 2 byte load address header
+  push_ram(0x0801, trackreadroutine_len - 2, &trackreadroutine[2]);
 
-  // Now select the side, and try to read the sector
-  mega65_poke(0xffD3084, track_number);
-  mega65_poke(0xffD3085, sector);
-  mega65_poke(0xffD3086, side ? 1 : 0);
+  char cmd[1024];
+  if (saw_openrom)
+    stuff_keybuffer("RUN\r");
+  else {
+    snprintf(cmd, 1024, "g080d\r");
+    slow_write(fd, cmd, strlen(cmd));
+    wait_for_prompt();
+  }
 
-  // Issue read command
-  mega65_poke(0xffD3081, 0x01); // but first reset buffers
-  mega65_poke(0xffD3081, 0x40);
+  snprintf(cmd, 1024, "t0\r");
+  slow_write(fd, cmd, strlen(cmd));
+  wait_for_prompt();
 
-  // Wait for busy flag to clear
-  while (mega65_peek(0xffD3082) & 0x80) { }
+  log_note("track reader installed");
+  return 0;
+}
 
-  if (mega65_peek(0xffD3082) & 0x18) {
-    // Read failed
-    log_error("failed to read T:%02x, S:%02x, H:%02x", track_number, sector, side);
-    return 1;
+void write_sector(int track, int side, int sector, unsigned char *data)
+{
+  int physical_sector = (side == 0 ? sector - 1 : sector + 9);
+  if (fseek(fd81, (track * 20 + physical_sector) * 512, SEEK_SET) || fwrite(data, 512, 1, fd81) != 1) {
+    log_crit("could not write D81 sector T:%02x, S:%02x, H:%02x", track, sector, side);
+    do_exit(-1);
   }
-  else {
-    // Read succeeded
-    return 0;
+}
+
+// Handles one sector as it arrives from the track reader
+void sector_received(void)
+{
+  int track = rx_job->track, side = rx_job->side, sector = rx_job->sector + rx_index;
+
+  if (track >= TRACKS || side >= SIDES || sector < 1 || sector > SECTORS)
+    return;
+  sector_tries[track][side][sector - 1]++;
+  sector_status[track][side][sector - 1] = rx_sector[0];
+  if (rx_sector[0]) {
+    log_warn("failed to read T:%02x, S:%02x, H:%02x (%s, try %d)", track, sector, side,
+        rx_sector[0] & 0x10 ? "sector not found" : "CRC error", sector_tries[track][side][sector - 1]);
+    return;
   }
+  write_sector(track, side, sector, &rx_sector[1]);
+  sector_read[track][side][sector - 1] = 1;
 }
 
-void goto_track0(void)
+void receive_byte(uint8_t v)
 {
-  // Do some slow seeks first, in case head is stuck at end of disk
-  mega65_poke(0xffd3081, 0x10);
-  usleep(20000);
-  mega65_poke(0xffd3081, 0x10);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  usleep(30000);
-  mega65_poke(0xffd3081, 0x10);
-  usleep(40000);
-
-  while (!(mega65_peek(0xffd3082) & 0x01)) {
-    while (mega65_peek(0xffd3082) & 0x80)
-      continue;
-    //    mega65_poke(0xffd3020,1);
-    mega65_poke(0xffd3081, 0x10);
-    while (mega65_peek(0xffd3082) & 0x80)
+  rx_left--;
+  if (!rx_job)
+    return;
+  rx_sector[rx_len++] = v;
+  if (rx_len == sizeof(rx_sector)) {
+    sector_received();
+    rx_len = 0;
+    rx_index++;
+  }
+}
+
+int queue_execute(void)
+{
+  if (!track_job_count)
+    return 0;
+
+  // Push queued jobs in one go, then set the number of jobs to execute them
+  push_ram(0xc001, queue_addr - 0xc001, queue_cmds);
+  char cmd[1024];
+  snprintf(cmd, 1024, "sc000 %x\r", track_job_count);
+  slow_write(fd, cmd, strlen(cmd));
+
+  uint8_t buff[8192];
+  uint8_t recent[32];
+  bzero(recent, sizeof(recent));
+  rx_left = 0;
+  long long last_rx = gettime_us();
+  int retVal = 0;
+
+  while (1) {
+    int b = serialport_read(fd, buff, 8192);
+    if (b < 1) {
+      if (gettime_us() - last_rx > TRACK_READER_TIMEOUT_US) {
+        log_crit("track reader stopped responding");
+        retVal = -1;
+        break;
+      }
+      usleep(0);
       continue;
-    mega65_poke(0xffd3020, mega65_peek(0xffd3020) + 1);
+    }
+    last_rx = gettime_us();
+
+    for (int i = 0; i < b; i++) {
+      if (rx_left) {
+        receive_byte(buff[i]);
+        continue;
+      }
+      // Keep rolling window of most recent chars for interpreting job results
+      bcopy(&recent[1], &recent[0], 30);
+      recent[30] = buff[i];
+      recent[31] = 0;
+      if (!strncmp((char *)&recent[30 - 10], "FTBATCHDONE", 11))
+        goto done;
+      int j_addr, n;
+      unsigned int transfer_size;
+      if (sscanf((char *)recent, "FTJOBDATR:%x:%x:%n", &j_addr, &transfer_size, &n) == 2) {
+        rx_job = NULL;
+        for (int j = 0; j < track_job_count; j++)
+          if (track_jobs[j].addr == j_addr)
+            rx_job = &track_jobs[j];
+        rx_left = transfer_size;
+        rx_len = 0;
+        rx_index = 0;
+        // The window already holds the first data bytes
+        for (int k = n; k <= 30 && rx_left; k++)
+          receive_byte(recent[k]);
+      }
+    }
+  }
+
+done:
+  queue_addr = 0xc001;
+  track_job_count = 0;
+  return retVal;
+}
+
+int queue_read_track(int track, int side, int sector, int count)
+{
+  if (queue_addr + 5 > 0xd000 || track_job_count == 255)
+    if (queue_execute())
+      return -1;
+  uint8_t job[5] = { 0x21, track, side, sector, count };
+  track_jobs[track_job_count++] = (struct track_job) { queue_addr, track, side, sector, count };
+  bcopy(job, &queue_cmds[queue_addr - 0xc001], 5);
+  queue_addr += 5;
+  return 0;
+}
+
+/*
+  Uses the BAM on track 40 to find the tracks that have data on them.
+  Returns 0 if the BAM was read and looks valid.
+*/
+int read_bam(void)
+{
+  unsigned char bam[512];
+  int physical_track = 40 - 1;
+
+  memset(track_wanted, 0, TRACKS);
+  track_wanted[physical_track] = 1;
+  if (queue_read_track(physical_track, 0, 1, 2) || queue_execute())
+    return -1;
+  if (!sector_read[physical_track][0][0] || !sector_read[physical_track][0][1])
+    return -1;
+
+  // Logical sectors 1 and 2 hold the BAM entries of tracks 1-40 and 41-80
+  for (int half = 0; half < 2; half++) {
+    if (fseek(fd81, (physical_track * 20 + half) * 512, SEEK_SET) || fread(bam, 512, 1, fd81) != 1)
+      return -1;
+    unsigned char *entries = half ? &bam[0] : &bam[256];
+    if (entries[2] != 0x44 || entries[3] != 0xbb)
+      return -1;
+    for (int t = 0; t < 40; t++)
+      if (entries[0x10 + t * 6] < 40)
+        track_wanted[half * 40 + t] = 1;
   }
+  return 0;
 }
 
 int main(int argc, char **argv)
@@ -1128,15 +1277,17 @@ int main(int argc, char **argv)
     usage();
 
   int opt;
-  while ((opt = getopt(argc, argv, "fhl:s:?")) != -1) {
+  while ((opt = getopt(argc, argv, "Ffhl:s:?")) != -1) {
     switch (opt) {
     case 'h':
     case '?':
       usage();
+    case 'F':
+      force_helper_push = 1;
+      break;
     case 'f':
       full_read = 1;
       break;
-      break;
     case 'l':
       serial_port = strdup(optarg);
       break;
@@ -1158,6 +1309,10 @@ int main(int argc, char **argv)
     }
   }
 
+  if (optind != argc - 1)
+    usage();
+  d81file = argv[optind];
+
   // Automatically find the serial port
   unsigned int fpga_id = get_bitstream_fpgaid(bitstream);
 
@@ -1199,41 +1354,77 @@ int main(int argc, char **argv)
   rxbuff_detect();
   monitor_sync();
 
-  real_stop_cpu();
+  // Only truncate an existing image once the helper is known to be running
+  if (load_track_reader())
+    do_exit(-1);
 
-  // Seek to track 0, then to track 37
-  goto_track0();
-  for (int i = 0; i < 35; i++) {
-    mega65_poke(0xffD3081, 0x18);
-    while (mega65_peek(0xffd3082) & 0x80)
-      continue;
+  // An empty image, that sectors are written to as they are read
+  fd81 = fopen(d81file, "wb+");
+  if (!fd81) {
+    log_crit("could not open D81 file: '%s'", d81file);
+    do_exit(-1);
+  }
+  unsigned char blank[512];
+  bzero(blank, 512);
+  for (int i = 0; i < TRACKS * SIDES * SECTORS; i++)
+    fwrite(blank, 512, 1, fd81);
+
+  memset(track_wanted, 1, TRACKS);
+  if (!full_read && read_bam()) {
+    log_warn("could not read the BAM, doing a full copy");
+    memset(track_wanted, 1, TRACKS);
   }
 
-  for (int track = 38; track < 41; track++) {
-
-    // Step one track
-    mega65_poke(0xffD3081, 0x18);
-    while (mega65_peek(0xffd3082) & 0x80)
-      continue;
-
-    usleep(50000);
-    log_note("current track is T:%02x, H:%02x", mega65_peek(0xffd36a3), mega65_peek(0xffd36a5));
-
-    for (int side = 0; side < 2; side++) {
-      // Allow a little bit of time for a sector to pass under the head,
-      // so that we can check the track and head, and step if we need
-
-      for (int sector = 1; sector <= 10; sector++) {
-        log_note("reading T:%02x, S:%02x, H:%02x", track, sector, side);
-        read_a_sector(track, side, sector);
+  long long start_usec = gettime_us();
+  for (int pass = 0; pass < MAX_TRIES; pass++) {
+    // Queue every run of sectors still to be read
+    int queued = 0;
+    for (int track = 0; track < TRACKS; track++) {
+      if (!track_wanted[track])
+        continue;
+      for (int side = 0; side < SIDES; side++) {
+        for (int sector = 0; sector < SECTORS; sector++) {
+          if (sector_read[track][side][sector])
+            continue;
+          int count = 1;
+          while (sector + count < SECTORS && !sector_read[track][side][sector + count])
+            count++;
+          if (queue_read_track(track, side, sector + 1, count))
+            do_exit(-1);
+          queued += count;
+          sector += count - 1;
+        }
       }
     }
+    if (!queued)
+      break;
+    if (pass)
+      log_note("retrying %d sectors", queued);
+    if (queue_execute())
+      do_exit(-1);
   }
-  // Floppy motor off
-  mega65_poke(0xffD3080, 0x00);
 
-  start_cpu();
-  do_exit(0);
+  int sectors_read = 0, failed = 0;
+  for (int track = 0; track < TRACKS; track++)
+    for (int side = 0; side < SIDES; side++)
+      for (int sector = 0; sector < SECTORS; sector++) {
+        if (sector_read[track][side][sector])
+          sectors_read++;
+        else if (track_wanted[track]) {
+          log_error("could not read T:%02x, S:%02x, H:%02x (%s)", track, sector + 1, side,
+              sector_status[track][side][sector] & 0x10 ? "sector not found" : "CRC error");
+          failed++;
+        }
+      }
+  fclose(fd81);
+  log_note("read %d sectors in %.1f seconds, %d could not be read", sectors_read, (gettime_us() - start_usec) / 1000000.0,
+      failed);
+
+  // Quit the track reader, which also turns the floppy motor off
+  mega65_poke(0xc001, 0xff);
+  mega65_poke(0xc000, 0x01);
+
+  do_exit(failed ? 1 : 0);
 }
 
 void do_exit(int retval)
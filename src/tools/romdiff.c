@@ -4,6 +4,10 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "dirtymock.h"
 
 #ifdef WINDOWS
 #define bzero(b, len) (memset((b), '\0', (len)), (void)0)
@@ -23,14 +27,27 @@ void do_usleep(unsigned long usec);
 #include <IOKit/IOBSD.h>
 #endif
 
-#define FILE_SIZE 128 * 1024
+#define FILE_SIZE (128 * 1024)
 // Use just a little part for testing
-//#define FILE_SIZE 8*1024
-
-#define EFFORT (FILE_SIZE * 1.0 * FILE_SIZE) / 2.0
-
-unsigned char ref[FILE_SIZE];
-unsigned char new[FILE_SIZE];
+//#define FILE_SIZE (8 * 1024)
+
+/*
+  A diff can be made against up to MAX_REFS reference ROMs. With one it
+  is written as a MEGA65ROMPATCH01 file, exactly as before. With more it
+  becomes MEGA65ROMPATCH02: byte 31 of the header holds the number of
+  references, the names of the second and later ones follow the 256 byte
+  header in 64 byte fields, and the token stream may contain $01 $nn to
+  make reference nn the one that following matches copy from. Literals
+  are always XORed with the first reference.
+*/
+#define MAX_REFS 8
+#define HEADER_SIZE 256
+#define REF_NAME_SIZE 64
+
+// the reference ROMs, one after the other
+unsigned char ref[MAX_REFS * FILE_SIZE];
+int ref_count = 1;
+unsigned char new_rom[FILE_SIZE];
 unsigned char diff[4 * FILE_SIZE];
 int diff_len = 0;
 unsigned char out[2 * FILE_SIZE];
@@ -41,19 +58,26 @@ unsigned char out[2 * FILE_SIZE];
 
 unsigned char out_origin[FILE_SIZE];
 
-int costs[FILE_SIZE];
-int next_pos[FILE_SIZE];
+// Dynamic programming grid, for each position and the reference selected on arriving there
+int costs[FILE_SIZE + 1][MAX_REFS];
+int next_pos[FILE_SIZE][MAX_REFS];
+int match_addr[FILE_SIZE][MAX_REFS]; // -1 for a literal
+unsigned char match_approx[FILE_SIZE][MAX_REFS];
 unsigned char tokens[FILE_SIZE][128];
 int token_lens[FILE_SIZE];
 
-int decode_diff(unsigned char *ref, unsigned char *diff, int diff_len, unsigned char *out)
+int decode_diff(unsigned char *ref, int ref_count, unsigned char *diff, int diff_len, unsigned char *out)
 {
-  int out_ofs = 0;
+  unsigned char *src = ref;
+  int out_ofs = 0, checked_ofs = -1;
   for (int ofs = 0; ofs < diff_len;) {
     int bad = 0;
-    for (int i = 0; i < token_lens[out_ofs]; i++)
-      if (diff[ofs + i] != tokens[out_ofs][i])
-        bad++;
+    if (out_ofs != checked_ofs) {
+      for (int i = 0; i < token_lens[out_ofs]; i++)
+        if (diff[ofs + i] != tokens[out_ofs][i])
+          bad++;
+      checked_ofs = out_ofs;
+    }
     if (bad) {
       fprintf(stderr, "ofs=%d : %02x %02x %02x %02x %02x ... vs out_ofs=%d : %02x %02x %02x %02x %02x (n=%d)\n", ofs,
           diff[ofs + 0], diff[ofs + 1], diff[ofs + 2], diff[ofs + 3], diff[ofs + 4], out_ofs, tokens[out_ofs][0],
@@ -72,10 +96,13 @@ int decode_diff(unsigned char *ref, unsigned char *diff, int diff_len, unsigned
       ofs += 2;
     }
     else if (diff[ofs] == 0x01) {
-      // Double byte literal
-      // XXX Not yet used
-      fprintf(stderr, "ERROR: Unsupported token $01 encountered\n");
-      exit(-3);
+      // Select the reference that following matches copy from
+      if (diff[ofs + 1] >= ref_count) {
+        fprintf(stderr, "ERROR: Token $01 selects reference %d, but there are only %d\n", diff[ofs + 1], ref_count);
+        exit(-3);
+      }
+      src = ref + diff[ofs + 1] * FILE_SIZE;
+      ofs += 2;
     }
     else if (diff[ofs] < 0x80) {
       // Exact match of 1 -- 63 bytes
@@ -86,7 +113,7 @@ int decode_diff(unsigned char *ref, unsigned char *diff, int diff_len, unsigned
       addr |= (diff[ofs + 1]);
       addr |= (diff[ofs + 2]) << 8;
       ofs += 3;
-      bcopy(&ref[addr], &out[out_ofs], count);
+      bcopy(&src[addr], &out[out_ofs], count);
       //	fprintf(stderr,"Copying %d EXACT match bytes from $%05x to $%05x\n",
       //		count,addr,out_ofs);
       for (int i = 0; i < count; i++)
@@ -106,7 +133,7 @@ int decode_diff(unsigned char *ref, unsigned char *diff, int diff_len, unsigned
       addr |= (diff[ofs + 1]);
       addr |= (diff[ofs + 2]) << 8;
       ofs += 3;
-      bcopy(&ref[addr], &out[out_ofs], count);
+      bcopy(&src[addr], &out[out_ofs], count);
       //	fprintf(stderr,"Copying %d approx match bytes from $%05x to $%05x\n",
       //		count,addr,out_ofs);
       int bitmap_ofs = ofs;
@@ -164,112 +191,393 @@ char *normalise(char *s)
   return normalised;
 }
 
-int main(int argc, char **argv)
+long long time_us(void)
 {
-  if (argc == 3) {
-    FILE *f = fopen(argv[1], "rb");
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
 
-    if (!f) {
-      fprintf(stderr, "ERROR: Could not open diff file '%s'\n", argv[1]);
-      perror("fopen");
-      exit(-1);
-    }
-    diff_len = fread(diff, 1, 4 * FILE_SIZE, f);
+int read_rom(char *filename, unsigned char *buf, char *what)
+{
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not read %s file '%s'\n", what, filename);
+    perror("fopen");
+    return -1;
+  }
+  if (fread(buf, FILE_SIZE, 1, f) != 1) {
+    fprintf(stderr, "ERROR: Could not read 128KB from %s file '%s'\n", what, filename);
     fclose(f);
+    return -1;
+  }
+  fclose(f);
+  return 0;
+}
 
-    char *reffile = (char *)&diff[32];
+/*
+  Match finder for the encoder
+
+  Rather than trying every reference offset for every position of the new
+  ROM, the references are indexed with a suffix array (sorted on the first
+  64 bytes, which is as far as any token reaches). The longest exact
+  match for a position is then found with a binary search, and its
+  lowest address, which is what the exhaustive search picked, with a
+  range minimum query. The suffix array neighbours of the new data are
+  also the offsets that make the most promising approximate matches, so
+  only the ROMDIFF_CANDIDATES nearest of them are tried, along with the
+  same offset in each reference.
+
+  Finding candidates does not depend on the DP costs, so it is done for a
+  block of positions at a time, spread over all cores, before the DP
+  walks back over the block.
+*/
+#define SA_KEY 64
+#define SA_BLOCK 32
+#define SA_LEVELS 16
+#define ROMDIFF_CANDIDATES 32
+#define ROMDIFF_BLOCK 4096
+
+int sa[MAX_REFS * FILE_SIZE];
+int sa_size;
+// sa_min[l][b] = lowest address in blocks b .. b+2^l-1 of SA_BLOCK suffix array entries
+int sa_min[SA_LEVELS][MAX_REFS * FILE_SIZE / SA_BLOCK];
+
+struct candidates {
+  int best_len;
+  int best_addr;
+  int count;
+  // the nearest neighbours, plus the same offset and the continued matches in each reference
+  int addr[ROMDIFF_CANDIDATES + 2 * MAX_REFS + 1];
+  // bit k set if new_rom[i+k] != ref[addr+k]
+  unsigned long long mismatch[ROMDIFF_CANDIDATES + 2 * MAX_REFS + 1];
+};
+struct candidates block_candidates[ROMDIFF_BLOCK];
+
+// bytes from ref[j] to the end of its reference ROM
+int ref_left(int j)
+{
+  return FILE_SIZE - j % FILE_SIZE;
+}
 
-    if (strncmp("MEGA65ROMPATCH01", (char *)diff, 16)) {
-      fprintf(stderr, "ERROR: Input file is not a MEGA65 ROM Diff File\n");
-      exit(-1);
+int sa_compare(const void *a, const void *b)
+{
+  int i = *(const int *)a, j = *(const int *)b;
+  int li = ref_left(i) < SA_KEY ? ref_left(i) : SA_KEY;
+  int lj = ref_left(j) < SA_KEY ? ref_left(j) : SA_KEY;
+  int r = memcmp(&ref[i], &ref[j], li < lj ? li : lj);
+  if (r)
+    return r;
+  if (li != lj)
+    return li - lj;
+  return i - j;
+}
+
+void build_suffix_array(void)
+{
+  sa_size = ref_count * FILE_SIZE;
+  for (int i = 0; i < sa_size; i++)
+    sa[i] = i;
+  qsort(sa, sa_size, sizeof(int), sa_compare);
+
+  int blocks = sa_size / SA_BLOCK;
+  for (int b = 0; b < blocks; b++) {
+    sa_min[0][b] = sa[b * SA_BLOCK];
+    for (int x = 1; x < SA_BLOCK; x++)
+      if (sa[b * SA_BLOCK + x] < sa_min[0][b])
+        sa_min[0][b] = sa[b * SA_BLOCK + x];
+  }
+  for (int l = 1; l < SA_LEVELS; l++)
+    for (int b = 0; b + (1 << l) <= blocks; b++) {
+      int x = sa_min[l - 1][b], y = sa_min[l - 1][b + (1 << (l - 1))];
+      sa_min[l][b] = x < y ? x : y;
     }
+}
 
-    fprintf(stderr, "Diff file is %d bytes long. Reffile is '%s'\n", diff_len, reffile);
+// lowest address in sa[lo .. hi-1]
+int sa_range_min(int lo, int hi)
+{
+  int best = sa[lo];
+  while (lo < hi && lo % SA_BLOCK)
+    if (sa[lo++] < best)
+      best = sa[lo - 1];
+  while (hi > lo && hi % SA_BLOCK)
+    if (sa[--hi] < best)
+      best = sa[hi];
+  if (lo < hi) {
+    int b = lo / SA_BLOCK, n = (hi - lo) / SA_BLOCK, l = 0;
+    while ((2 << l) <= n)
+      l++;
+    if (sa_min[l][b] < best)
+      best = sa_min[l][b];
+    if (sa_min[l][b + n - (1 << l)] < best)
+      best = sa_min[l][b + n - (1 << l)];
+  }
+  return best;
+}
 
-    f = fopen(reffile, "rb");
-    if (!f) {
-      fprintf(stderr, "ERROR: Could not read reference ROM file '%s'\n", reffile);
-      perror("fopen");
-      exit(-1);
-    }
-    if (fread(ref, FILE_SIZE, 1, f) != 1) {
-      fprintf(stderr, "ERROR: Could not read 128KB from reference ROM file '%s'\n", reffile);
-      exit(-1);
-    }
-    fclose(f);
-    fprintf(stderr, "Read reference ROM '%s'\n", reffile);
-    decode_diff(ref, &diff[0x100], diff_len - 256, out);
-    f = fopen(argv[2], "wb");
-    if (!f) {
-      fprintf(stderr, "ERROR: Could not write output file '%s'\n", argv[2]);
-      perror("fopen");
-      exit(-1);
-    }
-    fwrite(out, FILE_SIZE, 1, f);
-    fclose(f);
-    fprintf(stderr, "Successfully wrote '%s'\n", argv[2]);
-    return 0;
+// compares the first n bytes of new_rom[i..] against the suffix array key of ref[j..]
+int sa_compare_new(int i, int j, int n)
+{
+  int left = ref_left(j);
+  for (int m = 0; m < n; m++) {
+    if (m >= left)
+      return 1;
+    if (new_rom[i + m] != ref[j + m])
+      return new_rom[i + m] - ref[j + m];
   }
+  return 0;
+}
 
-  if (argc != 4) {
-    fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "       (diff mode)   romdiff <reference ROM> <new ROM> <output file>\n");
-    fprintf(stderr, "       (patch mode)  romdiff <rom diff file> <outputfile>\n\n");
-    fprintf(stderr, "Be aware that in diff mode the output file will be silently overwritten!\n\n");
-    fprintf(stderr, "In patch mode the referenced ROM file name is taken from the header of\n");
-    fprintf(stderr, "the diff file. Make sure that this file can be found in the current\n");
-    fprintf(stderr, "directory, or the patch will fail.\n");
-    exit(-1);
+// first suffix array position whose key is not below new_rom[i..i+n-1] (or above, if upper)
+int sa_search(int i, int n, int upper)
+{
+  int lo = 0, hi = sa_size;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int c = sa_compare_new(i, sa[mid], n);
+    if (c > 0 || (upper && !c))
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return lo;
+}
 
-  // check args for filename size
-  normalise(argv[1]);
-  if (strlen(normalised) > 31) {
-    fprintf(stderr, "ERROR: name of reference rom file is greater than 31 characters.\n");
-    exit(-1);
+// length of the exact match of new_rom[i..] with ref[j..], as the exhaustive search counted it
+int match_len(int i, int j)
+{
+  int mlen = 0, left = ref_left(j);
+  while (mlen < 62 && i + mlen < FILE_SIZE && mlen < left && new_rom[i + mlen] == ref[j + mlen])
+    mlen++;
+  return mlen;
+}
+
+unsigned long long mismatch_bits(int i, int j)
+{
+  unsigned long long bits = 0;
+  int left = ref_left(j);
+  for (int k = 0; k < 64 && i + k < FILE_SIZE && k < left; k++)
+    if (new_rom[i + k] != ref[j + k])
+      bits |= 1ULL << k;
+  return bits;
+}
+
+void add_candidate(struct candidates *c, int i, int j)
+{
+  int n;
+  for (n = 0; n < c->count; n++)
+    if (c->addr[n] == j)
+      return;
+  // keep them in address order, as the exhaustive search visited them
+  for (n = c->count; n > 0 && c->addr[n - 1] > j; n--) {
+    c->addr[n] = c->addr[n - 1];
+    c->mismatch[n] = c->mismatch[n - 1];
   }
+  c->addr[n] = j;
+  c->mismatch[n] = mismatch_bits(i, j);
+  c->count++;
+}
 
-  normalise(argv[2]);
-  if (strlen(normalised) > 159) {
-    fprintf(stderr, "ERROR: name of new rom file is greater than 159 characters.\n");
-    exit(-1);
+void find_candidates(int i, struct candidates *c)
+{
+  int n = FILE_SIZE - i < 62 ? FILE_SIZE - i : 62;
+  int pos = sa_search(i, n, 0);
+  int left = pos - 1, right = pos;
+  int left_len = left >= 0 ? match_len(i, sa[left]) : 0;
+  int right_len = right < sa_size ? match_len(i, sa[right]) : 0;
+
+  c->count = 0;
+  c->best_len = left_len > right_len ? left_len : right_len;
+  c->best_addr = 0;
+  if (!c->best_len)
+    return;
+
+  // all suffixes sharing the longest match are next to each other
+  c->best_addr = sa_range_min(sa_search(i, c->best_len, 0), sa_search(i, c->best_len, 1));
+  add_candidate(c, i, c->best_addr);
+  for (int r = 0; r < ref_count; r++)
+    if (new_rom[i] == ref[r * FILE_SIZE + i])
+      add_candidate(c, i, r * FILE_SIZE + i);
+
+  for (int found = 0; found < ROMDIFF_CANDIDATES && (left_len || right_len); found++) {
+    if (left_len >= right_len) {
+      add_candidate(c, i, sa[left--]);
+      left_len = left >= 0 ? match_len(i, sa[left]) : 0;
+    }
+    else {
+      add_candidate(c, i, sa[right++]);
+      right_len = right < sa_size ? match_len(i, sa[right]) : 0;
+    }
   }
+}
+
+struct finder_job {
+  int first, count, thread, threads;
+};
 
-  fprintf(stderr, "Generating patch of %s, using %s as the reference.\n", argv[2], argv[1]);
+void *candidate_thread(void *arg)
+{
+  struct finder_job *job = arg;
+  for (int n = job->thread; n < job->count; n += job->threads)
+    find_candidates(job->first + n, &block_candidates[n]);
+  return NULL;
+}
 
-  // Reset dynamic programming grid
-  for (int i = 0; i < FILE_SIZE; i++) {
-    costs[i] = 999999999;
-    next_pos[i] = 999999999;
-    token_lens[i] = 0;
+void find_block_candidates(int first, int count, int threads)
+{
+  pthread_t tid[threads];
+  struct finder_job jobs[threads];
+  int started[threads];
+
+  for (int t = 0; t < threads; t++) {
+    jobs[t] = (struct finder_job) { first, count, t, threads };
+    started[t] = !pthread_create(&tid[t], NULL, candidate_thread, &jobs[t]);
+    if (!started[t])
+      candidate_thread(&jobs[t]);
   }
+  for (int t = 0; t < threads; t++)
+    if (started[t])
+      pthread_join(tid[t], NULL);
+}
 
-  FILE *f;
+int cpu_count(void)
+{
+#ifdef WINDOWS
+  char *n = getenv("NUMBER_OF_PROCESSORS");
+  return n && atoi(n) > 0 ? atoi(n) : 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#endif
+}
 
-  f = fopen(argv[1], "rb");
-  if (!f) {
-    fprintf(stderr, "ERROR: Could not read reference ROM file '%s'\n", argv[1]);
-    perror("fopen");
-    exit(-1);
+// Evaluates the tokens that can start at position i, keeping the cheapest for each selected reference
+void encode_position(int i, struct candidates *c)
+{
+  int best_cost[MAX_REFS], best_next[MAX_REFS], best_addr[MAX_REFS];
+  unsigned char best_approx[MAX_REFS];
+
+  for (int s = 0; s < ref_count; s++)
+    best_cost[s] = 999999999;
+
+  // Continuing the matches used by the next position is often a good approximate match
+  if (i < FILE_SIZE - 1)
+    for (int r = 0; r < ref_count; r++) {
+      int j = match_addr[i + 1][r] - 1;
+      if (match_addr[i + 1][r] % FILE_SIZE > 0 && new_rom[i] == ref[j])
+        add_candidate(c, i, j);
+    }
+
+  for (int n = 0; n < c->count; n++) {
+    int j = c->addr[n], s = j / FILE_SIZE;
+    unsigned long long bits = c->mismatch[n];
+    int mlen = match_len(i, j);
+
+    // Also model approximate matches
+    if (mlen > 0) {
+      int enc_len = 3;
+      enc_len += (mlen >> 3);
+      if (mlen & 7)
+        enc_len++;
+      for (int k = mlen; k < 64 && (i + k) < FILE_SIZE && k < ref_left(j); k++) {
+        if (bits & (1ULL << k))
+          enc_len++;
+        if ((k & 7) == 0)
+          enc_len++;
+
+        if ((enc_len + costs[i + k][s]) < best_cost[s]) {
+          // Approximate match helps here
+          best_cost[s] = costs[i + k][s] + enc_len;
+          best_next[s] = i + k + 1;
+          best_addr[s] = j;
+          best_approx[s] = 1;
+        }
+      }
+    }
   }
-  if (fread(ref, FILE_SIZE, 1, f) != 1) {
-    fprintf(stderr, "ERROR: Could not read 128KB from reference ROM file '%s'\n", argv[1]);
-    exit(-1);
+
+  if (c->best_len) {
+    int s = c->best_addr / FILE_SIZE;
+    for (int len = 1; len <= c->best_len; len++) {
+      if (best_cost[s] > (costs[i + len][s] + 3)) {
+        best_cost[s] = costs[i + len][s] + 3;
+        best_next[s] = i + len;
+        best_addr[s] = c->best_addr;
+        best_approx[s] = 0;
+      }
+    }
   }
-  fclose(f);
 
-  f = fopen(argv[2], "rb");
-  if (!f) {
-    fprintf(stderr, "ERROR: Could not read new ROM file '%s'\n", argv[2]);
-    perror("fopen");
-    exit(-1);
+  for (int r = 0; r < ref_count; r++) {
+    // Try encoding the byte as an XOR literal
+    costs[i][r] = costs[i + 1][r] + 2;
+    next_pos[i][r] = i + 1;
+    match_addr[i][r] = -1;
+
+    // then matches, paying for a select token when they come from another reference
+    for (int n = 0; n < ref_count; n++) {
+      int s = (r + n) % ref_count;
+      int cost = best_cost[s] + (s == r ? 0 : 2);
+      if (cost < costs[i][r]) {
+        costs[i][r] = cost;
+        next_pos[i][r] = best_next[s];
+        match_addr[i][r] = best_addr[s];
+        match_approx[i][r] = best_approx[s];
+      }
+    }
   }
-  if (fread(new, FILE_SIZE, 1, f) != 1) {
-    fprintf(stderr, "ERROR: Could not read 128KB from new ROM file '%s'\n", argv[2]);
-    exit(-1);
+}
+
+// Writes the tokens for position ofs into tokens[ofs], returns the next position
+int emit_token(int ofs, int *selected)
+{
+  unsigned char *t = tokens[ofs];
+  int j = match_addr[ofs][*selected];
+  int next = next_pos[ofs][*selected];
+  int approx = match_approx[ofs][*selected];
+  int len = 0;
+
+  if (j < 0) {
+    t[len++] = 0x00;
+    t[len++] = new_rom[ofs] ^ ref[ofs];
   }
-  fclose(f);
+  else {
+    int s = j / FILE_SIZE, addr = j % FILE_SIZE, count = next - ofs;
+    if (s != *selected) {
+      t[len++] = 0x01;
+      t[len++] = s;
+      *selected = s;
+    }
+    t[len++] = (approx ? 0x80 : 0x02) + ((count - 1) << 1) + (addr >> 16);
+    t[len++] = addr >> 0;
+    t[len++] = addr >> 8;
+    if (approx) {
+      // Setup bitmap for diffs
+      int bitmap = len, bitmap_len = count / 8;
+      if (count & 7)
+        bitmap_len++;
+      bzero(&t[bitmap], bitmap_len);
+      len += bitmap_len;
+      // Now write diffs
+      for (int l = 0; l < count; l++) {
+        if (ref[j + l] != new_rom[ofs + l]) {
+          // Set bitmap bit
+          t[bitmap + (l >> 3)] |= (1 << (l & 7));
+          // Copy literals from reference
+          // We XOR so that there is no copyright material leaked
+          t[len++] = ref[j + l] ^ new_rom[ofs + l];
+        }
+      }
+    }
+  }
+  token_lens[ofs] = len;
+  return next;
+}
 
+// Encodes new_rom against the reference ROMs into diff
+void encode_rom(void)
+{
   // From the end of the new file, working backwards, find the various matches that
   // are possible that start here (including this byte).  We do it backwards, so that
   // we can do dynamic programming optimisation to find the smallest diff.
@@ -277,192 +585,251 @@ int main(int argc, char **argv)
   /*
     Token types:
     $00 $nn = single literal byte
-    $01 $nn $nn = two literal bytes
+    $01 $nn = select reference nn for the following matches (MEGA65ROMPATCH02 only)
     $02-$7F $xx $xx = Exact match 1 to 63 bytes, followed by 17-bit address
     $80-$FF $xx $xx <bitmap> <replacement bytes> = Approximate match 1 to 64 bytes.  Followed by bitmap of which bytes
               need to be replaced, followed by the byte values to replace
   */
+  int threads = cpu_count();
+  build_suffix_array();
 
-  int output_size_so_far = 0;
+  for (int last = FILE_SIZE; last > 0; last -= ROMDIFF_BLOCK) {
+    int first = last > ROMDIFF_BLOCK ? last - ROMDIFF_BLOCK : 0;
+    find_block_candidates(first, last - first, threads);
+    for (int i = last - 1; i >= first; i--)
+      encode_position(i, &block_candidates[i - first]);
 
-  long long effort_done = 0;
+    fprintf(stderr, "\r$%05x : %d bytes (%.1f%% of original size) : %.1f%% done.        ", FILE_SIZE - first,
+        costs[first][0], costs[first][0] * 100.0 / (FILE_SIZE - first), 100.0 * (FILE_SIZE - first) / FILE_SIZE);
+    fflush(stderr);
+  }
 
-  for (int i = (FILE_SIZE - 1); i >= 0; i--) {
-    // Calculate cost of single byte
+  fprintf(stderr, "\rTotal size of diff = %d bytes.                              \n", costs[0][0]);
+  int steps = 0, selected = 0;
+  diff_len = 0;
+  for (int ofs = 0; ofs < FILE_SIZE;) {
+    int next = emit_token(ofs, &selected);
+    if (next > FILE_SIZE) {
+      fprintf(stderr, "ERROR: Position $%05x points to illegal position %d (out of bounds)\n", ofs, next);
+      exit(-1);
+    }
+    if (next <= ofs) {
+      fprintf(stderr, "ERROR: Position $%05x points to illegal position %d (backwards)\n", ofs, next);
+      exit(-1);
+    }
 
-    double progress = effort_done / (EFFORT);
-    progress *= 100;
+    bcopy(tokens[ofs], &diff[diff_len], token_lens[ofs]);
+    diff_len += token_lens[ofs];
 
-    fprintf(stderr, "\r$%05x : %d bytes (%.1f%% of original size) : %.1f%% done.        ", FILE_SIZE - i, output_size_so_far,
-        output_size_so_far * 100.0 / (FILE_SIZE - i), progress);
+    ofs = next;
+    steps++;
+  }
+  fprintf(stderr, "ROM encoded using %d steps. Output stream = %d bytes.\n", steps, diff_len);
+}
 
-    effort_done += i;
+/*
+  Patches can be applied in a chain, each one producing the ROM named in
+  its header. Later patches in the chain that reference one of these get
+  the ROM produced earlier instead of looking for the file.
+*/
+#define MAX_CHAIN 32
+struct chained_rom {
+  char name[160];
+  unsigned char *data;
+} chain[MAX_CHAIN];
+int chain_len = 0;
+
+int load_reference(char *name, unsigned char *buf)
+{
+  for (int n = chain_len - 1; n >= 0; n--)
+    if (!strcmp(chain[n].name, name)) {
+      memcpy(buf, chain[n].data, FILE_SIZE);
+      fprintf(stderr, "Using '%s' produced earlier in the chain\n", name);
+      return 0;
+    }
+  if (read_rom(name, buf, "reference ROM"))
+    return -1;
+  fprintf(stderr, "Read reference ROM '%s'\n", name);
+  return 0;
+}
 
-    fflush(stderr);
+int is_patch_file(char *filename)
+{
+  char magic[14];
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return 0;
+  int r = fread(magic, sizeof(magic), 1, f) == 1 && !strncmp("MEGA65ROMPATCH", magic, sizeof(magic));
+  fclose(f);
+  return r;
+}
 
-    // Try encoding the byte as an XOR literal
-    if (i == (FILE_SIZE - 1))
-      costs[i] = 2;
-    else
-      costs[i] = costs[i + 1] + 2;
-    next_pos[i] = i + 1;
-    tokens[i][0] = 0x00;
-    tokens[i][1] = new[i] ^ ref[i];
-    token_lens[i] = 2;
-
-    int best_len = 0;
-    int best_addr = 0;
-    for (int j = 0; j < FILE_SIZE; j++) {
-      int mlen = 0;
-      while (mlen < 62) {
-        if (i + mlen >= FILE_SIZE)
-          break;
-        if (j + mlen >= FILE_SIZE)
-          break;
-        if (new[i + mlen] != ref[j + mlen])
-          break;
-        mlen++;
-      }
-      if (mlen > best_len) {
-        best_len = mlen;
-        best_addr = j;
-        //	if (best_len==64) break;
-      }
+int apply_patch(char *filename, unsigned char *out)
+{
+  char name[REF_NAME_SIZE];
+  FILE *f = fopen(filename, "rb");
 
-#if 0
-      fprintf(stderr,"new[i]=%02x, ref[j]=%02x, ",
-	      new[i],ref[j]);
-      fprintf(stderr,"new[i+mlen=%d]=%02x, ref[j+mlen=%d]=%02x, i=%d,j=%d,mlen=%d\n",
-	      i+mlen,new[i+mlen],j+mlen,ref[j+mlen],i,j,mlen);
-#endif
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not open diff file '%s'\n", filename);
+    perror("fopen");
+    return -1;
+  }
+  diff_len = fread(diff, 1, 4 * FILE_SIZE, f);
+  fclose(f);
 
-      // Also model approximate matches
-      if (mlen > 0) {
-        int diffs = 0;
-        int enc_len = 3;
-        //	fprintf(stderr,"\n3+");
-        enc_len += (mlen >> 3);
-        if (mlen & 7)
-          enc_len++;
-        //	fprintf(stderr,"%d+",enc_len-3);
-        for (int k = mlen; k < 64 && (i + k) < FILE_SIZE && (j + k) < FILE_SIZE; k++) {
-          if (new[i + k] != ref[j + k]) {
-            diffs++;
-            enc_len++;
-            // fprintf(stderr,"d(%d)",k);
-          }
-          if ((k & 7) == 0) {
-            enc_len++;
-            // fprintf(stderr,".<%d>",k);
-          }
-
-          if ((enc_len + costs[i + k]) < costs[i]) {
-            if (0)
-              fprintf(stderr, "$%05x -> $%05x : mlen=%d, approx_len=%d, src_addr=$%05x, diffs=%d, cost=%d, old cost=%d\n", i,
-                  i + k, mlen, k, j, diffs, enc_len + costs[i + k], costs[i]);
-            // Approximate match helps here
-            costs[i] = costs[i + k] + enc_len;
-            next_pos[i] = i + k + 1;
-            tokens[i][0] = 0x80 + ((k + 1 - 1) << 1) + (j >> 16);
-            tokens[i][1] = j >> 0;
-            tokens[i][2] = j >> 8;
-            token_lens[i] = 3;
-
-            output_size_so_far = costs[i];
-
-            // Setup bitmap for diffs
-            int bitmap_len = (k + 1) / 8;
-            if ((k + 1) & 7)
-              bitmap_len++;
-            for (int n = 0; n < bitmap_len; n++)
-              tokens[i][3 + n] = 0x00;
-            token_lens[i] += bitmap_len;
-            // Now write diffs
-            int diffs_hit = 0;
-            for (int l = 0; l <= k; l++) {
-              if (ref[j + l] != new[i + l]) {
-                // Set bitmap bit
-                tokens[i][3 + (l >> 3)] |= (1 << (l & 7));
-                // Copy literals from reference
-                // We XOR so that there is no copyright material leaked
-                tokens[i][token_lens[i]++] = ref[j + l] ^ new[i + l];
-                diffs_hit++;
-                //		fprintf(stderr,"(%d, i=%d,j=%d, l=%d, r=%02x, n=%02x)",l,i,j,l,ref[j+l],new[i+l]);
-              }
-            }
-            if (enc_len != token_lens[i]) {
-              fprintf(stderr,
-                  "ERROR: Modeled cost of %d for %d bytes, but incurred cost of %d bytes. Bitmap len=%d, diffs_hit=%d\n",
-                  enc_len, k + 1, token_lens[i], bitmap_len, diffs_hit);
-              exit(-1);
-            }
-          }
-        }
-      }
-    }
+  if (!strncmp("MEGA65ROMPATCH01", (char *)diff, 16))
+    ref_count = 1;
+  else if (!strncmp("MEGA65ROMPATCH02", (char *)diff, 16))
+    ref_count = diff[31];
+  else {
+    fprintf(stderr, "ERROR: Input file is not a MEGA65 ROM Diff File\n");
+    return -1;
+  }
+  int header_len = HEADER_SIZE + (ref_count - 1) * REF_NAME_SIZE;
+  if (ref_count < 1 || ref_count > MAX_REFS || diff_len < header_len) {
+    fprintf(stderr, "ERROR: Diff file '%s' has a bad header\n", filename);
+    return -1;
+  }
 
-    for (int len = 1; len <= best_len; len++) {
-      if (costs[i] > (costs[i + len] + 3)) {
-        if (0)
-          fprintf(stderr, "$%05x -> $%05x : mlen=%d, exact, cost=%d, old cost=%d\n", i, i + len, len,
-              (i + len < FILE_SIZE) ? costs[i + len] + 3 : 3, costs[i]);
-        if (i + len == FILE_SIZE)
-          costs[i] = 3;
-        else
-          costs[i] = costs[i + len] + 3;
-        next_pos[i] = i + len;
-        tokens[i][0] = 0x02 + ((len - 1) << 1) + (best_addr >> 16);
-        tokens[i][1] = best_addr >> 0;
-        tokens[i][2] = best_addr >> 8;
-        token_lens[i] = 3;
-      }
-    }
-    output_size_so_far = costs[i];
+  fprintf(stderr, "Diff file is %d bytes long, with %d reference ROM(s).\n", diff_len, ref_count);
+
+  for (int r = 0; r < ref_count; r++) {
+    snprintf(name, sizeof(name), "%.63s", (char *)(r ? &diff[HEADER_SIZE + (r - 1) * REF_NAME_SIZE] : &diff[32]));
+    if (load_reference(name, &ref[r * FILE_SIZE]))
+      return -1;
   }
+  if (decode_diff(ref, ref_count, &diff[header_len], diff_len - header_len, out))
+    return -1;
 
-  fprintf(stderr, "\rTotal size of diff = %d bytes.                              \n", costs[0]);
-  int steps = 0;
-  for (int ofs = 0; ofs < FILE_SIZE;) {
-    if (next_pos[ofs] > FILE_SIZE) {
-      fprintf(stderr, "ERROR: Position $%05x points to illegal position %d (out of bounds)\n", ofs, next_pos[ofs]);
+  if (chain_len < MAX_CHAIN) {
+    snprintf(chain[chain_len].name, sizeof(chain[chain_len].name), "%.159s", (char *)&diff[32 + 64]);
+    chain[chain_len].data = malloc(FILE_SIZE);
+    memcpy(chain[chain_len++].data, out, FILE_SIZE);
+  }
+  return 0;
+}
+
+void benchmark(void)
+{
+  long long start = time_us();
+  encode_rom();
+  long long encode_us = time_us() - start;
+
+  // the encoder's token check would dominate the decode time
+  bzero(token_lens, sizeof(token_lens));
+
+  int runs = 0;
+  start = time_us();
+  do {
+    decode_diff(ref, ref_count, diff, diff_len, out);
+    runs++;
+  } while (time_us() - start < 1000000);
+  long long decode_us = time_us() - start;
+
+  if (memcmp(out, new_rom, FILE_SIZE))
+    fprintf(stderr, "ERROR: Verify error while testing encoded data stream.\n");
+  fprintf(stderr, "%d reference ROM(s), diff stream %d bytes (%.1f%% of original size)\n", ref_count, diff_len,
+      diff_len * 100.0 / FILE_SIZE);
+  fprintf(stderr, "Encode: %.2f s, %.1f KB/s\n", encode_us / 1000000.0, FILE_SIZE / 1024.0 * 1000000.0 / encode_us);
+  fprintf(stderr, "Decode: %.1f us per ROM, %.1f MB/s\n", decode_us * 1.0 / runs,
+      FILE_SIZE * (double)runs / (1024.0 * 1024.0) * 1000000.0 / decode_us);
+}
+
+int DIRTYMOCK(main)(int argc, char **argv)
+{
+  if (argc == 3 || (argc > 3 && is_patch_file(argv[1]))) {
+    for (int n = 1; n < argc - 1; n++)
+      if (apply_patch(argv[n], out))
+        exit(-1);
+
+    FILE *f = fopen(argv[argc - 1], "wb");
+    if (!f) {
+      fprintf(stderr, "ERROR: Could not write output file '%s'\n", argv[argc - 1]);
+      perror("fopen");
       exit(-1);
     }
-    if (next_pos[ofs] <= ofs) {
-      fprintf(stderr, "ERROR: Position $%05x points to illegal position %d (backwards)\n", ofs, next_pos[ofs]);
+    fwrite(out, FILE_SIZE, 1, f);
+    fclose(f);
+    fprintf(stderr, "Successfully wrote '%s'\n", argv[argc - 1]);
+    return 0;
+  }
+
+  int bench = argc > 3 && !strcmp(argv[1], "-b");
+  if (argc < 4 || argc - 3 > MAX_REFS) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "       (diff mode)   romdiff <reference ROM> [<reference ROM> ...] <new ROM> <output file>\n");
+    fprintf(stderr, "       (patch mode)  romdiff <rom diff file> [<rom diff file> ...] <outputfile>\n");
+    fprintf(stderr, "       (benchmark)   romdiff -b <reference ROM> [<reference ROM> ...] <new ROM>\n\n");
+    fprintf(stderr, "Be aware that in diff mode the output file will be silently overwritten!\n\n");
+    fprintf(stderr, "In diff mode up to %d reference ROMs can be given, the diff may copy from\n", MAX_REFS);
+    fprintf(stderr, "any of them. In patch mode the referenced ROM file names are taken from the\n");
+    fprintf(stderr, "header of the diff file. Make sure that these files can be found in the current\n");
+    fprintf(stderr, "directory, or the patch will fail. With several diff files the patches are\n");
+    fprintf(stderr, "applied in turn, and a later one may reference the ROM made by an earlier one.\n");
+    exit(-1);
+  }
+
+  char **ref_names = &argv[1 + bench];
+  char *new_name = argv[argc - 2 + bench];
+  ref_count = argc - 3;
+
+  // check args for filename size
+  for (int r = 0; r < ref_count; r++) {
+    normalise(ref_names[r]);
+    if (strlen(normalised) > 31) {
+      fprintf(stderr, "ERROR: name of reference rom file is greater than 31 characters.\n");
       exit(-1);
     }
+  }
 
-    bcopy(tokens[ofs], &diff[diff_len], token_lens[ofs]);
-    diff_len += token_lens[ofs];
+  normalise(new_name);
+  if (strlen(normalised) > 159) {
+    fprintf(stderr, "ERROR: name of new rom file is greater than 159 characters.\n");
+    exit(-1);
+  }
 
-    ofs = next_pos[ofs];
-    steps++;
+  fprintf(stderr, "Generating patch of %s, using %s%s as the reference.\n", new_name, ref_names[0],
+      ref_count > 1 ? " and others" : "");
+
+  for (int r = 0; r < ref_count; r++)
+    if (read_rom(ref_names[r], &ref[r * FILE_SIZE], "reference ROM"))
+      exit(-1);
+  if (read_rom(new_name, new_rom, "new ROM"))
+    exit(-1);
+
+  if (bench) {
+    benchmark();
+    return 0;
   }
-  fprintf(stderr, "ROM encoded using %d steps. Output stream = %d bytes.\n", steps, diff_len);
 
-  f = fopen(argv[3], "wb");
+  encode_rom();
+
+  FILE *f = fopen(argv[argc - 1], "wb");
   if (!f) {
-    fprintf(stderr, "ERROR: Could not write to output file '%s'\n", argv[3]);
+    fprintf(stderr, "ERROR: Could not write to output file '%s'\n", argv[argc - 1]);
     exit(-3);
   }
-  // Write header and reference file name
-  unsigned char header[256];
-  bzero(header, 256);
-  snprintf((char *)header, 32, "MEGA65ROMPATCH01.00");
-  snprintf((char *)&header[32], 64, "%s", normalise(argv[1]));
-  snprintf((char *)&header[32 + 64], 160, "%s", normalise(argv[2]));
-  fwrite(header, 256, 1, f);
+  // Write header and reference file names
+  unsigned char header[HEADER_SIZE + (MAX_REFS - 1) * REF_NAME_SIZE];
+  bzero(header, sizeof(header));
+  snprintf((char *)header, 32, ref_count > 1 ? "MEGA65ROMPATCH02.00" : "MEGA65ROMPATCH01.00");
+  header[31] = ref_count > 1 ? ref_count : 0;
+  snprintf((char *)&header[32], 64, "%s", normalise(ref_names[0]));
+  snprintf((char *)&header[32 + 64], 160, "%s", normalise(new_name));
+  for (int r = 1; r < ref_count; r++)
+    snprintf((char *)&header[HEADER_SIZE + (r - 1) * REF_NAME_SIZE], REF_NAME_SIZE, "%s", normalise(ref_names[r]));
+  fwrite(header, HEADER_SIZE + (ref_count - 1) * REF_NAME_SIZE, 1, f);
   // Write diff
   fwrite(diff, diff_len, 1, f);
   fclose(f);
 
-  decode_diff(ref, diff, diff_len, out);
+  decode_diff(ref, ref_count, diff, diff_len, out);
 
-  if (memcmp(out, new, FILE_SIZE)) {
+  if (memcmp(out, new_rom, FILE_SIZE)) {
     fprintf(stderr, "ERROR: Verify error while testing encoded data stream.\n");
     for (int i = 0; i < FILE_SIZE; i++) {
-      if (out[i] != new[i]) {
-        fprintf(stderr, "  mismatch at $%05x: saw $%02x, but should be $%02x, origin=%s\n", i, out[i], new[i],
+      if (out[i] != new_rom[i]) {
+        fprintf(stderr, "  mismatch at $%05x: saw $%02x, but should be $%02x, origin=%s\n", i, out[i], new_rom[i],
             describe_origin(out_origin[i]));
       }
     }
@@ -1,9 +1,24 @@
+/*
+  Draws VCD traces of a video signal as rasters on PDF pages, and
+  resamples them into samples.raw and rasters.png.
+
+  The VCD is never loaded into memory: a streaming tokenizer reads it a
+  block at a time, and value changes are looked up in a hash of the
+  selected signals' identifier codes. The renderer and the resampler
+  each walk the changes with their own cursor, and the renderer reduces
+  the changes within each pixel to a single vertical span. With -i, a
+  time index is kept next to the VCD (<vcd>.idx), so that a window
+  starting late in a large dump (-t) can be drawn without reading up to
+  it.
+*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
@@ -11,26 +26,23 @@
 #include <cairo.h>
 #include <cairo-pdf.h>
 
-int *values;
-double *times;
-int val_count=0;
-int val_allocated=0;
-
 int ts_mult=0;
 char ts_units[1024];
-int next_is_ts=0;
 float ts_div=1.0;
 
-#define MAX_SIGS 16
+struct signal {
+  char *name;
+  char *desig;
+  int width;
+  int firstbit;
+};
+
+struct signal *sigs=NULL;
 int sig_count=0;
-char sig_names[MAX_SIGS][1024];
-char sig_desigs[MAX_SIGS][1024];
-int sig_widths[MAX_SIGS];
-int sig_firstbits[MAX_SIGS];
 
-char sig_name[1024];
-char sig_designator[1024];
-int sig_firstbit,sig_lastbit,sig_width;
+// Selected signals by identifier code: index + 1, 0 = empty
+int *sig_hash=NULL;
+int sig_hash_size=0;
 
 void abort_(const char * s, ...)
 {
@@ -54,6 +66,385 @@ void parse_ts(void)
   fprintf(stderr,"INFO: Timestep divisor is %f\n",ts_div);
 }
 
+unsigned int desig_hash(char *desig)
+{
+  unsigned int h=2166136261u;
+  for(;*desig;desig++) h=(h^(unsigned char)*desig)*16777619u;
+  return h;
+}
+
+void add_signal(char *name, char *desig, int width, int firstbit)
+{
+  sigs=realloc(sigs,(sig_count+1)*sizeof(struct signal));
+  if (!sigs) {
+    fprintf(stderr,"ERROR: Failed to allocate signal list.\n");
+    exit(-1);
+  }
+  sigs[sig_count].name=strdup(name);
+  sigs[sig_count].desig=strdup(desig);
+  sigs[sig_count].width=width;
+  sigs[sig_count].firstbit=firstbit;
+  sig_count++;
+
+  if (sig_count*2>sig_hash_size) {
+    free(sig_hash);
+    sig_hash_size=sig_hash_size?sig_hash_size*2:64;
+    sig_hash=calloc(sig_hash_size,sizeof(int));
+    if (!sig_hash) {
+      fprintf(stderr,"ERROR: Failed to allocate signal hash.\n");
+      exit(-1);
+    }
+    for(int i=0;i<sig_count;i++) {
+      unsigned int slot=desig_hash(sigs[i].desig)&(sig_hash_size-1);
+      while(sig_hash[slot]) {
+        // Signals sharing a designator are one signal as far as values go
+        if (!strcmp(sigs[sig_hash[slot]-1].desig,sigs[i].desig)) break;
+        slot=(slot+1)&(sig_hash_size-1);
+      }
+      if (!sig_hash[slot]) sig_hash[slot]=i+1;
+    }
+  }
+  else {
+    unsigned int slot=desig_hash(desig)&(sig_hash_size-1);
+    while(sig_hash[slot]&&strcmp(sigs[sig_hash[slot]-1].desig,desig))
+      slot=(slot+1)&(sig_hash_size-1);
+    if (!sig_hash[slot]) sig_hash[slot]=sig_count;
+  }
+}
+
+// Returns the selected signal with this identifier code, or -1
+int find_signal(char *desig)
+{
+  if (!sig_hash_size) return -1;
+  unsigned int slot=desig_hash(desig)&(sig_hash_size-1);
+  while(sig_hash[slot]) {
+    if (!strcmp(sigs[sig_hash[slot]-1].desig,desig)) return sig_hash[slot]-1;
+    slot=(slot+1)&(sig_hash_size-1);
+  }
+  return -1;
+}
+
+/*
+  Streaming VCD tokenizer
+*/
+#define VCD_BLOCK 65536
+
+struct vcd_reader {
+  FILE *f;
+  char buffer[VCD_BLOCK];
+  int len,ofs;
+  long long block_offset; // file offset of buffer[0]
+  long long token_offset; // file offset of the last token
+  char token[1024];
+  long long ts_raw;       // time of the changes being read
+  long long changes;
+  int indexing;           // add time index checkpoints
+};
+
+int vcd_open(struct vcd_reader *r, char *filename, long long offset)
+{
+  r->f=fopen(filename,"r");
+  if (!r->f) return -1;
+  if (offset) fseek(r->f,offset,SEEK_SET);
+  r->len=r->ofs=0;
+  r->block_offset=offset;
+  r->ts_raw=0;
+  r->changes=0;
+  r->indexing=0;
+  return 0;
+}
+
+// Reads the next whitespace separated token, returns its length, or 0 at the end of the file
+int next_token(struct vcd_reader *r)
+{
+  int len=0;
+  while(1) {
+    if (r->ofs==r->len) {
+      r->block_offset+=r->len;
+      r->len=fread(r->buffer,1,VCD_BLOCK,r->f);
+      r->ofs=0;
+      if (r->len<=0) {
+        r->len=0;
+        break;
+      }
+    }
+    char c=r->buffer[r->ofs];
+    if ((unsigned char)c<=' ') {
+      r->ofs++;
+      if (len) break;
+      continue;
+    }
+    if (!len) r->token_offset=r->block_offset+r->ofs;
+    if (len<(int)sizeof(r->token)-1) r->token[len++]=c;
+    r->ofs++;
+  }
+  r->token[len]=0;
+  return len;
+}
+
+// Skips to the $end of a section
+void skip_section(struct vcd_reader *r)
+{
+  while(next_token(r)&&strcmp(r->token,"$end")) continue;
+}
+
+/*
+  Reads the definitions up to $enddefinitions, selecting the named
+  signals. Returns the file offset of the value changes.
+*/
+long long read_definitions(struct vcd_reader *r, char **names, int name_count)
+{
+  while(next_token(r)) {
+    if (!strcmp(r->token,"$timescale")) {
+      // The multiplier and units can be one token or two
+      char scale[2048]="";
+      while(next_token(r)&&strcmp(r->token,"$end")) strncat(scale,r->token,sizeof(scale)-strlen(scale)-1);
+      if (sscanf(scale,"%d%s",&ts_mult,ts_units)==2) {
+	fprintf(stderr,"INFO: Set time scale to x %d %s\n",ts_mult,ts_units);
+	parse_ts();
+      }
+    }
+    else if (!strcmp(r->token,"$var")) {
+      char sig_name[1024],sig_designator[1024];
+      int sig_width=0,sig_firstbit=0;
+      // $var <type> <width> <designator> <name> [<range>] $end
+      if (!next_token(r)||!next_token(r)) break;
+      sig_width=atoi(r->token);
+      if (!next_token(r)) break;
+      strcpy(sig_designator,r->token);
+      if (!next_token(r)) break;
+      strcpy(sig_name,r->token);
+      char *range=strchr(sig_name,'[');
+      if (range) {
+	sscanf(range,"[%d",&sig_firstbit);
+	*range=0;
+      }
+      while(next_token(r)&&strcmp(r->token,"$end")) sscanf(r->token,"[%d",&sig_firstbit);
+
+      for(int i=0;i<name_count;i++) {
+	if (!strcmp(sig_name,names[i])) {
+	  fprintf(stderr,"INFO: Signal '%s' is designated by '%s'\n",sig_name,sig_designator);
+	  add_signal(sig_name,sig_designator,sig_width,sig_firstbit);
+	}
+      }
+    }
+    else if (!strcmp(r->token,"$enddefinitions")) {
+      skip_section(r);
+      return r->block_offset+r->ofs;
+    }
+    else if (r->token[0]=='$'&&strcmp(r->token,"$end")&&strcmp(r->token,"$scope")&&strcmp(r->token,"$upscope"))
+      // $date, $version, $comment etc.
+      skip_section(r);
+  }
+  fprintf(stderr,"ERROR: No $enddefinitions found.\n");
+  exit(-1);
+}
+
+/*
+  Time index (-i): a checkpoint about every INDEX_STEP bytes, at a
+  timestamp, with the value in effect there. It is only valid for the
+  same VCD and the same selected signals.
+*/
+#define INDEX_MAGIC "VCDGRAPH-INDEX-1"
+#define INDEX_STEP (4 * 1024 * 1024)
+
+struct index_entry {
+  long long offset; // of the timestamp
+  long long ts_raw;
+  int value, valid;
+};
+
+struct index_entry *index_entries=NULL;
+int index_count=0;
+
+// While building the index: the value in effect, and where the next checkpoint is due
+int index_value=0,index_valid=0,index_allocated=0;
+long long index_next_checkpoint=0;
+
+void add_checkpoint(long long offset, long long ts_raw)
+{
+  if (index_count==index_allocated) {
+    index_allocated=index_allocated?index_allocated*2:1024;
+    index_entries=realloc(index_entries,index_allocated*sizeof(struct index_entry));
+    if (!index_entries) {
+      fprintf(stderr,"ERROR: Failed to allocate time index.\n");
+      exit(-1);
+    }
+  }
+  index_entries[index_count++]=(struct index_entry){ offset, ts_raw, index_value, index_valid };
+  index_next_checkpoint=offset+INDEX_STEP;
+}
+
+/*
+  Reads up to the next value change of a selected signal. Returns 1 and
+  its time (in ns) and value, or 0 at the end of the file.
+*/
+int next_change(struct vcd_reader *r, double *ts, int *value)
+{
+  while(next_token(r)) {
+    char *t=r->token;
+    switch(t[0]) {
+    case '#':
+      r->ts_raw=atoll(&t[1]);
+      if (r->indexing&&r->token_offset>=index_next_checkpoint) add_checkpoint(r->token_offset,r->ts_raw);
+      break;
+    case '$':
+      // $dumpvars, $dumpall etc. just wrap value changes, but skip comments
+      if (!strcmp(t,"$comment")) skip_section(r);
+      break;
+    case 'b': case 'B': {
+      // Binary string
+      int v=0;
+      for(int i=1;t[i];i++) {
+	v=v*2;
+	switch(t[i]) {
+	case 'U': case 'X': case '0': v+=0; break;
+	case '1': case 'H': v+=1; break;
+	}
+      }
+      if (!next_token(r)) return 0;
+      if (find_signal(r->token)>=0) {
+	*ts=r->ts_raw/ts_div;
+	*value=v;
+	r->changes++;
+	return 1;
+      }
+      break;
+    }
+    case 'r': case 'R':
+      // Real values are not drawn
+      if (!next_token(r)) return 0;
+      break;
+    default:
+      // Scalar value, with the designator attached
+      if (find_signal(&t[1])>=0) {
+	*ts=r->ts_raw/ts_div;
+	*value=(t[0]=='1'||t[0]=='H');
+	r->changes++;
+	return 1;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+void index_key(char *vcd_name, char *key, int len)
+{
+  struct stat st;
+  stat(vcd_name,&st);
+  snprintf(key,len,"%s %lld %lld",INDEX_MAGIC,(long long)st.st_size,(long long)st.st_mtime);
+  for(int i=0;i<sig_count;i++) {
+    strncat(key," ",len-strlen(key)-1);
+    strncat(key,sigs[i].name,len-strlen(key)-1);
+  }
+}
+
+int load_index(char *index_name, char *key)
+{
+  FILE *f=fopen(index_name,"rb");
+  if (!f) return -1;
+  char saved_key[4096];
+  int len=0;
+  if (fread(&len,sizeof(len),1,f)!=1||len!=(int)strlen(key)+1||len>(int)sizeof(saved_key)
+      ||fread(saved_key,len,1,f)!=1||strcmp(saved_key,key)||fread(&index_count,sizeof(index_count),1,f)!=1) {
+    fclose(f);
+    return -1;
+  }
+  index_entries=malloc((index_count+1)*sizeof(struct index_entry));
+  if (!index_entries||fread(index_entries,sizeof(struct index_entry),index_count,f)!=index_count) {
+    fclose(f);
+    index_count=0;
+    return -1;
+  }
+  fclose(f);
+  return 0;
+}
+
+void build_index(char *vcd_name, long long data_offset, char *index_name, char *key)
+{
+  static struct vcd_reader r;
+  if (vcd_open(&r,vcd_name,data_offset)) {
+    fprintf(stderr,"ERROR: Could not read from '%s'\n",vcd_name);
+    exit(-1);
+  }
+  fprintf(stderr,"INFO: Building time index '%s'\n",index_name);
+
+  // next_change() adds the checkpoints as it passes timestamps
+  r.indexing=1;
+  index_next_checkpoint=data_offset;
+  double ts;
+  while(next_change(&r,&ts,&index_value)) index_valid=1;
+  fclose(r.f);
+
+  FILE *f=fopen(index_name,"wb");
+  if (!f) {
+    fprintf(stderr,"WARNING: Could not write time index '%s'\n",index_name);
+    return;
+  }
+  int len=strlen(key)+1;
+  fwrite(&len,sizeof(len),1,f);
+  fwrite(key,len,1,f);
+  fwrite(&index_count,sizeof(index_count),1,f);
+  fwrite(index_entries,sizeof(struct index_entry),index_count,f);
+  fclose(f);
+}
+
+/*
+  A cursor walks the value changes in time order.
+*/
+struct vcd_cursor {
+  struct vcd_reader r;
+  double next_ts;
+  int next_value,has_next;
+  int value;
+};
+
+/*
+  Opens a cursor at the start time, from the last index checkpoint
+  before it if there is an index.
+*/
+void cursor_open(struct vcd_cursor *c, char *vcd_name, long long data_offset, double start_ts)
+{
+  long long offset=data_offset;
+  int value=0,valid=0;
+  for(int i=0;i<index_count&&index_entries[i].ts_raw/ts_div<=start_ts;i++) {
+    offset=index_entries[i].offset;
+    value=index_entries[i].value;
+    valid=index_entries[i].valid;
+  }
+  if (vcd_open(&c->r,vcd_name,offset)) {
+    fprintf(stderr,"ERROR: Could not read from '%s'\n",vcd_name);
+    exit(-1);
+  }
+  c->next_value=0;
+  c->has_next=next_change(&c->r,&c->next_ts,&c->next_value);
+  // Before the first change, show the first value
+  c->value=valid?value:c->next_value;
+  while(c->has_next&&c->next_ts<start_ts) {
+    c->value=c->next_value;
+    c->has_next=next_change(&c->r,&c->next_ts,&c->next_value);
+  }
+}
+
+/*
+  Consumes the changes before ts, and returns the value in effect then.
+  Sets the range of values the changes went through, and their number.
+*/
+int cursor_advance(struct vcd_cursor *c, double ts, int *min, int *max, int *changes)
+{
+  *min=*max=c->value;
+  *changes=0;
+  while(c->has_next&&c->next_ts<ts) {
+    c->value=c->next_value;
+    if (c->value<*min) *min=c->value;
+    if (c->value>*max) *max=c->value;
+    (*changes)++;
+    c->has_next=next_change(&c->r,&c->next_ts,&c->next_value);
+  }
+  return c->value;
+}
+
 void draw_line(cairo_t *cr, float x1, float y1, float x2, float y2)
 {
   cairo_set_line_width(cr, 0.5);
@@ -84,124 +475,57 @@ int set_pixel(png_bytep *png_rows, int x, int y, int r, int g, int b)
   return 0;
 }
 
+void usage(void)
+{
+  fprintf(stderr,"usage: vcdgraph [-i] [-t <start ns>] [-n <rasters>] <vcd input file> <pdf output file> [signal names...]\n");
+  fprintf(stderr,"  -i   keep a time index of the VCD in <vcd input file>.idx, to start late in large dumps quickly\n");
+  fprintf(stderr,"  -t   time to start drawing and sampling at (default 0)\n");
+  fprintf(stderr,"  -n   number of rasters to draw (default 625)\n");
+  exit(-1);
+}
+
 int main(int argc,char **argv) 
 {
-  if (argc<3) {
-    fprintf(stderr,"usage: vcdgraph <vcd input file> <pdf output file> [signal names...]\n");
-    exit(-1);
+  int use_index=0;
+  double start_ts=0;
+  int raster_count=312.5*2;
+  int opt;
+  while ((opt=getopt(argc,argv,"it:n:"))!=-1) {
+    switch (opt) {
+    case 'i': use_index=1; break;
+    case 't': start_ts=atof(optarg); break;
+    case 'n': raster_count=atoi(optarg); break;
+    default: usage();
+    }
   }
+  argc-=optind-1;
+  argv+=optind-1;
+  if (argc<3) usage();
 
-  val_allocated=100000000;
-  values = calloc(sizeof(int),val_allocated);
-  times = calloc(sizeof(double),val_allocated);
-  if ((!values)||(!times)) {
-    fprintf(stderr,"ERROR: Failed to allocate arrays for measurements.\n");
-    exit(-1);
-  }
-  
-  
-  FILE *f=fopen(argv[1],"r");
-  if (!f) {
+  static struct vcd_reader header;
+  if (vcd_open(&header,argv[1],0)) {
     fprintf(stderr,"ERROR: Could not read from '%s'\n",argv[1]);
     exit(-1);
   }
+  long long data_offset=read_definitions(&header,&argv[3],argc-3);
+  fclose(header.f);
 
-  char line[1024];
-
-  int in_setup=1;
-
-  double ts=0;
-  
-  int lines=0;
-  line[0]=0; fgets(line,1024,f);
-  while(line[0]) {
-
-    if (in_setup) {
+  fprintf(stderr,"INFO: Found %d signals.\n",sig_count);
+  if (sig_count!=(argc-3)) {
+    fprintf(stderr,"ERROR: Expected to see %d signals.  Are some of the names incorrect?\n",argc-3);
+    exit(-1);
+  }
 
-      if (next_is_ts) {
-	next_is_ts=0;
-	if (sscanf(line,"%d %s",&ts_mult,ts_units)==2) {
-	  fprintf(stderr,"INFO: Set time scale to x %d %s\n",ts_mult,ts_units);
-	  parse_ts();
-	}
-      }
-      else if (sscanf(line,"$timescale %d %s $end",&ts_mult,ts_units)==2) {
-	fprintf(stderr,"INFO: Set time scale to x %d %s\n",ts_mult,ts_units);
-	parse_ts();
-      }
-      else if (!strncmp("$timescale",line,strlen("$timescale"))) next_is_ts=1;
-      else if (sscanf(line,"$var reg %d %s %[^[][%d:%d] $end",
-		      &sig_width,sig_designator,sig_name,&sig_firstbit,&sig_lastbit)==5) {
-	for(int i=3;i<argc;i++) {
-	  if (!strcmp(sig_name,argv[i])) {
-	    fprintf(stderr,"INFO: Signal '%s' is designated by '%s'\n",sig_name,sig_designator);
-	    if (sig_count<MAX_SIGS) {
-	      strcpy(sig_names[sig_count],sig_name);
-	      strcpy(sig_desigs[sig_count],sig_designator);
-	      sig_widths[sig_count]=sig_width;
-	      sig_firstbits[sig_count]=sig_firstbit;
-	      sig_count++;
-	    } else {
-	      fprintf(stderr,"ERROR: Too many signals. Increase MAX_SIGS or select fewer signals.\n");
-	      exit(-1);
-	    }
-	  }
-	}
-      }
-      if (!strncmp("$enddefinitions",line,strlen("$enddefinitions"))) {
-	in_setup=0;
-	fprintf(stderr,"INFO: Found %d signals.\n",sig_count);
-	if (sig_count!=(argc-3)) {
-	  fprintf(stderr,"ERROR: Expected to see %d signals.  Are some of the names incorrect?\n",argc-2);
-	  exit(-1);
-	}
-      }
-    } else {
-      long long ts_raw;
-      if (sscanf(line,"#%lld",&ts_raw)==1) {
-	ts=ts_raw/ts_div;
-	//	fprintf(stderr,"DEBUG: ts=%g\n",ts);
-      }
-      // Remove CRLF
-      while(line[0]&&line[strlen(line)-1]<' ') line[strlen(line)-1]=0;
-      for(int sig=0;sig<sig_count;sig++) {
-	if (!strcmp(&line[strlen(line)-strlen(sig_desigs[sig])],sig_desigs[sig])) {
-	  if (line[0]=='b') {
-	    // Binary string
-	    int v=0;
-	    for(int i=1;i<strlen(line);i++) {
-	      if (line[i]==' ') break;
-	      v=v*2;
-	      switch(line[i]) {
-	      case 'U': case 'X': case '0': v+=0; break;
-	      case '1': case 'H': v+=1; break;
-	      }
-	    }
-	    //	    fprintf(stderr,"DEBUG: Value for %s at ts %g : v=%d\n",sig_names[sig],ts,v);
-	    if (val_count<val_allocated) {
-	      values[val_count]=v;
-	      times[val_count++]=ts;
-	    } else {
-	      fprintf(stderr,"WARNING: Too many measurements. Stopping at ts = %g ns\n",ts);
-	      break;
-	    }
-	  } else {
-	    fprintf(stderr,"ERROR: Unknown data format '%s'\n",line);
-	  }
-	}
-      }
-    }
-      
-    
-    lines++;
-    
-    line[0]=0; fgets(line,1024,f);
+  if (use_index) {
+    char index_name[1024],key[4096];
+    snprintf(index_name,1024,"%s.idx",argv[1]);
+    index_key(argv[1],key,sizeof(key));
+    if (load_index(index_name,key)) build_index(argv[1],data_offset,index_name,key);
+    fprintf(stderr,"INFO: Time index has %d checkpoints\n",index_count);
   }
 
-  fprintf(stderr,"INFO: Read %d values\n",val_count);
-  
-  fclose(f);
-  fprintf(stderr,"INFO: Processed %d lines\n",lines);
+  static struct vcd_cursor cursor;
+  cursor_open(&cursor,argv[1],data_offset,start_ts);
   
   cairo_surface_t *surface;
   cairo_t *cr;
@@ -209,20 +533,11 @@ int main(int argc,char **argv)
   int page_height=842;
   int page_width=595;
   
-  surface = cairo_pdf_surface_create("pdffile.pdf", page_width, page_height);
+  surface = cairo_pdf_surface_create(argv[2], page_width, page_height);
   cr = cairo_create(surface);
 
   cairo_set_source_rgb(cr, 0, 0, 0);
 
-#if 0
-  cairo_select_font_face (cr, "Sans", CAIRO_FONT_SLANT_NORMAL,
-      CAIRO_FONT_WEIGHT_NORMAL);
-  cairo_set_font_size (cr, 40.0);
-
-  cairo_move_to(cr, 10.0, 50.0);
-  cairo_show_text(cr, "Disziplin ist Macht.");
-#endif
-
 #define ROW_HEIGHT (72.0/4)
 #define ROW_GAP (72.0/16)
   // C64 style PAL is 63usec, although official PAL is 64usec.
@@ -235,13 +550,13 @@ int main(int argc,char **argv)
 
   int raster_num=0;
 
-  int val_num=0;
-  int val=0;
+  int val=cursor.value;
+  int min,max,changes;
 
   // Now used to track time point during rendering
-  ts=0.0;
+  double ts=start_ts;
 
-  while(raster_num < 312.5*2 ) {
+  while(raster_num < raster_count ) {
     fprintf(stderr,"INFO: Page starting on raster %d\n",raster_num);
     page_y=page_y_margin;
     for(;page_y<(page_height-page_y_margin);page_y+=ROW_HEIGHT) {
@@ -281,11 +596,14 @@ int main(int argc,char **argv)
 	ts+=ts_step;
 	
 	// Advance to the next measurement, if required
-	while((val_num<val_count)&&times[val_num+1]<ts) val_num++;
-	val=values[val_num];
+	val=cursor_advance(&cursor,ts,&min,&max,&changes);
 	
 	draw_line(cr,page_x_margin+72/2+(x-1),page_y+ROW_HEIGHT-ROW_GAP-prev_val/256.0*(ROW_HEIGHT - ROW_GAP),
 		  page_x_margin+72/2+x,page_y+ROW_HEIGHT-ROW_GAP-val/256.0*(ROW_HEIGHT - ROW_GAP));
+	// Changes narrower than a pixel are drawn as the range they span
+	if (changes>1&&min<max)
+	  draw_line(cr,page_x_margin+72/2+x,page_y+ROW_HEIGHT-ROW_GAP-min/256.0*(ROW_HEIGHT - ROW_GAP),
+		    page_x_margin+72/2+x,page_y+ROW_HEIGHT-ROW_GAP-max/256.0*(ROW_HEIGHT - ROW_GAP));
 	
       }
       
@@ -297,30 +615,36 @@ int main(int argc,char **argv)
 
   cairo_surface_destroy(surface);
   cairo_destroy(cr);
+  fclose(cursor.r.f);
 
   fprintf(stderr,"Writing raw sample file to samples.raw\n");
-  ts=0.0;
+  ts=start_ts;
   // 27MHz apparent sample rate
   double ts_step = 1000.0/27;  
-  val_num=0;
   int sample_num=0;
 #define MAX_SAMPLES 8000000
-  unsigned char samples[MAX_SAMPLES];
-  
-  while((val_num<val_count)&&sample_num<MAX_SAMPLES)
+  unsigned char *samples=malloc(MAX_SAMPLES);
+  if (!samples) {
+    fprintf(stderr,"ERROR: Failed to allocate samples.\n");
+    exit(-1);
+  }
+
+  cursor_open(&cursor,argv[1],data_offset,start_ts);
+  while(cursor.has_next&&sample_num<MAX_SAMPLES)
     {
       ts+=ts_step;
       
       // Advance to the next measurement, if required
-      while((val_num<val_count)&&times[val_num+1]<ts) val_num++;
-      val=values[val_num];
+      val=cursor_advance(&cursor,ts,&min,&max,&changes);
       
       samples[sample_num++]=val;
       
     }
+  fprintf(stderr,"INFO: Read %lld values\n",cursor.r.changes);
+  fclose(cursor.r.f);
   
   
-  f=fopen("samples.raw","wb");
+  FILE *f=fopen("samples.raw","wb");
   fwrite(samples,1,sample_num,f);
   fclose(f);
 
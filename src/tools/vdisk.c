@@ -0,0 +1,363 @@
+/*
+  Disk image access for the virtual F011 FDC (m65 --virtuald81)
+
+  Copyright (C) 2014-2023 Paul Gardner-Stephen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <strings.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "m65common.h"
+#include "logging.h"
+#include "vdisk.h"
+
+#define VDISK_SECTOR_SIZE 512
+// dirty tracking granularity: D64/D71 tracks can end in a half sector
+#define VDISK_BLOCK_SIZE 256
+
+static int d64_sectors_per_track(int track)
+{
+  if (track <= 17)
+    return 21;
+  if (track <= 24)
+    return 19;
+  if (track <= 30)
+    return 18;
+  return 17;
+}
+
+static int d71_sectors_per_track(int track)
+{
+  return d64_sectors_per_track(track > 35 ? track - 35 : track);
+}
+
+static int d81_sectors_per_track(int track)
+{
+  return 40;
+}
+
+static int d65_sectors_per_track(int track)
+{
+  return 256;
+}
+
+// images of unknown size are treated as D81s
+#define VDISK_D81_SIZE 819200
+
+// clang-format off
+const VDISK_GEOMETRY vdisk_geometries[] = {
+  { "D64",           ".d64",  174848, 35, d64_sectors_per_track },
+  { "D64 (errors)",  ".d64",  175531, 35, d64_sectors_per_track },
+  { "D64 40 tracks", ".d64",  196608, 40, d64_sectors_per_track },
+  { "D64 40 tracks (errors)", ".d64", 197376, 40, d64_sectors_per_track },
+  { "D71",           ".d71",  349696, 70, d71_sectors_per_track },
+  { "D71 (errors)",  ".d71",  351062, 70, d71_sectors_per_track },
+  { "D81",           ".d81",  VDISK_D81_SIZE, 80, d81_sectors_per_track },
+  { "D65",           ".d65", 5570560, 85, d65_sectors_per_track },
+  { NULL }
+};
+// clang-format on
+
+// images currently open, so drives using the same file share one mapping
+static VDISK *open_vdisks = NULL;
+
+static const VDISK_GEOMETRY *vdisk_geometry_by_size(size_t size)
+{
+  for (const VDISK_GEOMETRY *g = vdisk_geometries; g->name; g++)
+    if (g->size == size)
+      return g;
+  return NULL;
+}
+
+static const VDISK_GEOMETRY *vdisk_find_geometry(const char *filename, size_t size)
+{
+  const VDISK_GEOMETRY *g = vdisk_geometry_by_size(size);
+  const char *ext = strrchr(filename, '.');
+
+  if (g)
+    return g;
+  // unusual size, so go by extension if the image is at least big enough
+  if (ext)
+    for (g = vdisk_geometries; g->name; g++)
+      if (!strcasecmp(ext, g->extension) && size >= g->size)
+        return g;
+  return NULL;
+}
+
+static VDISK *vdisk_find_open(const char *filename, VDISK *vd)
+{
+  for (VDISK *o = open_vdisks; o; o = o->next) {
+#ifdef WINDOWS
+    if (!strcmp(o->filename, filename))
+      return o;
+#else
+    if (vd && o->dev == vd->dev && o->ino == vd->ino)
+      return o;
+#endif
+  }
+  return NULL;
+}
+
+static void vdisk_free(VDISK *vd)
+{
+  free(vd->track_offset);
+  free(vd->dirty);
+  free(vd->filename);
+  free(vd);
+}
+
+VDISK *vdisk_open(const char *filename)
+{
+  VDISK *vd, *shared;
+
+#ifdef WINDOWS
+  if ((shared = vdisk_find_open(filename, NULL))) {
+    shared->refcount++;
+    return shared;
+  }
+#endif
+
+  vd = calloc(1, sizeof(VDISK));
+  if (!vd)
+    return NULL;
+  vd->filename = strdup(filename);
+
+#ifdef WINDOWS
+  // No mmap here, so just read the whole image once and write back
+  // dirty sectors on flush.
+  vd->f = fopen(filename, "rb+");
+  if (!vd->f) {
+    log_crit("could not open disk image '%s'", filename);
+    vdisk_free(vd);
+    return NULL;
+  }
+  fseek(vd->f, 0, SEEK_END);
+  vd->size = ftell(vd->f);
+  fseek(vd->f, 0, SEEK_SET);
+  vd->data = malloc(vd->size);
+  if (!vd->data || fread(vd->data, 1, vd->size, vd->f) != vd->size) {
+    log_crit("could not read disk image '%s'", filename);
+    fclose(vd->f);
+    free(vd->data);
+    vdisk_free(vd);
+    return NULL;
+  }
+#else
+  struct stat st;
+  vd->fd = open(filename, O_RDWR);
+  if (vd->fd < 0 || fstat(vd->fd, &st)) {
+    log_crit("could not open disk image '%s': %s", filename, strerror(errno));
+    if (vd->fd >= 0)
+      close(vd->fd);
+    vdisk_free(vd);
+    return NULL;
+  }
+  vd->dev = st.st_dev;
+  vd->ino = st.st_ino;
+  if ((shared = vdisk_find_open(filename, vd))) {
+    close(vd->fd);
+    vdisk_free(vd);
+    shared->refcount++;
+    log_debug("vdisk: sharing mapping of '%s'", shared->filename);
+    return shared;
+  }
+  vd->size = st.st_size;
+  vd->data = mmap(NULL, vd->size, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd, 0);
+  if (vd->data == MAP_FAILED) {
+    log_crit("could not map disk image '%s': %s", filename, strerror(errno));
+    close(vd->fd);
+    vdisk_free(vd);
+    return NULL;
+  }
+#endif
+
+  vd->geometry = vdisk_find_geometry(filename, vd->size);
+  if (!vd->geometry) {
+    // the old behaviour was to treat anything as a D81
+    vd->geometry = vdisk_geometry_by_size(VDISK_D81_SIZE);
+    log_warn("unknown disk image size %ld of '%s', assuming %s", (long)vd->size, filename, vd->geometry->name);
+  }
+  vd->track_offset = calloc(vd->geometry->tracks + 2, sizeof(size_t));
+  for (int t = 1; t <= vd->geometry->tracks; t++)
+    vd->track_offset[t + 1] = vd->track_offset[t] + vd->geometry->sectors_per_track(t) * 256;
+
+  vd->dirty = calloc((vd->size + VDISK_BLOCK_SIZE - 1) / VDISK_BLOCK_SIZE, 1);
+  vd->refcount = 1;
+  vd->next = open_vdisks;
+  open_vdisks = vd;
+  log_debug("vdisk: mapped '%s' (%ld bytes, %s)", filename, (long)vd->size, vd->geometry->name);
+  return vd;
+}
+
+long vdisk_offset(VDISK *vd, int track, int sector, int side, int *len)
+{
+  int spt, half, logical;
+
+  // F011 tracks count from 0, CBM tracks from 1
+  track++;
+  if (track < 1 || track > vd->geometry->tracks || sector < 1 || side < 0 || side > 1)
+    return -1;
+  spt = vd->geometry->sectors_per_track(track);
+  /*
+   * This follows the 1581 layout used by D81 images: each 512 byte
+   * physical sector holds two consecutive 256 byte logical sectors, and
+   * side 0 holds logical sectors 0-19 of a track, side 1 sectors 20-39.
+   * D64/D71 images have no F011 layout of their own (a 1541/1571 disk
+   * is GCR), so they use the same packing with side 0 getting the even
+   * number of logical sectors rounded up from half the track. Odd sized
+   * tracks end in a 256 byte half sector on side 1.
+   */
+  half = (spt + 3) / 4 * 2;
+  logical = side * half + (sector - 1) * 2;
+  if (logical >= (side ? spt : half))
+    return -1;
+  *len = logical + 1 < spt ? VDISK_SECTOR_SIZE : 256;
+  if (vd->track_offset[track] + logical * 256 + *len > vd->size)
+    return -1;
+  return vd->track_offset[track] + logical * 256;
+}
+
+void vdisk_mark_dirty(VDISK *vd, size_t offset, int len)
+{
+  size_t block = offset / VDISK_BLOCK_SIZE, end = (offset + len + VDISK_BLOCK_SIZE - 1) / VDISK_BLOCK_SIZE;
+
+  for (; block < end; block++)
+    if (!vd->dirty[block]) {
+      vd->dirty[block] = 1;
+      vd->dirty_count++;
+    }
+  vd->last_write_ms = gettime_ms();
+}
+
+int vdisk_flush(VDISK *vd)
+{
+  size_t blocks, first, last;
+  int flushed = 0;
+
+  if (!vd || !vd->dirty_count)
+    return 0;
+
+  blocks = (vd->size + VDISK_BLOCK_SIZE - 1) / VDISK_BLOCK_SIZE;
+  for (first = 0; first < blocks; first++) {
+    if (!vd->dirty[first])
+      continue;
+    // write back runs of consecutive dirty blocks in one go
+    for (last = first; last + 1 < blocks && vd->dirty[last + 1]; last++)
+      ;
+    size_t ofs = first * VDISK_BLOCK_SIZE, len = (last - first + 1) * VDISK_BLOCK_SIZE;
+    // the image need not end on a block boundary
+    if (ofs + len > vd->size)
+      len = vd->size - ofs;
+#ifdef WINDOWS
+    fseek(vd->f, ofs, SEEK_SET);
+    if (fwrite(vd->data + ofs, 1, len, vd->f) != len)
+      log_warn("vdisk: short write to '%s'", vd->filename);
+#else
+    // msync wants a page aligned start address
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t aligned = ofs & ~(page - 1);
+    if (msync(vd->data + aligned, len + (ofs - aligned), MS_SYNC))
+      log_warn("vdisk: msync of '%s' failed: %s", vd->filename, strerror(errno));
+#endif
+    memset(&vd->dirty[first], 0, last - first + 1);
+    flushed += last - first + 1;
+    first = last;
+  }
+#ifdef WINDOWS
+  fflush(vd->f);
+#endif
+  vd->dirty_count = 0;
+  log_debug("vdisk: flushed %d blocks to '%s'", flushed, vd->filename);
+  return flushed;
+}
+
+int vdisk_flush_if_idle(VDISK *vd, int idle_ms)
+{
+  if (!vd || !vd->dirty_count)
+    return 0;
+  if (gettime_ms() - vd->last_write_ms < idle_ms)
+    return 0;
+  return vdisk_flush(vd);
+}
+
+void vdisk_close(VDISK *vd)
+{
+  VDISK **p;
+
+  if (!vd)
+    return;
+  vdisk_flush(vd);
+  if (--vd->refcount > 0)
+    return;
+  for (p = &open_vdisks; *p; p = &(*p)->next)
+    if (*p == vd) {
+      *p = vd->next;
+      break;
+    }
+#ifdef WINDOWS
+  fclose(vd->f);
+  free(vd->data);
+#else
+  munmap(vd->data, vd->size);
+  close(vd->fd);
+#endif
+  vdisk_free(vd);
+}
+
+void vdisk_histogram_add(VDISK_HISTOGRAM *h, long long us)
+{
+  int bucket = 0;
+  while (bucket < VDISK_HIST_BUCKETS - 1 && us >= (2LL << bucket))
+    bucket++;
+  h->bucket[bucket]++;
+  h->count++;
+  h->total_us += us;
+  if (us > h->max_us)
+    h->max_us = us;
+}
+
+void vdisk_histogram_report(VDISK_HISTOGRAM *h)
+{
+  unsigned int max = 0;
+  char bar[41];
+
+  if (!h->count)
+    return;
+
+  log_note("%s: %u requests, avg %lld us, max %lld us", h->name, h->count, h->total_us / h->count, h->max_us);
+  for (int i = 0; i < VDISK_HIST_BUCKETS; i++)
+    if (h->bucket[i] > max)
+      max = h->bucket[i];
+  for (int i = 0; i < VDISK_HIST_BUCKETS; i++) {
+    if (!h->bucket[i])
+      continue;
+    int len = h->bucket[i] * 40 / max;
+    memset(bar, '#', len);
+    bar[len] = 0;
+    log_note("  < %8lld us %6u %s", 2LL << i, h->bucket[i], bar);
+  }
+}
@@ -0,0 +1,227 @@
+/*
+  On-target floppy track reader for readdisk.
+
+  It implements the same job queue protocol as remotesd does for
+  mega65_ftp: readdisk pushes a list of jobs to $C001 and writes the
+  number of jobs to $C000. Each read job seeks to a track, then reads a
+  run of sectors of one side, sending a status byte and the 512 bytes of
+  every sector back over the serial monitor interface in raw mode. The
+  next sector is read by the F011 while the last one is being sent, so
+  the host never has to poll the F011 registers itself.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <hal.h>
+#include <memory.h>
+
+// Write a char to the serial monitor interface
+#define SERIAL_WRITE(the_char)                                                                                              \
+  {                                                                                                                         \
+    __asm__("LDA %v", the_char);                                                                                            \
+    __asm__("STA $D643");                                                                                                   \
+    __asm__("NOP");                                                                                                         \
+  }
+
+uint8_t c, k, job_type, job_count, jid;
+uint8_t track, side, sector, sector_count, status;
+// 0xff = head position not known yet
+uint8_t current_track = 0xff;
+uint16_t i, job_addr, job_type_addr;
+
+char msg[80 + 1];
+
+uint8_t sector_buffer[0x200];
+
+void serial_write_string(uint8_t *m, uint16_t len)
+{
+  for (i = 0; i < len; i++) {
+    c = *m;
+    m++;
+    SERIAL_WRITE(c);
+  }
+}
+
+void wait_busy(void)
+{
+  while (PEEK(0xD082) & 0x80)
+    continue;
+}
+
+// About one frame per count, to let the head settle after stepping
+void wait_frames(uint8_t frames)
+{
+  while (frames--) {
+    while (PEEK(0xD012) != 0xff)
+      continue;
+    while (PEEK(0xD012) == 0xff)
+      continue;
+  }
+}
+
+void step(uint8_t command)
+{
+  wait_busy();
+  POKE(0xD081, command);
+  wait_busy();
+}
+
+void goto_track0(void)
+{
+  // Do some slow seeks first, in case head is stuck at end of disk
+  step(0x10);
+  wait_frames(2);
+  step(0x10);
+  wait_frames(20);
+
+  for (k = 0; k < 90 && !(PEEK(0xD082) & 0x01); k++)
+    step(0x10);
+  current_track = 0;
+}
+
+void seek(uint8_t t)
+{
+  if (current_track == 0xff)
+    goto_track0();
+  if (current_track == t)
+    return;
+  while (current_track < t) {
+    step(0x18);
+    current_track++;
+  }
+  while (current_track > t) {
+    step(0x10);
+    current_track--;
+  }
+  wait_frames(3);
+}
+
+void start_read(void)
+{
+  wait_busy();
+  POKE(0xD084, track);
+  POKE(0xD085, sector);
+  POKE(0xD086, side);
+  // Reset buffers, then read
+  POKE(0xD081, 0x01);
+  POKE(0xD081, 0x40);
+}
+
+void main(void)
+{
+  asm("sei");
+
+  // Fast CPU, M65 IO
+  POKE(0, 65);
+  POKE(0xD02F, 0x47);
+  POKE(0xD02F, 0x53);
+
+  // Map FDC sector buffer, not SD sector buffer
+  POKE(0xD689, PEEK(0xD689) & 0x7f);
+  // Disable auto-seek, so we control the head position
+  POKE(0xD696, 0x00);
+  // Disable matching on any sector, use real drive
+  POKE(0xD6A1, 0x01);
+
+  // Cursor off
+  POKE(204, 0x80);
+
+  printf("%cMEGA65 ReadDisk track reader.\n", 0x93);
+
+  // Clear communications area
+  lfill(0xc000, 0x00, 0x1000);
+
+  while (1) {
+    if (PEEK(0xC000)) {
+      job_count = PEEK(0xC000);
+      job_addr = 0xc001;
+      for (jid = 0; jid < job_count; jid++) {
+        if (job_addr > 0xcfff)
+          break;
+        job_type_addr = job_addr;
+        job_type = PEEK(job_type_addr);
+        switch (job_type) {
+
+        // - - - - - - - - - - - - - - - - - - - - -
+        // Terminate / Quit
+        // - - - - - - - - - - - - - - - - - - - - -
+        case 0xFF:
+          // Floppy motor off
+          POKE(0xD080, 0x00);
+          __asm__("jmp 58552");
+          break;
+
+        // - - - - - - - - - - - - - - - - - - - - -
+        // Seek to track 0
+        // - - - - - - - - - - - - - - - - - - - - -
+        case 0x20:
+          job_addr++;
+          goto_track0();
+          snprintf(msg, 80, "ftjobdone:%04x:\n\r", job_type_addr);
+          serial_write_string(msg, strlen(msg));
+          break;
+
+        // - - - - - - - - - - - - - - - - - - - - -
+        // Read sectors of one track side and stream
+        // - - - - - - - - - - - - - - - - - - - - -
+        case 0x21:
+          track = PEEK(job_addr + 1);
+          side = PEEK(job_addr + 2);
+          sector = PEEK(job_addr + 3);
+          sector_count = PEEK(job_addr + 4);
+          job_addr += 5;
+
+          snprintf(msg, 80, "ftjobdatr:%04x:%08lx:", job_type_addr, sector_count * 0x201L);
+          serial_write_string(msg, strlen(msg));
+
+          // Floppy motor on, and select side
+          POKE(0xD080, side ? 0x60 : 0x68);
+          seek(track);
+
+          if (sector_count)
+            start_read();
+          while (sector_count) {
+            wait_busy();
+            POKE(0xD020, PEEK(0xD020) + 1);
+            // RNF and CRC error flags
+            status = PEEK(0xD082) & 0x18;
+            lcopy(0xffd6c00, (uint32_t)sector_buffer, 0x200);
+
+            // Read the next sector while this one is sent
+            sector_count--;
+            sector++;
+            if (sector_count)
+              start_read();
+
+            SERIAL_WRITE(status);
+            serial_write_string(sector_buffer, 0x200);
+          }
+
+          snprintf(msg, 80, "ftjobdone:%04x:\n\r", job_type_addr);
+          serial_write_string(msg, strlen(msg));
+          break;
+
+        // - - - - - - - - - - - - - - - - - - - - -
+        // Request track reader version
+        // - - - - - - - - - - - - - - - - - - - - -
+        case 0x13:
+          job_addr++;
+          serial_write_string("\nmega65rd1.0\n\r", 14);
+          break;
+
+        default:
+          job_addr = 0xd000;
+          break;
+        }
+      }
+
+      // Indicate when we think we are all done
+      POKE(0xC000, 0);
+      snprintf(msg, 80, "ftbatchdone\n");
+      serial_write_string(msg, strlen(msg));
+    }
+  }
+}